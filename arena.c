@@ -0,0 +1,106 @@
+#include <iot/cJSON.h>
+#include <iot/mongoose.h>
+#include "arena.h"
+
+struct arena {
+    char *buf;
+    size_t size;
+    size_t used;
+    size_t last;            //offset of the latest allocation, freeing it gives the room back
+    cJSON_Hooks heap;
+    struct arena_stats stats;
+};
+
+static struct arena s_arena = { .heap = { malloc, free } };
+static __thread int s_depth; //scopes opened by this thread
+
+static int arena_owns(const void *ptr) {
+    return s_arena.buf && (const char *) ptr >= s_arena.buf && (const char *) ptr < s_arena.buf + s_arena.size;
+}
+
+void *arena_alloc(size_t size) {
+    struct arena *a = &s_arena;
+    size_t n = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (s_depth == 0 || !a->buf) {
+        __atomic_fetch_add(&a->stats.heap, 1, __ATOMIC_RELAXED); //the lua worker gets here too
+        return a->heap.malloc_fn(size);
+    }
+    if (n == 0 || n > a->size - a->used) {
+        a->stats.spills++;
+        return a->heap.malloc_fn(size);
+    }
+    a->last = a->used;
+    a->used += n;
+    if (a->used > a->stats.high_water)
+        a->stats.high_water = a->used;
+    a->stats.allocs++;
+    return a->buf + a->last;
+}
+
+void arena_release(void *ptr) {
+    struct arena *a = &s_arena;
+
+    if (!ptr)
+        return;
+    if (!arena_owns(ptr)) {
+        a->heap.free_fn(ptr);
+        return;
+    }
+    if (a->buf + a->last == (char *) ptr && a->last < a->used) //cJSON often frees what it just took
+        a->used = a->last;
+}
+
+char *arena_strndup(struct mg_str s) {
+    char *p = (char *) arena_alloc(s.len + 1);
+    if (p) {
+        if (s.len)
+            memcpy(p, s.ptr, s.len);
+        p[s.len] = '\0';
+    }
+    return p;
+}
+
+void arena_begin(void) {
+    s_depth++;
+}
+
+void arena_end(void) {
+    if (s_depth > 0 && --s_depth == 0 && s_arena.used) {
+        s_arena.used = 0;
+        s_arena.last = 0;
+        s_arena.stats.resets++;
+    }
+}
+
+int arena_init(size_t size, const cJSON_Hooks *heap) {
+    cJSON_Hooks hooks = { arena_alloc, arena_release };
+
+    memset(&s_arena, 0, sizeof(s_arena));
+    s_arena.heap.malloc_fn = heap ? heap->malloc_fn : malloc;
+    s_arena.heap.free_fn = heap ? heap->free_fn : free;
+    if ((s_arena.buf = s_arena.heap.malloc_fn(size)) == NULL)
+        return -1;
+    s_arena.size = size;
+    cJSON_InitHooks(&hooks);
+    return 0;
+}
+
+void arena_exit(void) {
+    cJSON_InitHooks(NULL);
+    if (s_arena.buf)
+        s_arena.heap.free_fn(s_arena.buf);
+    s_arena.buf = NULL;
+    s_arena.size = 0;
+}
+
+const struct arena_stats *arena_get_stats(void) {
+    return &s_arena.stats;
+}
+
+void arena_stats_dump(void) {
+    MG_INFO(("arena allocs: %llu, spills: %llu, heap: %llu, resets: %llu, high water: %lu bytes",
+        (unsigned long long) s_arena.stats.allocs, (unsigned long long) s_arena.stats.spills,
+        (unsigned long long) s_arena.stats.heap, (unsigned long long) s_arena.stats.resets,
+        (unsigned long) s_arena.stats.high_water));
+}
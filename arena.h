@@ -0,0 +1,41 @@
+#ifndef __IOT_ARENA_H__
+#define __IOT_ARENA_H__
+
+#include <iot/cJSON.h>
+#include <iot/mongoose.h>
+
+#define ARENA_SIZE      (32 * 1024)     //scratch of one message, larger documents spill to the heap
+#define ARENA_ALIGN     16
+
+struct arena_stats {
+    uint64_t allocs;        //served from the arena
+    uint64_t spills;        //in a scope, but no room left, served from the heap
+    uint64_t heap;          //outside any scope
+    uint64_t resets;        //outermost scopes ended
+    size_t high_water;      //most bytes used by one scope
+};
+
+/*
+ * bump allocator behind cJSON_InitHooks for the per-message work of the event loop.
+ * between arena_begin and arena_end allocations of that thread come from one buffer and
+ * free is a no-op, the outermost arena_end rewinds it. anything allocated in a scope must
+ * be gone when it ends, trees which live on (delta state, config) are built outside one.
+ * free checks the address, so memory from before, after or outside a scope is released
+ * to the heap as usual, whatever thread frees it.
+ */
+//heap NULL: malloc/free
+int arena_init(size_t size, const cJSON_Hooks *heap);
+void arena_exit(void);
+
+void arena_begin(void);
+void arena_end(void);
+
+void *arena_alloc(size_t size);
+void arena_release(void *ptr);
+//NUL terminated copy, arena_release it
+char *arena_strndup(struct mg_str s);
+
+const struct arena_stats *arena_get_stats(void);
+void arena_stats_dump(void);
+
+#endif
@@ -0,0 +1,67 @@
+#include <zlib.h>
+#include <iot/mongoose.h>
+#include "batch.h"
+
+int batch_add(struct batch *b, struct mg_str msg, uint64_t now, int window_ms) {
+    size_t len = b->buf.len;
+
+    if (b->buf.align == 0) //grow in steps, not on every message
+        b->buf.align = BATCH_IO_ALIGN;
+
+    if (mg_iobuf_add(&b->buf, b->buf.len, b->count ? "," : "[", 1) == 0 ||
+        mg_iobuf_add(&b->buf, b->buf.len, msg.ptr, msg.len) == 0) {
+        b->buf.len = len; //out of memory, keep the batch as it was
+        return -1;
+    }
+
+    if (b->count++ == 0)
+        b->deadline = now + window_ms;
+    return 0;
+}
+
+struct mg_str batch_finish(struct batch *b) {
+    if (b->count == 0)
+        return mg_str_n(NULL, 0);
+    if (mg_iobuf_add(&b->buf, b->buf.len, "]", 1) == 0)
+        return mg_str_n(NULL, 0);
+    return mg_str_n((const char *) b->buf.buf, b->buf.len);
+}
+
+void batch_reset(struct batch *b) {
+    b->buf.len = 0; //keep the allocation for the next batch
+    b->count = 0;
+    b->deadline = 0;
+}
+
+void batch_free(struct batch *b) {
+    mg_iobuf_free(&b->buf);
+    b->count = 0;
+}
+
+void batch_stats_dump(struct batch_stats *st, size_t batch_bytes) {
+    if (st->batches == 0 && st->bypassed == 0)
+        return;
+    MG_INFO(("batches: %llu, messages: %llu, bypassed: %llu, dropped: %llu, fill: %llu%%",
+        (unsigned long long) st->batches, (unsigned long long) st->messages,
+        (unsigned long long) st->bypassed, (unsigned long long) st->dropped,
+        (unsigned long long) (st->batches && batch_bytes ? st->fill_bytes * 100 / (st->batches * batch_bytes) : 0)));
+    MG_INFO(("deflated batches: %llu, bytes in: %llu, out: %llu, ratio: %llu%%",
+        (unsigned long long) st->deflated, (unsigned long long) st->deflate_in, (unsigned long long) st->deflate_out,
+        (unsigned long long) (st->deflate_in ? st->deflate_out * 100 / st->deflate_in : 0)));
+}
+
+int batch_deflate(struct mg_str in, struct mg_iobuf *out) {
+    uLongf len = compressBound((uLong) in.len);
+
+    if (out->size < len) {
+        mg_iobuf_free(out);
+        if (mg_iobuf_add(out, 0, NULL, len) == 0)
+            return -1;
+    }
+
+    if (compress2(out->buf, &len, (const Bytef *) in.ptr, (uLong) in.len, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return -1;
+
+    out->len = len;
+    return 0;
+}
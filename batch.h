@@ -0,0 +1,38 @@
+#ifndef __IOT_BATCH_H__
+#define __IOT_BATCH_H__
+
+#include <iot/mongoose.h>
+
+#define BATCH_IO_ALIGN 1024
+
+// uplink messages of one session collected into a json array [msg,msg,...]
+struct batch {
+    struct mg_iobuf buf;
+    int count;              //messages in buf
+    uint64_t deadline;      //ms, flush at the latest, set by the first message
+};
+
+struct batch_stats {
+    uint64_t batches;       //publishes of a batch
+    uint64_t messages;      //messages sent in batches
+    uint64_t bypassed;      //control replies published at once
+    uint64_t fill_bytes;    //sum of batch bytes, fill ratio is fill_bytes / (batches * max bytes)
+    uint64_t deflated;      //batches sent compressed
+    uint64_t deflate_in;    //bytes before compression
+    uint64_t deflate_out;   //bytes after compression
+    uint64_t dropped;       //messages lost with a batch, connection closed and no queue
+};
+
+//append a json message, the first one sets deadline to now + window_ms
+int batch_add(struct batch *b, struct mg_str msg, uint64_t now, int window_ms);
+//close the array, the returned string is valid until batch_reset
+struct mg_str batch_finish(struct batch *b);
+void batch_reset(struct batch *b);
+void batch_free(struct batch *b);
+
+void batch_stats_dump(struct batch_stats *st, size_t batch_bytes);
+
+//zlib compress in into out, 0: ok
+int batch_deflate(struct mg_str in, struct mg_iobuf *out);
+
+#endif
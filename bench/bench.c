@@ -0,0 +1,787 @@
+#include <iot/mongoose.h>
+#include <iot/iot.h>
+#include "../mqtt.h"
+#include "../client.h"
+#include "../callback.h"
+#include <sys/un.h>
+
+/*
+ * offline relay benchmark, everything runs on the iot-client mg_mgr:
+ *
+ *   cloud driver --bench/down--> broker --> iot-client cloud session --> cloud_mqtt_msg_callback
+ *   --mg/iot-client/channel/iot-rpcd--> broker --> fake iot-rpcd (echo) --mg/iot-client/channel--> broker
+ *   --> iot-client local conn --> local_mqtt_msg_callback --bench/up--> broker --> cloud driver
+ *
+ * the in-process broker stands in for both the cloud broker and the local bus. with -u the
+ * fake iot-rpcd listens on a unix seqpacket socket instead, and iot-client uses -s unix://.
+ * with -I n get_config returns a gateway config of n identities on bench/down/<i> and
+ * bench/up/<i>, the driver spreads requests over them round robin.
+ */
+
+#define BENCH_BROKER_URL  "mqtt://127.0.0.1:18830"
+#define BENCH_TOPIC_DOWN  "bench/down"
+#define BENCH_TOPIC_UP    "bench/up"
+#define BENCH_MAX_SUBS    128
+#define BENCH_IDENTITIES_MAX 32
+
+struct bench_sub {
+    struct mg_connection *c;
+    char topic[128];
+};
+
+// topic alias 1 of an mqtt5 client
+struct bench_alias {
+    struct mg_connection *c;
+    char topic[128];
+};
+
+struct bench {
+    const char *broker_url;
+    int rate;               //requests per second
+    int duration;           //seconds
+    int payload;            //bytes of padding in each request
+    int64_t p99_limit_us;   //0: no limit
+    int soak;               //seconds between rss samples, 0: no soak
+    long rss_limit_kb;      //soak: fail if rss grows more over the second half
+
+    int version;            //highest mqtt version the broker accepts
+    int identities;         //cloud identities, 1: single device config on the plain topics
+
+    struct bench_sub subs[BENCH_MAX_SUBS];
+    struct bench_alias aliases[BENCH_MAX_SUBS];
+
+    struct mg_connection *rpcd;
+    const char *unix_path;  //fake iot-rpcd on a unix socket, NULL: on the broker
+    int unix_fd;            //listening socket
+    struct local_unix rpcd_local;
+    struct mg_connection *driver;
+    int rpcd_ready;
+    int driver_ready;
+
+    uint64_t start_ns;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t rpcd_handled;
+    int64_t budget;         //in 1/100 request, send timer runs every 10ms
+
+    uint32_t *latency_us;   //one slot per request
+    size_t latency_cap;
+
+    uint64_t down_bytes;    //request bytes the driver published towards the device
+    uint64_t up_bytes;      //reply bytes the driver received back from the device
+    uint64_t received_by[BENCH_IDENTITIES_MAX]; //replies per identity with -I
+    uint64_t wire_up_bytes; //publish packets of iot-client on BENCH_TOPIC_UP or BENCH_TOPIC_UP/<i>, header and topic included
+    uint64_t wire_up_msgs;
+    uint64_t correlated;    //replies carrying the correlation data of their request
+
+    char *pad;
+};
+
+static struct bench s_bench;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long rss_kb(void) {
+    char line[128];
+    long kb = -1;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+// mqtt topic filter match, supports + and #
+static int topic_match(const char *filter, struct mg_str topic) {
+    const char *t = topic.ptr, *end = topic.ptr + topic.len;
+
+    while (*filter) {
+        if (*filter == '#')
+            return 1;
+        if (*filter == '+') {
+            while (t < end && *t != '/')
+                t++;
+            filter++;
+        } else {
+            if (t >= end || *t != *filter)
+                return 0;
+            t++;
+            filter++;
+        }
+    }
+    return t == end;
+}
+
+// base, or base/<i> in multi identity mode
+static struct mg_str bench_topic(char *buf, size_t len, const char *base, int i) {
+    if (s_bench.identities <= 1)
+        return mg_str(base);
+    return mg_str_n(buf, mg_snprintf(buf, len, "%s/%d", base, i));
+}
+
+// identity of an uplink topic, -1: not one
+static int bench_identity(struct mg_str topic) {
+    size_t n = strlen(BENCH_TOPIC_UP);
+
+    if (topic.len < n || memcmp(topic.ptr, BENCH_TOPIC_UP, n) != 0)
+        return -1;
+    if (topic.len == n)
+        return 0;
+    if (topic.ptr[n] != '/' || topic.len == n + 1)
+        return -1;
+    int i = 0;
+    for (size_t k = n + 1; k < topic.len; k++) {
+        if (!isdigit((unsigned char) topic.ptr[k]) || (i = i * 10 + topic.ptr[k] - '0') >= BENCH_IDENTITIES_MAX)
+            return -1;
+    }
+    return i;
+}
+
+// payload of a raw mqtt packet, after fixed header
+static const uint8_t *packet_body(struct mg_str dgram, const uint8_t **end) {
+    const uint8_t *p = (const uint8_t *) dgram.ptr + 1;
+    *end = (const uint8_t *) dgram.ptr + dgram.len;
+    while (p < *end && (*p++ & 0x80))
+        ;
+    return p;
+}
+
+// response topic, correlation data and topic alias of an mqtt5 publish, other properties end the walk
+static void publish_props(struct mg_connection *c, struct mg_mqtt_message *mm, struct mg_str *resp,
+    struct mg_str *cdata, uint32_t *alias) {
+    const uint8_t *p, *end;
+
+    if (!c->is_mqtt5 || mm->props_size == 0 || mm->props_start + mm->props_size > mm->dgram.len)
+        return;
+    p = (const uint8_t *) mm->dgram.ptr + mm->props_start;
+    end = p + mm->props_size;
+    while (p < end) {
+        uint8_t id = *p++;
+        if (id == MQTT_PROP_TOPIC_ALIAS && end - p >= 2) {
+            *alias = ((uint32_t) p[0] << 8) | p[1];
+            p += 2;
+        } else if ((id == MQTT_PROP_RESPONSE_TOPIC || id == MQTT_PROP_CORRELATION_DATA) && end - p >= 2) {
+            size_t len = ((size_t) p[0] << 8) | p[1];
+            if ((size_t) (end - p - 2) < len)
+                return;
+            *(id == MQTT_PROP_RESPONSE_TOPIC ? resp : cdata) = mg_str_n((const char *) p + 2, len);
+            p += 2 + len;
+        } else {
+            return;
+        }
+    }
+}
+
+// CONNECT protocol level picks the CONNACK format, mqtt 5 above s_bench.version is refused
+static void broker_connect(struct mg_connection *c, struct mg_mqtt_message *mm) {
+    const uint8_t *end, *p = packet_body(mm->dgram, &end);
+    uint8_t level = end - p > 6 ? p[6] : 4;
+
+    if (level == 5 && s_bench.version >= 5) {
+        //receive maximum 64, topic alias maximum 1
+        uint8_t response[] = {0, 0, 6, MQTT_PROP_RECEIVE_MAXIMUM, 0, 64, MQTT_PROP_TOPIC_ALIAS_MAXIMUM, 0, 1};
+        c->is_mqtt5 = 1;
+        mg_mqtt_send_header(c, MQTT_CMD_CONNACK, 0, sizeof(response));
+        mg_send(c, response, sizeof(response));
+    } else {
+        uint8_t response[] = {0, level == 5 ? 1 : 0}; //1: unacceptable protocol version
+        mg_mqtt_send_header(c, MQTT_CMD_CONNACK, 0, sizeof(response));
+        mg_send(c, response, sizeof(response));
+        if (level == 5)
+            c->is_draining = 1;
+    }
+}
+
+static struct bench_alias *broker_alias(struct mg_connection *c) {
+    struct bench_alias *free_slot = NULL;
+    for (int i = 0; i < BENCH_MAX_SUBS; i++) {
+        if (s_bench.aliases[i].c == c)
+            return &s_bench.aliases[i];
+        if (!s_bench.aliases[i].c && !free_slot)
+            free_slot = &s_bench.aliases[i];
+    }
+    if (free_slot) {
+        free_slot->c = c;
+        free_slot->topic[0] = '\0';
+    }
+    return free_slot;
+}
+
+static void broker_publish(struct mg_connection *c, struct mg_mqtt_message *mm) {
+    struct mg_str topic = mm->topic, resp = MG_NULL_STR, cdata = MG_NULL_STR;
+    uint32_t alias = 0;
+
+    publish_props(c, mm, &resp, &cdata, &alias);
+    if (alias == 1) {
+        struct bench_alias *a = broker_alias(c);
+        if (!a)
+            return;
+        if (topic.len > 0 && topic.len < sizeof(a->topic)) {
+            memcpy(a->topic, topic.ptr, topic.len);
+            a->topic[topic.len] = '\0';
+        }
+        topic = mg_str(a->topic);
+    }
+
+    if (bench_identity(topic) >= 0) {
+        s_bench.wire_up_bytes += mm->dgram.len;
+        s_bench.wire_up_msgs++;
+    }
+
+    for (int i = 0; i < BENCH_MAX_SUBS; i++) {
+        if (s_bench.subs[i].c && topic_match(s_bench.subs[i].topic, topic)) {
+            struct mg_mqtt_prop props[2];
+            size_t n = 0;
+            memset(props, 0, sizeof(props));
+            if (resp.len) {
+                props[n].id = MQTT_PROP_RESPONSE_TOPIC;
+                props[n++].val = resp;
+            }
+            if (cdata.len) {
+                props[n].id = MQTT_PROP_CORRELATION_DATA;
+                props[n++].val = cdata;
+            }
+
+            struct mg_mqtt_opts pub_opts;
+            memset(&pub_opts, 0, sizeof(pub_opts));
+            pub_opts.topic = topic;
+            pub_opts.message = mm->data;
+            if (s_bench.subs[i].c->is_mqtt5) {
+                pub_opts.props = n ? props : NULL;
+                pub_opts.num_props = n;
+            }
+            mg_mqtt_pub(s_bench.subs[i].c, &pub_opts);
+        }
+    }
+}
+
+static void broker_subscribe(struct mg_connection *c, struct mg_mqtt_message *mm) {
+    const uint8_t *end, *p = packet_body(mm->dgram, &end);
+    uint8_t resp[32];
+    int n = 0;
+
+    p += 2; //packet id
+    while (p + 2 <= end && n < (int) sizeof(resp)) {
+        size_t len = ((size_t) p[0] << 8) | p[1];
+        p += 2;
+        if (p + len + 1 > end)
+            break;
+        for (int i = 0; i < BENCH_MAX_SUBS; i++) {
+            if (s_bench.subs[i].c == NULL && len < sizeof(s_bench.subs[i].topic)) {
+                s_bench.subs[i].c = c;
+                memcpy(s_bench.subs[i].topic, p, len);
+                s_bench.subs[i].topic[len] = '\0';
+                break;
+            }
+        }
+        resp[n++] = p[len] & 3;
+        p += len + 1;
+    }
+
+    uint8_t id[2] = { (uint8_t) (mm->id >> 8), (uint8_t) mm->id };
+    mg_mqtt_send_header(c, MQTT_CMD_SUBACK, 0, (uint32_t) n + 2);
+    mg_send(c, id, sizeof(id));
+    mg_send(c, resp, n);
+}
+
+static void broker_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+
+    if (ev == MG_EV_MQTT_CMD) {
+        struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+        switch (mm->cmd) {
+            case MQTT_CMD_CONNECT:
+                broker_connect(c, mm);
+                break;
+            case MQTT_CMD_SUBSCRIBE:
+                broker_subscribe(c, mm);
+                break;
+            case MQTT_CMD_PUBLISH:
+                broker_publish(c, mm);
+                break;
+            case MQTT_CMD_PINGREQ:
+                mg_mqtt_pong(c);
+                break;
+        }
+    } else if (ev == MG_EV_CLOSE) {
+        for (int i = 0; i < BENCH_MAX_SUBS; i++) {
+            if (s_bench.subs[i].c == c)
+                s_bench.subs[i].c = NULL;
+            if (s_bench.aliases[i].c == c)
+                s_bench.aliases[i].c = NULL;
+        }
+    }
+}
+
+// "to" topic and data of a request envelope, {"method":"call","param":[m,f,{"topic":..,"to":"..","data":<data>}]}
+static int rpcd_parse(struct mg_str msg, struct mg_str *to, struct mg_str *data) {
+    const char *p = msg.ptr, *end = msg.ptr + msg.len;
+    const char *k_to = "\"" FIELD_TO "\":\"", *k_data = "\"" FIELD_DATA "\":";
+
+    *to = *data = mg_str_n(NULL, 0);
+    for (; p < end; p++) {
+        if (!to->ptr && (size_t) (end - p) > strlen(k_to) && memcmp(p, k_to, strlen(k_to)) == 0) {
+            const char *q = p + strlen(k_to), *e = memchr(q, '"', end - q);
+            if (e)
+                *to = mg_str_n(q, e - q);
+        } else if (to->ptr && (size_t) (end - p) > strlen(k_data) && memcmp(p, k_data, strlen(k_data)) == 0) {
+            const char *q = p + strlen(k_data);
+            *data = mg_str_n(q, end - q - 3); //strip }]}
+            break;
+        }
+    }
+    return to->ptr && data->ptr ? 0 : -1;
+}
+
+// fake iot-rpcd on the unix socket, same echo as rpcd_cb
+static void rpcd_unix_frame(struct mg_connection *c, struct mg_str topic, struct mg_str msg) {
+    struct mg_str to, data;
+
+    if (mg_strcmp(topic, mg_str(IOT_CLIENT_RPCD_TOPIC)) != 0 || rpcd_parse(msg, &to, &data))
+        return;
+    local_unix_send(&s_bench.rpcd_local, c, to, data);
+    s_bench.rpcd_handled++;
+}
+
+static void rpcd_unix_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+
+    if (ev == MG_EV_READ) {
+        local_unix_read(&s_bench.rpcd_local, c, rpcd_unix_frame);
+    } else if (ev == MG_EV_CLOSE) {
+        local_unix_reset(&s_bench.rpcd_local);
+        s_bench.rpcd = NULL;
+        s_bench.rpcd_ready = 0;
+    }
+}
+
+// iot-client connects on its first mqtt task run, after the loop has started
+static void rpcd_unix_accept(struct mg_mgr *mgr) {
+    int fd;
+
+    if (s_bench.rpcd) {
+        local_unix_flush(&s_bench.rpcd_local, s_bench.rpcd);
+        return;
+    }
+    if ((fd = accept(s_bench.unix_fd, NULL, NULL)) < 0)
+        return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if ((s_bench.rpcd = local_unix_wrap(mgr, fd, rpcd_unix_cb, NULL)) == NULL) {
+        close(fd);
+        return;
+    }
+    s_bench.rpcd_ready = 1;
+}
+
+static int rpcd_unix_listen(const char *path) {
+    struct sockaddr_un sun;
+    int fd;
+
+    memset(&sun, 0, sizeof(sun));
+    if (strlen(path) >= sizeof(sun.sun_path))
+        return -1;
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+    unlink(path);
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0 || listen(fd, 4) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// fake iot-rpcd: reply data of the request to the "to" topic of the envelope
+static void rpcd_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+
+    if (ev == MG_EV_MQTT_OPEN) {
+        struct mg_mqtt_opts sub_opts;
+        memset(&sub_opts, 0, sizeof(sub_opts));
+        sub_opts.topic = mg_str(IOT_CLIENT_RPCD_TOPIC);
+        mg_mqtt_sub(c, &sub_opts);
+        s_bench.rpcd_ready = 1;
+    } else if (ev == MG_EV_MQTT_MSG) {
+        struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+        struct mg_str to, data;
+
+        if (rpcd_parse(mm->data, &to, &data))
+            return;
+
+        struct mg_mqtt_opts pub_opts;
+        memset(&pub_opts, 0, sizeof(pub_opts));
+        pub_opts.topic = to;
+        pub_opts.message = data;
+        mg_mqtt_pub(c, &pub_opts);
+        s_bench.rpcd_handled++;
+    } else if (ev == MG_EV_CLOSE) {
+        s_bench.rpcd = NULL;
+        s_bench.rpcd_ready = 0;
+    }
+}
+
+static void driver_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+
+    if (ev == MG_EV_MQTT_OPEN) {
+        struct mg_mqtt_opts sub_opts;
+        memset(&sub_opts, 0, sizeof(sub_opts));
+        sub_opts.topic = mg_str(s_bench.identities > 1 ? BENCH_TOPIC_UP "/+" : BENCH_TOPIC_UP);
+        mg_mqtt_sub(c, &sub_opts);
+        s_bench.driver_ready = 1;
+    } else if (ev == MG_EV_MQTT_MSG) {
+        struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+        double seq, ts;
+        if (json_get_top_number(mm->data, "seq", &seq) || json_get_top_number(mm->data, "ts", &ts))
+            return;
+        uint64_t lat = (now_ns() - (uint64_t) ts) / 1000 + 1; //0 marks a lost request
+        if ((size_t) seq < s_bench.latency_cap)
+            s_bench.latency_us[(size_t) seq] = lat > UINT32_MAX ? UINT32_MAX : (uint32_t) lat;
+        s_bench.received++;
+        s_bench.up_bytes += mm->data.len;
+        int who = bench_identity(mm->topic);
+        if (who >= 0)
+            s_bench.received_by[who]++;
+
+        struct mg_str resp = MG_NULL_STR, cdata = MG_NULL_STR;
+        uint32_t alias = 0;
+        char id[24];
+        publish_props(c, mm, &resp, &cdata, &alias);
+        mg_snprintf(id, sizeof(id), "%llu", (unsigned long long) seq);
+        if (cdata.len && mg_strcmp(cdata, mg_str(id)) == 0)
+            s_bench.correlated++;
+    } else if (ev == MG_EV_CLOSE) {
+        s_bench.driver = NULL;
+        s_bench.driver_ready = 0;
+    }
+}
+
+static void timer_send_fn(void *arg) {
+    struct client_private *priv = (struct client_private *) ((struct mg_mgr *) arg)->userdata;
+
+    if (!s_bench.driver_ready || !s_bench.rpcd_ready || priv->num_sessions < s_bench.identities || !priv->mqtt_conn)
+        return;
+    for (int i = 0; i < s_bench.identities; i++) {
+        if (!priv->sessions[i]->registered)
+            return;
+    }
+
+    if (s_bench.start_ns == 0)
+        s_bench.start_ns = now_ns();
+
+    if (s_bench.sent >= s_bench.latency_cap)
+        return;
+
+    s_bench.budget += s_bench.rate;
+    while (s_bench.budget >= 100 && s_bench.sent < s_bench.latency_cap) {
+        char *msg = mg_mprintf("{\"seq\":%llu,\"ts\":%llu,\"pad\":\"%s\"}",
+            (unsigned long long) s_bench.sent, (unsigned long long) now_ns(), s_bench.pad);
+        char id[24], down[64], up[64];
+        int who = (int) (s_bench.sent % (uint64_t) s_bench.identities);
+        struct mg_mqtt_prop props[2];
+        memset(props, 0, sizeof(props));
+        mg_snprintf(id, sizeof(id), "%llu", (unsigned long long) s_bench.sent);
+        props[0].id = MQTT_PROP_RESPONSE_TOPIC;
+        props[0].val = bench_topic(up, sizeof(up), BENCH_TOPIC_UP, who);
+        props[1].id = MQTT_PROP_CORRELATION_DATA;
+        props[1].val = mg_str(id);
+
+        struct mg_mqtt_opts pub_opts;
+        memset(&pub_opts, 0, sizeof(pub_opts));
+        pub_opts.topic = bench_topic(down, sizeof(down), BENCH_TOPIC_DOWN, who);
+        pub_opts.message = mg_str(msg);
+        if (s_bench.driver->is_mqtt5) { //request/response the mqtt5 way
+            pub_opts.props = props;
+            pub_opts.num_props = 2;
+        }
+        mg_mqtt_pub(s_bench.driver, &pub_opts);
+        s_bench.down_bytes += strlen(msg);
+        free(msg);
+        s_bench.sent++;
+        s_bench.budget -= 100;
+    }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// one identity, a single device config as before, more make a gateway config
+static int write_script(const char *path, const char *broker_url) {
+    char data[BENCH_IDENTITIES_MAX * 192];
+    size_t n = 0;
+    FILE *fp;
+
+    for (int i = 0; i < s_bench.identities; i++) {
+        char down[64], up[64], id[32];
+        struct mg_str d = bench_topic(down, sizeof(down), BENCH_TOPIC_DOWN, i);
+        struct mg_str u = bench_topic(up, sizeof(up), BENCH_TOPIC_UP, i);
+        if (s_bench.identities > 1)
+            mg_snprintf(id, sizeof(id), "bench-%d", i);
+        else
+            mg_snprintf(id, sizeof(id), "bench");
+        n += mg_snprintf(data + n, sizeof(data) - n,
+            "%s{\"address\":\"%s\",\"user\":\"\",\"password\":\"\",\"client_id\":\"%s\","
+            "\"topic_sub\":\"%.*s\",\"topic_pub\":\"%.*s\",\"qos\":0,\"keepalive\":60}",
+            i ? "," : "", broker_url, id, (int) d.len, d.ptr, (int) u.len, u.ptr);
+    }
+
+    if ((fp = fopen(path, "w")) == NULL)
+        return -1;
+    fprintf(fp,
+        "local M = {}\n"
+        "M.call = function(method, param)\n"
+        "    if method == 'get_config' then\n"
+        "        return '{\"code\":0,\"data\":%s%s%s}'\n"
+        "    end\n"
+        "    return '{\"code\":-1}'\n"
+        "end\n"
+        "return M\n", s_bench.identities > 1 ? "[" : "", data, s_bench.identities > 1 ? "]" : "");
+    fclose(fp);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s OPTIONS\n"
+        "  -b ADDR  - in-process broker listen address, default: '%s'\n"
+        "  -n n     - cloud requests per second, default: 1000\n"
+        "  -t n     - duration in seconds, default: 10\n"
+        "  -p n     - request padding bytes, default: 64\n"
+        "  -P n     - fail if p99 latency is above n us, default: no limit\n"
+        "  -V n     - highest mqtt version of the broker, 4 makes iot-client fall back, default: 5\n"
+        "  -u PATH  - fake iot-rpcd on a unix seqpacket socket instead of the broker, default: broker\n"
+        "  -I n     - cloud identities of a gateway config, one connection each, at most %d, default: 1\n"
+        "  -k n     - soak, print rss every n seconds, default: off\n"
+        "  -R n     - soak, fail if rss grows more than n KB over the second half, default: 1024\n"
+        "  -v LEVEL - debug level, from 0 to 4, default: 1\n",
+        prog, BENCH_BROKER_URL, BENCH_IDENTITIES_MAX);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    char script[64];
+    void *handle = NULL;
+    struct client_private *priv;
+    int ret = 0;
+
+    struct client_option opts = {
+        .mqtt_keepalive = 6,
+        .dns4_url = "udp://127.0.0.1:53",
+        .dns4_timeout = 3,
+        .debug_level = MG_LL_ERROR,
+        .module = "plugin/unicom/callback",
+        .func = "handler",
+        .forward_mode = FORWARD_MODE_RAW,
+        .request_timeout = 10000,
+        .max_inflight = 4096,
+        .send_high_water = 16 * 1024,
+        .outq_bytes = 1024 * 1024,
+        .cloud_mqtt_version = 5,
+        .inflight_window = 64,
+        .reconnect_max = 60000,
+    };
+
+    s_bench.broker_url = BENCH_BROKER_URL;
+    s_bench.rate = 1000;
+    s_bench.duration = 10;
+    s_bench.payload = 64;
+    s_bench.version = 5;
+    s_bench.identities = 1;
+    s_bench.rss_limit_kb = 1024;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc)
+            usage(argv[0]);
+        if (strcmp(argv[i], "-b") == 0) {
+            s_bench.broker_url = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0) {
+            s_bench.rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0) {
+            s_bench.duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-p") == 0) {
+            s_bench.payload = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-P") == 0) {
+            s_bench.p99_limit_us = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "-V") == 0) {
+            s_bench.version = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            s_bench.unix_path = argv[++i];
+        } else if (strcmp(argv[i], "-I") == 0) {
+            s_bench.identities = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            s_bench.soak = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-R") == 0) {
+            s_bench.rss_limit_kb = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-v") == 0) {
+            opts.debug_level = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (s_bench.rate < 1 || s_bench.duration < 1 || s_bench.payload < 0 ||
+        (s_bench.version != 4 && s_bench.version != 5) || s_bench.soak < 0 ||
+        s_bench.identities < 1 || s_bench.identities > BENCH_IDENTITIES_MAX)
+        usage(argv[0]);
+
+    s_bench.latency_cap = (size_t) s_bench.rate * s_bench.duration;
+    s_bench.latency_us = calloc(s_bench.latency_cap, sizeof(uint32_t));
+    s_bench.pad = malloc(s_bench.payload + 1);
+    if (!s_bench.latency_us || !s_bench.pad)
+        return EXIT_FAILURE;
+    if (s_bench.soak) //touch it now, not while rss is watched
+        memset(s_bench.latency_us, 0, s_bench.latency_cap * sizeof(uint32_t));
+    memset(s_bench.pad, 'x', s_bench.payload);
+    s_bench.pad[s_bench.payload] = '\0';
+
+    mg_snprintf(script, sizeof(script), "/tmp/iot-client-bench-%d.lua", (int) getpid());
+    if (write_script(script, s_bench.broker_url)) {
+        fprintf(stderr, "write %s failed\n", script);
+        return EXIT_FAILURE;
+    }
+
+    char *unix_url = NULL;
+    s_bench.unix_fd = -1;
+    if (s_bench.unix_path) {
+        if ((s_bench.unix_fd = rpcd_unix_listen(s_bench.unix_path)) < 0) {
+            fprintf(stderr, "listen on %s failed\n", s_bench.unix_path);
+            unlink(script);
+            return EXIT_FAILURE;
+        }
+        unix_url = mg_mprintf("%s%s", LOCAL_UNIX_PREFIX, s_bench.unix_path);
+    }
+
+    opts.mqtt_serve_address = unix_url ? unix_url : s_bench.broker_url;
+    opts.callback_lua = script;
+
+    if (client_init(&handle, &opts)) {
+        unlink(script);
+        return EXIT_FAILURE;
+    }
+    priv = (struct client_private *) handle;
+
+    if (!mg_mqtt_listen(&priv->mgr, s_bench.broker_url, broker_cb, NULL)) {
+        fprintf(stderr, "listen on %s failed\n", s_bench.broker_url);
+        client_exit(handle);
+        unlink(script);
+        return EXIT_FAILURE;
+    }
+
+    struct mg_mqtt_opts conn_opts;
+    memset(&conn_opts, 0, sizeof(conn_opts));
+    conn_opts.clean = true;
+    conn_opts.version = 4;
+    conn_opts.client_id = mg_str("bench-rpcd");
+    if (!s_bench.unix_path)
+        s_bench.rpcd = mg_mqtt_connect(&priv->mgr, s_bench.broker_url, &conn_opts, rpcd_cb, NULL);
+    conn_opts.client_id = mg_str("bench-cloud");
+    conn_opts.version = (uint8_t) s_bench.version;
+    s_bench.driver = mg_mqtt_connect(&priv->mgr, s_bench.broker_url, &conn_opts, driver_cb, NULL);
+
+    mg_timer_add(&priv->mgr, 10, MG_TIMER_REPEAT, timer_send_fn, &priv->mgr);
+
+    long rss_start = rss_kb();
+    uint64_t deadline = now_ns() + (uint64_t) (s_bench.duration + 10) * 1000000000ULL;
+    uint64_t done_ns = 0, sample_ns = 0;
+    long rss_half = -1;
+
+    while (now_ns() < deadline) {
+        client_poll(priv, 1);
+        if (s_bench.soak && s_bench.start_ns && now_ns() >= sample_ns) {
+            uint64_t t = (now_ns() - s_bench.start_ns) / 1000000000ULL;
+            long rss = rss_kb();
+            if (rss_half < 0 && t * 2 >= (uint64_t) s_bench.duration)
+                rss_half = rss;
+            printf("soak       : %llus, sent %llu, rss %ld kb\n", (unsigned long long) t,
+                (unsigned long long) s_bench.sent, rss);
+            fflush(stdout);
+            sample_ns = s_bench.start_ns + (t + s_bench.soak) * 1000000000ULL;
+        }
+        if (s_bench.unix_path)
+            rpcd_unix_accept(&priv->mgr);
+        if (s_bench.sent == s_bench.latency_cap && !done_ns)
+            done_ns = now_ns();
+        if (s_bench.received == s_bench.latency_cap)
+            break;
+        if (done_ns && now_ns() - done_ns > 2000000000ULL) //2s grace for replies in flight
+            break;
+    }
+
+    double elapsed = s_bench.start_ns ? (double) (now_ns() - s_bench.start_ns) / 1e9 : 0;
+    size_t n = 0;
+    for (size_t i = 0; i < s_bench.latency_cap; i++) {
+        if (s_bench.latency_us[i])
+            s_bench.latency_us[n++] = s_bench.latency_us[i];
+    }
+    qsort(s_bench.latency_us, n, sizeof(uint32_t), cmp_u32);
+
+#define PCT(p) (n ? s_bench.latency_us[(size_t) ((n - 1) * (p))] : 0)
+    printf("requests   : sent %llu, received %llu, lost %llu, rpcd handled %llu\n",
+        (unsigned long long) s_bench.sent, (unsigned long long) s_bench.received,
+        (unsigned long long) (s_bench.sent - s_bench.received), (unsigned long long) s_bench.rpcd_handled);
+    printf("throughput : %.0f msg/s, down %.1f KB/s, up %.1f KB/s\n",
+        elapsed > 0 ? s_bench.received / elapsed : 0,
+        elapsed > 0 ? s_bench.down_bytes / elapsed / 1024 : 0, elapsed > 0 ? s_bench.up_bytes / elapsed / 1024 : 0);
+    printf("latency us : p50 %u, p99 %u, p999 %u, max %u\n",
+        PCT(0.50), PCT(0.99), PCT(0.999), n ? s_bench.latency_us[n - 1] : 0);
+    if (s_bench.identities > 1) {
+        uint64_t lo = UINT64_MAX, hi = 0;
+        for (int i = 0; i < s_bench.identities; i++) {
+            if (s_bench.received_by[i] < lo)
+                lo = s_bench.received_by[i];
+            if (s_bench.received_by[i] > hi)
+                hi = s_bench.received_by[i];
+        }
+        printf("identities : %d, sessions %d, replies per identity min %llu, max %llu\n", s_bench.identities,
+            priv->num_sessions, (unsigned long long) lo, (unsigned long long) hi);
+    }
+    printf("uplink     : mqtt %d, wire %llu bytes, %.1f per msg, aliased %llu, alias saved %llu bytes, correlated %llu\n",
+        s_bench.version, (unsigned long long) s_bench.wire_up_bytes,
+        s_bench.wire_up_msgs ? (double) s_bench.wire_up_bytes / s_bench.wire_up_msgs : 0,
+        (unsigned long long) priv->cloud_stats.aliased, (unsigned long long) priv->cloud_stats.alias_saved,
+        (unsigned long long) s_bench.correlated);
+    printf("local      : %s, frames in %llu, out %llu, deferred %llu\n",
+        s_bench.unix_path ? "unix seqpacket" : "mqtt broker",
+        (unsigned long long) priv->local.stats.frames_in, (unsigned long long) priv->local.stats.frames_out,
+        (unsigned long long) priv->local.stats.deferred);
+    long rss_end = rss_kb();
+    printf("rss kb     : start %ld, end %ld\n", rss_start, rss_end);
+    if (s_bench.soak)
+        printf("soak       : rss half %ld, end %ld, growth %ld kb, limit %ld kb\n", rss_half, rss_end,
+            rss_half < 0 ? 0 : rss_end - rss_half, s_bench.rss_limit_kb);
+    printf("arena      : allocs %llu, spills %llu, heap %llu, high water %lu bytes\n",
+        (unsigned long long) arena_get_stats()->allocs, (unsigned long long) arena_get_stats()->spills,
+        (unsigned long long) arena_get_stats()->heap, (unsigned long) arena_get_stats()->high_water);
+    printf("forward    : messages %llu, fallbacks %llu, bytes copied %llu, allocs %llu\n",
+        (unsigned long long) priv->fwd.stats.messages, (unsigned long long) priv->fwd.stats.fallbacks,
+        (unsigned long long) priv->fwd.stats.bytes_copied, (unsigned long long) priv->fwd.stats.allocs);
+
+    if (s_bench.received == 0 || s_bench.received != s_bench.sent)
+        ret = EXIT_FAILURE;
+    if (s_bench.p99_limit_us && (int64_t) PCT(0.99) > s_bench.p99_limit_us)
+        ret = EXIT_FAILURE;
+    if (s_bench.soak && rss_half >= 0 && rss_end - rss_half > s_bench.rss_limit_kb)
+        ret = EXIT_FAILURE;
+#undef PCT
+
+    client_exit(handle);
+    unlink(script);
+    if (s_bench.unix_path) {
+        close(s_bench.unix_fd);
+        unlink(s_bench.unix_path);
+        free(unix_url);
+    }
+    free(s_bench.latency_us);
+    free(s_bench.pad);
+
+    return ret;
+}
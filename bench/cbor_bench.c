@@ -0,0 +1,108 @@
+#include <iot/cJSON.h>
+#include <iot/mongoose.h>
+#include "../cbor.h"
+
+/*
+ * cloud payload encoding, json as iot-rpcd sends it against cbor on the wire:
+ *   size  : bytes of the json and of the cbor payload
+ *   encode: cbor_from_json, what a cbor session does to every publish
+ *   decode: cbor_to_json, what it does to every cbor request
+ *   cjson : cJSON_ParseWithLength + cJSON_PrintUnformatted of the same json, for scale
+ */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct payload {
+    const char *name;
+    char *data;
+};
+
+// numeric heavy telemetry, one sample per second of a minute
+static char *series_json(void) {
+    static char buf[4096];
+    size_t n = mg_snprintf(buf, sizeof(buf), "{\"id\":\"8a7f01\",\"ts\":1700000000,\"interval\":1,\"rssi\":[");
+
+    for (int i = 0; i < 60; i++)
+        n += mg_snprintf(buf + n, sizeof(buf) - n, "%s%d", i ? "," : "", -60 - (i * 7) % 25);
+    n += mg_snprintf(buf + n, sizeof(buf) - n, "],\"rx\":[");
+    for (int i = 0; i < 60; i++)
+        n += mg_snprintf(buf + n, sizeof(buf) - n, "%s%lu", i ? "," : "", 123456789UL + (unsigned long) i * 104729);
+    n += mg_snprintf(buf + n, sizeof(buf) - n, "],\"temp\":[");
+    for (int i = 0; i < 60; i++)
+        n += mg_snprintf(buf + n, sizeof(buf) - n, "%s%d.%d", i ? "," : "", 40 + i % 5, (i * 5) % 10);
+    mg_snprintf(buf + n, sizeof(buf) - n, "]}");
+    return strdup(buf);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    struct payload payloads[] = {
+        {"command", strdup("{\"method\":\"call\",\"param\":[\"ubus\",\"call\",{\"object\":\"system\",\"method\":\"board\"}]}")},
+        {"reply", strdup("{\"code\":0,\"data\":{\"kernel\":\"5.15.137\",\"hostname\":\"OpenWrt\",\"system\":\"ARMv8 Processor rev 4\","
+            "\"model\":\"Router X1\",\"board_name\":\"router-x1\",\"release\":{\"distribution\":\"OpenWrt\","
+            "\"version\":\"23.05.2\",\"revision\":\"r23630-842932a63d\",\"target\":\"mediatek/filogic\"}}}")},
+        {"telemetry", strdup("{\"id\":\"8a7f01\",\"ts\":1700000000,\"wan\":{\"rx\":123456789,\"tx\":987654321,\"rssi\":-67,\"rsrp\":-95,\"sinr\":12.5},"
+            "\"lan\":[{\"mac\":\"00:11:22:33:44:55\",\"ip\":\"192.168.1.10\",\"rx\":1024,\"tx\":2048},"
+            "{\"mac\":\"00:11:22:33:44:66\",\"ip\":\"192.168.1.11\",\"rx\":4096,\"tx\":8192},"
+            "{\"mac\":\"00:11:22:33:44:77\",\"ip\":\"192.168.1.12\",\"rx\":16384,\"tx\":32768}],"
+            "\"cpu\":[12,15,9,30],\"mem\":{\"total\":131072,\"free\":40960,\"cached\":12288},\"uptime\":86400}")},
+        {"series", series_json()},
+    };
+    struct mg_iobuf cbor = { 0 }, json = { 0 };
+    uint64_t total_json = 0, total_cbor = 0;
+
+    if (iterations <= 0)
+        iterations = 100000;
+
+    printf("%-10s %10s %10s %6s %10s %10s %10s %10s\n", "payload", "json bytes", "cbor bytes", "size",
+        "enc ns", "enc MB/s", "dec ns", "cjson ns");
+
+    for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+        struct mg_str data = mg_str(payloads[i].data);
+        uint64_t start, enc, dec, cj;
+
+        if (cbor_from_json(data, &cbor) || cbor_to_json(mg_str_n((const char *) cbor.buf, cbor.len), &json)) {
+            fprintf(stderr, "%s: transcode failed\n", payloads[i].name);
+            return EXIT_FAILURE;
+        }
+        struct mg_str wire = mg_str_n((const char *) cbor.buf, cbor.len);
+        size_t wire_len = cbor.len;
+
+        start = now_ns();
+        for (int n = 0; n < iterations; n++)
+            cbor_from_json(data, &cbor);
+        enc = now_ns() - start;
+
+        start = now_ns();
+        for (int n = 0; n < iterations; n++)
+            cbor_to_json(wire, &json);
+        dec = now_ns() - start;
+
+        start = now_ns();
+        for (int n = 0; n < iterations; n++) {
+            cJSON *root = cJSON_ParseWithLength(data.ptr, data.len);
+            char *printed = cJSON_PrintUnformatted(root);
+            cJSON_free(printed);
+            cJSON_Delete(root);
+        }
+        cj = now_ns() - start;
+
+        total_json += data.len;
+        total_cbor += wire_len;
+        printf("%-10s %10lu %10lu %5lu%% %10.0f %10.1f %10.0f %10.0f\n", payloads[i].name,
+            (unsigned long) data.len, (unsigned long) wire_len, (unsigned long) (wire_len * 100 / data.len),
+            (double) enc / iterations, enc ? (double) data.len * iterations * 1000 / enc : 0,
+            (double) dec / iterations, (double) cj / iterations);
+        free(payloads[i].data);
+    }
+
+    printf("total: json %llu bytes, cbor %llu bytes, %llu%%\n", (unsigned long long) total_json,
+        (unsigned long long) total_cbor, (unsigned long long) (total_json ? total_cbor * 100 / total_json : 0));
+    mg_iobuf_free(&cbor);
+    mg_iobuf_free(&json);
+    return 0;
+}
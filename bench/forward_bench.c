@@ -0,0 +1,119 @@
+#include <iot/cJSON.h>
+#include <iot/mongoose.h>
+#include <iot/iot.h>
+#include "../forward.h"
+#include "../arena.h"
+#include "../mqtt.h"
+
+/*
+ * compare cloud -> iot-rpcd envelope building:
+ *   parse: cJSON_ParseWithLength + build tree + cJSON_Print (FORWARD_MODE_PARSE)
+ *   arena: the same inside an arena scope, as cloud_mqtt_msg_callback runs it
+ *   raw  : splice payload into precomputed prefix/suffix (FORWARD_MODE_RAW)
+ * heap allocations and bytes of the parse path are counted by the heap hooks behind the arena.
+ */
+
+static uint64_t s_allocs;
+static uint64_t s_alloc_bytes;
+
+static void *count_malloc(size_t sz) {
+    s_allocs++;
+    s_alloc_bytes += sz;
+    return malloc(sz);
+}
+
+static void count_free(void *ptr) {
+    free(ptr);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct payload {
+    const char *name;
+    const char *topic;
+    const char *data;
+};
+
+static const struct payload s_payloads[] = {
+    {"command", "device/cmd/123", "{\"method\":\"call\",\"param\":[\"ubus\",\"call\",{\"object\":\"system\",\"method\":\"board\"}]}"},
+    {"telemetry", "device/report/123",
+        "{\"id\":\"8a7f01\",\"ts\":1700000000,\"wan\":{\"rx\":123456789,\"tx\":987654321,\"rssi\":-67,\"rsrp\":-95,\"sinr\":12.5},"
+        "\"lan\":[{\"mac\":\"00:11:22:33:44:55\",\"ip\":\"192.168.1.10\",\"rx\":1024,\"tx\":2048},"
+        "{\"mac\":\"00:11:22:33:44:66\",\"ip\":\"192.168.1.11\",\"rx\":4096,\"tx\":8192},"
+        "{\"mac\":\"00:11:22:33:44:77\",\"ip\":\"192.168.1.12\",\"rx\":16384,\"tx\":32768}],"
+        "\"cpu\":[12,15,9,30],\"mem\":{\"total\":131072,\"free\":40960,\"cached\":12288},\"uptime\":86400}"},
+    {"not-json", "device/raw/123", "reboot now, \"please\"\n"},
+};
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    const char *module = "plugin/unicom/callback", *func = "handler";
+    cJSON_Hooks hooks = { count_malloc, count_free };
+
+    if (iterations <= 0)
+        iterations = 100000;
+
+    if (arena_init(ARENA_SIZE, &hooks)) {
+        fprintf(stderr, "arena init failed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("%-10s %-6s %10s %12s %12s %10s\n", "payload", "mode", "out bytes", "allocs/msg", "bytes/msg", "ns/msg");
+
+    for (size_t i = 0; i < sizeof(s_payloads) / sizeof(s_payloads[0]); i++) {
+        const struct payload *pl = &s_payloads[i];
+        struct mg_str topic = mg_str(pl->topic), data = mg_str(pl->data);
+        struct forward_ctx fwd;
+        size_t out_len = 0;
+        uint64_t start;
+
+        // parse
+        s_allocs = s_alloc_bytes = 0;
+        start = now_ns();
+        for (int n = 0; n < iterations; n++) {
+            char *printed = forward_envelope_parse(module, func, IOT_CLIENT_RPCD_TOPIC_PREFIX, n + 1, topic, data);
+            out_len = strlen(printed);
+            cJSON_free(printed);
+        }
+        printf("%-10s %-6s %10zu %12.1f %12.1f %10.0f\n", pl->name, "parse", out_len,
+            (double) s_allocs / iterations, (double) s_alloc_bytes / iterations,
+            (double) (now_ns() - start) / iterations);
+
+        // parse in an arena scope
+        s_allocs = s_alloc_bytes = 0;
+        start = now_ns();
+        for (int n = 0; n < iterations; n++) {
+            arena_begin();
+            char *printed = forward_envelope_parse(module, func, IOT_CLIENT_RPCD_TOPIC_PREFIX, n + 1, topic, data);
+            out_len = strlen(printed);
+            cJSON_free(printed);
+            arena_end();
+        }
+        printf("%-10s %-6s %10zu %12.1f %12.1f %10.0f\n", pl->name, "arena", out_len,
+            (double) s_allocs / iterations, (double) s_alloc_bytes / iterations,
+            (double) (now_ns() - start) / iterations);
+
+        // raw
+        if (forward_init(&fwd, module, func)) {
+            fprintf(stderr, "forward init failed\n");
+            return EXIT_FAILURE;
+        }
+        start = now_ns();
+        for (int n = 0; n < iterations; n++) {
+            out_len = forward_envelope(&fwd, topic, mg_str(IOT_CLIENT_RPCD_TOPIC_PREFIX), n + 1, data).len;
+        }
+        printf("%-10s %-6s %10zu %12.4f %12.1f %10.0f\n", pl->name, "raw", out_len,
+            (double) fwd.stats.allocs / iterations, (double) fwd.stats.bytes_copied / iterations,
+            (double) (now_ns() - start) / iterations);
+        forward_free(&fwd);
+    }
+
+    printf("arena: high water %lu bytes, spills %llu\n", (unsigned long) arena_get_stats()->high_water,
+        (unsigned long long) arena_get_stats()->spills);
+    arena_exit();
+    return 0;
+}
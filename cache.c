@@ -0,0 +1,222 @@
+#include <iot/cJSON.h>
+#include <iot/mongoose.h>
+#include <iot/iot.h>
+#include "forward.h"
+#include "cache.h"
+
+static void cache_entry_free(struct cache_entry *ce) {
+    free(ce->data);
+    free(ce->req);
+    memset(ce, 0, sizeof(*ce));
+}
+
+void cache_free(struct cache *c) {
+    for (int i = 0; i < CACHE_ENTRIES; i++)
+        cache_entry_free(&c->entries[i]);
+    mg_iobuf_free(&c->req);
+}
+
+void cache_rules_clear(struct cache *c) {
+    for (int i = 0; i < CACHE_ENTRIES; i++) { //pending ones still have their requests tracked
+        if (c->entries[i].state == CACHE_READY)
+            cache_entry_free(&c->entries[i]);
+    }
+    c->num_rules = 0;
+}
+
+int cache_rule_add(struct cache *c, const char *name, int ttl_ms) {
+    if (c->num_rules >= CACHE_RULES_MAX || strlen(name) >= CACHE_NAME_LEN || ttl_ms <= 0)
+        return -1;
+    mg_snprintf(c->rules[c->num_rules].name, CACHE_NAME_LEN, "%s", name);
+    c->rules[c->num_rules].ttl_ms = ttl_ms;
+    c->num_rules++;
+    return 0;
+}
+
+int cache_ttl(struct cache *c, struct mg_str data) {
+    char name[CACHE_NAME_LEN];
+    struct mg_str method;
+    int parsed = 0;
+
+    if (c->num_rules == 0 || json_get_top_string(data, FIELD_METHOD, &method))
+        return 0;
+
+    for (int i = 0; i < c->num_rules; i++) {
+        struct cache_rule *r = &c->rules[i];
+        size_t n = strlen(r->name);
+        if (n == method.len && memcmp(r->name, method.ptr, n) == 0)
+            return r->ttl_ms;
+        if (n <= method.len || r->name[method.len] != ':' || memcmp(r->name, method.ptr, method.len) != 0)
+            continue;
+        //parse once, only for a method some rule narrows down
+        if (parsed == 0)
+            parsed = json_ubus_name(data, method, name, sizeof(name)) == 0 ? 1 : -1;
+        if (parsed > 0 && strcmp(r->name, name) == 0)
+            return r->ttl_ms;
+    }
+    return 0;
+}
+
+static uint64_t cache_hash(uint64_t h, const char *p, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t) p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// whitespace outside strings does not change the request
+uint64_t cache_key(struct cache *c, int session, struct mg_str topic, struct mg_str data) {
+    uint64_t h = 14695981039346656037ull;
+    int in_str = 0;
+    char *out;
+    size_t n = 0;
+
+    c->req.len = 0;
+    if (mg_iobuf_add(&c->req, 0, NULL, topic.len + 1 + data.len) == 0)
+        return 0;
+    out = (char *) c->req.buf;
+    memcpy(out, topic.ptr, topic.len);
+    n = topic.len;
+    out[n++] = '\n';
+    for (size_t i = 0; i < data.len; i++) {
+        char ch = data.ptr[i];
+        if (in_str) {
+            if (ch == '\\' && i + 1 < data.len) {
+                out[n++] = ch;
+                out[n++] = data.ptr[++i];
+                continue;
+            }
+            if (ch == '"')
+                in_str = 0;
+        } else if (ch == '"') {
+            in_str = 1;
+        } else if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
+            continue;
+        }
+        out[n++] = ch;
+    }
+    c->req.len = n;
+
+    h = cache_hash(h, (const char *) &session, sizeof(session));
+    return cache_hash(h, out, n);
+}
+
+struct cache_entry *cache_lookup(struct cache *c, int session, uint64_t key, uint64_t now) {
+    for (int i = 0; c->req.len && i < CACHE_ENTRIES; i++) {
+        struct cache_entry *ce = &c->entries[i];
+        if (ce->state == CACHE_FREE || ce->key != key || ce->session != session || ce->req_len != c->req.len ||
+            memcmp(ce->req, c->req.buf, ce->req_len) != 0)
+            continue;
+        if (ce->expires <= now) {
+            if (ce->state == CACHE_READY)
+                c->stats.expired++;
+            cache_entry_free(ce); //a pending one timed out, its request is answered by the timeout
+            return NULL;
+        }
+        if (ce->state == CACHE_READY) {
+            ce->used = now;
+            c->stats.hits++;
+        }
+        return ce;
+    }
+    return NULL;
+}
+
+int cache_wait(struct cache *c, struct cache_entry *ce, uint32_t id) {
+    if (ce->state != CACHE_PENDING || ce->num_waiters >= CACHE_WAITERS)
+        return -1;
+    ce->waiters[ce->num_waiters++] = id;
+    c->stats.coalesced++;
+    return 0;
+}
+
+void cache_pending(struct cache *c, int session, uint64_t key, uint32_t id, int ttl_ms, uint64_t now, int timeout_ms) {
+    struct cache_entry *victim = NULL;
+
+    //a free or expired slot, else the least recently used response, never a pending one
+    for (int i = 0; i < CACHE_ENTRIES; i++) {
+        struct cache_entry *ce = &c->entries[i];
+        if (ce->state == CACHE_FREE || ce->expires <= now) {
+            victim = ce;
+            break;
+        }
+        if (ce->state == CACHE_READY && (!victim || ce->used < victim->used))
+            victim = ce;
+    }
+    c->stats.misses++;
+    if (!victim || c->req.len == 0)
+        return;
+    if (victim->state == CACHE_READY && victim->expires <= now)
+        c->stats.expired++;
+    else if (victim->state == CACHE_READY)
+        c->stats.evicted++;
+    cache_entry_free(victim);
+    if ((victim->req = malloc(c->req.len)) == NULL)
+        return;
+    memcpy(victim->req, c->req.buf, c->req.len);
+    victim->req_len = c->req.len;
+
+    victim->state = CACHE_PENDING;
+    victim->session = session;
+    victim->key = key;
+    victim->id = id;
+    victim->ttl_ms = ttl_ms;
+    victim->expires = now + timeout_ms;
+}
+
+static struct cache_entry *cache_by_id(struct cache *c, uint32_t id) {
+    for (int i = 0; id && i < CACHE_ENTRIES; i++) {
+        if (c->entries[i].state == CACHE_PENDING && c->entries[i].id == id)
+            return &c->entries[i];
+    }
+    return NULL;
+}
+
+int cache_complete(struct cache *c, uint32_t id, struct mg_str data, int ok, uint64_t now, uint32_t *waiters) {
+    struct cache_entry *ce = cache_by_id(c, id);
+    int n;
+
+    if (!ce)
+        return -1;
+    n = ce->num_waiters;
+    memcpy(waiters, ce->waiters, n * sizeof(*waiters));
+
+    if (!ok || data.len > CACHE_DATA_MAX || (ce->data = malloc(data.len + 1)) == NULL) {
+        c->stats.skipped++;
+        cache_entry_free(ce);
+        return n;
+    }
+    memcpy(ce->data, data.ptr, data.len);
+    ce->data[data.len] = '\0';
+    ce->len = data.len;
+    ce->state = CACHE_READY;
+    ce->num_waiters = 0;
+    ce->used = now;
+    ce->expires = now + ce->ttl_ms;
+    c->stats.stored++;
+    return n;
+}
+
+void cache_abort(struct cache *c, uint32_t id) {
+    struct cache_entry *ce = cache_by_id(c, id);
+    if (ce)
+        cache_entry_free(ce);
+}
+
+void cache_forget(struct cache *c, int session) {
+    for (int i = 0; i < CACHE_ENTRIES; i++) { //waiters of a pending one were forgotten with the session
+        if (c->entries[i].state != CACHE_FREE && c->entries[i].session == session)
+            cache_entry_free(&c->entries[i]);
+    }
+}
+
+void cache_stats_dump(struct cache *c) {
+    if (c->num_rules == 0)
+        return;
+    MG_INFO(("cache rules: %d, hits: %llu, misses: %llu, coalesced: %llu, stored: %llu, expired: %llu, evicted: %llu, skipped: %llu",
+        c->num_rules, (unsigned long long) c->stats.hits, (unsigned long long) c->stats.misses,
+        (unsigned long long) c->stats.coalesced, (unsigned long long) c->stats.stored,
+        (unsigned long long) c->stats.expired, (unsigned long long) c->stats.evicted,
+        (unsigned long long) c->stats.skipped));
+}
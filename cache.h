@@ -0,0 +1,90 @@
+#ifndef __IOT_CACHE_H__
+#define __IOT_CACHE_H__
+
+#include <iot/mongoose.h>
+
+#define CACHE_ENTRIES       64              //responses and in-flight requests kept
+#define CACHE_DATA_MAX      (16 * 1024)     //larger responses are passed on, not kept
+#define CACHE_WAITERS       8               //requests coalesced on one in flight, more are forwarded
+#define CACHE_RULES_MAX     32
+#define CACHE_NAME_LEN      64
+
+enum {
+    CACHE_FREE,
+    CACHE_PENDING,          //forwarded to iot-rpcd, no reply yet
+    CACHE_READY,            //response kept until expires
+};
+
+struct cache_rule {
+    char name[CACHE_NAME_LEN];  //method, or method:object.method of a ubus style param
+    int ttl_ms;
+};
+
+struct cache_entry {
+    int state;              //CACHE_*
+    int session;            //cloud session of the query
+    uint64_t key;
+    char *req;              //topic and normalized payload, a key match is checked against it
+    size_t req_len;
+    uint64_t expires;       //ms, ready: end of ttl, pending: stop coalescing
+    uint64_t used;          //last hit, the least recently used ready entry is evicted
+    int ttl_ms;
+    uint32_t id;            //pending: corr id of the forwarded request
+    uint32_t waiters[CACHE_WAITERS]; //corr ids of coalesced requests
+    int num_waiters;
+    char *data;
+    size_t len;
+};
+
+struct cache_stats {
+    uint64_t hits;          //answered from a kept response
+    uint64_t misses;        //forwarded, the response will be kept
+    uint64_t coalesced;     //waited on an identical request in flight
+    uint64_t stored;
+    uint64_t expired;
+    uint64_t evicted;
+    uint64_t skipped;       //error or too large response, not kept
+};
+
+/*
+ * opt-in cache of read-only cloud queries. only methods with a rule are cached, the key
+ * is a hash of session, topic and the payload without insignificant whitespace, which
+ * entries also keep to compare on a key match. while a query is in flight, identical
+ * ones wait for its reply instead of reaching iot-rpcd.
+ */
+struct cache {
+    struct cache_rule rules[CACHE_RULES_MAX];
+    int num_rules;
+
+    struct cache_entry entries[CACHE_ENTRIES];
+    struct mg_iobuf req;    //request of the last cache_key
+
+    struct cache_stats stats;
+};
+
+void cache_free(struct cache *c);
+//replace all rules, responses of old rules are dropped
+void cache_rules_clear(struct cache *c);
+int cache_rule_add(struct cache *c, const char *name, int ttl_ms);
+
+//ttl in ms of request data, 0: not cached
+int cache_ttl(struct cache *c, struct mg_str data);
+//key of a query, lookup and pending below are for this query, 0: no memory
+uint64_t cache_key(struct cache *c, int session, struct mg_str topic, struct mg_str data);
+
+//ready or pending entry of the query of key, NULL: none
+struct cache_entry *cache_lookup(struct cache *c, int session, uint64_t key, uint64_t now);
+//coalesce request id on pending entry, -1: no room
+int cache_wait(struct cache *c, struct cache_entry *ce, uint32_t id);
+//request id of session was forwarded for key, its reply is kept for ttl_ms
+void cache_pending(struct cache *c, int session, uint64_t key, uint32_t id, int ttl_ms, uint64_t now, int timeout_ms);
+//reply of request id, kept when ok, waiters get the corr ids to answer, return their number, -1: not cached
+int cache_complete(struct cache *c, uint32_t id, struct mg_str data, int ok, uint64_t now, uint32_t *waiters);
+//request id timed out, waiters time out on their own
+void cache_abort(struct cache *c, uint32_t id);
+//session takes another identity, drop its replies and pending queries
+void cache_forget(struct cache *c, int session);
+
+void cache_stats_dump(struct cache *c);
+
+#endif
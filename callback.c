@@ -7,95 +7,593 @@
 #include "mqtt.h"
 #include "client.h"
 
-void lua_callback(void *arg, const char *method, const char *data, struct mg_str *out) {
-    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
-    const char *ret = NULL;
-    lua_State *L = luaL_newstate();
+static __thread uint64_t s_lua_deadline; //ms, 0: no timeout, per thread so the worker has its own
+
+// count hook, abandon scripts running past the deadline
+static void lua_timeout_hook(lua_State *L, lua_Debug *ar) {
+    (void) ar;
+    if (s_lua_deadline && mg_millis() > s_lua_deadline)
+        luaL_error(L, "timeout");
+}
+
+void lua_vm_close(struct lua_vm *vm) {
+    if (vm->L) {
+        lua_close((lua_State *)vm->L);
+        vm->L = NULL;
+    }
+    vm->module_ref = LUA_NOREF;
+    vm->call_ref = LUA_NOREF;
+}
+
+// return the persistent lua_State, (re)build it only when script changed
+static lua_State *lua_vm_get(struct lua_vm *vm, const char *script) {
+    struct stat st;
+    lua_State *L = NULL;
+
+    if (stat(script, &st)) {
+        if (vm->L) { //script removed or unreadable, keep using the loaded one
+            vm->cache_hits++;
+            return (lua_State *)vm->L;
+        }
+        MG_ERROR(("lua script %s not found", script));
+        return NULL;
+    }
+
+    if (vm->L && st.st_mtime == vm->mtime &&
+        st.st_size == vm->size && st.st_ino == vm->ino) {
+        vm->cache_hits++;
+        return (lua_State *)vm->L;
+    }
+
+    lua_vm_close(vm);
+
+    L = luaL_newstate();
+    if (!L) {
+        MG_ERROR(("lua newstate failed"));
+        return NULL;
+    }
 
     luaL_openlibs(L);
 
-    if ( luaL_dofile(L, priv->cfg.opts->callback_lua) ) {
-        MG_ERROR(("lua dofile %s failed", priv->cfg.opts->callback_lua));
-        goto done;
+    if ( luaL_dofile(L, script) ) {
+        MG_ERROR(("lua dofile %s failed: %s", script, lua_tostring(L, -1)));
+        goto err;
+    }
+
+    lua_settop(L, 1); //keep the module table only
+    if (!lua_istable(L, -1)) {
+        MG_ERROR(("lua script %s does not return a module table", script));
+        goto err;
     }
 
     lua_getfield(L, -1, "call");
     if (!lua_isfunction(L, -1)) {
-        MG_ERROR(("method gen_rpc_request is not a function"));
-        goto done;
+        MG_ERROR(("method call is not a function"));
+        goto err;
     }
 
+    vm->call_ref = luaL_ref(L, LUA_REGISTRYINDEX);   //pop call
+    vm->module_ref = luaL_ref(L, LUA_REGISTRYINDEX); //pop module table
+
+    vm->L = L;
+    vm->mtime = st.st_mtime;
+    vm->size = st.st_size;
+    vm->ino = st.st_ino;
+    vm->builds++;
+
+    MG_INFO(("lua vm loaded %s, builds: %llu, cache hits: %llu", script,
+        (unsigned long long) vm->builds, (unsigned long long) vm->cache_hits));
+
+    return L;
+
+err:
+    lua_close(L);
+    return NULL;
+}
+
+int lua_vm_call(struct lua_vm *vm, const char *script, const char *method, const char *data,
+    int timeout_ms, struct mg_str *out) {
+    const char *ret = NULL;
+    size_t len = 0;
+    lua_State *L = lua_vm_get(vm, script);
+
+    if (!L)
+        return -1;
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, vm->call_ref);
     lua_pushstring(L, method);
     lua_pushstring(L, data);
 
+    s_lua_deadline = timeout_ms > 0 ? mg_millis() + timeout_ms : 0;
+    lua_sethook(L, lua_timeout_hook, timeout_ms > 0 ? LUA_MASKCOUNT : 0, LUA_HOOK_COUNT);
+
     if (lua_pcall(L, 2, 1, 0)) {//two param, one return values, zero error func
-        MG_ERROR(("callback failed"));
-        goto done;
+        MG_ERROR(("callback %s failed: %s", method, lua_tostring(L, -1)));
+        //module state may be half updated, start from a clean vm next time
+        lua_vm_close(vm);
+        return -1;
     }
 
-    ret = lua_tostring(L, -1);
+    ret = lua_tolstring(L, -1, &len);
     if (!ret) {
         MG_ERROR(("lua call no ret"));
-        goto done;
+        lua_settop(L, 0);
+        return -1;
     }
 
     //MG_INFO(("ret: %s", ret));
 
-    //must free by caller
-    if (out)
-        *out = mg_strdup(mg_str(ret));
+    //must arena_release by caller, from the arena when the caller opened a scope
+    if (out) {
+        char *copy = arena_strndup(mg_str_n(ret, len));
+        *out = copy ? mg_str_n(copy, len) : mg_str_n(NULL, 0);
+    }
 
-done:
-    if (L)
-        lua_close(L);
+    lua_settop(L, 0);
+    return 0;
+}
 
+void lua_callback(void *arg, const char *method, const char *data, struct mg_str *out) {
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    uint64_t start = metrics_now_us();
+    if (lua_vm_call(&priv->lua, priv->cfg.opts->callback_lua, method, data, priv->cfg.opts->lua_timeout, out))
+        metrics_add(&priv->metrics, METRIC_LUA_ERRORS, 1);
+    metrics_observe(&priv->metrics, METRIC_LUA_US, metrics_now_us() - start);
+    metrics_add(&priv->metrics, METRIC_LUA_CALLS, 1);
+}
+
+// run method on the worker thread if there is one, done gets the result on the event loop
+int lua_callback_post(struct mg_mgr *mgr, const char *method, const char *data, lua_done_fn done) {
+    struct client_private *priv = (struct client_private*)mgr->userdata;
+    struct mg_str out = MG_NULL_STR;
+
+    if (priv->worker) {
+        sched_kick(&priv->sched, TASK_WORKER, mg_millis()); //picks up the deadline of the new job
+        return worker_post(priv->worker, method, data, done);
+    }
+
+    lua_callback(mgr, method, data, &out);
+    if (done)
+        done(mgr, out, data);
+    arena_release((void *)out.ptr);
+    return 0;
+}
+
+void lua_callback_free(void *arg) {
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    if (priv->worker) {
+        worker_free(priv->worker);
+        priv->worker = NULL;
+    }
+    MG_INFO(("lua vm builds: %llu, cache hits: %llu",
+        (unsigned long long) priv->lua.builds, (unsigned long long) priv->lua.cache_hits));
+    lua_vm_close(&priv->lua);
 }
 
 
 // cloud mqtt connect/disconnect callback
-void cloud_mqtt_event_callback(struct mg_mgr *mgr, const char* event) {
-    struct client_private *priv = (struct client_private *)mgr->userdata;
+void cloud_mqtt_event_callback(struct mg_mgr *mgr, struct cloud_session *s, const char* event) {
+    arena_begin();
     cJSON *root = cJSON_CreateObject();
     cJSON_AddStringToObject(root, "event", event);
-    cJSON_AddStringToObject(root, "address", priv->cfg.opts->cloud_mqtt_serve_address);
+    if (s) { //NULL: no cloud config loaded yet
+        cJSON_AddStringToObject(root, "address", s->address);
+        cJSON_AddStringToObject(root, "client_id", s->client_id);
+        cJSON_AddNumberToObject(root, "index", s->index);
+    }
 
     char *params = cJSON_Print(root);
 
     MG_INFO(("callback on_event: %s", params));
 
     //don't care the return value
-    lua_callback(mgr, "on_event", params, NULL);
+    lua_callback_post(mgr, "on_event", params, NULL);
 
-    free(params);
+    cJSON_free(params);
     cJSON_Delete(root);
+    arena_end();
+}
+
+
+// publish to cloud mqtt server, on mqtt5 a repeated topic_pub is replaced by its alias, -1: dropped
+int cloud_mqtt_publish(struct cloud_session *s, const struct outq_pub *pub) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct outq_pub wire = *pub;
+    int qos = s->qos < s->max_qos ? s->qos : s->max_qos;
+    uint16_t alias = 0, id = 0;
+
+    if (!wire.topic.len)
+        wire.topic = mg_str(s->topic_pub);
+
+    //qos > 0 keeps a copy with the full topic until acked
+    if (qos > 0 && (id = inflight_add(&s->window, qos, &wire, mg_millis(), &priv->inflight_stats)) == 0) {
+        MG_ERROR(("cloud mqtt client %d in-flight table full, drop %lu bytes", s->index, (unsigned long) wire.data.len));
+        return -1;
+    }
+
+    if (s->conn->is_mqtt5 && s->alias_max > 0 && mg_strcmp(wire.topic, mg_str(s->topic_pub)) == 0) {
+        alias = CLOUD_TOPIC_ALIAS;
+        if (s->alias_set) { //broker knows the alias, the topic may be empty
+            priv->cloud_stats.aliased++;
+            priv->cloud_stats.alias_saved += wire.topic.len;
+            wire.topic = mg_str_n("", 0);
+        }
+        s->alias_set = 1;
+    }
+
+    inflight_write_publish(s->conn, &wire, alias, qos, id, 0);
+    metrics_add(&priv->metrics, METRIC_CLOUD_MSGS_UP, 1);
+    metrics_add(&priv->metrics, METRIC_CLOUD_BYTES_UP, wire.data.len);
+    MG_DEBUG(("pub %.*s -> %.*s, qos %d, id %u", (int) pub->data.len, pub->data.ptr,
+        (int) wire.topic.len, wire.topic.ptr, qos, id));
+    return 0;
+}
+
+// session open, room in the send buffer and in the in-flight window
+static int cloud_mqtt_writable(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+
+    if (s->stage != CLOUD_STAGE_OPEN) //before CONNACK a publish is lost if the broker refuses us
+        return 0;
+    if (s->conn->send.len >= priv->cfg.opts->send_high_water)
+        return 0;
+    if (s->qos > 0 && s->max_qos > 0) {
+        int limit = s->window.cap;
+        if (s->receive_max && s->receive_max < limit)
+            limit = s->receive_max;
+        if (s->window.count >= limit) {
+            priv->cloud_stats.flow_blocked++;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// payload on the cloud side, a cbor session sends json objects and arrays as cbor, anything else as it is
+static struct mg_str cloud_encode(struct client_private *priv, struct cloud_session *s, struct mg_str data) {
+    if (s->encoding != CLOUD_ENCODING_CBOR || !cbor_is_json(data))
+        return data;
+    if (cbor_from_json(data, &priv->cbor_up)) {
+        priv->cbor_stats.failed++;
+        return data;
+    }
+    priv->cbor_stats.encoded++;
+    priv->cbor_stats.json_bytes += data.len;
+    priv->cbor_stats.cbor_bytes += priv->cbor_up.len;
+    return mg_str_n((const char *) priv->cbor_up.buf, priv->cbor_up.len);
+}
+
+// publish at once while the connection is writable, otherwise wait in outq by priority, -1: dropped
+static int cloud_mqtt_post(struct cloud_session *s, const struct outq_pub *pub, int prio) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct client_option *opts = priv->cfg.opts;
+    struct outq_pub wire = *pub;
+    int rc = 0;
+
+    wire.data = cloud_encode(priv, s, pub->data);
+
+    if (s->outq.count == 0 && cloud_mqtt_writable(s)) {
+        priv->outq_stats.direct++;
+        return cloud_mqtt_publish(s, &wire);
+    }
+
+    if (outq_push(&s->outq, prio, &wire, opts->outq_bytes, opts->outq_drop_policy, mg_millis(), &priv->outq_stats)) {
+        MG_ERROR(("cloud mqtt client %d outbound queue full, drop %lu bytes", s->index, (unsigned long) wire.data.len));
+        rc = -1;
+    }
+    cloud_outq_release(s);
+    return rc;
+}
+
+int cloud_mqtt_send(struct cloud_session *s, struct mg_str data, int prio) {
+    struct outq_pub pub = { MG_NULL_STR, MG_NULL_STR, data };
+    return cloud_mqtt_post(s, &pub, prio);
+}
+
+// reply of an mqtt5 request, to its response topic with its correlation data
+int cloud_mqtt_reply(struct cloud_session *s, struct mg_str topic, struct mg_str cdata, struct mg_str data, int prio) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct outq_pub pub = { topic, cdata, data };
+    priv->cloud_stats.responses++;
+    return cloud_mqtt_post(s, &pub, prio);
+}
+
+// MG_EV_WRITE drained the send buffer or an ack opened the window, publish waiting messages
+void cloud_outq_release(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct outq_msg *m;
+    uint64_t now = mg_millis();
+
+    while (s->conn && (m = outq_peek(&s->outq)) != NULL && cloud_mqtt_writable(s)) {
+        struct outq_pub pub = outq_msg_pub(m);
+        cloud_mqtt_publish(s, &pub);
+        outq_pop(&s->outq, now, &priv->outq_stats);
+    }
+    cloud_xfer_pump(s);
+}
+
+// send begin messages and chunks of the transfers of session, as far as their windows and the connection allow
+void cloud_xfer_pump(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+
+    if (priv->xfer.active == 0 || !s->conn || s->stage != CLOUD_STAGE_OPEN)
+        return;
+
+    for (int i = 0; i < XFER_MAX; i++) {
+        struct xfer *x = &priv->xfer.slots[i];
+        struct outq_pub pub;
+
+        if (!x->id || x->session != s->index)
+            continue;
+        pub.topic = xfer_topic(x);
+        pub.cdata = xfer_cdata(x);
+
+        if (!x->announced) { //set first, cloud_mqtt_post may come back here through cloud_outq_release
+            x->announced = 1;
+            x->resend_at = mg_millis() + XFER_RESEND_MS;
+            pub.data = xfer_begin(&priv->xfer, x);
+            if (pub.data.ptr)
+                cloud_mqtt_post(s, &pub, OUTQ_LOW);
+        }
+
+        //chunks only go out directly, behind queued messages they would just pile up in outq
+        while (x->next < x->chunks && x->next < x->acked + x->window && s->outq.count == 0 &&
+            cloud_mqtt_writable(s)) {
+            pub.data = xfer_chunk(&priv->xfer, x, x->next);
+            if (!pub.data.ptr) {
+                MG_ERROR(("transfer %u read chunk %u failed", x->id, x->next));
+                xfer_end(&priv->xfer, x, 0);
+                break;
+            }
+            x->next++;
+            cloud_mqtt_post(s, &pub, OUTQ_LOW);
+        }
+    }
 }
 
+// ack of a chunked transfer from the cloud, flow control of the upload rather than a request, 0: consumed
+static int cloud_xfer_ack(struct cloud_session *s, struct mg_str data) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    double id, next;
+
+    if (json_get_top_number(data, "transfer_ack", &id))
+        return -1;
+
+    struct xfer *x = id >= 1 && id <= UINT32_MAX ? xfer_find(&priv->xfer, s->index, (uint32_t) id) : NULL;
+    if (!x) //done or given up already
+        return 0;
+    if (json_get_top_number(data, "next", &next) || next < 0 || next > UINT32_MAX)
+        next = -1;
+
+    int rc = xfer_ack(&priv->xfer, x, (int64_t) next, mg_millis());
+    if (rc != 0)
+        xfer_end(&priv->xfer, x, rc > 0);
+    else
+        cloud_xfer_pump(s);
+    return 0;
+}
+
+// store pub in the queue under the identity of session, drained by it after reconnect, -1: dropped
+static int cloud_queue_push(struct cloud_session *s, const struct outq_pub *pub) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+
+    if (!s->client_id || queue_push(priv->queue, mg_str(s->client_id), pub))
+        return -1;
+    s->queue_pending = 1;
+    return 0;
+}
+
+// process exits, unacked publishes go to the queue so they are sent after restart
+void cloud_inflight_abort(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct inflight_entry **order;
+    int n;
+
+    if (!priv->queue || s->window.count == 0)
+        return;
+    if ((order = malloc(s->window.count * sizeof(order[0]))) == NULL)
+        return;
+    n = inflight_sorted(&s->window, order, s->window.count);
+    for (int i = 0; i < n; i++) {
+        if (order[i]->state == INFLIGHT_WAIT_ACK) { //past PUBREC the broker has it
+            struct outq_pub pub = inflight_entry_pub(order[i]);
+            cloud_queue_push(s, &pub);
+        }
+    }
+    free(order);
+    inflight_free(&s->window);
+}
+
+// session is going away, waiting messages go to the queue if there is one
+void cloud_outq_abort(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct outq_msg *m;
+    uint64_t now = mg_millis();
+    size_t lost = 0;
+
+    while ((m = outq_peek(&s->outq)) != NULL) {
+        struct outq_pub pub = outq_msg_pub(m);
+        if (!priv->queue || cloud_queue_push(s, &pub))
+            lost++;
+        outq_pop(&s->outq, now, &priv->outq_stats);
+    }
+
+    if (lost)
+        MG_ERROR(("cloud mqtt client %d closed, %lu outbound messages lost", s->index, (unsigned long) lost));
+    if (priv->queue && queue_count(priv->queue) > 0)
+        sched_kick(&priv->sched, TASK_QUEUE, now);
+}
+
+// publish the batch of session, compressed when it is large enough
+void cloud_batch_flush(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct mg_str data = batch_finish(&s->batch);
+
+    if (!data.ptr || !s->conn) {
+        cloud_batch_abort(s);
+        return;
+    }
+
+    priv->batch_stats.batches++;
+    priv->batch_stats.messages += s->batch.count;
+    priv->batch_stats.fill_bytes += data.len;
+
+    //before compression, cloud_mqtt_post leaves cbor as it is
+    data = cloud_encode(priv, s, data);
+
+    size_t threshold = priv->cfg.opts->deflate_threshold;
+    if (threshold && data.len >= threshold && batch_deflate(data, &priv->deflate_buf) == 0 &&
+        priv->deflate_buf.len < data.len) {
+        priv->batch_stats.deflated++;
+        priv->batch_stats.deflate_in += data.len;
+        priv->batch_stats.deflate_out += priv->deflate_buf.len;
+        data = mg_str_n((const char *) priv->deflate_buf.buf, priv->deflate_buf.len);
+    }
+
+    cloud_mqtt_send(s, data, OUTQ_LOW);
+    batch_reset(&s->batch);
+}
+
+// session is going away, keep its batch in the queue if there is one
+void cloud_batch_abort(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct outq_pub pub = { MG_NULL_STR, MG_NULL_STR, batch_finish(&s->batch) };
+
+    if (pub.data.ptr && priv->queue && cloud_queue_push(s, &pub) == 0) {
+        sched_kick(&priv->sched, TASK_QUEUE, mg_millis());
+    } else {
+        priv->batch_stats.dropped += s->batch.count;
+    }
+    batch_reset(&s->batch);
+}
+
+// report replies wait for a batch, control replies go at once, -1: dropped
+static int cloud_batch_add(struct cloud_session *s, struct mg_str data) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    uint64_t now = mg_millis();
+
+    if (s->batch.count > 0 && s->batch.buf.len + data.len + 2 > priv->cfg.opts->batch_bytes)
+        cloud_batch_flush(s);
+
+    if (batch_add(&s->batch, data, now, priv->cfg.opts->batch_window))
+        return cloud_mqtt_send(s, data, OUTQ_LOW);
+
+    if (s->batch.buf.len + 1 >= priv->cfg.opts->batch_bytes)
+        cloud_batch_flush(s);
+    else
+        sched_kick(&priv->sched, TASK_BATCH, s->batch.deadline);
+    return 0;
+}
+
+// publish the reply of a cloud request, or a report of job, to the cloud, 0: sent, queued or batched
+static int cloud_reply_send(struct client_private *priv, struct cloud_session *s, struct report_job *job,
+    struct mg_str resp_topic, struct mg_str cdata, struct mg_str data) {
+    // cloud offline or not open yet, or queued records of this identity not drained yet, keep the order
+    if ( priv->queue && (!s->conn || s->stage != CLOUD_STAGE_OPEN || (s->queue_pending && queue_count(priv->queue) > 0)) ) {
+        struct outq_pub pub = { resp_topic, cdata, data };
+        int rc = cloud_queue_push(s, &pub);
+        if ( rc ) {
+            MG_ERROR(("queue full, drop %lu bytes", (unsigned long) data.len));
+        }
+        sched_kick(&priv->sched, TASK_QUEUE, mg_millis());
+        return rc;
+    } else if ( !s->conn ) {
+        MG_DEBUG(("cloud mqtt client %d not connected", s->index));
+        return -1;
+    } else if ( s->xfer.chunk && data.len >= s->xfer.threshold &&
+        xfer_start(&priv->xfer, s->index, &s->xfer, resp_topic, cdata, data, mg_millis()) ) {
+        sched_kick(&priv->sched, TASK_XFER, mg_millis()); //spooled, chunks follow as the cloud acks
+        return 0;
+    } else if ( job && priv->cfg.opts->batch_window > 0 && json_validate(data) ) {
+        return cloud_batch_add(s, data);
+    } else {
+        if ( priv->cfg.opts->batch_window > 0 )
+            priv->batch_stats.bypassed++;
+        // command acks go ahead of reports and bulk replies
+        int prio = job || data.len >= OUTQ_BULK_BYTES ? OUTQ_LOW : OUTQ_HIGH;
+        if ( resp_topic.len )
+            return cloud_mqtt_reply(s, resp_topic, cdata, data, prio);
+        return cloud_mqtt_send(s, data, prio);
+    }
+}
 
 void local_mqtt_msg_callback(struct mg_connection *c, struct mg_str topic, struct mg_str data) {
     // receive from rpcd
     struct client_private *priv = (struct client_private*)c->mgr->userdata;
-    if ( !priv->cloud_mqtt_conn ) {
-        MG_DEBUG(("cloud mqtt client not connected"));
+
+    if ( mg_strcmp(topic, mg_str(IOT_CLIENT_METRICS_TOPIC)) == 0 ) //own snapshot back from the broker
+        return;
+    metrics_add(&priv->metrics, METRIC_LOCAL_MSGS_IN, 1);
+    metrics_add(&priv->metrics, METRIC_LOCAL_BYTES_IN, data.len);
+
+    double code;
+    if ( json_get_top_number(data, FIELD_CODE, &code) == 0 && code == -10405 ) { // no data from lua callback, ignore it, the error code is from iot-rpcd
         return;
     }
 
-    cJSON *root = cJSON_ParseWithLength(data.ptr, data.len);
-    cJSON *code = cJSON_GetObjectItem(root, FIELD_CODE);
-    if ( cJSON_IsNumber(code) && cJSON_GetNumberValue(code) == -10405 ) { // no data from lua callback, ignore it, the error code is from iot-rpcd
-        cJSON_Delete(root);
+    // route back to the session by reply topic
+    struct cloud_session *s = client_session_by_topic(priv, topic);
+    if ( !s ) {
+        MG_DEBUG(("no cloud session for %.*s", (int) topic.len, topic.ptr));
         return;
     }
-    cJSON_Delete(root);
 
-    struct mg_str pubt = mg_str(priv->cfg.opts->topic_pub);
-    struct mg_mqtt_opts pub_opts;
-    memset(&pub_opts, 0, sizeof(pub_opts));
-    pub_opts.topic = pubt;
-    pub_opts.message = data;
-    pub_opts.qos = priv->cfg.opts->cloud_mqtt_qos, pub_opts.retain = false;
-    mg_mqtt_pub(priv->cloud_mqtt_conn, &pub_opts);
-    MG_DEBUG(("pub %.*s -> %.*s", (int) data.len, data.ptr,
-        (int) pubt.len, pubt.ptr));
+    // pair with the request, reply topic is <reply_topic>:<id>
+    struct report_job *job = NULL;
+    struct corr_entry e;
+    e.resp_topic[0] = '\0';
+    uint32_t id = corr_id_from_topic(topic);
+    if ( id ) {
+        if ( corr_complete(&priv->corr, id, mg_millis(), &e) == 0 ) {
+            MG_DEBUG(("request %lu of %s done in %llu ms", (unsigned long) id, e.topic,
+                (unsigned long long) (mg_millis() - e.sent)));
+            metrics_observe(&priv->metrics, METRIC_RPCD_MS, mg_millis() - e.sent);
+            client_flow_update(priv);
+            if ( e.session != s->index ) { //the session serves another identity since
+                MG_INFO(("reply of request %lu to a replaced identity, dropped", (unsigned long) id));
+                return;
+            }
+            if ( e.flags & CORR_F_REPORT )
+                job = report_sched_find(&priv->report, e.key);
+        } else { //answered by the timeout reply already, the cloud could not pair a second one
+            MG_INFO(("late reply of request %lu, dropped", (unsigned long) id));
+            return;
+        }
+    }
+
+    // delta report, publish what changed since the last one
+    char *printed = NULL;
+    if ( job && job->delta ) {
+        int ret = delta_encode(&priv->delta, s->index, job->name, job->full_every, data, &printed);
+        if ( ret == DELTA_UNCHANGED ) {
+            MG_DEBUG(("report %s unchanged", job->name));
+            return;
+        }
+        if ( printed )
+            data = mg_str(printed);
+    }
+
+    int rc = cloud_reply_send(priv, s, job, mg_str(e.resp_topic), mg_str_n((const char *) e.cdata, e.cdata_len), data);
+    if ( printed ) //the next patch is against what the cloud got, a dropped report changes nothing
+        delta_commit(&priv->delta, rc == 0);
+
+    // identical requests which waited for this one get the same reply
+    if ( id && !job && priv->cache.num_rules ) {
+        uint32_t waiters[CACHE_WAITERS];
+        int ok = json_get_top_number(data, FIELD_CODE, &code) != 0 || code == 0;
+        int n = cache_complete(&priv->cache, id, data, ok, mg_millis(), waiters);
+        for ( int i = 0; i < n; i++ ) {
+            if ( corr_complete(&priv->corr, waiters[i], mg_millis(), &e) == 0 && e.session >= 0 &&
+                e.session < priv->num_sessions )
+                cloud_reply_send(priv, priv->sessions[e.session], NULL, mg_str(e.resp_topic),
+                    mg_str_n((const char *) e.cdata, e.cdata_len), data);
+        }
+        if ( n > 0 )
+            client_flow_update(priv);
+    }
+
+    if ( printed )
+        cJSON_free(printed);
 
 }
 
@@ -116,50 +614,142 @@ void local_mqtt_msg_callback(struct mg_connection *c, struct mg_str topic, struc
 }
 */
 
-void cloud_mqtt_msg_callback(struct mg_connection *c, struct mg_str topic, struct mg_str data) {
-    // receive from cloud mqtt
-    struct client_private *priv = (struct client_private*)c->mgr->userdata;
+// track a cloud request, or a report of job key, until its reply or timeout, 0: table full
+static uint32_t cloud_request_track(struct cloud_session *s, struct mg_str topic, struct mg_str key,
+    struct mg_str resp_topic, struct mg_str cdata, struct mg_str data) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct mg_str method;
+    char name[CORR_NAME_LEN];
+    if ( json_get_top_string(data, FIELD_METHOD, &method) )
+        method = topic;
+    else if ( json_ubus_name(data, method, name, sizeof(name)) == 0 )
+        method = mg_str(name); //"call" alone says nothing, keyed by the routed object.method
+    int report = key.ptr != NULL;
+    uint32_t id = corr_add(&priv->corr, s->index, method, topic, key, report ? CORR_F_REPORT : 0, mg_millis());
+    sched_kick(&priv->sched, TASK_CORR, mg_millis() + CORR_TICK_MS);
+    if ( id && resp_topic.len && corr_set_response(&priv->corr, id, resp_topic, cdata) ) {
+        if ( resp_topic.len >= CORR_RESP_TOPIC_LEN )
+            MG_ERROR(("response topic %.*s too long, reply to %s", (int) resp_topic.len, resp_topic.ptr, s->topic_pub));
+        else
+            MG_ERROR(("correlation data of %lu bytes too long, reply to %s", (unsigned long) cdata.len, s->topic_pub));
+    }
+    client_flow_update(priv);
+    return id;
+}
+
+// forward a cloud request, or a report of job key, to iot-rpcd, rt NULL: default module/func
+// return the correlation id, 0: untracked or not sent
+static uint32_t cloud_request_forward(struct cloud_session *s, struct route_target *rt, struct mg_str topic, struct mg_str key,
+    struct mg_str resp_topic, struct mg_str cdata, struct mg_str data) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
     if ( !priv->mqtt_conn && data.len > 0 ) {
         MG_ERROR(("mqtt client not connected"));
-        return;
+        return 0;
     }
 
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, FIELD_METHOD, "call");
-
-    cJSON *param = cJSON_CreateArray();
-    cJSON_AddItemToArray(param, cJSON_CreateString(priv->cfg.opts->module));
-    cJSON_AddItemToArray(param, cJSON_CreateString(priv->cfg.opts->func));
-
-    cJSON *args = cJSON_CreateObject();
-    char *s_topic = mg_mprintf("%.*s", (int) topic.len, topic.ptr);
-    cJSON_AddItemToObject(args, FIELD_TOPIC, cJSON_CreateString(s_topic));
-    free(s_topic);
-    cJSON_AddItemToObject(args, FIELD_TO, cJSON_CreateString(IOT_CLIENT_RPCD_TOPIC_PREFIX));
-    cJSON *data_obj = cJSON_ParseWithLength(data.ptr, data.len);
-    if (data_obj) {
-        cJSON_AddItemToObject(args, FIELD_DATA, data_obj);
+    struct mg_str msg = MG_NULL_STR;
+    char *printed = NULL;
+    char to[sizeof(s->reply_topic) + 12];
+
+    // track the request, the id rides on the reply topic and in args
+    uint32_t id = cloud_request_track(s, topic, key, resp_topic, cdata, data);
+    if ( id )
+        mg_snprintf(to, sizeof(to), "%s:%lu", s->reply_topic, (unsigned long) id);
+    else
+        mg_snprintf(to, sizeof(to), "%s", s->reply_topic);
+
+    if (priv->cfg.opts->forward_mode == FORWARD_MODE_PARSE) {
+        printed = forward_envelope_parse(rt ? rt->module : priv->cfg.opts->module,
+            rt ? rt->func : priv->cfg.opts->func, to, id, topic, data);
+        msg = mg_str(printed);
+    } else if (rt) {
+        msg = forward_envelope_prefix(&priv->fwd, mg_str_n(rt->prefix, rt->prefix_len), topic, mg_str(to), id, data);
     } else {
-        char *s_data = mg_mprintf("%.*s", (int) data.len, data.ptr);
-        cJSON_AddItemToObject(args, FIELD_DATA, cJSON_CreateString(s_data));
-        free(s_data);
+        msg = forward_envelope(&priv->fwd, topic, mg_str(to), id, data);
     }
-    cJSON_AddItemToArray(param, args);
-
-    cJSON_AddItemToObject(root, FIELD_PARAM, param);
 
-    char *printed = cJSON_Print(root);
+    if (!msg.ptr) {
+        MG_ERROR(("build request failed"));
+        return 0;
+    }
 
     // send data to iot-rpcd
     struct mg_str pubt = mg_str(IOT_CLIENT_RPCD_TOPIC);
-    struct mg_mqtt_opts pub_opts;
-    memset(&pub_opts, 0, sizeof(pub_opts));
-    pub_opts.topic = pubt;
-    pub_opts.message = mg_str(printed);
-    pub_opts.qos = MQTT_QOS, pub_opts.retain = false;
-    mg_mqtt_pub(priv->mqtt_conn, &pub_opts);
-    MG_DEBUG(("pub %s -> %.*s", printed, (int) pubt.len, pubt.ptr));
-
-    cJSON_free(printed);
-    cJSON_Delete(root);
+    local_channel_pub(priv, pubt, msg);
+    MG_DEBUG(("pub %.*s -> %.*s", (int) msg.len, msg.ptr, (int) pubt.len, pubt.ptr));
+
+    if (printed)
+        cJSON_free(printed);
+    return id;
+}
+
+// route, answer from the cache, or forward a cloud request
+static void cloud_request_dispatch(struct cloud_session *s, struct mg_str topic, struct mg_str resp_topic,
+    struct mg_str cdata, struct mg_str data) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct route_target *rt = route_match(&s->routes, topic);
+    if ( rt && rt->action == ROUTE_DROP )
+        return;
+    if ( rt && rt->action == ROUTE_ACK ) { //answered here, iot-rpcd is not involved
+        cloud_reply_send(priv, s, NULL, resp_topic, cdata, mg_str("{\"" FIELD_CODE "\":0}"));
+        return;
+    }
+
+    // cached query: answer from the kept reply, or wait for the identical one in flight
+    int ttl = cache_ttl(&priv->cache, data);
+    struct cache_entry *ce = NULL;
+    uint64_t key = 0;
+    if ( ttl > 0 ) {
+        key = cache_key(&priv->cache, s->index, topic, data);
+        ce = cache_lookup(&priv->cache, s->index, key, mg_millis());
+        if ( ce && ce->state == CACHE_READY ) {
+            metrics_add(&priv->metrics, METRIC_CACHE_HITS, 1);
+            cloud_reply_send(priv, s, NULL, resp_topic, cdata, mg_str_n(ce->data, ce->len));
+            return;
+        }
+        if ( ce && ce->num_waiters < CACHE_WAITERS ) {
+            uint32_t id = cloud_request_track(s, topic, mg_str_n(NULL, 0), resp_topic, cdata, data);
+            if ( id && cache_wait(&priv->cache, ce, id) == 0 ) {
+                metrics_add(&priv->metrics, METRIC_CACHE_COALESCED, 1);
+                return;
+            }
+        }
+    }
+
+    uint32_t id = cloud_request_forward(s, rt, topic, mg_str_n(NULL, 0), resp_topic, cdata, data);
+    if ( ttl > 0 && id && !ce ) { //a full pending entry keeps its place
+        metrics_add(&priv->metrics, METRIC_CACHE_MISSES, 1);
+        cache_pending(&priv->cache, s->index, key, id, ttl, mg_millis(), priv->cfg.opts->request_timeout);
+    }
+}
+
+void cloud_mqtt_msg_callback(struct cloud_session *s, struct mg_str topic, struct mg_str resp_topic,
+    struct mg_str cdata, struct mg_str data) {
+    // receive from cloud mqtt
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    metrics_add(&priv->metrics, METRIC_CLOUD_MSGS_DOWN, 1);
+    metrics_add(&priv->metrics, METRIC_CLOUD_BYTES_DOWN, data.len);
+
+    // cbor request of a cbor session, iot-rpcd and lua see json
+    if ( s->encoding == CLOUD_ENCODING_CBOR && cbor_is_container(data) ) {
+        if ( cbor_to_json(data, &priv->cbor_down) ) {
+            MG_ERROR(("cloud mqtt client %d malformed cbor on %.*s, dropped", s->index, (int) topic.len, topic.ptr));
+            priv->cbor_stats.failed++;
+            return;
+        }
+        priv->cbor_stats.decoded++;
+        data = mg_str_n((const char *) priv->cbor_down.buf, priv->cbor_down.len);
+    }
+
+    if ( s->xfer.chunk && cloud_xfer_ack(s, data) == 0 )
+        return;
+
+    arena_begin();
+    cloud_request_dispatch(s, topic, resp_topic, cdata, data);
+    arena_end();
+}
+
+void report_mqtt_msg_callback(struct cloud_session *s, struct mg_str key, struct mg_str data) {
+    //simulate from cloud, topic report_timer tells iot-rpcd it's a timer report
+    cloud_request_forward(s, NULL, mg_str("report_timer"), key, mg_str_n(NULL, 0), mg_str_n(NULL, 0), data);
 }
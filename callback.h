@@ -3,11 +3,47 @@
 
 #include <iot/mongoose.h>
 
-#define report_mqtt_msg_callback(c, t, d) cloud_mqtt_msg_callback(c, t, d)
+#define LUA_HOOK_COUNT 1000 //instructions between timeout checks
+
+struct cloud_session;
+struct outq_pub;
+
+// persistent lua_State of callback_lua, rebuilt when the script changes
+struct lua_vm {
+    void *L;                //lua_State
+    int module_ref;         //registry ref of the module table returned by the script
+    int call_ref;           //registry ref of module.call
+    time_t mtime;           //script stat info when L was built
+    off_t size;
+    ino_t ino;
+    uint64_t builds;        //times L was (re)built
+    uint64_t cache_hits;    //times L was reused
+};
+
+//result of a lua call, out.ptr is NULL on failure, freed after done returns, data is the call's param
+typedef void (*lua_done_fn)(struct mg_mgr *mgr, struct mg_str out, const char *data);
 
 void local_mqtt_msg_callback(struct mg_connection *c, struct mg_str topic, struct mg_str data);
-void cloud_mqtt_msg_callback(struct mg_connection *c, struct mg_str topic, struct mg_str data);
-void cloud_mqtt_event_callback(struct mg_mgr *mgr, const char* event);
+//resp_topic and cdata: mqtt5 response topic and correlation data of the request, empty: none
+void cloud_mqtt_msg_callback(struct cloud_session *s, struct mg_str topic, struct mg_str resp_topic,
+    struct mg_str cdata, struct mg_str data);
+void report_mqtt_msg_callback(struct cloud_session *s, struct mg_str key, struct mg_str data);
+//-1: dropped, 0: written to the connection or waiting in outq
+int cloud_mqtt_publish(struct cloud_session *s, const struct outq_pub *pub);
+int cloud_mqtt_send(struct cloud_session *s, struct mg_str data, int prio);
+int cloud_mqtt_reply(struct cloud_session *s, struct mg_str topic, struct mg_str cdata, struct mg_str data, int prio);
+void cloud_outq_release(struct cloud_session *s);
+void cloud_xfer_pump(struct cloud_session *s);
+void cloud_outq_abort(struct cloud_session *s);
+void cloud_inflight_abort(struct cloud_session *s);
+void cloud_batch_flush(struct cloud_session *s);
+void cloud_batch_abort(struct cloud_session *s);
+void cloud_mqtt_event_callback(struct mg_mgr *mgr, struct cloud_session *s, const char* event);
+int lua_vm_call(struct lua_vm *vm, const char *script, const char *method, const char *data,
+    int timeout_ms, struct mg_str *out);
+void lua_vm_close(struct lua_vm *vm);
 void lua_callback(void *arg, const char *method, const char *data, struct mg_str *out);
+int lua_callback_post(struct mg_mgr *mgr, const char *method, const char *data, lua_done_fn done);
+void lua_callback_free(void *arg);
 
 #endif
\ No newline at end of file
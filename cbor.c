@@ -0,0 +1,724 @@
+#include <math.h>
+#include <iot/mongoose.h>
+#include "cbor.h"
+
+enum {
+    CBOR_UINT,
+    CBOR_NEGINT,
+    CBOR_BYTES,
+    CBOR_TEXT,
+    CBOR_ARRAY,
+    CBOR_MAP,
+    CBOR_TAG,
+    CBOR_SIMPLE,
+};
+
+#define CBOR_BREAK  0xff
+
+static int cbor_reserve(struct mg_iobuf *out, size_t n) {
+    if (out->len + n <= out->size)
+        return 0;
+    if (out->align == 0) //grow in steps, not on every item
+        out->align = CBOR_IO_ALIGN;
+    return mg_iobuf_resize(out, (out->len + n + out->align - 1) / out->align * out->align) ? 0 : -1;
+}
+
+static int cbor_put(struct mg_iobuf *out, const void *buf, size_t len) {
+    if (cbor_reserve(out, len))
+        return -1;
+    memcpy(out->buf + out->len, buf, len);
+    out->len += len;
+    return 0;
+}
+
+static void cbor_be(uint8_t *p, uint64_t v, int n) {
+    for (int i = n - 1; i >= 0; i--, v >>= 8)
+        p[i] = (uint8_t) v;
+}
+
+static size_t cbor_head_len(uint64_t v) {
+    return v < 24 ? 1 : v <= 0xff ? 2 : v <= 0xffff ? 3 : v <= 0xffffffff ? 5 : 9;
+}
+
+// initial byte and argument in the shortest form, p has room for 9 bytes
+static size_t cbor_head_put(uint8_t *p, int major, uint64_t v) {
+    size_t n = cbor_head_len(v);
+    static const uint8_t ai[] = { 0, 0, 24, 25, 0, 26, 0, 0, 0, 27 };
+
+    if (n == 1) {
+        p[0] = (uint8_t) (major << 5 | v);
+        return 1;
+    }
+    p[0] = (uint8_t) (major << 5 | ai[n]);
+    cbor_be(p + 1, v, (int) n - 1);
+    return n;
+}
+
+static int cbor_head(struct mg_iobuf *out, int major, uint64_t v) {
+    if (cbor_reserve(out, 9))
+        return -1;
+    out->len += cbor_head_put(out->buf + out->len, major, v);
+    return 0;
+}
+
+// count of a container is known at its end, the one byte head reserved at ofs grows when needed
+static int cbor_patch(struct mg_iobuf *out, size_t ofs, int major, uint64_t n) {
+    size_t extra = cbor_head_len(n) - 1;
+
+    if (extra) {
+        if (cbor_reserve(out, extra))
+            return -1;
+        memmove(out->buf + ofs + 1 + extra, out->buf + ofs + 1, out->len - ofs - 1);
+        out->len += extra;
+    }
+    cbor_head_put(out->buf + ofs, major, n);
+    return 0;
+}
+
+// exact binary16 of f, -1: not representable
+static int cbor_half(float f, uint16_t *h) {
+    uint32_t u, full;
+    int exp;
+
+    memcpy(&u, &f, sizeof(u));
+    *h = (uint16_t) ((u >> 16) & 0x8000);
+    if ((u & 0x7fffffff) == 0)
+        return 0;
+    exp = (int) ((u >> 23) & 0xff) - 127;
+    if (exp > 15 || exp < -24)
+        return -1;
+    if (exp >= -14) {
+        if (u & 0x1fff)
+            return -1;
+        *h |= (uint16_t) ((exp + 15) << 10 | (u & 0x7fffff) >> 13);
+        return 0;
+    }
+    full = 0x800000 | (u & 0x7fffff); //subnormal half
+    if (full & ((1u << (-1 - exp)) - 1))
+        return -1;
+    *h |= (uint16_t) (full >> (-1 - exp));
+    return 0;
+}
+
+static int cbor_double(struct mg_iobuf *out, double d) {
+    float f = (float) d;
+    uint16_t h;
+    uint32_t u;
+    uint64_t v;
+    uint8_t *p;
+
+    if (cbor_reserve(out, 9))
+        return -1;
+    p = out->buf + out->len;
+    if ((double) f != d) {
+        memcpy(&v, &d, sizeof(v));
+        p[0] = 0xfb;
+        cbor_be(p + 1, v, 8);
+        out->len += 9;
+    } else if (cbor_half(f, &h) == 0) {
+        p[0] = 0xf9;
+        cbor_be(p + 1, h, 2);
+        out->len += 3;
+    } else {
+        memcpy(&u, &f, sizeof(u));
+        p[0] = 0xfa;
+        cbor_be(p + 1, u, 4);
+        out->len += 5;
+    }
+    return 0;
+}
+
+struct cbor_enc {
+    const char *p, *end;
+    struct mg_iobuf *out;
+};
+
+static void json_skip_ws(struct cbor_enc *e) {
+    while (e->p < e->end && (*e->p == ' ' || *e->p == '\t' || *e->p == '\n' || *e->p == '\r'))
+        e->p++;
+}
+
+static int json_hex4(const char *p, const char *end, uint32_t *cp) {
+    *cp = 0;
+    if (end - p < 4)
+        return -1;
+    for (int i = 0; i < 4; i++) {
+        char ch = p[i];
+        int d = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 :
+            ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+        if (d < 0)
+            return -1;
+        *cp = *cp << 4 | (uint32_t) d;
+    }
+    return 0;
+}
+
+// \uXXXX at p, a surrogate pair takes the next escape too, return chars consumed after the backslash
+static int json_unicode(const char *p, const char *end, uint32_t *cp) {
+    uint32_t lo;
+
+    if (json_hex4(p + 1, end, cp))
+        return -1;
+    if (*cp >= 0xdc00 && *cp < 0xe000)
+        return -1;
+    if (*cp < 0xd800 || *cp >= 0xdc00)
+        return 5;
+    if (end - p < 11 || p[5] != '\\' || p[6] != 'u' || json_hex4(p + 7, end, &lo) || lo < 0xdc00 || lo >= 0xe000)
+        return -1;
+    *cp = 0x10000 + ((*cp - 0xd800) << 10) + (lo - 0xdc00);
+    return 11;
+}
+
+static size_t utf8_len(uint32_t cp) {
+    return cp < 0x80 ? 1 : cp < 0x800 ? 2 : cp < 0x10000 ? 3 : 4;
+}
+
+static size_t utf8_put(uint8_t *o, uint32_t cp) {
+    size_t n = utf8_len(cp);
+    if (n == 1) {
+        o[0] = (uint8_t) cp;
+    } else if (n == 2) {
+        o[0] = (uint8_t) (0xc0 | cp >> 6);
+        o[1] = (uint8_t) (0x80 | (cp & 0x3f));
+    } else if (n == 3) {
+        o[0] = (uint8_t) (0xe0 | cp >> 12);
+        o[1] = (uint8_t) (0x80 | ((cp >> 6) & 0x3f));
+        o[2] = (uint8_t) (0x80 | (cp & 0x3f));
+    } else {
+        o[0] = (uint8_t) (0xf0 | cp >> 18);
+        o[1] = (uint8_t) (0x80 | ((cp >> 12) & 0x3f));
+        o[2] = (uint8_t) (0x80 | ((cp >> 6) & 0x3f));
+        o[3] = (uint8_t) (0x80 | (cp & 0x3f));
+    }
+    return n;
+}
+
+// e->p at the opening quote, first pass finds the end and the unescaped length
+static int cbor_enc_string(struct cbor_enc *e) {
+    const char *s = e->p + 1, *q;
+    uint32_t cp;
+    size_t n = 0;
+    uint8_t *o;
+    int k;
+
+    for (q = s; q < e->end && *q != '"'; q++) {
+        if ((unsigned char) *q < 0x20)
+            return -1;
+        if (*q != '\\') {
+            n++;
+            continue;
+        }
+        if (++q >= e->end)
+            return -1;
+        if (*q == 'u') {
+            if ((k = json_unicode(q, e->end, &cp)) < 0)
+                return -1;
+            n += utf8_len(cp);
+            q += k - 1;
+        } else if (*q && strchr("\"\\/bfnrt", *q)) {
+            n++;
+        } else {
+            return -1;
+        }
+    }
+    if (q >= e->end || cbor_head(e->out, CBOR_TEXT, n) || cbor_reserve(e->out, n))
+        return -1;
+
+    o = e->out->buf + e->out->len;
+    for (const char *r = s; r < q; r++) {
+        if (*r != '\\') {
+            *o++ = (uint8_t) *r;
+            continue;
+        }
+        switch (*++r) {
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'u':
+                k = json_unicode(r, q, &cp);
+                o += utf8_put(o, cp);
+                r += k - 1;
+                break;
+            default: *o++ = (uint8_t) *r; break;
+        }
+    }
+    e->out->len += n;
+    e->p = q + 1;
+    return 0;
+}
+
+static const double s_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static int json_digits(const char **q, const char *end, uint64_t *v, int *overflow) {
+    int n = 0;
+    for (; *q < end && isdigit((unsigned char) **q); (*q)++, n++) {
+        uint64_t d = (uint64_t) (**q - '0');
+        if (*v > (UINT64_MAX - d) / 10)
+            *overflow = 1;
+        else if (!*overflow)
+            *v = *v * 10 + d;
+    }
+    return n;
+}
+
+static int cbor_enc_number(struct cbor_enc *e) {
+    const char *s = e->p, *q = s;
+    char buf[64];
+    uint64_t mant = 0, exp = 0;
+    int neg = 0, integer = 1, overflow = 0, exp_overflow = 0, frac = 0, e10;
+
+    if (q < e->end && *q == '-') {
+        neg = 1;
+        q++;
+    }
+    if (q >= e->end || !isdigit((unsigned char) *q) || (*q == '0' && q + 1 < e->end && isdigit((unsigned char) q[1])))
+        return -1;
+    json_digits(&q, e->end, &mant, &overflow);
+    if (q < e->end && *q == '.') {
+        integer = 0;
+        q++;
+        if ((frac = json_digits(&q, e->end, &mant, &overflow)) == 0)
+            return -1;
+    }
+    if (q < e->end && (*q == 'e' || *q == 'E')) {
+        int exp_neg = 0;
+        integer = 0;
+        if (++q < e->end && (*q == '+' || *q == '-'))
+            exp_neg = *q++ == '-';
+        if (json_digits(&q, e->end, &exp, &exp_overflow) == 0)
+            return -1;
+        if (exp_overflow || exp > 10000)
+            exp = 10000;
+        frac += exp_neg ? (int) exp : -(int) exp;
+    }
+    e->p = q;
+
+    //integers up to 64 bits, larger ones are doubles like in cJSON
+    if (integer && !overflow)
+        return neg && mant > 0 ? cbor_head(e->out, CBOR_NEGINT, mant - 1) : cbor_head(e->out, CBOR_UINT, mant);
+
+    //mantissa and power of ten both exact, one rounding of the division or product
+    e10 = -frac;
+    if (!overflow && mant < (1ull << 53) && e10 >= -22 && e10 <= 22) {
+        double d = e10 < 0 ? (double) mant / s_pow10[-e10] : (double) mant * s_pow10[e10];
+        return cbor_double(e->out, neg ? -d : d);
+    }
+
+    if ((size_t) (q - s) >= sizeof(buf))
+        return -1;
+    memcpy(buf, s, (size_t) (q - s));
+    buf[q - s] = '\0';
+    return cbor_double(e->out, strtod(buf, NULL));
+}
+
+static int cbor_enc_literal(struct cbor_enc *e) {
+    static const struct { const char *text; uint8_t byte; } lits[] = {
+        { "true", 0xf5 }, { "false", 0xf4 }, { "null", 0xf6 },
+    };
+
+    for (size_t i = 0; i < sizeof(lits) / sizeof(lits[0]); i++) {
+        size_t n = strlen(lits[i].text);
+        if ((size_t) (e->end - e->p) >= n && memcmp(e->p, lits[i].text, n) == 0) {
+            e->p += n;
+            return cbor_put(e->out, &lits[i].byte, 1);
+        }
+    }
+    return -1;
+}
+
+static int cbor_enc_value(struct cbor_enc *e, int depth);
+
+static int cbor_enc_container(struct cbor_enc *e, int depth) {
+    int map = *e->p == '{';
+    char close = map ? '}' : ']';
+    size_t ofs = e->out->len;
+    uint64_t n = 0;
+
+    if (depth >= CBOR_DEPTH_MAX || cbor_head(e->out, map ? CBOR_MAP : CBOR_ARRAY, 0))
+        return -1;
+    e->p++;
+    json_skip_ws(e);
+    if (e->p < e->end && *e->p == close) {
+        e->p++;
+        return 0;
+    }
+
+    for (;;) {
+        if (map) {
+            json_skip_ws(e);
+            if (e->p >= e->end || *e->p != '"' || cbor_enc_string(e))
+                return -1;
+            json_skip_ws(e);
+            if (e->p >= e->end || *e->p++ != ':')
+                return -1;
+        }
+        if (cbor_enc_value(e, depth + 1))
+            return -1;
+        n++;
+        json_skip_ws(e);
+        if (e->p >= e->end)
+            return -1;
+        if (*e->p == ',') {
+            e->p++;
+            continue;
+        }
+        if (*e->p++ != close)
+            return -1;
+        break;
+    }
+    return cbor_patch(e->out, ofs, map ? CBOR_MAP : CBOR_ARRAY, n);
+}
+
+static int cbor_enc_value(struct cbor_enc *e, int depth) {
+    json_skip_ws(e);
+    if (e->p >= e->end)
+        return -1;
+    switch (*e->p) {
+        case '{':
+        case '[':
+            return cbor_enc_container(e, depth);
+        case '"':
+            return cbor_enc_string(e);
+        case 't':
+        case 'f':
+        case 'n':
+            return cbor_enc_literal(e);
+        default:
+            return cbor_enc_number(e);
+    }
+}
+
+int cbor_is_json(struct mg_str data) {
+    for (size_t i = 0; i < data.len; i++) {
+        char ch = data.ptr[i];
+        if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r')
+            return ch == '{' || ch == '[';
+    }
+    return 0;
+}
+
+int cbor_from_json(struct mg_str json, struct mg_iobuf *out) {
+    struct cbor_enc e = { json.ptr, json.ptr + json.len, out };
+
+    out->len = 0;
+    if (!cbor_is_json(json) || cbor_enc_value(&e, 0))
+        goto fail;
+    json_skip_ws(&e);
+    if (e.p != e.end)
+        goto fail;
+    return 0;
+
+fail:
+    out->len = 0;
+    return -1;
+}
+
+struct cbor_dec {
+    const uint8_t *p, *end;
+    struct mg_iobuf *out;
+};
+
+static int cbor_arg(struct cbor_dec *d, int ai, uint64_t *v) {
+    size_t n;
+
+    if (ai < 24) {
+        *v = (uint64_t) ai;
+        return 0;
+    }
+    if (ai > 27)
+        return -1;
+    n = (size_t) 1 << (ai - 24);
+    if ((size_t) (d->end - d->p) < n)
+        return -1;
+    *v = 0;
+    for (size_t i = 0; i < n; i++)
+        *v = *v << 8 | d->p[i];
+    d->p += n;
+    return 0;
+}
+
+static int json_escape(struct mg_iobuf *out, const uint8_t *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    size_t run = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        char esc[6] = { '\\', 0, '0', '0', 0, 0 };
+        size_t elen = 2;
+        switch (s[i]) {
+            case '"': esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            default:
+                if (s[i] >= 0x20) {
+                    run++;
+                    continue;
+                }
+                esc[1] = 'u';
+                esc[4] = hex[s[i] >> 4];
+                esc[5] = hex[s[i] & 0xf];
+                elen = 6;
+                break;
+        }
+        if (cbor_put(out, s + i - run, run) || cbor_put(out, esc, elen))
+            return -1;
+        run = 0;
+    }
+    return cbor_put(out, s + n - run, run);
+}
+
+static int cbor_dec_text(struct cbor_dec *d, uint64_t n) {
+    if (n > (uint64_t) (d->end - d->p) || json_escape(d->out, d->p, (size_t) n))
+        return -1;
+    d->p += n;
+    return 0;
+}
+
+// chunks of definite text strings up to a break
+static int cbor_dec_text_chunks(struct cbor_dec *d) {
+    uint64_t n;
+
+    while (d->p < d->end && *d->p != CBOR_BREAK) {
+        int ib = *d->p++;
+        if (ib >> 5 != CBOR_TEXT || (ib & 0x1f) == 31 || cbor_arg(d, ib & 0x1f, &n) || cbor_dec_text(d, n))
+            return -1;
+    }
+    if (d->p >= d->end)
+        return -1;
+    d->p++;
+    return 0;
+}
+
+// byte string as base64url without padding
+static int cbor_dec_bytes(struct cbor_dec *d, uint64_t n) {
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    const uint8_t *s = d->p;
+    char *o;
+
+    if (n > (uint64_t) (d->end - d->p) || cbor_reserve(d->out, (size_t) n / 3 * 4 + 4))
+        return -1;
+    o = (char *) d->out->buf + d->out->len;
+    for (size_t i = 0; i < n; i += 3) {
+        uint32_t v = (uint32_t) s[i] << 16 | (i + 1 < n ? (uint32_t) s[i + 1] << 8 : 0) | (i + 2 < n ? s[i + 2] : 0);
+        *o++ = b64[v >> 18];
+        *o++ = b64[(v >> 12) & 0x3f];
+        if (i + 1 < n)
+            *o++ = b64[(v >> 6) & 0x3f];
+        if (i + 2 < n)
+            *o++ = b64[v & 0x3f];
+    }
+    d->out->len = (size_t) (o - (char *) d->out->buf);
+    d->p += n;
+    return 0;
+}
+
+static double cbor_half_value(uint16_t h) {
+    int exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+    double v;
+
+    if (exp == 0)
+        v = mant / 16777216.0; //2^24
+    else if (exp == 31)
+        v = mant ? NAN : INFINITY;
+    else
+        v = exp >= 25 ? (double) (mant + 1024) * (1u << (exp - 25)) : (double) (mant + 1024) / (1u << (25 - exp));
+    return h & 0x8000 ? -v : v;
+}
+
+static size_t json_u64(char *buf, uint64_t v) {
+    char tmp[20];
+    size_t n = 0, len;
+
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v);
+    for (len = n; n > 0; n--)
+        buf[len - n] = tmp[n - 1];
+    return len;
+}
+
+// exact decimal of a value with at most 10 binary fraction digits, counters and halves of
+// floats mostly are, 0: not one
+static size_t json_dyadic(char *buf, double v) {
+    double m = v * 1024; //exact, a power of two
+    uint64_t a, fp;
+    size_t n = 0;
+
+    if (!(m > -9007199254740992.0 && m < 9007199254740992.0) || m != (double) (int64_t) m)
+        return 0;
+    a = m < 0 ? (uint64_t) -(int64_t) m : (uint64_t) m;
+    if (m < 0)
+        buf[n++] = '-';
+    n += json_u64(buf + n, a >> 10);
+    if ((fp = (a & 1023) * 9765625) != 0) { //fraction in 10^-10, 5^10 * 2^10 = 10^10
+        buf[n++] = '.';
+        for (uint64_t div = 1000000000; div && fp; div /= 10) {
+            buf[n++] = (char) ('0' + fp / div);
+            fp %= div;
+        }
+    }
+    return n;
+}
+
+// shortest text which reads back as the same double, mg_snprintf does not round trip
+static int json_double(struct mg_iobuf *out, double v) {
+    char buf[40];
+    int n;
+
+    if (!isfinite(v))
+        return cbor_put(out, "null", 4);
+    if ((n = (int) json_dyadic(buf, v)) > 0)
+        return cbor_put(out, buf, (size_t) n);
+    n = snprintf(buf, sizeof(buf), "%.15g", v);
+    if (strtod(buf, NULL) != v)
+        n = snprintf(buf, sizeof(buf), "%.17g", v);
+    return cbor_put(out, buf, (size_t) n);
+}
+
+static int cbor_dec_simple(struct cbor_dec *d, int ai) {
+    uint64_t v;
+
+    switch (ai) {
+        case 20: return cbor_put(d->out, "false", 5);
+        case 21: return cbor_put(d->out, "true", 4);
+        case 25:
+        case 26:
+        case 27:
+            if (cbor_arg(d, ai, &v))
+                return -1;
+            if (ai == 25)
+                return json_double(d->out, cbor_half_value((uint16_t) v));
+            if (ai == 26) {
+                uint32_t u = (uint32_t) v;
+                float f;
+                memcpy(&f, &u, sizeof(f));
+                return json_double(d->out, f);
+            }
+            double x;
+            memcpy(&x, &v, sizeof(x));
+            return json_double(d->out, x);
+        case 24: //one byte simple value
+            if (cbor_arg(d, ai, &v))
+                return -1;
+            return cbor_put(d->out, "null", 4);
+        case 28:
+        case 29:
+        case 30:
+        case 31: //a break outside an indefinite item
+            return -1;
+        default: //null, undefined and unassigned ones
+            return cbor_put(d->out, "null", 4);
+    }
+}
+
+static int cbor_dec_value(struct cbor_dec *d, int depth, int key);
+
+static int cbor_dec_container(struct cbor_dec *d, int depth, int map, int indefinite, uint64_t n) {
+    if (depth >= CBOR_DEPTH_MAX)
+        return -1;
+    if (!indefinite && n > (uint64_t) (d->end - d->p)) //every item takes a byte at least
+        return -1;
+    if (cbor_put(d->out, map ? "{" : "[", 1))
+        return -1;
+    for (uint64_t i = 0; indefinite || i < n; i++) {
+        if (indefinite) {
+            if (d->p >= d->end)
+                return -1;
+            if (*d->p == CBOR_BREAK) {
+                d->p++;
+                break;
+            }
+        }
+        if (i > 0 && cbor_put(d->out, ",", 1))
+            return -1;
+        if (map && (cbor_dec_value(d, depth + 1, 1) || cbor_put(d->out, ":", 1)))
+            return -1;
+        if (cbor_dec_value(d, depth + 1, 0))
+            return -1;
+    }
+    return cbor_put(d->out, map ? "}" : "]", 1);
+}
+
+// key: map key, json wants a string, integers are quoted
+static int cbor_dec_value(struct cbor_dec *d, int depth, int key) {
+    char num[24];
+    uint64_t v = 0;
+    int ib, major, ai;
+    size_t n;
+
+    if (d->p >= d->end)
+        return -1;
+    ib = *d->p++;
+    major = ib >> 5;
+    ai = ib & 0x1f;
+    if (key && major != CBOR_UINT && major != CBOR_NEGINT && major != CBOR_TEXT && major != CBOR_TAG)
+        return -1;
+    if (major == CBOR_SIMPLE)
+        return cbor_dec_simple(d, ai);
+    if (ai == 31) {
+        if (major == CBOR_TEXT)
+            return cbor_put(d->out, "\"", 1) || cbor_dec_text_chunks(d) || cbor_put(d->out, "\"", 1) ? -1 : 0;
+        if (major == CBOR_ARRAY || major == CBOR_MAP)
+            return cbor_dec_container(d, depth, major == CBOR_MAP, 1, 0);
+        return -1;
+    }
+    if (cbor_arg(d, ai, &v))
+        return -1;
+
+    switch (major) {
+        case CBOR_UINT:
+        case CBOR_NEGINT:
+            n = 0;
+            if (major == CBOR_NEGINT)
+                num[n++] = '-';
+            if (major == CBOR_NEGINT && v == UINT64_MAX) //-1 - v does not fit in 64 bits
+                n += mg_snprintf(num + n, sizeof(num) - n, "18446744073709551616");
+            else
+                n += json_u64(num + n, major == CBOR_NEGINT ? v + 1 : v);
+            if (key)
+                return cbor_put(d->out, "\"", 1) || cbor_put(d->out, num, n) || cbor_put(d->out, "\"", 1) ? -1 : 0;
+            return cbor_put(d->out, num, n);
+        case CBOR_BYTES:
+            return cbor_put(d->out, "\"", 1) || cbor_dec_bytes(d, v) || cbor_put(d->out, "\"", 1) ? -1 : 0;
+        case CBOR_TEXT:
+            return cbor_put(d->out, "\"", 1) || cbor_dec_text(d, v) || cbor_put(d->out, "\"", 1) ? -1 : 0;
+        case CBOR_ARRAY:
+        case CBOR_MAP:
+            return cbor_dec_container(d, depth, major == CBOR_MAP, 0, v);
+        default: //tag, the content stands for itself
+            return depth >= CBOR_DEPTH_MAX ? -1 : cbor_dec_value(d, depth + 1, key);
+    }
+}
+
+int cbor_is_container(struct mg_str data) {
+    return data.len > 0 && ((uint8_t) data.ptr[0] >> 5 == CBOR_ARRAY || (uint8_t) data.ptr[0] >> 5 == CBOR_MAP);
+}
+
+int cbor_to_json(struct mg_str cbor, struct mg_iobuf *out) {
+    struct cbor_dec d = { (const uint8_t *) cbor.ptr, (const uint8_t *) cbor.ptr + cbor.len, out };
+
+    out->len = 0;
+    if (!cbor_is_container(cbor) || cbor_dec_value(&d, 0, 0) || d.p != d.end) {
+        out->len = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void cbor_stats_dump(struct cbor_stats *st) {
+    if (st->encoded == 0 && st->decoded == 0 && st->failed == 0)
+        return;
+    MG_INFO(("cbor encoded: %llu, json bytes: %llu, cbor bytes: %llu, ratio: %llu%%, decoded: %llu, failed: %llu",
+        (unsigned long long) st->encoded, (unsigned long long) st->json_bytes, (unsigned long long) st->cbor_bytes,
+        (unsigned long long) (st->json_bytes ? st->cbor_bytes * 100 / st->json_bytes : 0),
+        (unsigned long long) st->decoded, (unsigned long long) st->failed));
+}
@@ -0,0 +1,35 @@
+#ifndef __IOT_CBOR_H__
+#define __IOT_CBOR_H__
+
+#include <iot/mongoose.h>
+
+#define CBOR_IO_ALIGN   1024
+#define CBOR_DEPTH_MAX  32      //nesting of arrays, maps and tags
+
+struct cbor_stats {
+    uint64_t encoded;       //json payloads published as cbor
+    uint64_t json_bytes;    //their size as json
+    uint64_t cbor_bytes;    //their size as cbor
+    uint64_t decoded;       //cbor requests forwarded to iot-rpcd as json
+    uint64_t failed;        //json published as it was, or malformed cbor dropped
+};
+
+/*
+ * streaming json <-> cbor (rfc 8949) transcoder of the cloud boundary, one pass and no tree.
+ * json integers become the shortest cbor integer, other numbers the shortest float which
+ * keeps the value; strings are unescaped to utf-8. from cbor, byte strings become base64url
+ * text, integer map keys are quoted, tags are dropped, undefined and non-finite floats are null.
+ */
+//json object or array to cbor, out is overwritten, 0: ok
+int cbor_from_json(struct mg_str json, struct mg_iobuf *out);
+//cbor map or array to json, out is overwritten, 0: ok
+int cbor_to_json(struct mg_str cbor, struct mg_iobuf *out);
+
+//first byte of a cbor map or array, json text never starts with one
+int cbor_is_container(struct mg_str data);
+//first non blank byte of a json object or array
+int cbor_is_json(struct mg_str data);
+
+void cbor_stats_dump(struct cbor_stats *st);
+
+#endif
@@ -10,6 +10,18 @@ static void signal_handler(int signo) {
     s_signo = signo;
 }
 
+static volatile sig_atomic_t s_dump;
+static void dump_handler(int signo) {
+    (void) signo;
+    s_dump = 1;
+}
+
+static volatile sig_atomic_t s_hup;
+static void reload_handler(int signo) {
+    (void) signo;
+    s_hup = 1;
+}
+
 /*
 {
     code = 0, -- if code !=0, don't send request
@@ -22,21 +34,22 @@ static void signal_handler(int signo) {
     }
 }
 */
-void timer_report_fn(void *arg) {
+static void report_done_cb(struct mg_mgr *mgr, struct mg_str ret, const char *param) {
 
-    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    struct client_private *priv = (struct client_private*)mgr->userdata;
     cJSON *root = NULL;
     char *printed = NULL;
-    if (!priv->mqtt_conn || !priv->cloud_mqtt_conn) {
-        MG_DEBUG(("mqtt client not connected"));
+    struct cloud_session *s = priv->num_sessions > 0 ? priv->sessions[0] : NULL; //reports go to the primary identity
+
+    if (!ret.ptr) {
+        MG_DEBUG(("no report data"));
         return;
     }
 
-    struct mg_str ret = MG_NULL_STR;
-    lua_callback(arg, "gen_request", "", &ret);
+    MG_DEBUG(("ret: %.*s", (int) ret.len, ret.ptr));
 
-    if (!ret.ptr) {
-        MG_DEBUG(("no report data"));
+    if (!priv->mqtt_conn || !s || (!s->conn && !priv->queue)) { //disconnected while lua was running
+        MG_DEBUG(("mqtt client not connected"));
         return;
     }
 
@@ -51,8 +64,11 @@ void timer_report_fn(void *arg) {
 
     printed = cJSON_Print(data);
 
-    //simulate from cloud, send report request to iot-rpcd
-    report_mqtt_msg_callback(priv->mqtt_conn, mg_str("report_timer"), mg_str(printed));
+    //send report request to iot-rpcd, the job name keys its reply
+    struct mg_str key;
+    if (json_get_top_string(mg_str(param), "name", &key))
+        key = mg_str(REPORT_LEGACY_NAME);
+    report_mqtt_msg_callback(s, key, mg_str(printed));
 
 end:
 
@@ -62,26 +78,391 @@ end:
     if (root)
         cJSON_Delete(root);
 
-    if (ret.ptr) {
-        MG_DEBUG(("ret: %.*s", (int) ret.len, ret.ptr));
-        free((void*)ret.ptr);
+}
+
+// report parse, envelope and print are per cycle scratch
+static void report_done(struct mg_mgr *mgr, struct mg_str ret, const char *param) {
+    arena_begin();
+    report_done_cb(mgr, ret, param);
+    arena_end();
+}
+
+/*
+{
+    code = 0,
+    data = {
+        { name = "link", interval = 5, jitter = 1, priority = 1 },  -- seconds
+        { name = "inventory", interval = 3600, jitter = 300 }
+    }
+}
+*/
+static void report_schedule_done(struct mg_mgr *mgr, struct mg_str ret, const char *param) {
+
+    struct client_private *priv = (struct client_private*)mgr->userdata;
+    uint64_t now = mg_millis();
+    cJSON *root = NULL;
+
+    priv->report_loading = 0;
+
+    if (ret.ptr)
+        root = cJSON_ParseWithLength(ret.ptr, ret.len);
+    cJSON *code = cJSON_GetObjectItem(root, FIELD_CODE);
+    cJSON *data = cJSON_GetObjectItem(root, FIELD_DATA);
+
+    //an empty or all invalid schedule is no schedule, reports must not stop
+    if (cJSON_IsNumber(code) && cJSON_GetNumberValue(code) == 0 && cJSON_IsArray(data) &&
+        report_sched_load(&priv->report, data, now) > 0) {
+        MG_INFO(("report schedule loaded, jobs: %d", priv->report.num_jobs));
+    } else if (priv->report.num_jobs == 0) {
+        MG_INFO(("no report schedule, gen_request every %d ms", REPORT_INTERVAL_MS));
+        report_sched_legacy(&priv->report, REPORT_INTERVAL_MS, now);
+    }
+
+    if (root)
+        cJSON_Delete(root);
+
+    sched_kick(&priv->sched, TASK_REPORT, now);
+}
+
+// jobs due at the same wakeup, higher priority first
+static int report_job_cmp(const void *a, const void *b) {
+    int pa = (*(struct report_job **)a)->priority, pb = (*(struct report_job **)b)->priority;
+    return pa == pb ? 0 : pa > pb ? -1 : 1;
+}
+
+// Task function - run due report jobs, return when the next one is due
+uint64_t timer_report_fn(void *arg, uint64_t now) {
+
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    struct report_job *due[REPORT_JOBS_MAX], *job;
+    int n = 0;
+
+    if (priv->report_stale && !priv->report_loading) {
+        priv->report_stale = 0;
+        priv->report_loading = 1;
+        if (lua_callback_post(arg, "get_schedule", "", report_schedule_done)) {
+            priv->report_stale = 1; //worker busy, retry
+            priv->report_loading = 0;
+        }
+    }
+
+    if (priv->report.num_jobs == 0) //report_schedule_done kicks
+        return priv->report_stale ? now + REPORT_INTERVAL_MS : SCHED_NEVER;
+
+    while ((job = report_sched_pop(&priv->report, now)) != NULL)
+        due[n++] = job;
+    qsort(due, n, sizeof(due[0]), report_job_cmp);
+
+    struct cloud_session *s = priv->num_sessions > 0 ? priv->sessions[0] : NULL; //reports go to the primary identity
+    int ready = priv->mqtt_conn && s && (s->conn || priv->queue); //queue keeps reports while cloud offline
+
+    for (int i = 0; i < n; i++) {
+        job = due[i];
+        if (!ready) {
+            MG_DEBUG(("mqtt client not connected, skip report %s", job->name));
+            job->skipped++;
+        } else if (priv->report.legacy) {
+            arena_begin(); //an inline lua result lives in the arena until report_done is over
+            lua_callback_post(arg, "gen_request", "", report_done);
+            arena_end();
+            job->runs++;
+        } else {
+            char param[REPORT_NAME_LEN + 32];
+            mg_snprintf(param, sizeof(param), "{\"name\":\"%s\",\"priority\":%d}", job->name, job->priority);
+            arena_begin();
+            lua_callback_post(arg, "gen_request", param, report_done);
+            arena_end();
+            job->runs++;
+        }
+        report_sched_push(&priv->report, job, now);
+    }
+
+    return report_sched_next(&priv->report);
+}
+
+// Task function - flush queue file, drain queued records to cloud at queue_drain_rate
+uint64_t timer_queue_fn(void *arg, uint64_t now) {
+
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    struct outq_pub pub;
+    struct mg_str key;
+    int rate = priv->cfg.opts->queue_drain_rate;
+    uint64_t sync_interval = (uint64_t) priv->cfg.opts->queue_sync_interval;
+    int more = 0;
+
+    if (now < priv->queue_synced || now - priv->queue_synced >= sync_interval) {
+        queue_sync(priv->queue);
+        priv->queue_synced = now;
+    }
+
+    //written records wait at most sync_interval for msync
+    uint64_t next = priv->queue->dirty ? priv->queue_synced + sync_interval : SCHED_NEVER;
+
+    if (queue_count(priv->queue) == 0)
+        return next;
+
+    //budget in 1/10 record, drain runs every QUEUE_DRAIN_TICK_MS
+    priv->queue_drain_budget += rate;
+    if (priv->queue_drain_budget > rate * 10)
+        priv->queue_drain_budget = rate * 10;
+
+    //each identity drains its own records in order, an offline one does not hold up the others
+    for (int k = 0; k < priv->num_sessions && priv->queue_drain_budget >= 10; k++) {
+        int i = (priv->queue_drain_from + k) % priv->num_sessions;
+        struct cloud_session *s = priv->sessions[i];
+
+        if (!s->enabled || !s->queue_pending || !s->registered) //MG_EV_MQTT_OPEN kicks the drain
+            continue;
+        while (priv->queue_drain_budget >= 10) {
+            if (s->conn->send.len >= priv->cfg.opts->send_high_water || s->outq.count > 0) {
+                more = 1;
+                break;
+            }
+            if (queue_next(priv->queue, &s->queue_cur, mg_str(s->client_id), &pub)) {
+                s->queue_pending = 0; //new replies go out directly
+                break;
+            }
+            if (pub.topic.len) //reply of an mqtt5 request
+                cloud_mqtt_reply(s, pub.topic, pub.cdata, pub.data, OUTQ_LOW);
+            else
+                cloud_mqtt_send(s, pub.data, OUTQ_LOW);
+            queue_done(priv->queue, &s->queue_cur);
+            priv->queue_drain_budget -= 10;
+        }
+        if (s->queue_pending)
+            more = 1;
+        priv->queue_drain_from = i + 1;
+    }
+
+    //records of identities no longer configured would keep their space forever
+    while (priv->num_sessions > 0 && queue_peek(priv->queue, &key, &pub) == 0 &&
+        !client_session_by_id(priv, key)) {
+        MG_INFO(("drop queued record of %.*s, no such session", (int) key.len, key.ptr));
+        queue_pop(priv->queue);
+    }
+
+    if (queue_count(priv->queue) == 0) {
+        MG_INFO(("queue drained, pushed: %llu, popped: %llu, dropped: %llu",
+            (unsigned long long) priv->queue->stats.pushed, (unsigned long long) priv->queue->stats.popped,
+            (unsigned long long) priv->queue->stats.dropped));
+    } else if (more && now + QUEUE_DRAIN_TICK_MS < next) {
+        next = now + QUEUE_DRAIN_TICK_MS;
+    }
+
+    return next;
+}
+
+// enabled session of identity client_id, keys records of the queue
+struct cloud_session *client_session_by_id(struct client_private *priv, struct mg_str client_id) {
+    for (int i = 0; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        if (s->enabled && s->client_id && strlen(s->client_id) == client_id.len &&
+            memcmp(s->client_id, client_id.ptr, client_id.len) == 0)
+            return s;
+    }
+    return NULL;
+}
+
+// route iot-rpcd responses by reply topic, mg/iot-client/channel[-<index>][:<id>]
+struct cloud_session *client_session_by_topic(struct client_private *priv, struct mg_str topic) {
+    size_t plen = strlen(IOT_CLIENT_RPCD_TOPIC_PREFIX);
+    int index = 0;
+
+    if (priv->num_sessions == 0)
+        return NULL;
+
+    if (topic.len > plen + 1 && strncmp(topic.ptr, IOT_CLIENT_RPCD_TOPIC_PREFIX "-", plen + 1) == 0) {
+        index = 0;
+        for (size_t i = plen + 1; i < topic.len && topic.ptr[i] != ':'; i++) {
+            if (!isdigit((unsigned char) topic.ptr[i]) || index > CLOUD_SESSION_MAX)
+                return NULL;
+            index = index * 10 + (topic.ptr[i] - '0');
+        }
+        return index < priv->num_sessions ? priv->sessions[index] : NULL;
+    }
+
+    //primary reply topic, or other publishers on mg/iot-client/+
+    return priv->sessions[0];
+}
+
+// backpressure, stop reading cloud connections while in-flight requests are at the cap
+void client_flow_update(struct client_private *priv) {
+    int paused = priv->corr.inflight >= priv->corr.cap;
+
+    if (paused != priv->flow_paused)
+        MG_INFO(("%s cloud requests, in-flight: %d", paused ? "pause" : "resume", priv->corr.inflight));
+    priv->flow_paused = paused;
+
+    for (int i = 0; i < priv->num_sessions; i++) {
+        if (priv->sessions[i]->conn)
+            priv->sessions[i]->conn->is_full = paused;
+    }
+}
+
+/*
+{
+    "code": -10408,
+    "message": "iot-rpcd timeout",
+    "id": 12,
+    "topic": "cloud request topic"
+}
+*/
+static void corr_timeout_fn(struct corr_entry *e, void *arg) {
+    struct client_private *priv = (struct client_private*)arg;
+    struct cloud_session *s = e->session >= 0 && e->session < priv->num_sessions ? priv->sessions[e->session] : NULL;
+
+    MG_INFO(("request %lu of %s timeout", (unsigned long) e->id, e->topic));
+    cache_abort(&priv->cache, e->id); //requests waiting on it time out on their own
+
+    if ((e->flags & CORR_F_REPORT) || !s || !s->conn) //nobody waits for a report
+        return;
+
+    arena_begin();
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, FIELD_CODE, IOT_CLIENT_TIMEOUT_CODE);
+    cJSON_AddStringToObject(root, "message", "iot-rpcd timeout");
+    cJSON_AddNumberToObject(root, "id", e->id);
+    cJSON_AddStringToObject(root, FIELD_TOPIC, e->topic);
+    char *printed = cJSON_PrintUnformatted(root);
+    if (printed) {
+        if (e->resp_topic[0])
+            cloud_mqtt_reply(s, mg_str(e->resp_topic), mg_str_n((const char *) e->cdata, e->cdata_len),
+                mg_str(printed), OUTQ_HIGH);
+        else
+            cloud_mqtt_send(s, mg_str(printed), OUTQ_HIGH);
+        cJSON_free(printed);
+    }
+    cJSON_Delete(root);
+    arena_end();
+}
+
+// Task function - expire in-flight requests which iot-rpcd did not answer in time
+uint64_t timer_corr_fn(void *arg, uint64_t now) {
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    corr_expire(&priv->corr, now, corr_timeout_fn, priv);
+    client_flow_update(priv);
+    return priv->corr.inflight > 0 ? now + CORR_TICK_MS : SCHED_NEVER; //cloud_mqtt_msg_callback kicks it
+}
+
+// Task function - publish batches whose window is over
+uint64_t timer_batch_fn(void *arg, uint64_t now) {
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    uint64_t next = SCHED_NEVER;
+
+    for (int i = 0; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        if (s->batch.count == 0)
+            continue;
+        if (s->batch.deadline <= now)
+            cloud_batch_flush(s);
+        else if (s->batch.deadline < next)
+            next = s->batch.deadline;
+    }
+    return next;
+}
+
+// Task function - give up on lua jobs past their deadline
+uint64_t timer_worker_fn(void *arg, uint64_t now) {
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    return worker_poll(priv->worker, now);
+}
+
+// Task function - go back to the last ack of transfers the cloud stopped acking, give up on stalled ones
+uint64_t timer_xfer_fn(void *arg, uint64_t now) {
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    uint64_t next = SCHED_NEVER;
+
+    for (int i = 0; i < XFER_MAX; i++) {
+        struct xfer *x = &priv->xfer.slots[i];
+        struct cloud_session *s = x->session < priv->num_sessions ? priv->sessions[x->session] : NULL;
+        int online = s && s->conn && s->stage == CLOUD_STAGE_OPEN;
+
+        if (!x->id)
+            continue;
+        if (now - x->progress_at >= XFER_IDLE_MS) {
+            xfer_end(&priv->xfer, x, 0);
+            continue;
+        }
+        if (online && now >= x->resend_at) {
+            if (x->next > x->acked && ++x->retries > XFER_RETRIES) {
+                xfer_end(&priv->xfer, x, 0);
+                continue;
+            }
+            //lost chunks or acks, the begin message asks the cloud for its offset again
+            if (x->next > x->acked) {
+                x->next = x->acked;
+                x->announced = 0;
+            }
+            x->resend_at = now + XFER_RESEND_MS;
+        }
+    }
+
+    for (int i = 0; i < priv->num_sessions; i++)
+        cloud_xfer_pump(priv->sessions[i]);
+
+    for (int i = 0; i < XFER_MAX; i++) { //offline transfers only wait for the idle limit
+        struct xfer *x = &priv->xfer.slots[i];
+        struct cloud_session *s = x->session < priv->num_sessions ? priv->sessions[x->session] : NULL;
+
+        if (!x->id)
+            continue;
+        if (x->progress_at + XFER_IDLE_MS < next)
+            next = x->progress_at + XFER_IDLE_MS;
+        if (s && s->conn && s->stage == CLOUD_STAGE_OPEN && x->resend_at < next)
+            next = x->resend_at;
     }
+    return next;
+}
+
+// merge the event loop and worker sets, NULLs are skipped
+static int client_metrics_sets(struct client_private *priv, struct metrics **sets) {
+    sets[0] = &priv->metrics;
+    sets[1] = priv->worker ? &priv->worker->metrics : NULL;
+    return 2;
+}
+
+void client_metrics_dump(struct client_private *priv) {
+    struct metrics *sets[2];
+    MG_INFO(("metrics, uptime %llu s", (unsigned long long) ((mg_millis() - priv->started) / 1000)));
+    metrics_dump(sets, client_metrics_sets(priv, sets));
+}
+
+// Task function - publish a metrics snapshot on the local bus
+uint64_t timer_metrics_fn(void *arg, uint64_t now) {
+    struct client_private *priv = (struct client_private*)((struct mg_mgr*)arg)->userdata;
+    struct metrics *sets[2];
+    char buf[8192], methods[6144];
+    size_t n = corr_hist_json(&priv->corr, methods, sizeof(methods));
+    size_t len = metrics_json(sets, client_metrics_sets(priv, sets), now - priv->started, n ? methods : NULL,
+        buf, sizeof(buf));
+
+    if (len > 0)
+        local_channel_pub(priv, mg_str(IOT_CLIENT_METRICS_TOPIC), mg_str_n(buf, len));
+    return now + (uint64_t) priv->cfg.opts->metrics_interval * 1000;
+}
 
+// callback_lua written or replaced
+static void client_watch_fn(struct mg_mgr *mgr) {
+    client_reload((struct client_private *) mgr->userdata);
 }
 
 int client_init(void **priv, void *opts) {
 
     struct client_private *p;
-    int timer_opts = MG_TIMER_REPEAT | MG_TIMER_RUN_NOW;
 
     signal(SIGINT, signal_handler);   // Setup signal handlers - exist event
     signal(SIGTERM, signal_handler);  // manager loop on SIGINT and SIGTERM
+    signal(SIGUSR1, dump_handler);    // metrics to the log
+    signal(SIGHUP, reload_handler);   // get_config and get_schedule again, connections stay up
 
     *priv = NULL;
     p = calloc(1, sizeof(struct client_private));
     if (!p)
         return -1;
 
+    if (arena_init(ARENA_SIZE, NULL)) //per-message cJSON work, before any cJSON allocation
+        MG_ERROR(("arena init failed, cJSON uses the heap"));
+
     //生成client id
     char rnd[10];
     mg_random(rnd, sizeof(rnd));
@@ -95,10 +476,62 @@ int client_init(void **priv, void *opts) {
     p->mgr.dns4.url = p->cfg.opts->dns4_url;
 
     p->mgr.userdata = p;
+    dns_init(&p->dns, &p->mgr, p->cfg.opts->dns4_url, p->cfg.opts->dns4_timeout*1000);
+    tls_creds_init(&p->tls, p->cfg.opts->cloud_mqtts_ca, p->cfg.opts->cloud_mqtts_cert,
+        p->cfg.opts->cloud_mqtts_certkey, p->cfg.opts->cloud_tls_session);
+    ka_store_load(&p->ka, p->cfg.opts->keepalive_state);
+    watch_init(&p->watch, &p->mgr, p->cfg.opts->callback_lua, client_watch_fn);
+
+    if (forward_init(&p->fwd, p->cfg.opts->module, p->cfg.opts->func)) {
+        MG_ERROR(("forward init failed"));
+        mg_mgr_free(&p->mgr);
+        free(p);
+        arena_exit();
+        return -1;
+    }
 
-    mg_timer_add(&p->mgr, 1000, timer_opts, timer_mqtt_fn, &p->mgr);
-    mg_timer_add(&p->mgr, 1000, timer_opts, timer_cloud_mqtt_fn, &p->mgr);
-    mg_timer_add(&p->mgr, 1000, timer_opts, timer_report_fn, &p->mgr);
+    if (p->cfg.opts->lua_async) {
+        p->worker = worker_init(&p->mgr, p->cfg.opts->callback_lua, p->cfg.opts->lua_timeout);
+        if (!p->worker)
+            MG_ERROR(("lua worker init failed, run callbacks on event loop"));
+    }
+
+    if (corr_init(&p->corr, p->cfg.opts->max_inflight, p->cfg.opts->request_timeout)) {
+        MG_ERROR(("request table init failed"));
+        forward_free(&p->fwd);
+        mg_mgr_free(&p->mgr);
+        free(p);
+        arena_exit();
+        return -1;
+    }
+
+    uint64_t now = mg_millis();
+    p->started = now;
+    p->report_stale = 1;
+    sched_init(&p->sched, now);
+    sched_set(&p->sched, TASK_MQTT, "mqtt", timer_mqtt_fn, &p->mgr, now);
+    sched_set(&p->sched, TASK_CLOUD, "cloud", timer_cloud_mqtt_fn, &p->mgr, now);
+    sched_set(&p->sched, TASK_REPORT, "report", timer_report_fn, &p->mgr, now);
+    sched_set(&p->sched, TASK_CORR, "corr", timer_corr_fn, &p->mgr, SCHED_NEVER);
+    if (p->cfg.opts->batch_window > 0)
+        sched_set(&p->sched, TASK_BATCH, "batch", timer_batch_fn, &p->mgr, SCHED_NEVER);
+    if (p->worker)
+        sched_set(&p->sched, TASK_WORKER, "worker", timer_worker_fn, &p->mgr, SCHED_NEVER);
+    xfer_init(&p->xfer, p->cfg.opts->xfer_dir);
+    sched_set(&p->sched, TASK_XFER, "xfer", timer_xfer_fn, &p->mgr, SCHED_NEVER);
+    if (p->cfg.opts->metrics_interval > 0)
+        sched_set(&p->sched, TASK_METRICS, "metrics", timer_metrics_fn, &p->mgr,
+            now + (uint64_t) p->cfg.opts->metrics_interval * 1000);
+
+    if (p->cfg.opts->queue_path) {
+        p->queue = queue_open(p->cfg.opts->queue_path, p->cfg.opts->queue_size,
+            p->cfg.opts->queue_max_records, p->cfg.opts->queue_drop_policy);
+        if (!p->queue) {
+            MG_ERROR(("open queue %s failed, store-and-forward disabled", p->cfg.opts->queue_path));
+        } else {
+            sched_set(&p->sched, TASK_QUEUE, "queue", timer_queue_fn, &p->mgr, now);
+        }
+    }
 
 
     *priv = p;
@@ -108,17 +541,122 @@ int client_init(void **priv, void *opts) {
 }
 
 
+// SIGHUP or a new callback script: cloud config and report schedule again, connections stay up,
+// lua picks the script up on the get_config call
+void client_reload(struct client_private *priv) {
+    uint64_t now = mg_millis();
+
+    MG_INFO(("reload %s", priv->cfg.opts->callback_lua));
+    priv->reloads++;
+    priv->config_reload = 1;
+    sched_kick(&priv->sched, TASK_CLOUD, now);
+    priv->report_stale = 1;
+    sched_kick(&priv->sched, TASK_REPORT, now);
+}
+
+// run due tasks, then sleep in mg_mgr_poll until the earliest of them, at most max_ms
+void client_poll(struct client_private *priv, int max_ms) {
+    int ms = sched_run(&priv->sched, mg_millis(), max_ms);
+    mg_mgr_poll(&priv->mgr, ms);
+}
+
 void client_run(void *handle) {
     struct client_private *priv = (struct client_private *)handle;
-    while (s_signo == 0) mg_mgr_poll(&priv->mgr, 1000);  // Event loop, 1000ms timeout
+    while (s_signo == 0) {  // Event loop
+        client_poll(priv, SCHED_POLL_MAX_MS);
+        if (s_dump) {
+            s_dump = 0;
+            client_metrics_dump(priv);
+        }
+        if (s_hup) {
+            s_hup = 0;
+            client_reload(priv);
+        }
+    }
 }
 
 void client_exit(void *handle) {
     struct client_private *priv = (struct client_private *)handle;
     if (priv->cfg.cloud_mqtt_cfg)
         cJSON_Delete(priv->cfg.cloud_mqtt_cfg);
-    mg_mgr_free(&priv->mgr);
+    client_metrics_dump(priv); //before the worker is gone
+    lua_callback_free(&priv->mgr);
+    sched_dump(&priv->sched, mg_millis());
+    MG_INFO(("delta reports full: %llu, patches: %llu, unchanged: %llu, bytes in: %llu, out: %llu",
+        (unsigned long long) priv->delta.stats.full, (unsigned long long) priv->delta.stats.patches,
+        (unsigned long long) priv->delta.stats.unchanged, (unsigned long long) priv->delta.stats.bytes_in,
+        (unsigned long long) priv->delta.stats.bytes_out));
+    delta_free(&priv->delta);
+    for (int i = 0; i < priv->report.num_jobs; i++) {
+        struct report_job *job = &priv->report.jobs[i];
+        MG_INFO(("report %s runs: %llu, skipped: %llu", job->name,
+            (unsigned long long) job->runs, (unsigned long long) job->skipped));
+    }
+    MG_INFO(("forward messages: %llu, fallbacks: %llu, bytes copied: %llu, allocs: %llu",
+        (unsigned long long) priv->fwd.stats.messages, (unsigned long long) priv->fwd.stats.fallbacks,
+        (unsigned long long) priv->fwd.stats.bytes_copied, (unsigned long long) priv->fwd.stats.allocs));
+    forward_free(&priv->fwd);
+    for (int i = 0; i < priv->num_sessions; i++) { //pending messages go to the queue before it closes
+        cloud_inflight_abort(priv->sessions[i]);
+        cloud_outq_abort(priv->sessions[i]);
+        cloud_batch_abort(priv->sessions[i]);
+    }
+    batch_stats_dump(&priv->batch_stats, priv->cfg.opts->batch_bytes);
+    outq_stats_dump(&priv->outq_stats);
+    inflight_stats_dump(&priv->inflight_stats);
+    if (priv->cloud_stats.mqtt5 || priv->cloud_stats.fallbacks)
+        MG_INFO(("cloud mqtt5 connections: %llu, fallbacks: %llu, aliased: %llu, alias saved: %llu bytes, responses: %llu",
+            (unsigned long long) priv->cloud_stats.mqtt5, (unsigned long long) priv->cloud_stats.fallbacks,
+            (unsigned long long) priv->cloud_stats.aliased, (unsigned long long) priv->cloud_stats.alias_saved,
+            (unsigned long long) priv->cloud_stats.responses));
+    if (priv->inflight_stats.published)
+        MG_INFO(("cloud window blocked: %llu, sessions resumed: %llu",
+            (unsigned long long) priv->cloud_stats.flow_blocked, (unsigned long long) priv->cloud_stats.sessions_resumed));
+    cbor_stats_dump(&priv->cbor_stats);
+    xfer_free(&priv->xfer); //spool files are unlinked, unfinished transfers are lost
+    xfer_stats_dump(&priv->xfer.stats);
+    mg_iobuf_free(&priv->deflate_buf);
+    mg_iobuf_free(&priv->cbor_up);
+    mg_iobuf_free(&priv->cbor_down);
+    queue_close(priv->queue);
+    priv->queue = NULL; //close handlers below check it
+    MG_INFO(("requests tracked: %llu, completed: %llu, timeouts: %llu, late: %llu, untracked: %llu",
+        (unsigned long long) priv->corr.stats.tracked, (unsigned long long) priv->corr.stats.completed,
+        (unsigned long long) priv->corr.stats.timeouts, (unsigned long long) priv->corr.stats.late,
+        (unsigned long long) priv->corr.stats.untracked));
+    corr_hist_dump(&priv->corr);
+    corr_free(&priv->corr);
+    cache_stats_dump(&priv->cache);
+    cache_free(&priv->cache);
+    for (int i = 0; i < priv->num_sessions; i++) {
+        route_stats_dump(&priv->sessions[i]->routes, i);
+        ka_probe_dump(&priv->sessions[i]->probe, i);
+    }
+    dns_free(&priv->dns);
+    if (local_is_unix(priv->cfg.opts->mqtt_serve_address))
+        local_stats_dump(&priv->local);
+    tls_stats_dump(&priv->tls.stats);
+    if (priv->reloads)
+        MG_INFO(("reloads: %llu, script changes: %llu", (unsigned long long) priv->reloads,
+            (unsigned long long) priv->watch.changes));
+    watch_free(&priv->watch);
+    mg_mgr_free(&priv->mgr); //close handlers still use sessions
+    tls_creds_free(&priv->tls);
+    local_unix_reset(&priv->local);
+    for (int i = 0; i < priv->num_sessions; i++) {
+        if (priv->sessions[i]->cfg)
+            cJSON_Delete(priv->sessions[i]->cfg);
+        batch_free(&priv->sessions[i]->batch);
+        outq_free(&priv->sessions[i]->outq);
+        inflight_free(&priv->sessions[i]->window);
+        tls_session_free(&priv->sessions[i]->tls_session);
+        route_free(&priv->sessions[i]->routes);
+        free(priv->sessions[i]);
+    }
+    free(priv->sessions);
     free(handle);
+    arena_stats_dump();
+    arena_exit();
 }
 
 int client_main(void *user_options) {
@@ -2,24 +2,37 @@
 #define __IOT_CLIENT_H__
 
 #include <iot/mongoose.h>
+#include "forward.h"
+#include "queue.h"
+#include "corr.h"
+#include "worker.h"
+#include "sched.h"
+#include "report.h"
+#include "delta.h"
+#include "batch.h"
+#include "outq.h"
+#include "inflight.h"
+#include "dns.h"
+#include "tls.h"
+#include "local.h"
+#include "metrics.h"
+#include "route.h"
+#include "cache.h"
+#include "arena.h"
+#include "cbor.h"
+#include "xfer.h"
+#include "keepalive.h"
+#include "watch.h"
 
 struct client_option {
 
     const char *mqtt_serve_address;      //mqtt 服务端口
     int mqtt_keepalive;                  //mqtt 保活间隔
 
-    const char *cloud_mqtt_client_id;    //cloud mqtt client id
-    const char *cloud_mqtt_serve_address;
-    const char *cloud_mqtt_username;
-    const char *cloud_mqtt_password;
-    const char *topic_sub;
-    const char *topic_pub;
-    int cloud_mqtt_keepalive;
-    int cloud_mqtt_qos;
-
     const char *cloud_mqtts_ca;
     const char *cloud_mqtts_cert;
     const char *cloud_mqtts_certkey;
+    const char *cloud_tls_session;       //file keeping the last tls session across restarts, NULL: memory only
 
     const char *dns4_url;
     int dns4_timeout;
@@ -28,6 +41,38 @@ struct client_option {
     const char *callback_lua;
     const char *module;
     const char *func;
+    int forward_mode;                    //FORWARD_MODE_RAW or FORWARD_MODE_PARSE
+
+    const char *queue_path;              //store-and-forward queue file, NULL: disabled
+    size_t queue_size;                   //queue file byte cap
+    size_t queue_max_records;            //0: no limit
+    int queue_drop_policy;               //QUEUE_DROP_OLDEST or QUEUE_DROP_NEWEST
+    int queue_drain_rate;                //records per second published after reconnect
+    int queue_sync_interval;             //ms between msync of queue file
+
+    int request_timeout;                 //ms to wait for iot-rpcd reply of a cloud request
+    int max_inflight;                    //cloud requests waiting for iot-rpcd, reading from cloud pauses at the cap
+
+    int lua_async;                       //run lua callbacks on a worker thread
+    int lua_timeout;                     //ms a lua callback may run, 0: no limit
+
+    int batch_window;                    //ms report replies wait for a batch, 0: no batching
+    size_t batch_bytes;                  //batch is sent when it reaches this size
+    size_t deflate_threshold;            //batches from this size are zlib compressed, 0: never
+
+    size_t send_high_water;              //cloud send buffer bytes above which messages wait in outq
+    size_t outq_bytes;                   //outq byte cap per session
+    int outq_drop_policy;                //OUTQ_DROP_OLDEST or OUTQ_DROP_NEWEST
+
+    int cloud_mqtt_version;              //4: mqtt 3.1.1, 5: mqtt 5 with fallback to 3.1.1
+    int inflight_window;                 //unacked qos 1/2 publishes per session
+
+    int reconnect_max;                   //ms cap of the cloud reconnect backoff
+
+    int metrics_interval;                //s between metrics snapshots on the local bus, 0: SIGUSR1 dump only
+
+    const char *xfer_dir;                //spool directory of chunked transfers
+    const char *keepalive_state;         //file of idle intervals found per network, NULL: memory only
 
 };
 
@@ -36,27 +81,173 @@ struct client_config {
     void *cloud_mqtt_cfg; //a cJSON object, cJSON_Delete it when it's no longer needed
 };
 
+// one cloud device identity, gateway mode has many of them on the same mg_mgr
+struct cloud_session {
+
+    struct mg_mgr *mgr;
+    int index;
+    void *cfg;                  //a cJSON object of this identity, owned by session
+
+    const char *address;
+    const char *client_id;
+    const char *user;
+    const char *password;
+    const char *topic_sub;      //first of the subscriptions
+    const char *topic_pub;
+    int qos;
+    int keepalive;
+    int encoding;               //CLOUD_ENCODING_* of payloads on the cloud side
+    struct xfer_cfg xfer;       //large replies in chunks, chunk 0: in one publish
+
+    char reply_topic[40];       //iot-rpcd replies to this topic, routes responses back to the session
+    struct route_table routes;  //cloud topic -> iot-rpcd module/func, empty: all to the default one
+
+    struct batch batch;         //report replies waiting to be published together
+    struct outq outq;           //messages waiting for the send buffer to drain
+    struct queue_cursor queue_cur;  //next record of this identity in the store-and-forward queue
+    int queue_pending;          //records of this identity may be queued, replies go behind them
+
+    struct mg_connection *conn;
+    uint64_t tx_active;         //last write on conn, the broker heard from us
+    uint64_t rx_active;         //last read on conn, any packet proves the link is up
+    uint64_t ping_wait;         //PINGREQ sent and nothing read since, 0: none
+    uint32_t ping_interval;     //s of idle link the pending ping probes, 0: keepalive ping
+    struct ka_probe probe;      //idle interval search, network empty: ping every keepalive
+
+    int version;                //mqtt version of the next connect
+    int version_ok;             //broker accepted version, no more fallback
+    int connect_sent;           //CONNECT of conn left the send buffer, past tcp and tls
+    int connack;                //return code of the CONNACK on conn, -1: none yet
+    int stage;                  //CLOUD_STAGE_* of conn
+    uint16_t alias_max;         //mqtt5 broker topic alias maximum, 0: no alias
+    int alias_set;              //topic_pub alias sent on conn, later publishes carry an empty topic
+    uint16_t receive_max;       //mqtt5 broker receive maximum, 0: no limit
+    uint8_t max_qos;            //mqtt5 broker maximum qos
+    struct inflight window;     //qos > 0 publishes not acked, resent after reconnect
+
+    uint64_t retry_due;         //next connect attempt not before, jittered backoff
+    int retry_attempts;         //connects since the last stable connection
+    uint64_t opened_at;         //MG_EV_MQTT_OPEN of conn, 0: not open
+    int by_cache;               //conn was started on a cached broker address
+    uint64_t connect_at;        //last connect attempt
+    void *tls_session;          //SSL_SESSION of the last handshake with this broker, NULL: none
+    uint64_t tls_started;       //tls handshake of conn started, 0: not in handshake
+
+    int enabled;                //still present in config
+    int registered;
+    uint64_t disconnected_check_times;
+
+};
+
+enum {
+    CLOUD_STAGE_CONNECTING,     //resolving or tcp connect
+    CLOUD_STAGE_CONNECTED,      //transport up, waiting for CONNACK
+    CLOUD_STAGE_OPEN,           //MG_EV_MQTT_OPEN
+};
+
+enum {
+    CLOUD_ENCODING_JSON,        //payloads as iot-rpcd sends them
+    CLOUD_ENCODING_CBOR,        //json sent as cbor, cbor requests forwarded as json
+};
+
+struct cloud_mqtt_stats {
+    uint64_t mqtt5;             //connections opened with mqtt 5
+    uint64_t fallbacks;         //mqtt 5 refused, next connect with 3.1.1
+    uint64_t aliased;           //publishes with an empty topic and topic alias
+    uint64_t alias_saved;       //topic bytes not sent thanks to aliases
+    uint64_t responses;         //replies to an mqtt5 response topic
+    uint64_t flow_blocked;      //publishes held back by the in-flight window
+    uint64_t sessions_resumed;  //CONNACK with session present
+};
+
+// scheduler tasks of the event loop
+enum {
+    TASK_MQTT,      //local mqtt connect and ping
+    TASK_CLOUD,     //cloud config, connect and ping
+    TASK_REPORT,    //gen_request
+    TASK_CORR,      //request timeouts, while requests are in flight
+    TASK_QUEUE,     //queue msync and drain
+    TASK_WORKER,    //lua job deadlines
+    TASK_BATCH,     //batch windows
+    TASK_METRICS,   //metrics snapshot on the local bus
+    TASK_XFER,      //transfer ack timeouts, while transfers are in progress
+};
+
 struct client_private {
 
     struct client_config cfg;
 
     struct mg_mgr mgr;
 
-    struct mg_connection *mqtt_conn;
+    struct sched sched;
+
+    struct mg_connection *mqtt_conn;   //local channel to iot-rpcd, mqtt broker or unix socket
+    uint64_t mqtt_connect_at;   //last local mqtt connect attempt
     uint64_t ping_active;
     uint64_t pong_active;
-
-    struct mg_connection *cloud_mqtt_conn;
-    uint64_t cloud_ping_active;
-    uint64_t cloud_pong_active;
+    struct local_unix local;    //frames of the unix socket channel
+
+    struct cloud_session **sessions;    //sessions[0] is the primary identity, reports go to it
+    int num_sessions;
+    uint64_t disconnected_check_times;  //no cloud config loaded yet
+    uint64_t cloud_check_due;           //next disconnected event check while a session is down
+    uint64_t config_due;                //get_config failed, next reload not before
+    int config_attempts;                //get_config failures in a row
+    int config_pending;                 //get_config posted, not returned yet
+    int config_reload;                  //get_config wanted for connected sessions, SIGHUP or script changed
+    uint64_t reloads;
+    struct watch watch;                 //callback_lua changes
+    struct dns_cache dns;               //broker addresses resolved ahead of reconnects
+    struct tls_creds tls;               //cloud mqtts credentials, parsed once
+    struct ka_store ka;                 //idle intervals of adaptive keepalive per network
 
     char client_id[21]; //id len 20 + 0
 
-    int registered;
-    uint64_t disconnected_check_times;
+    struct report_sched report; //gen_request jobs from get_schedule
+    int report_stale;           //get_schedule again, primary identity (re)connected
+    int report_loading;         //get_schedule posted, not returned yet
+    struct delta_ctx delta;     //last published document of delta report jobs
+
+    struct batch_stats batch_stats;
+    struct mg_iobuf deflate_buf;    //compressed batch, reused
+
+    struct outq_stats outq_stats;
+    struct cloud_mqtt_stats cloud_stats;
+    struct inflight_stats inflight_stats;
+
+    struct cbor_stats cbor_stats;
+    struct mg_iobuf cbor_up;    //json to cbor of a publish, reused
+    struct mg_iobuf cbor_down;  //cbor to json of a request, reused
+
+    struct xfer_table xfer;     //large replies sent in chunks
+
+    struct metrics metrics;     //event loop counters and histograms, the worker has its own
+    uint64_t started;           //ms, uptime of snapshots
+
+    struct forward_ctx fwd; //cloud -> iot-rpcd envelope builder
+
+    struct corr_table corr; //in-flight cloud requests
+    struct cache cache;     //replies of read-only cloud queries, rules from the primary identity
+    int flow_paused;        //cloud connections stopped reading, corr is full
+
+    struct queue *queue;    //uplink store-and-forward queue, NULL: disabled
+    int queue_drain_budget;
+    int queue_drain_from;   //session the next drain starts with, each gets its turn
+    uint64_t queue_synced;  //last msync time
+
+    struct lua_vm lua;          //lua vm of the event loop, unused when worker runs the callbacks
+    struct worker *worker;      //lua worker thread, NULL: callbacks run on the event loop
 
 };
 
+int client_init(void **priv, void *opts);
+void client_exit(void *handle);
 int client_main(void *user_options);
+struct cloud_session *client_session_by_topic(struct client_private *priv, struct mg_str topic);
+struct cloud_session *client_session_by_id(struct client_private *priv, struct mg_str client_id);
+void client_flow_update(struct client_private *priv);
+void client_poll(struct client_private *priv, int max_ms);
+void client_metrics_dump(struct client_private *priv);
+void client_reload(struct client_private *priv);
 
 #endif //__IOT_CLIENT_H__
\ No newline at end of file
@@ -0,0 +1,304 @@
+#include <iot/mongoose.h>
+#include "corr.h"
+
+static uint32_t corr_hash(uint32_t id) {
+    return id * 2654435761u;
+}
+
+int corr_init(struct corr_table *t, int cap, int timeout_ms) {
+    uint32_t size = 16;
+
+    memset(t, 0, sizeof(*t));
+
+    if (cap < 1)
+        cap = 1;
+    while (size < (uint32_t) cap * 2)
+        size <<= 1;
+
+    t->pool = calloc(cap, sizeof(struct corr_entry));
+    t->index = malloc(size * sizeof(int32_t));
+    if (!t->pool || !t->index) {
+        corr_free(t);
+        return -1;
+    }
+
+    t->cap = cap;
+    t->index_mask = size - 1;
+    t->timeout_ms = timeout_ms;
+    memset(t->index, 0xff, size * sizeof(int32_t));
+    for (int i = 0; i < CORR_WHEEL_SLOTS; i++)
+        t->wheel[i] = -1;
+
+    for (int i = 0; i < cap; i++)
+        t->pool[i].next = i + 1 < cap ? i + 1 : -1;
+    t->free_head = 0;
+
+    return 0;
+}
+
+void corr_free(struct corr_table *t) {
+    free(t->pool);
+    free(t->index);
+    t->pool = NULL;
+    t->index = NULL;
+}
+
+static uint32_t corr_index_find(struct corr_table *t, uint32_t id) {
+    uint32_t i = corr_hash(id) & t->index_mask;
+    while (t->index[i] >= 0 && t->pool[t->index[i]].id != id)
+        i = (i + 1) & t->index_mask;
+    return i;
+}
+
+static void corr_index_del(struct corr_table *t, uint32_t i) {
+    //backward shift deletion, keep probe chains without tombstones
+    uint32_t j = i;
+    t->index[i] = -1;
+    for (;;) {
+        j = (j + 1) & t->index_mask;
+        if (t->index[j] < 0)
+            return;
+        uint32_t k = corr_hash(t->pool[t->index[j]].id) & t->index_mask;
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        t->index[i] = t->index[j];
+        t->index[j] = -1;
+        i = j;
+    }
+}
+
+static void corr_wheel_add(struct corr_table *t, int32_t idx) {
+    struct corr_entry *e = &t->pool[idx];
+    int32_t *head = &t->wheel[e->expire_tick % CORR_WHEEL_SLOTS];
+    e->prev = -1;
+    e->next = *head;
+    if (*head >= 0)
+        t->pool[*head].prev = idx;
+    *head = idx;
+}
+
+static void corr_wheel_del(struct corr_table *t, int32_t idx) {
+    struct corr_entry *e = &t->pool[idx];
+    if (e->prev >= 0)
+        t->pool[e->prev].next = e->next;
+    else
+        t->wheel[e->expire_tick % CORR_WHEEL_SLOTS] = e->next;
+    if (e->next >= 0)
+        t->pool[e->next].prev = e->prev;
+}
+
+static void corr_release(struct corr_table *t, int32_t idx) {
+    struct corr_entry *e = &t->pool[idx];
+
+    corr_wheel_del(t, idx);
+    corr_index_del(t, corr_index_find(t, e->id));
+    e->id = 0;
+    e->next = t->free_head;
+    t->free_head = idx;
+    t->inflight--;
+}
+
+static int corr_method(struct corr_table *t, struct mg_str method) {
+    char name[CORR_NAME_LEN];
+    int fits = method.len < sizeof(name);
+
+    for (size_t i = 0; fits && i < method.len; i++) { //names go into json as they are
+        char c = method.ptr[i];
+        name[i] = c == '"' || c == '\\' || (uint8_t) c < 0x20 ? '_' : c;
+    }
+    if (fits)
+        name[method.len] = '\0';
+
+    for (int i = 0; fits && i < t->num_methods; i++) {
+        if (strcmp(t->hist[i].name, name) == 0)
+            return i;
+    }
+    if (fits && t->num_methods < CORR_METHODS_MAX - 1) {
+        memcpy(t->hist[t->num_methods].name, name, method.len + 1);
+        return t->num_methods++;
+    }
+    //the last slot is kept for long names and methods beyond the named ones
+    if (t->hist[CORR_METHODS_MAX - 1].name[0] == '\0')
+        mg_snprintf(t->hist[CORR_METHODS_MAX - 1].name, sizeof(t->hist[0].name), "%s", "other");
+    return CORR_METHODS_MAX - 1;
+}
+
+// named slots, then "other" once it has samples
+static struct corr_hist *corr_hist_at(struct corr_table *t, int i) {
+    if (i < t->num_methods)
+        return &t->hist[i];
+    if (i == t->num_methods && (t->hist[CORR_METHODS_MAX - 1].count || t->hist[CORR_METHODS_MAX - 1].timeouts))
+        return &t->hist[CORR_METHODS_MAX - 1];
+    return NULL;
+}
+
+static void corr_hist_add(struct corr_hist *h, uint64_t ms) {
+    int b = 0;
+    while (b < CORR_HIST_BUCKETS - 1 && ms >= (1ULL << b))
+        b++;
+    h->buckets[b]++;
+    h->count++;
+    h->sum_ms += ms;
+    if (ms > h->max_ms)
+        h->max_ms = ms > UINT32_MAX ? UINT32_MAX : (uint32_t) ms;
+}
+
+uint32_t corr_add(struct corr_table *t, int session, struct mg_str method, struct mg_str topic,
+    struct mg_str key, int flags, uint64_t now) {
+    uint32_t id;
+
+    if (t->free_head < 0) {
+        t->stats.untracked++;
+        return 0;
+    }
+
+    if (t->tick_ms == 0)
+        t->tick_ms = now;
+
+    do { //skip 0 and ids still in flight after wrap around
+        id = ++t->next_id;
+    } while (id == 0 || t->index[corr_index_find(t, id)] >= 0);
+
+    int32_t idx = t->free_head;
+    struct corr_entry *e = &t->pool[idx];
+    t->free_head = e->next;
+
+    e->id = id;
+    e->session = (int16_t) session;
+    e->method = (int16_t) corr_method(t, method);
+    e->flags = flags;
+    e->sent = now;
+    e->expire_tick = t->tick + (uint32_t) ((now > t->tick_ms ? now - t->tick_ms : 0) / CORR_TICK_MS) +
+        (uint32_t) ((t->timeout_ms + CORR_TICK_MS - 1) / CORR_TICK_MS);
+    mg_snprintf(e->topic, sizeof(e->topic), "%.*s", (int) topic.len, topic.ptr);
+    mg_snprintf(e->key, sizeof(e->key), "%.*s", (int) key.len, key.ptr ? key.ptr : "");
+    e->resp_topic[0] = '\0';
+    e->cdata_len = 0;
+
+    corr_wheel_add(t, idx);
+    t->index[corr_index_find(t, id)] = idx;
+    t->inflight++;
+    t->stats.tracked++;
+
+    return id;
+}
+
+int corr_set_response(struct corr_table *t, uint32_t id, struct mg_str resp_topic, struct mg_str cdata) {
+    int32_t idx = id ? t->index[corr_index_find(t, id)] : -1;
+
+    if (idx < 0 || resp_topic.len >= CORR_RESP_TOPIC_LEN || cdata.len > CORR_CDATA_LEN)
+        return -1;
+
+    struct corr_entry *e = &t->pool[idx];
+    memcpy(e->resp_topic, resp_topic.ptr, resp_topic.len);
+    e->resp_topic[resp_topic.len] = '\0';
+    if (cdata.len)
+        memcpy(e->cdata, cdata.ptr, cdata.len);
+    e->cdata_len = (uint8_t) cdata.len;
+    return 0;
+}
+
+void corr_forget(struct corr_table *t, int session) {
+    for (int i = 0; i < t->cap; i++) {
+        if (t->pool[i].id && t->pool[i].session == session)
+            t->pool[i].session = -1;
+    }
+}
+
+int corr_complete(struct corr_table *t, uint32_t id, uint64_t now, struct corr_entry *e) {
+    uint32_t i = corr_index_find(t, id);
+    int32_t idx = t->index[i];
+
+    if (id == 0 || idx < 0) {
+        t->stats.late++;
+        return -1;
+    }
+
+    *e = t->pool[idx];
+    corr_hist_add(&t->hist[e->method], now > e->sent ? now - e->sent : 0);
+    corr_release(t, idx);
+    t->stats.completed++;
+    return 0;
+}
+
+void corr_expire(struct corr_table *t, uint64_t now, corr_expire_fn fn, void *arg) {
+
+    if (t->tick_ms == 0 || now < t->tick_ms) {
+        t->tick_ms = now;
+        return;
+    }
+
+    uint64_t ticks = (now - t->tick_ms) / CORR_TICK_MS;
+    if (ticks > CORR_WHEEL_SLOTS) { //stalled, one lap of the wheel visits every entry
+        t->tick += (uint32_t) (ticks - CORR_WHEEL_SLOTS);
+        t->tick_ms += (ticks - CORR_WHEEL_SLOTS) * CORR_TICK_MS;
+    }
+
+    while (now - t->tick_ms >= CORR_TICK_MS) {
+        t->tick++;
+        t->tick_ms += CORR_TICK_MS;
+
+        int32_t idx = t->wheel[t->tick % CORR_WHEEL_SLOTS];
+        while (idx >= 0) {
+            struct corr_entry *e = &t->pool[idx];
+            int32_t next = e->next;
+            if ((int32_t) (e->expire_tick - t->tick) <= 0) {
+                if (fn)
+                    fn(e, arg);
+                t->hist[e->method].timeouts++;
+                t->stats.timeouts++;
+                corr_release(t, idx);
+            }
+            idx = next;
+        }
+    }
+}
+
+uint32_t corr_id_from_topic(struct mg_str topic) {
+    uint32_t id = 0;
+    size_t i = topic.len;
+
+    while (i > 0 && topic.ptr[i - 1] != ':') {
+        if (!isdigit((unsigned char) topic.ptr[i - 1]))
+            return 0;
+        i--;
+    }
+    if (i == 0 || i == topic.len)
+        return 0;
+    for (; i < topic.len; i++)
+        id = id * 10 + (uint32_t) (topic.ptr[i] - '0');
+    return id;
+}
+
+size_t corr_hist_json(struct corr_table *t, char *buf, size_t len) {
+    size_t ofs = 0;
+
+#define OUT(...) do { if (ofs < len) ofs += mg_snprintf(buf + ofs, len - ofs, __VA_ARGS__); } while (0)
+    OUT("\"methods\":{");
+    struct corr_hist *h;
+    for (int i = 0; (h = corr_hist_at(t, i)) != NULL; i++) {
+        OUT("%s\"%s\":{\"count\":%llu,\"timeouts\":%llu,\"avg\":%llu,\"max\":%lu,\"buckets\":[", i ? "," : "",
+            h->name, (unsigned long long) h->count, (unsigned long long) h->timeouts,
+            (unsigned long long) (h->count ? h->sum_ms / h->count : 0), (unsigned long) h->max_ms);
+        for (int b = 0; b < CORR_HIST_BUCKETS; b++)
+            OUT("%s%lu", b ? "," : "", (unsigned long) h->buckets[b]);
+        OUT("]}");
+    }
+    OUT("}");
+#undef OUT
+
+    return ofs < len ? ofs : 0;
+}
+
+void corr_hist_dump(struct corr_table *t) {
+    struct corr_hist *h;
+    for (int i = 0; (h = corr_hist_at(t, i)) != NULL; i++) {
+        char buckets[CORR_HIST_BUCKETS * 11];
+        size_t ofs = 0;
+        for (int b = 0; b < CORR_HIST_BUCKETS; b++)
+            ofs += mg_snprintf(buckets + ofs, sizeof(buckets) - ofs, "%s%lu", b ? " " : "", (unsigned long) h->buckets[b]);
+        MG_INFO(("method %s: count %llu, timeouts %llu, avg %llu ms, max %lu ms, buckets <1ms..>=32768ms: %s", h->name,
+            (unsigned long long) h->count, (unsigned long long) h->timeouts,
+            (unsigned long long) (h->count ? h->sum_ms / h->count : 0), (unsigned long) h->max_ms, buckets));
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef __IOT_CORR_H__
+#define __IOT_CORR_H__
+
+#include <iot/mongoose.h>
+
+#define CORR_TICK_MS        100     //timer wheel granularity
+#define CORR_WHEEL_SLOTS    256
+#define CORR_HIST_BUCKETS   17      //latency buckets, <1ms, <2ms, <4ms ... >=32768ms
+#define CORR_METHODS_MAX    32      //histogram slots, the last one is "other" for the rest
+#define CORR_NAME_LEN       64      //method, or method:object.method of a ubus style param
+#define CORR_TOPIC_LEN      64
+#define CORR_KEY_LEN        32      //report job name
+#define CORR_RESP_TOPIC_LEN 96      //mqtt5 response topic
+#define CORR_CDATA_LEN      32      //mqtt5 correlation data
+
+#define CORR_F_REPORT       1       //timer report, no timeout reply to cloud
+
+struct corr_entry {
+    uint32_t id;            //0: free
+    int16_t session;        //-1: identity of the request is gone
+    int16_t method;         //histogram slot
+    int flags;
+    uint64_t sent;          //ms
+    uint32_t expire_tick;
+    int32_t prev;           //timer wheel slot list, or free list
+    int32_t next;
+    char topic[CORR_TOPIC_LEN]; //cloud topic of the request, truncated
+    char key[CORR_KEY_LEN];     //report job of a CORR_F_REPORT request, empty: none
+    char resp_topic[CORR_RESP_TOPIC_LEN]; //mqtt5 request, reply goes here, empty: topic_pub
+    uint8_t cdata[CORR_CDATA_LEN];        //mqtt5 correlation data echoed in the reply
+    uint8_t cdata_len;
+};
+
+struct corr_hist {
+    char name[CORR_NAME_LEN];
+    uint64_t count;
+    uint64_t timeouts;
+    uint64_t sum_ms;
+    uint32_t max_ms;
+    uint32_t buckets[CORR_HIST_BUCKETS];
+};
+
+struct corr_stats {
+    uint64_t tracked;
+    uint64_t completed;
+    uint64_t timeouts;
+    uint64_t late;          //reply after timeout, or unknown id
+    uint64_t untracked;     //table full, forwarded without id
+};
+
+/*
+ * in-flight cloud requests: entries live in a fixed pool, found by id through an
+ * open-addressing index, expired by a hashed timer wheel.
+ */
+struct corr_table {
+    struct corr_entry *pool;
+    int cap;                //max in-flight requests
+    int inflight;
+    int32_t free_head;
+
+    int32_t *index;         //pool index, -1: empty
+    uint32_t index_mask;
+
+    int32_t wheel[CORR_WHEEL_SLOTS];
+    uint32_t tick;
+    uint64_t tick_ms;
+    int timeout_ms;
+
+    uint32_t next_id;
+
+    struct corr_hist hist[CORR_METHODS_MAX];
+    int num_methods;
+
+    struct corr_stats stats;
+};
+
+typedef void (*corr_expire_fn)(struct corr_entry *e, void *arg);
+
+int corr_init(struct corr_table *t, int cap, int timeout_ms);
+void corr_free(struct corr_table *t);
+
+//track a request under histogram name method, return its id, 0: table full
+uint32_t corr_add(struct corr_table *t, int session, struct mg_str method, struct mg_str topic,
+    struct mg_str key, int flags, uint64_t now);
+//mqtt5 response topic and correlation data of request id, -1: not found or too long
+int corr_set_response(struct corr_table *t, uint32_t id, struct mg_str resp_topic, struct mg_str cdata);
+//reply received, 0: request found and removed, e is a copy of it
+int corr_complete(struct corr_table *t, uint32_t id, uint64_t now, struct corr_entry *e);
+//session serves another identity now, replies of its requests in flight go nowhere
+void corr_forget(struct corr_table *t, int session);
+//expire timed out requests, fn is called before an entry is removed
+void corr_expire(struct corr_table *t, uint64_t now, corr_expire_fn fn, void *arg);
+
+//correlation id of reply topic <reply_topic>:<id>, 0: none
+uint32_t corr_id_from_topic(struct mg_str topic);
+
+//histograms as json members "methods":{name:{count,timeouts,avg,max,buckets}}, 0: buf too small
+size_t corr_hist_json(struct corr_table *t, char *buf, size_t len);
+void corr_hist_dump(struct corr_table *t);
+
+#endif
@@ -0,0 +1,203 @@
+#include <iot/mongoose.h>
+#include <iot/cJSON.h>
+#include <iot/iot.h>
+#include "delta.h"
+
+//merge patch drops null members of objects, arrays are replaced as they are
+static int has_null_member(const cJSON *item) {
+    const cJSON *child;
+    if (!cJSON_IsObject(item))
+        return 0;
+    cJSON_ArrayForEach(child, item) {
+        if (cJSON_IsNull(child) || has_null_member(child))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * merge patch turning from into to, NULL: equal. a null member in to can not be
+ * expressed by RFC 7386, *full is set and the caller sends a snapshot.
+ */
+static cJSON *merge_diff(const cJSON *from, const cJSON *to, int *full) {
+    const cJSON *child;
+
+    if (!cJSON_IsObject(from) || !cJSON_IsObject(to)) {
+        if (cJSON_Compare(from, to, true))
+            return NULL;
+        if (has_null_member(to))
+            *full = 1;
+        return cJSON_Duplicate(to, true);
+    }
+
+    cJSON *patch = cJSON_CreateObject();
+
+    cJSON_ArrayForEach(child, from) { //removed members
+        if (!cJSON_GetObjectItemCaseSensitive(to, child->string))
+            cJSON_AddNullToObject(patch, child->string);
+    }
+
+    cJSON_ArrayForEach(child, to) {
+        const cJSON *old = cJSON_GetObjectItemCaseSensitive(from, child->string);
+        cJSON *sub;
+        if (cJSON_IsNull(child)) {
+            if (!cJSON_IsNull(old))
+                *full = 1;
+            continue;
+        }
+        if (!old) {
+            if (has_null_member(child))
+                *full = 1;
+            sub = cJSON_Duplicate(child, true);
+        } else {
+            sub = merge_diff(old, child, full);
+        }
+        if (sub)
+            cJSON_AddItemToObject(patch, child->string, sub);
+    }
+
+    if (!patch->child) {
+        cJSON_Delete(patch);
+        return NULL;
+    }
+    return patch;
+}
+
+static struct delta_entry *delta_entry_get(struct delta_ctx *d, int session, const char *key) {
+    for (int i = 0; i < d->num_entries; i++) {
+        if (d->entries[i].session == session && strcmp(d->entries[i].key, key) == 0)
+            return &d->entries[i];
+    }
+
+    if (d->num_entries == d->size) {
+        int size = d->size ? d->size * 2 : 8;
+        struct delta_entry *entries = realloc(d->entries, size * sizeof(struct delta_entry));
+        if (!entries)
+            return NULL;
+        d->entries = entries;
+        d->size = size;
+    }
+
+    struct delta_entry *e = &d->entries[d->num_entries++];
+    memset(e, 0, sizeof(*e));
+    e->session = session;
+    mg_snprintf(e->key, sizeof(e->key), "%s", key);
+    return e;
+}
+
+static char *delta_envelope(const char *key, const char *type, uint32_t seq, cJSON *data) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "report", key);
+    cJSON_AddStringToObject(root, "delta", type);
+    cJSON_AddNumberToObject(root, "seq", seq);
+    cJSON_AddItemReferenceToObject(root, FIELD_DATA, data);
+    char *printed = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return printed;
+}
+
+int delta_encode(struct delta_ctx *d, int session, const char *key, int full_every, struct mg_str data, char **out) {
+    cJSON *doc = cJSON_ParseWithLength(data.ptr, data.len);
+    struct delta_entry *e;
+    char *printed = NULL;
+    int ret = DELTA_FULL;
+
+    *out = NULL;
+    if (!doc)
+        return -1;
+
+    if ((e = delta_entry_get(d, session, key)) == NULL) {
+        cJSON_Delete(doc);
+        return -1;
+    }
+
+    d->stats.bytes_in += data.len;
+
+    if (e->doc && (full_every <= 0 || e->since_full + 1 < (uint32_t) full_every)) {
+        int full = 0;
+        cJSON *patch = merge_diff((cJSON *)e->doc, doc, &full);
+
+        if (!patch) {
+            d->stats.unchanged++;
+            cJSON_Delete(doc);
+            return DELTA_UNCHANGED;
+        }
+
+        if (!full) {
+            printed = delta_envelope(key, "patch", e->seq + 1, patch);
+            ret = DELTA_PATCH;
+        }
+        cJSON_Delete(patch);
+    }
+
+    if (printed && ret == DELTA_PATCH && strlen(printed) >= data.len) { //patch saves nothing
+        cJSON_free(printed);
+        printed = NULL;
+    }
+
+    if (!printed) {
+        printed = delta_envelope(key, "full", e->seq + 1, doc);
+        ret = DELTA_FULL;
+    }
+
+    if (!printed) {
+        cJSON_Delete(doc);
+        return -1;
+    }
+
+    delta_commit(d, 0); //a pending one not committed is dropped
+    d->pending = (int) (e - d->entries);
+    d->pending_doc = doc;
+    d->pending_type = ret;
+    d->pending_bytes = strlen(printed);
+
+    *out = printed;
+    return ret;
+}
+
+void delta_commit(struct delta_ctx *d, int ok) {
+    struct delta_entry *e;
+
+    if (!d->pending_doc)
+        return;
+    e = &d->entries[d->pending];
+    if (ok) {
+        e->seq++;
+        if (d->pending_type == DELTA_FULL) {
+            e->since_full = 0;
+            d->stats.full++;
+        } else {
+            e->since_full++;
+            d->stats.patches++;
+        }
+        d->stats.bytes_out += d->pending_bytes;
+        if (e->doc)
+            cJSON_Delete((cJSON *)e->doc);
+        e->doc = d->pending_doc;
+    } else {
+        cJSON_Delete((cJSON *)d->pending_doc);
+    }
+    d->pending_doc = NULL;
+}
+
+void delta_reset(struct delta_ctx *d, int session) {
+    if (d->pending_doc && d->entries[d->pending].session == session)
+        delta_commit(d, 0);
+    for (int i = 0; i < d->num_entries; i++) {
+        struct delta_entry *e = &d->entries[i];
+        if (e->session == session && e->doc) {
+            cJSON_Delete((cJSON *)e->doc);
+            e->doc = NULL;
+        }
+    }
+}
+
+void delta_free(struct delta_ctx *d) {
+    delta_commit(d, 0);
+    for (int i = 0; i < d->num_entries; i++) {
+        if (d->entries[i].doc)
+            cJSON_Delete((cJSON *)d->entries[i].doc);
+    }
+    free(d->entries);
+    memset(d, 0, sizeof(*d));
+}
@@ -0,0 +1,54 @@
+#ifndef __IOT_DELTA_H__
+#define __IOT_DELTA_H__
+
+#include <iot/mongoose.h>
+
+#define DELTA_KEY_LEN 32
+
+#define DELTA_FULL      0   //publish out, a full snapshot
+#define DELTA_PATCH     1   //publish out, a merge patch
+#define DELTA_UNCHANGED 2   //nothing changed, publish nothing
+
+struct delta_entry {
+    int session;
+    char key[DELTA_KEY_LEN];
+    void *doc;              //a cJSON, last document published for key
+    uint32_t seq;           //messages published for key
+    uint32_t since_full;    //patches since the last full snapshot
+};
+
+struct delta_stats {
+    uint64_t full;
+    uint64_t patches;
+    uint64_t unchanged;
+    uint64_t bytes_in;      //reply bytes from iot-rpcd
+    uint64_t bytes_out;     //bytes published
+};
+
+// last published report per session and key, RFC 7386 merge patches against it
+struct delta_ctx {
+    struct delta_entry *entries;
+    int num_entries;
+    int size;
+    int pending;            //entry of pending_doc
+    void *pending_doc;      //doc of the last delta_encode, becomes the entry doc on delta_commit, NULL: none
+    int pending_type;       //DELTA_FULL or DELTA_PATCH
+    size_t pending_bytes;
+    struct delta_stats stats;
+};
+
+void delta_free(struct delta_ctx *d);
+//next report of session is a full snapshot, e.g. after reconnect
+void delta_reset(struct delta_ctx *d, int session);
+
+/*
+ * encode report data of key into an envelope {"report":key,"delta":"full"|"patch","seq":n,"data":...},
+ * full every full_every reports or when the patch is not smaller. *out must free by cJSON_free.
+ * the entry is left as it was until delta_commit.
+ * return DELTA_FULL, DELTA_PATCH, DELTA_UNCHANGED, -1: data is not json, publish it as is
+ */
+int delta_encode(struct delta_ctx *d, int session, const char *key, int full_every, struct mg_str data, char **out);
+//out of the last delta_encode was published or queued (ok), or dropped: the next one encodes against the old doc
+void delta_commit(struct delta_ctx *d, int ok);
+
+#endif
@@ -0,0 +1,234 @@
+#include <iot/mongoose.h>
+#include "dns.h"
+
+static struct dns_entry *dns_find(struct dns_cache *d, struct mg_str host) {
+    if (host.len == 0 || host.len >= DNS_HOST_LEN)
+        return NULL;
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        struct dns_entry *e = &d->entries[i];
+        if (strlen(e->host) == host.len && memcmp(e->host, host.ptr, host.len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+// free entry, or the one which expires first
+static struct dns_entry *dns_slot(struct dns_cache *d, struct mg_str host) {
+    struct dns_entry *victim = NULL;
+
+    if (host.len == 0 || host.len >= DNS_HOST_LEN)
+        return NULL;
+    for (int i = 0; i < DNS_CACHE_SIZE; i++) {
+        struct dns_entry *e = &d->entries[i];
+        if (!e->host[0]) {
+            victim = e;
+            break;
+        }
+        if (!e->queried && (!victim || e->expires < victim->expires))
+            victim = e;
+    }
+    if (victim) {
+        memset(victim, 0, sizeof(*victim));
+        memcpy(victim->host, host.ptr, host.len);
+    }
+    return victim;
+}
+
+static size_t dns_skip_name(const uint8_t *buf, size_t len, size_t ofs) {
+    while (ofs < len) {
+        uint8_t n = buf[ofs];
+        if (n == 0)
+            return ofs + 1;
+        if ((n & 0xc0) == 0xc0) //compression pointer ends the name
+            return ofs + 2;
+        ofs += 1 + n;
+    }
+    return 0;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+// question at ofs is host, type A, class IN, return the offset after it, 0: not our question
+static size_t dns_question(const uint8_t *buf, size_t len, size_t ofs, const char *host) {
+    size_t h = 0, hlen = strlen(host);
+
+    if (hlen > 0 && host[hlen - 1] == '.') //root label, sent as the end of the name
+        hlen--;
+
+    while (ofs < len && buf[ofs] != 0) {
+        uint8_t n = buf[ofs++];
+        if (h > 0 && (h >= hlen || host[h++] != '.'))
+            return 0;
+        if ((n & 0xc0) || ofs + n > len || h + n > hlen) //no compression in the question we sent
+            return 0;
+        for (uint8_t i = 0; i < n; i++, h++) {
+            if (tolower(buf[ofs + i]) != tolower((unsigned char) host[h]))
+                return 0;
+        }
+        ofs += n;
+    }
+    if (ofs + 5 > len || h != hlen || get_u16(buf + ofs + 1) != 1 || get_u16(buf + ofs + 3) != 1)
+        return 0;
+    return ofs + 5;
+}
+
+// first A record, ttl is the lowest of the answers up to it (cname chain)
+static void dns_answer(struct dns_cache *d, const uint8_t *buf, size_t len) {
+    struct dns_entry *e = NULL;
+    uint64_t now = mg_millis();
+    uint32_t ttl = DNS_TTL_MAX, ip = 0;
+    size_t ofs = 0;
+
+    //a response (qr) to a standard query (opcode 0) repeating the one question of a query
+    //in flight with its id, anything else is stray or forged and the query stays in flight
+    if (len >= 12 && (buf[2] & 0x80) && (buf[2] & 0x78) == 0 && get_u16(buf + 4) == 1) {
+        for (int i = 0; i < DNS_CACHE_SIZE && !e; i++) {
+            struct dns_entry *q = &d->entries[i];
+            if (q->queried && q->txid == get_u16(buf) && (ofs = dns_question(buf, len, 12, q->host)) != 0)
+                e = q;
+        }
+    }
+    if (!e) {
+        d->stats.rejected++;
+        return;
+    }
+
+    uint16_t an = get_u16(buf + 6);
+    if ((buf[3] & 0x0f) == 0) { //rcode
+        for (int i = 0; i < an && ofs && ofs + 10 <= len; i++) {
+            if ((ofs = dns_skip_name(buf, len, ofs)) == 0 || ofs + 10 > len)
+                break;
+            uint16_t type = get_u16(buf + ofs), rdlen = get_u16(buf + ofs + 8);
+            uint32_t rr_ttl = ((uint32_t) get_u16(buf + ofs + 4) << 16) | get_u16(buf + ofs + 6);
+            if (ofs + 10 + rdlen > len)
+                break;
+            if (rr_ttl < ttl)
+                ttl = rr_ttl;
+            if (type == 1 && rdlen == 4) {
+                memcpy(&ip, buf + ofs + 10, 4);
+                break;
+            }
+            ofs += 10 + rdlen;
+        }
+    }
+
+    e->queried = 0;
+    e->ip = ip;
+    if (ip) {
+        if (ttl < DNS_TTL_MIN)
+            ttl = DNS_TTL_MIN;
+        e->expires = now + (uint64_t) ttl * 1000;
+        d->stats.answers++;
+        MG_INFO(("dns %s: %d.%d.%d.%d, ttl %lu s", e->host, ((uint8_t *) &ip)[0], ((uint8_t *) &ip)[1],
+            ((uint8_t *) &ip)[2], ((uint8_t *) &ip)[3], (unsigned long) ttl));
+    } else {
+        e->expires = now + DNS_NEG_TTL * 1000;
+        d->stats.failures++;
+        MG_ERROR(("dns %s: no address", e->host));
+    }
+}
+
+static void dns_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+    struct dns_cache *d = (struct dns_cache *) fn_data;
+
+    if (ev == MG_EV_READ) {
+        dns_answer(d, c->recv.buf, c->recv.len); //one datagram per read
+        c->recv.len = 0;
+    } else if (ev == MG_EV_ERROR) {
+        MG_ERROR(("dns %s: %s", d->url, (char *) ev_data));
+    } else if (ev == MG_EV_CLOSE) {
+        d->conn = NULL;
+    }
+}
+
+void dns_init(struct dns_cache *d, struct mg_mgr *mgr, const char *url, int timeout_ms) {
+    memset(d, 0, sizeof(*d));
+    d->mgr = mgr;
+    d->url = url;
+    d->timeout_ms = timeout_ms;
+}
+
+void dns_free(struct dns_cache *d) {
+    if (d->conn)
+        d->conn->is_closing = 1; //mg_mgr_free closes it
+    MG_INFO(("dns queries: %llu, answers: %llu, failures: %llu, rejected: %llu, cached connects: %llu, resolver connects: %llu",
+        (unsigned long long) d->stats.queries, (unsigned long long) d->stats.answers,
+        (unsigned long long) d->stats.failures, (unsigned long long) d->stats.rejected, (unsigned long long) d->stats.hits,
+        (unsigned long long) d->stats.misses));
+}
+
+int dns_lookup(struct dns_cache *d, struct mg_str host, uint64_t when, uint32_t *ip) {
+    struct dns_entry *e = dns_find(d, host);
+
+    if (!e || !e->ip || e->expires <= when)
+        return -1;
+    *ip = e->ip;
+    return 0;
+}
+
+void dns_resolve(struct dns_cache *d, struct mg_str host, uint64_t when, uint64_t now) {
+    struct dns_entry *e = dns_find(d, host);
+    uint8_t pkt[12 + DNS_HOST_LEN + 2 + 4];
+    size_t n = 12;
+
+    if (e && e->queried && now - e->queried < (uint64_t) d->timeout_ms)
+        return; //answer on the way
+    if (e && e->queried) { //timed out
+        e->queried = 0;
+        e->expires = now + DNS_NEG_TTL * 1000;
+        d->stats.failures++;
+    }
+    if (e && e->expires > when)
+        return; //fresh answer, or a failure not to be repeated yet
+    if (!e && (e = dns_slot(d, host)) == NULL)
+        return;
+
+    if (!d->conn && (d->conn = mg_connect(d->mgr, d->url, dns_cb, d)) == NULL)
+        return;
+
+    //header: id, recursion desired, one question
+    memset(pkt, 0, 12);
+    mg_random(&e->txid, sizeof(e->txid)); //a sequence would let a spoofer guess the next one
+    pkt[0] = (uint8_t) (e->txid >> 8), pkt[1] = (uint8_t) e->txid;
+    pkt[2] = 0x01;
+    pkt[5] = 1;
+    for (size_t i = 0; i < host.len;) {
+        size_t j = i;
+        while (j < host.len && host.ptr[j] != '.')
+            j++;
+        if (j == i || j - i > 63)
+            return;
+        pkt[n++] = (uint8_t) (j - i);
+        memcpy(pkt + n, host.ptr + i, j - i);
+        n += j - i;
+        i = j + 1;
+    }
+    pkt[n++] = 0;
+    pkt[n++] = 0, pkt[n++] = 1; //type A
+    pkt[n++] = 0, pkt[n++] = 1; //class IN
+
+    mg_send(d->conn, pkt, n);
+    e->queried = now;
+    d->stats.queries++;
+}
+
+void dns_forget(struct dns_cache *d, struct mg_str host) {
+    struct dns_entry *e = dns_find(d, host);
+    if (e && !e->queried)
+        e->expires = 0;
+}
+
+int dns_is_ipv4(struct mg_str host) {
+    int dots = 0;
+    if (host.len == 0)
+        return 0;
+    for (size_t i = 0; i < host.len; i++) {
+        if (host.ptr[i] == '.')
+            dots++;
+        else if (!isdigit((unsigned char) host.ptr[i]))
+            return 0;
+    }
+    return dots == 3;
+}
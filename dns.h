@@ -0,0 +1,55 @@
+#ifndef __IOT_DNS_H__
+#define __IOT_DNS_H__
+
+#include <iot/mongoose.h>
+
+#define DNS_CACHE_SIZE  16
+#define DNS_HOST_LEN    64
+#define DNS_TTL_MIN     5       //s, floor of answer ttl
+#define DNS_TTL_MAX     300     //s, cap of answer ttl, a poisoned or stale address does not stick
+#define DNS_NEG_TTL     5       //s, a failed name is not queried again before
+
+struct dns_entry {
+    char host[DNS_HOST_LEN];    //empty: free
+    uint32_t ip;                //network order, 0: no answer
+    uint64_t expires;           //ms
+    uint64_t queried;           //ms of the query waiting for an answer, 0: none
+    uint16_t txid;              //random per query
+};
+
+struct dns_stats {
+    uint64_t queries;
+    uint64_t answers;
+    uint64_t failures;          //no A record, error rcode or timeout
+    uint64_t rejected;          //datagrams not answering the query in flight
+    uint64_t hits;              //connects by cached address
+    uint64_t misses;            //connects left to the mongoose resolver
+};
+
+/*
+ * ipv4 addresses of cloud brokers with the ttl of the answer. queries go over one udp
+ * connection to dns4_url, so a reconnect can start from a cached address.
+ */
+struct dns_cache {
+    struct mg_mgr *mgr;
+    const char *url;
+    int timeout_ms;
+    struct mg_connection *conn;
+    struct dns_entry entries[DNS_CACHE_SIZE];
+    struct dns_stats stats;
+};
+
+void dns_init(struct dns_cache *d, struct mg_mgr *mgr, const char *url, int timeout_ms);
+void dns_free(struct dns_cache *d);
+
+//address of host still valid at when, 0: found
+int dns_lookup(struct dns_cache *d, struct mg_str host, uint64_t when, uint32_t *ip);
+//query host unless an answer valid at when exists or a query is in flight
+void dns_resolve(struct dns_cache *d, struct mg_str host, uint64_t when, uint64_t now);
+//cached address did not connect, ask again next time
+void dns_forget(struct dns_cache *d, struct mg_str host);
+
+//1: host is a dotted ipv4 address, nothing to resolve
+int dns_is_ipv4(struct mg_str host);
+
+#endif
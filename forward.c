@@ -0,0 +1,399 @@
+#include <iot/cJSON.h>
+#include <iot/mongoose.h>
+#include <iot/iot.h>
+#include "forward.h"
+#include "arena.h"
+
+static const char *json_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+static const char *json_skip_string(const char *p, const char *end) {
+    if (p >= end || *p != '"')
+        return NULL;
+    for (p++; p < end; p++) {
+        unsigned char ch = (unsigned char) *p;
+        if (ch == '"')
+            return p + 1;
+        if (ch < 0x20)
+            return NULL;
+        if (ch == '\\') {
+            if (++p >= end)
+                return NULL;
+            switch (*p) {
+                case '"': case '\\': case '/': case 'b':
+                case 'f': case 'n': case 'r': case 't':
+                    break;
+                case 'u':
+                    if (end - p < 5)
+                        return NULL;
+                    for (int i = 1; i <= 4; i++) {
+                        if (!isxdigit((unsigned char) p[i]))
+                            return NULL;
+                    }
+                    p += 4;
+                    break;
+                default:
+                    return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+static const char *json_skip_digits(const char *p, const char *end) {
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9')
+        p++;
+    return p > start ? p : NULL;
+}
+
+static const char *json_skip_number(const char *p, const char *end) {
+    if (p < end && *p == '-')
+        p++;
+    if (p < end && *p == '0') {
+        p++;
+    } else if (!(p = json_skip_digits(p, end))) {
+        return NULL;
+    }
+    if (p < end && *p == '.' && !(p = json_skip_digits(p + 1, end)))
+        return NULL;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-'))
+            p++;
+        if (!(p = json_skip_digits(p, end)))
+            return NULL;
+    }
+    return p;
+}
+
+static const char *json_skip_literal(const char *p, const char *end, const char *lit) {
+    size_t n = strlen(lit);
+    if ((size_t) (end - p) < n || memcmp(p, lit, n) != 0)
+        return NULL;
+    return p + n;
+}
+
+static const char *json_skip_value(const char *p, const char *end, int depth) {
+
+    p = json_ws(p, end);
+    if (p >= end)
+        return NULL;
+
+    switch (*p) {
+        case '"':
+            return json_skip_string(p, end);
+        case 't':
+            return json_skip_literal(p, end, "true");
+        case 'f':
+            return json_skip_literal(p, end, "false");
+        case 'n':
+            return json_skip_literal(p, end, "null");
+        case '[':
+        case '{': {
+            char close = *p == '[' ? ']' : '}';
+            if (depth >= JSON_MAX_DEPTH)
+                return NULL;
+            p = json_ws(p + 1, end);
+            if (p < end && *p == close)
+                return p + 1;
+            for (;;) {
+                if (close == '}') {
+                    if (!(p = json_skip_string(json_ws(p, end), end)))
+                        return NULL;
+                    p = json_ws(p, end);
+                    if (p >= end || *p++ != ':')
+                        return NULL;
+                }
+                if (!(p = json_skip_value(p, end, depth + 1)))
+                    return NULL;
+                p = json_ws(p, end);
+                if (p >= end)
+                    return NULL;
+                if (*p == close)
+                    return p + 1;
+                if (*p++ != ',')
+                    return NULL;
+            }
+        }
+        default:
+            return json_skip_number(p, end);
+    }
+}
+
+int json_validate(struct mg_str s) {
+    const char *end = s.ptr + s.len;
+    const char *p;
+
+    if (!s.ptr)
+        return 0;
+    p = json_skip_value(s.ptr, end, 0);
+    return p && json_ws(p, end) == end;
+}
+
+// value span of a top level key of a json object, 0: found
+static int json_find_top(struct mg_str s, const char *key, struct mg_str *value) {
+    const char *p, *end = s.ptr + s.len;
+    size_t klen = strlen(key);
+
+    if (!s.ptr)
+        return -1;
+
+    p = json_ws(s.ptr, end);
+    if (p >= end || *p++ != '{')
+        return -1;
+
+    for (;;) {
+        const char *k = json_ws(p, end), *k_end, *v;
+        if (!(k_end = json_skip_string(k, end)))
+            return -1;
+        p = json_ws(k_end, end);
+        if (p >= end || *p++ != ':')
+            return -1;
+        v = json_ws(p, end);
+        if (!(p = json_skip_value(v, end, 1)))
+            return -1;
+
+        if ((size_t) (k_end - k) == klen + 2 && memcmp(k + 1, key, klen) == 0) {
+            *value = mg_str_n(v, p - v);
+            return 0;
+        }
+
+        p = json_ws(p, end);
+        if (p >= end || *p != ',')
+            return -1; //end of object or malformed, key not found
+        p++;
+    }
+}
+
+int json_get_top_number(struct mg_str s, const char *key, double *value) {
+    struct mg_str v;
+    char num[32];
+
+    if (json_find_top(s, key, &v) || json_skip_number(v.ptr, v.ptr + v.len) != v.ptr + v.len ||
+        v.len >= sizeof(num))
+        return -1; //not found or not a number
+
+    memcpy(num, v.ptr, v.len);
+    num[v.len] = '\0';
+    *value = strtod(num, NULL);
+    return 0;
+}
+
+int json_get_top_string(struct mg_str s, const char *key, struct mg_str *value) {
+    struct mg_str v;
+
+    if (json_find_top(s, key, &v) || v.len < 2 || v.ptr[0] != '"')
+        return -1; //not found or not a string
+
+    *value = mg_str_n(v.ptr + 1, v.len - 2);
+    return 0;
+}
+
+static int fwd_reserve(struct forward_ctx *fwd, size_t n) {
+    if (fwd->len + n <= fwd->size)
+        return 0;
+
+    size_t size = fwd->size ? fwd->size : 512;
+    while (size < fwd->len + n)
+        size *= 2;
+
+    char *buf = realloc(fwd->buf, size);
+    if (!buf)
+        return -1;
+
+    fwd->buf = buf;
+    fwd->size = size;
+    fwd->stats.allocs++;
+    return 0;
+}
+
+static void fwd_append(struct forward_ctx *fwd, const char *s, size_t n) {
+    memcpy(fwd->buf + fwd->len, s, n);
+    fwd->len += n;
+}
+
+static size_t json_quoted_len(struct mg_str s) {
+    size_t n = 2;
+    for (size_t i = 0; i < s.len; i++) {
+        unsigned char ch = (unsigned char) s.ptr[i];
+        if (ch == '"' || ch == '\\' || ch == '\b' || ch == '\f' ||
+            ch == '\n' || ch == '\r' || ch == '\t')
+            n += 2;
+        else if (ch < 0x20)
+            n += 6;
+        else
+            n++;
+    }
+    return n;
+}
+
+//caller must reserve json_quoted_len(s) bytes
+static void fwd_append_quoted(struct forward_ctx *fwd, struct mg_str s) {
+    static const char *hex = "0123456789abcdef";
+    char *o = fwd->buf + fwd->len;
+
+    *o++ = '"';
+    for (size_t i = 0; i < s.len; i++) {
+        unsigned char ch = (unsigned char) s.ptr[i];
+        switch (ch) {
+            case '"':  *o++ = '\\'; *o++ = '"'; break;
+            case '\\': *o++ = '\\'; *o++ = '\\'; break;
+            case '\b': *o++ = '\\'; *o++ = 'b'; break;
+            case '\f': *o++ = '\\'; *o++ = 'f'; break;
+            case '\n': *o++ = '\\'; *o++ = 'n'; break;
+            case '\r': *o++ = '\\'; *o++ = 'r'; break;
+            case '\t': *o++ = '\\'; *o++ = 't'; break;
+            default:
+                if (ch < 0x20) {
+                    *o++ = '\\'; *o++ = 'u'; *o++ = '0'; *o++ = '0';
+                    *o++ = hex[ch >> 4]; *o++ = hex[ch & 0xf];
+                } else {
+                    *o++ = (char) ch;
+                }
+        }
+    }
+    *o++ = '"';
+    fwd->len = o - fwd->buf;
+}
+
+static char *json_quote(const char *s) {
+    struct forward_ctx tmp;
+    struct mg_str str = mg_str(s ? s : "");
+
+    memset(&tmp, 0, sizeof(tmp));
+    if (fwd_reserve(&tmp, json_quoted_len(str) + 1))
+        return NULL;
+    fwd_append_quoted(&tmp, str);
+    tmp.buf[tmp.len] = '\0';
+    return tmp.buf;
+}
+
+char *forward_prefix(const char *module, const char *func) {
+    char *q_module = json_quote(module), *q_func = json_quote(func), *prefix = NULL;
+
+    if (q_module && q_func) {
+        prefix = mg_mprintf("{\"" FIELD_METHOD "\":\"call\",\"" FIELD_PARAM "\":[%s,%s,{\"" FIELD_TOPIC "\":",
+            q_module, q_func);
+    }
+
+    free(q_module);
+    free(q_func);
+    return prefix;
+}
+
+int forward_init(struct forward_ctx *fwd, const char *module, const char *func) {
+    memset(fwd, 0, sizeof(*fwd));
+    fwd->prefix = forward_prefix(module, func);
+
+    if (!fwd->prefix) {
+        forward_free(fwd);
+        return -1;
+    }
+
+    fwd->prefix_len = strlen(fwd->prefix);
+    return 0;
+}
+
+void forward_free(struct forward_ctx *fwd) {
+    free(fwd->prefix);
+    free(fwd->buf);
+    memset(fwd, 0, sizeof(*fwd));
+}
+
+/*
+{"method":"call","param":["plugin/unicom/callback","handler",{"topic":"...","to":"mg/iot-client/channel","data":<raw payload>}]}
+*/
+#define FORWARD_TO   ",\"" FIELD_TO "\":"
+#define FORWARD_ID   ",\"id\":"
+#define FORWARD_DATA ",\"" FIELD_DATA "\":"
+
+struct mg_str forward_envelope(struct forward_ctx *fwd, struct mg_str topic, struct mg_str to, uint32_t id, struct mg_str data) {
+    return forward_envelope_prefix(fwd, mg_str_n(fwd->prefix, fwd->prefix_len), topic, to, id, data);
+}
+
+struct mg_str forward_envelope_prefix(struct forward_ctx *fwd, struct mg_str prefix, struct mg_str topic,
+    struct mg_str to, uint32_t id, struct mg_str data) {
+    int raw = json_validate(data);
+    size_t data_len = raw ? data.len : json_quoted_len(data);
+    size_t n = prefix.len + json_quoted_len(topic) + sizeof(FORWARD_TO) - 1 + json_quoted_len(to) +
+        sizeof(FORWARD_ID) - 1 + 10 + sizeof(FORWARD_DATA) - 1 + data_len + 3;
+
+    fwd->len = 0;
+    if (fwd_reserve(fwd, n + 1))
+        return mg_str_n(NULL, 0);
+
+    fwd_append(fwd, prefix.ptr, prefix.len);
+    fwd_append_quoted(fwd, topic);
+    fwd_append(fwd, FORWARD_TO, sizeof(FORWARD_TO) - 1);
+    fwd_append_quoted(fwd, to);
+    if (id) {
+        fwd_append(fwd, FORWARD_ID, sizeof(FORWARD_ID) - 1);
+        fwd->len += mg_snprintf(fwd->buf + fwd->len, 11, "%lu", (unsigned long) id);
+    }
+    fwd_append(fwd, FORWARD_DATA, sizeof(FORWARD_DATA) - 1);
+    if (raw) {
+        fwd_append(fwd, data.ptr, data.len);
+    } else { //not a json document, forward it as json string
+        fwd_append_quoted(fwd, data);
+        fwd->stats.fallbacks++;
+    }
+    fwd_append(fwd, "}]}", 3);
+    fwd->buf[fwd->len] = '\0';
+
+    fwd->stats.messages++;
+    fwd->stats.bytes_copied += fwd->len;
+
+    return mg_str_n(fwd->buf, fwd->len);
+}
+
+char *forward_envelope_parse(const char *module, const char *func, const char *to, uint32_t id, struct mg_str topic, struct mg_str data) {
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, FIELD_METHOD, "call");
+
+    cJSON *param = cJSON_CreateArray();
+    cJSON_AddItemToArray(param, cJSON_CreateString(module));
+    cJSON_AddItemToArray(param, cJSON_CreateString(func));
+
+    cJSON *args = cJSON_CreateObject();
+    char *s_topic = arena_strndup(topic);
+    cJSON_AddItemToObject(args, FIELD_TOPIC, cJSON_CreateString(s_topic));
+    arena_release(s_topic);
+    cJSON_AddItemToObject(args, FIELD_TO, cJSON_CreateString(to));
+    if (id)
+        cJSON_AddNumberToObject(args, "id", id);
+    cJSON *data_obj = cJSON_ParseWithLength(data.ptr, data.len);
+    if (data_obj) {
+        cJSON_AddItemToObject(args, FIELD_DATA, data_obj);
+    } else {
+        char *s_data = arena_strndup(data);
+        cJSON_AddItemToObject(args, FIELD_DATA, cJSON_CreateString(s_data));
+        arena_release(s_data);
+    }
+    cJSON_AddItemToArray(param, args);
+
+    cJSON_AddItemToObject(root, FIELD_PARAM, param);
+
+    char *printed = cJSON_Print(root);
+    cJSON_Delete(root);
+
+    return printed;
+}
+
+// {"method":"call","param":["ubus","call",{"object":"system","method":"board"}]} -> call:system.board
+int json_ubus_name(struct mg_str data, struct mg_str method, char *buf, size_t len) {
+    cJSON *root = cJSON_ParseWithLength(data.ptr, data.len);
+    cJSON *arg = cJSON_GetArrayItem(cJSON_GetObjectItem(root, FIELD_PARAM), 2);
+    const char *object = cJSON_GetStringValue(cJSON_GetObjectItem(arg, "object"));
+    const char *func = cJSON_GetStringValue(cJSON_GetObjectItem(arg, FIELD_METHOD));
+    int n = 0;
+
+    if (object && func)
+        n = mg_snprintf(buf, len, "%.*s:%s.%s", (int) method.len, method.ptr, object, func);
+    cJSON_Delete(root);
+    return n > 0 && (size_t) n < len ? 0 : -1;
+}
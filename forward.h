@@ -0,0 +1,55 @@
+#ifndef __IOT_FORWARD_H__
+#define __IOT_FORWARD_H__
+
+#include <iot/mongoose.h>
+
+#define FORWARD_MODE_RAW   0 //splice raw payload into a precomputed envelope
+#define FORWARD_MODE_PARSE 1 //parse payload into cJSON and print the whole envelope
+
+#define JSON_MAX_DEPTH 256
+
+struct forward_stats {
+    uint64_t messages;      //envelopes built
+    uint64_t fallbacks;     //payloads which are not valid json, forwarded as json string
+    uint64_t bytes_copied;  //bytes written into envelope buffer
+    uint64_t allocs;        //envelope buffer (re)allocations
+};
+
+struct forward_ctx {
+    char *prefix;           // {"method":"call","param":["module","func",{"topic":
+    size_t prefix_len;
+
+    char *buf;              //envelope buffer, reused between messages
+    size_t len;
+    size_t size;
+
+    struct forward_stats stats;
+};
+
+int forward_init(struct forward_ctx *fwd, const char *module, const char *func);
+void forward_free(struct forward_ctx *fwd);
+
+//envelope head up to the topic value for module/func, must free
+char *forward_prefix(const char *module, const char *func);
+
+//build envelope into fwd->buf, the returned string is valid until next call
+//id is the correlation id, 0: omitted
+struct mg_str forward_envelope(struct forward_ctx *fwd, struct mg_str topic, struct mg_str to, uint32_t id, struct mg_str data);
+//same with the head of another module/func from forward_prefix, fwd only lends its buffer
+struct mg_str forward_envelope_prefix(struct forward_ctx *fwd, struct mg_str prefix, struct mg_str topic,
+    struct mg_str to, uint32_t id, struct mg_str data);
+
+//build envelope by cJSON, must free by cJSON_free
+char *forward_envelope_parse(const char *module, const char *func, const char *to, uint32_t id, struct mg_str topic, struct mg_str data);
+
+//1: s is exactly one json value (surrounding whitespace allowed), 0: otherwise
+int json_validate(struct mg_str s);
+
+//find top level number field key of a json object without building a tree, 0: found
+int json_get_top_number(struct mg_str s, const char *key, double *value);
+//same as json_get_top_number for a string field, value is the raw string content without quotes
+int json_get_top_string(struct mg_str s, const char *key, struct mg_str *value);
+//method:object.method of a ubus style param of request data with top level method, 0: fits in buf
+int json_ubus_name(struct mg_str data, struct mg_str method, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,199 @@
+#include <iot/mongoose.h>
+#include "inflight.h"
+
+void inflight_init(struct inflight *w, int cap) {
+    memset(w, 0, sizeof(*w));
+    w->cap = cap < 1 ? 1 : cap;
+}
+
+void inflight_free(struct inflight *w) {
+    if (w->slots) {
+        for (int i = 0; i < w->cap; i++)
+            free(w->slots[i].buf);
+        free(w->slots);
+    }
+    w->slots = NULL;
+    w->count = 0;
+}
+
+uint16_t inflight_add(struct inflight *w, int qos, const struct outq_pub *pub, uint64_t now, struct inflight_stats *st) {
+    struct inflight_entry *e;
+    uint16_t id;
+
+    if (w->count >= w->cap || pub->topic.len > UINT16_MAX || pub->cdata.len > UINT16_MAX)
+        return 0;
+    if (!w->slots && (w->slots = calloc(w->cap, sizeof(struct inflight_entry))) == NULL)
+        return 0;
+
+    do { //skip 0 and ids whose slot is still busy, count < cap so one is free
+        id = ++w->next_id;
+    } while (id == 0 || w->slots[id % w->cap].id != 0);
+
+    e = &w->slots[id % w->cap];
+    e->len = pub->data.len;
+    e->topic_len = (uint16_t) pub->topic.len;
+    e->cdata_len = (uint16_t) pub->cdata.len;
+    e->buf = malloc(e->len + e->topic_len + e->cdata_len + 1);
+    if (!e->buf)
+        return 0;
+    memcpy(e->buf, pub->data.ptr, pub->data.len);
+    if (e->topic_len)
+        memcpy(e->buf + e->len, pub->topic.ptr, e->topic_len);
+    if (e->cdata_len)
+        memcpy(e->buf + e->len + e->topic_len, pub->cdata.ptr, e->cdata_len);
+
+    e->id = id;
+    e->qos = (uint8_t) qos;
+    e->state = INFLIGHT_WAIT_ACK;
+    e->seq = w->next_seq++;
+    e->sent = now;
+    w->count++;
+
+    st->published++;
+    if (w->count > st->max_count)
+        st->max_count = w->count;
+    return id;
+}
+
+struct inflight_entry *inflight_find(struct inflight *w, uint16_t id) {
+    struct inflight_entry *e;
+
+    if (!w->slots || id == 0)
+        return NULL;
+    e = &w->slots[id % w->cap];
+    return e->id == id ? e : NULL;
+}
+
+struct outq_pub inflight_entry_pub(struct inflight_entry *e) {
+    struct outq_pub pub;
+    pub.data = mg_str_n(e->buf, e->len);
+    pub.topic = mg_str_n(e->buf + e->len, e->topic_len);
+    pub.cdata = mg_str_n(e->buf + e->len + e->topic_len, e->cdata_len);
+    return pub;
+}
+
+void inflight_release(struct inflight *w, struct inflight_entry *e, uint64_t now, struct inflight_stats *st) {
+    uint64_t ms = now > e->sent ? now - e->sent : 0;
+
+    st->acked++;
+    st->ack_ms += ms;
+    if (ms > st->max_ack_ms)
+        st->max_ack_ms = ms;
+
+    free(e->buf);
+    memset(e, 0, sizeof(*e));
+    w->count--;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+    const struct inflight_entry *x = *(const struct inflight_entry **) a, *y = *(const struct inflight_entry **) b;
+    return (int32_t) (x->seq - y->seq) < 0 ? -1 : x->seq != y->seq;
+}
+
+int inflight_sorted(struct inflight *w, struct inflight_entry **out, int n) {
+    int k = 0;
+
+    for (int i = 0; w->slots && i < w->cap && k < n; i++) {
+        if (w->slots[i].id)
+            out[k++] = &w->slots[i];
+    }
+    qsort(out, k, sizeof(out[0]), entry_cmp);
+    return k;
+}
+
+static size_t varint_len(size_t n) {
+    size_t len = 1;
+    while (n >= 128) {
+        n >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static void send_u16(struct mg_connection *c, size_t v) {
+    uint8_t b[2] = { (uint8_t) (v >> 8), (uint8_t) v };
+    mg_send(c, b, sizeof(b));
+}
+
+// mongoose 7.9 mg_mqtt_pub hides the packet id and never sets dup, so the packet is built here
+void inflight_write_publish(struct mg_connection *c, const struct outq_pub *pub, uint16_t alias,
+    int qos, uint16_t id, int dup) {
+    size_t props = 0, len = 2 + pub->topic.len + (qos > 0 ? 2 : 0) + pub->data.len;
+
+    if (c->is_mqtt5) {
+        if (alias)
+            props += 3;
+        if (pub->cdata.len)
+            props += 3 + pub->cdata.len;
+        len += varint_len(props) + props;
+    }
+
+    mg_mqtt_send_header(c, MQTT_CMD_PUBLISH, (uint8_t) ((dup ? 8 : 0) | (qos << 1)), (uint32_t) len);
+    send_u16(c, pub->topic.len);
+    mg_send(c, pub->topic.ptr, pub->topic.len);
+    if (qos > 0)
+        send_u16(c, id);
+
+    if (c->is_mqtt5) {
+        uint8_t b[4];
+        size_t n = 0, v = props;
+        do { //variable byte integer
+            b[n] = (uint8_t) (v & 0x7f);
+            v >>= 7;
+            if (v)
+                b[n] |= 0x80;
+            n++;
+        } while (v);
+        mg_send(c, b, n);
+        if (alias) {
+            uint8_t id_alias = MQTT_PROP_TOPIC_ALIAS;
+            mg_send(c, &id_alias, 1);
+            send_u16(c, alias);
+        }
+        if (pub->cdata.len) {
+            uint8_t id_cdata = MQTT_PROP_CORRELATION_DATA;
+            mg_send(c, &id_cdata, 1);
+            send_u16(c, pub->cdata.len);
+            mg_send(c, pub->cdata.ptr, pub->cdata.len);
+        }
+    }
+
+    mg_send(c, pub->data.ptr, pub->data.len);
+}
+
+// mongoose 7.9 answers PUBREC with PUBREL as it arrives, one still unanswered by PUBCOMP
+// when the connection dropped is sent again here, mongoose does not remember it
+void inflight_write_pubrel(struct mg_connection *c, uint16_t id) {
+    mg_mqtt_send_header(c, MQTT_CMD_PUBREL, 2, 2);
+    send_u16(c, id);
+}
+
+void inflight_resend(struct inflight *w, struct mg_connection *c, struct inflight_stats *st) {
+    struct inflight_entry **order;
+    int n;
+
+    if (w->count == 0 || (order = malloc(w->count * sizeof(order[0]))) == NULL)
+        return;
+
+    n = inflight_sorted(w, order, w->count);
+    for (int i = 0; i < n; i++) {
+        struct inflight_entry *e = order[i];
+        if (e->state == INFLIGHT_WAIT_COMP) {
+            inflight_write_pubrel(c, e->id);
+        } else {
+            struct outq_pub pub = inflight_entry_pub(e); //aliases do not survive the connection
+            inflight_write_publish(c, &pub, 0, e->qos, e->id, 1);
+        }
+        st->resent++;
+    }
+    free(order);
+}
+
+void inflight_stats_dump(struct inflight_stats *st) {
+    if (st->published == 0)
+        return;
+    MG_INFO(("qos publishes: %llu, acked: %llu, resent: %llu, unknown acks: %llu, max in flight: %d, avg ack: %llu ms, max ack: %llu ms",
+        (unsigned long long) st->published, (unsigned long long) st->acked, (unsigned long long) st->resent,
+        (unsigned long long) st->unknown, st->max_count,
+        (unsigned long long) (st->acked ? st->ack_ms / st->acked : 0), (unsigned long long) st->max_ack_ms));
+}
@@ -0,0 +1,66 @@
+#ifndef __IOT_INFLIGHT_H__
+#define __IOT_INFLIGHT_H__
+
+#include <iot/mongoose.h>
+#include "outq.h"
+
+#define INFLIGHT_WAIT_ACK   1   //PUBLISH sent, PUBACK or PUBREC due
+#define INFLIGHT_WAIT_COMP  2   //qos 2, PUBREL sent, PUBCOMP due
+
+struct inflight_entry {
+    uint16_t id;            //packet id, 0: free
+    uint8_t qos;
+    uint8_t state;          //INFLIGHT_WAIT_*
+    uint32_t seq;           //publish order, resend keeps it
+    uint64_t sent;          //ms of the first send
+    char *buf;              //data, then topic and cdata, kept until acked
+    size_t len;
+    uint16_t topic_len;
+    uint16_t cdata_len;
+};
+
+struct inflight_stats {
+    uint64_t published;     //qos > 0 publishes
+    uint64_t acked;         //released by PUBACK or PUBCOMP
+    uint64_t resent;        //PUBLISH or PUBREL sent again after reconnect
+    uint64_t unknown;       //ack of a packet id not in flight
+    uint64_t ack_ms;        //sum of publish to release time
+    uint64_t max_ack_ms;
+    int max_count;          //peak entries of one session
+};
+
+/*
+ * unacknowledged qos 1/2 publishes of one cloud session, at most cap. an entry lives in
+ * slot id % cap, ids are handed out in order skipping busy slots, so lookup is one probe.
+ * the table outlives the connection, a reconnect with clean = false resends it in order.
+ */
+struct inflight {
+    struct inflight_entry *slots;   //allocated by the first add
+    int cap;
+    int count;
+    uint16_t next_id;
+    uint32_t next_seq;
+};
+
+void inflight_init(struct inflight *w, int cap);
+void inflight_free(struct inflight *w);
+
+//keep a copy of pub until it is acked, return its packet id, 0: table full or out of memory
+uint16_t inflight_add(struct inflight *w, int qos, const struct outq_pub *pub, uint64_t now, struct inflight_stats *st);
+struct inflight_entry *inflight_find(struct inflight *w, uint16_t id);
+struct outq_pub inflight_entry_pub(struct inflight_entry *e);
+void inflight_release(struct inflight *w, struct inflight_entry *e, uint64_t now, struct inflight_stats *st);
+//entries in publish order, n at most w->count, return the number written
+int inflight_sorted(struct inflight *w, struct inflight_entry **out, int n);
+
+//PUBLISH packet, topic alias and correlation data only on mqtt5, alias 0: none
+void inflight_write_publish(struct mg_connection *c, const struct outq_pub *pub, uint16_t alias,
+    int qos, uint16_t id, int dup);
+//PUBREL of a resend, the first one is sent by mongoose on PUBREC
+void inflight_write_pubrel(struct mg_connection *c, uint16_t id);
+//PUBLISH again with dup, PUBREL again for entries past PUBREC
+void inflight_resend(struct inflight *w, struct mg_connection *c, struct inflight_stats *st);
+
+void inflight_stats_dump(struct inflight_stats *st);
+
+#endif
@@ -9,6 +9,8 @@ local M = {}
 --     "Username": "",
 --     "Password": "",
 -- */
+--- called again on SIGHUP or when this file is saved, a connected identity takes the new config in place:
+--- topic_sub changes are subscribed/unsubscribed, address/client_id/user/password changes reconnect it
 local function get_config()
     -- get mqtt config
     local config = {
@@ -25,11 +27,42 @@ local function get_config()
         }
     }
 
+    --- topic_sub can be a list, routes send matching cloud topics to other iot-rpcd module/func,
+    --- or answer/drop them in iot-client, the rest go to the default module/func:
+    --- topic_sub = { "cmd/#", "ota/#" },
+    --- routes = {
+    ---     { topic = "cmd/+/set", module = "plugin/unicom/cmd", func = "set" },
+    ---     { topic = "ota/#", module = "plugin/ota", func = "handler" },
+    ---     { topic = "cmd/ping", action = "ack" },
+    ---     { topic = "cmd/debug/#", action = "drop" },
+    --- },
+    --- cache = { ["call:system.board"] = 30 }, --- primary identity only, seconds to keep replies of read-only queries
+    --- encoding = "cbor", --- publish json payloads as cbor, cbor requests reach iot-rpcd as json, default "json"
+    --- transfer = { threshold = 65536, chunk = 16384, window = 8 }, --- the cloud takes replies from threshold bytes in acked chunks
+    --- keepalive_adaptive = { min = 30, network = "46001" }, --- idle pings at the longest interval up to keepalive the network keeps
+
+    --- gateway mode: data can be an array of identities, the first one is the primary
+    --- data = { { address = ..., client_id = 'gw', ... }, { address = ..., client_id = 'sub-1', ... } }
+
     return cjson.encode(config)
 end
 
-local function gen_request()
-    --- generate request
+--- optional, report jobs, interval and jitter in seconds, gen_request is called with the job
+--- without it gen_request is called every second with empty param
+local function get_schedule()
+    return cjson.encode({
+        code = 0,
+        data = {
+            --- delta = true: publish only changed fields as RFC 7386 merge patch, full snapshot every full_every reports
+            { name = "board", interval = 60, jitter = 10, priority = 1, delta = false, full_every = 10 },
+        }
+    })
+end
+
+local function gen_request(param)
+    --- without get_schedule param is empty
+    local job = param ~= "" and cjson.decode(param) or {}
+    --- generate request of job.name
     local request = {
         code = 0, -- if code !=0, don't send request
         data = {
@@ -59,8 +92,12 @@ M.call = function(method, param)
         return get_config()
     end
 
+    if method == "get_schedule" then
+        return get_schedule()
+    end
+
     if method == "gen_request" then
-        return gen_request()
+        return gen_request(param)
     end
 
     if method == "on_event" then
@@ -0,0 +1,133 @@
+#include <iot/mongoose.h>
+#include "keepalive.h"
+
+void ka_store_load(struct ka_store *st, const char *path) {
+    struct ka_entry e;
+    FILE *fp;
+    int n = 0;
+
+    memset(st, 0, sizeof(*st));
+    st->path = path;
+    if (!path || (fp = fopen(path, "r")) == NULL)
+        return;
+    while (n < KA_NETWORKS && fscanf(fp, "%31s %u %u", e.network, &e.lo, &e.hi) == 3) {
+        if (e.lo > 0 && e.lo < e.hi)
+            st->entries[n++] = e;
+    }
+    fclose(fp);
+    MG_INFO(("keepalive state %s, networks: %d", path, n));
+}
+
+static void ka_store_save(struct ka_store *st) {
+    char tmp[256];
+    FILE *fp;
+    int ok = 1;
+
+    if (!st->path)
+        return;
+
+    //write aside and rename, a crash never leaves half a file
+    mg_snprintf(tmp, sizeof(tmp), "%s.tmp", st->path);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        MG_ERROR(("open %s failed: %d", tmp, errno));
+        return;
+    }
+    for (int i = 0; i < KA_NETWORKS; i++) {
+        struct ka_entry *e = &st->entries[i];
+        if (e->network[0] && fprintf(fp, "%s %u %u\n", e->network, e->lo, e->hi) < 0)
+            ok = 0;
+    }
+    if (fclose(fp) != 0 || !ok || rename(tmp, st->path) != 0) {
+        MG_ERROR(("save keepalive state %s failed", st->path));
+        unlink(tmp);
+        return;
+    }
+    st->saved++;
+}
+
+// entry of network, a free or the first one is taken for a new network
+static struct ka_entry *ka_store_entry(struct ka_store *st, const char *network, int create) {
+    struct ka_entry *free_entry = NULL;
+
+    for (int i = 0; i < KA_NETWORKS; i++) {
+        struct ka_entry *e = &st->entries[i];
+        if (strcmp(e->network, network) == 0 && e->network[0])
+            return e;
+        if (!e->network[0] && !free_entry)
+            free_entry = e;
+    }
+    if (!create)
+        return NULL;
+    if (!free_entry) { //full, forget the oldest one
+        memmove(&st->entries[0], &st->entries[1], (KA_NETWORKS - 1) * sizeof(st->entries[0]));
+        free_entry = &st->entries[KA_NETWORKS - 1];
+    }
+    memset(free_entry, 0, sizeof(*free_entry));
+    mg_snprintf(free_entry->network, sizeof(free_entry->network), "%s", network);
+    return free_entry;
+}
+
+static void ka_probe_store(struct ka_probe *p, struct ka_store *st) {
+    struct ka_entry *e = ka_store_entry(st, p->network, 1);
+    e->lo = p->lo;
+    e->hi = p->hi;
+    ka_store_save(st);
+}
+
+void ka_probe_init(struct ka_probe *p, struct ka_store *st, const char *network, uint32_t min, uint32_t max) {
+    struct ka_entry *e;
+
+    mg_snprintf(p->network, sizeof(p->network), "%s", network);
+    p->min = min < max ? min : max;
+    p->max = max;
+    p->lo = p->min;
+    p->hi = max + 1;
+    if ((e = ka_store_entry(st, p->network, 0)) != NULL) { //bounds may have changed since
+        if (e->lo > p->lo)
+            p->lo = e->lo < max ? e->lo : max;
+        if (e->hi > p->lo && e->hi < p->hi)
+            p->hi = e->hi;
+    }
+}
+
+uint32_t ka_probe_interval(const struct ka_probe *p) {
+    if (p->hi - p->lo <= KA_STEP || p->lo >= p->max)
+        return p->lo;
+    return p->lo + (p->hi - p->lo) / 2;
+}
+
+void ka_probe_ok(struct ka_probe *p, struct ka_store *st, uint32_t interval) {
+    if (interval <= p->lo)
+        return;
+    p->lo = interval < p->max ? interval : p->max;
+    if (p->hi <= p->lo) //the path changed, search above again
+        p->hi = p->max + 1;
+    p->answered++;
+    MG_INFO(("keepalive %s: %u s answered, next interval %u s", p->network, interval, ka_probe_interval(p)));
+    ka_probe_store(p, st);
+}
+
+void ka_probe_fail(struct ka_probe *p, struct ka_store *st, uint32_t interval) {
+    p->lost++;
+    if (interval < p->hi)
+        p->hi = interval;
+    if (p->lo >= p->hi) { //a known safe interval failed, start lower
+        p->lo = p->hi / 2 > p->min ? p->hi / 2 : p->min;
+        if (p->hi <= p->lo)
+            p->hi = p->lo + 1;
+    }
+    MG_INFO(("keepalive %s: %u s lost, next interval %u s", p->network, interval, ka_probe_interval(p)));
+    ka_probe_store(p, st);
+}
+
+void ka_probe_dump(struct ka_probe *p, int index) {
+    if (p->pings == 0 && !p->network[0])
+        return;
+    if (!p->network[0]) {
+        MG_INFO(("cloud mqtt client %d pings: %llu", index, (unsigned long long) p->pings));
+        return;
+    }
+    MG_INFO(("cloud mqtt client %d pings: %llu, keepalive %s: interval %u s, safe %u s, lost %u s, answered: %llu, lost: %llu",
+        index, (unsigned long long) p->pings, p->network, ka_probe_interval(p), p->lo, p->hi > p->max ? 0 : p->hi,
+        (unsigned long long) p->answered, (unsigned long long) p->lost));
+}
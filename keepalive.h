@@ -0,0 +1,52 @@
+#ifndef __IOT_KEEPALIVE_H__
+#define __IOT_KEEPALIVE_H__
+
+#include <iot/mongoose.h>
+
+#define KA_NETWORKS     16      //networks kept in the state file
+#define KA_NETWORK_LEN  32
+#define KA_MIN          30      //s, default shortest interval of the search
+#define KA_STEP         15      //s, the search stops when the safe and the lost interval are this close
+#define KA_PONG_MS      6000    //ping with no inbound packet after it for this long, the connection is dead
+
+struct ka_entry {
+    char network[KA_NETWORK_LEN];   //empty: free
+    uint32_t lo;
+    uint32_t hi;
+};
+
+/*
+ * idle intervals found per network, one "network lo hi" line each in path, written aside and
+ * renamed when a search moves, so a restarted client goes on from where the last one stopped.
+ */
+struct ka_store {
+    const char *path;       //NULL: memory only
+    struct ka_entry entries[KA_NETWORKS];
+    uint64_t saved;         //file writes
+};
+
+// binary search of the longest idle time, in s, the path (nat, carrier) keeps a connection open
+struct ka_probe {
+    char network[KA_NETWORK_LEN];
+    uint32_t min;           //shortest interval tried
+    uint32_t max;           //mqtt keepalive, the broker wants a packet at least this often
+    uint32_t lo;            //longest idle interval a ping was answered after
+    uint32_t hi;            //shortest idle interval a ping was lost after, max + 1: none
+    uint64_t pings;
+    uint64_t answered;      //pings after an idle interval above lo which moved it up
+    uint64_t lost;          //pings after an idle interval which closed the connection
+};
+
+void ka_store_load(struct ka_store *st, const char *path);
+//start from what st knows of network, min and max clamp it
+void ka_probe_init(struct ka_probe *p, struct ka_store *st, const char *network, uint32_t min, uint32_t max);
+//idle interval to ping after: lo once the search is done, halfway between lo and hi before
+uint32_t ka_probe_interval(const struct ka_probe *p);
+//a ping after interval s was answered
+void ka_probe_ok(struct ka_probe *p, struct ka_store *st, uint32_t interval);
+//a ping after interval s was not, the connection is closed
+void ka_probe_fail(struct ka_probe *p, struct ka_store *st, uint32_t interval);
+
+void ka_probe_dump(struct ka_probe *p, int index);
+
+#endif
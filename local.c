@@ -0,0 +1,181 @@
+#include <iot/mongoose.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include "local.h"
+
+static uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+}
+
+// 0: sent, 1: socket full, -1: error
+static int local_sendmsg(struct mg_connection *c, struct mg_str topic, struct mg_str data) {
+    uint8_t hdr[LOCAL_FRAME_HEADER];
+    uint32_t len = (uint32_t) (LOCAL_FRAME_HEADER - 4 + topic.len + data.len);
+    struct iovec iov[3];
+    struct msghdr msg;
+    ssize_t n;
+
+    hdr[0] = (uint8_t) (len >> 24), hdr[1] = (uint8_t) (len >> 16);
+    hdr[2] = (uint8_t) (len >> 8), hdr[3] = (uint8_t) len;
+    hdr[4] = LOCAL_FRAME_PUBLISH;
+    hdr[5] = (uint8_t) (topic.len >> 8), hdr[6] = (uint8_t) topic.len;
+
+    iov[0].iov_base = hdr, iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *) topic.ptr, iov[1].iov_len = topic.len;
+    iov[2].iov_base = (void *) data.ptr, iov[2].iov_len = data.len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+
+    //a seqpacket record goes whole or not at all
+    n = sendmsg((int) (size_t) c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n == (ssize_t) len + 4)
+        return 0;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+        return 1;
+    return -1;
+}
+
+int local_is_unix(const char *url) {
+    return url && strncmp(url, LOCAL_UNIX_PREFIX, strlen(LOCAL_UNIX_PREFIX)) == 0;
+}
+
+struct mg_connection *local_unix_wrap(struct mg_mgr *mgr, int fd, mg_event_handler_t fn, void *fn_data) {
+    struct mg_connection *c = mg_wrapfd(mgr, fd, fn, fn_data);
+    //mongoose reads into the free space of recv, a smaller space would cut a record
+    if (c && !mg_iobuf_resize(&c->recv, LOCAL_RECORD_MAX))
+        c->is_closing = 1;
+    return c;
+}
+
+struct mg_connection *local_unix_connect(struct mg_mgr *mgr, const char *url, mg_event_handler_t fn, void *fn_data) {
+    const char *path = url + strlen(LOCAL_UNIX_PREFIX);
+    struct sockaddr_un sun;
+    struct mg_connection *c;
+    int fd;
+
+    memset(&sun, 0, sizeof(sun));
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        MG_ERROR(("unix socket path too long: %s", path));
+        return NULL;
+    }
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        MG_ERROR(("unix socket failed: %d", errno));
+        return NULL;
+    }
+    //a local connect completes at once or fails, no EINPROGRESS
+    if (connect(fd, (struct sockaddr *) &sun, sizeof(sun)) != 0) {
+        MG_ERROR(("connect %s failed: %d", path, errno));
+        close(fd);
+        return NULL;
+    }
+    if ((c = local_unix_wrap(mgr, fd, fn, fn_data)) == NULL)
+        close(fd);
+    return c;
+}
+
+int local_unix_read(struct local_unix *u, struct mg_connection *c, local_frame_fn fn) {
+    size_t ofs = 0;
+    int rc = 0;
+
+    while (c->recv.len - ofs >= 4) {
+        const uint8_t *p = c->recv.buf + ofs;
+        uint32_t len = get_u32(p);
+        if (len < LOCAL_FRAME_HEADER - 4 || len > LOCAL_RECORD_MAX - 4) {
+            rc = -1;
+            break;
+        }
+        if (c->recv.len - ofs < len + 4)
+            break;
+        uint16_t topic_len = (uint16_t) ((p[5] << 8) | p[6]);
+        if (p[4] != LOCAL_FRAME_PUBLISH || topic_len > len - (LOCAL_FRAME_HEADER - 4)) {
+            rc = -1;
+            break;
+        }
+        u->stats.frames_in++;
+        u->stats.bytes_in += len + 4;
+        fn(c, mg_str_n((const char *) p + LOCAL_FRAME_HEADER, topic_len),
+            mg_str_n((const char *) p + LOCAL_FRAME_HEADER + topic_len, len - (LOCAL_FRAME_HEADER - 4) - topic_len));
+        ofs += len + 4;
+    }
+
+    if (rc) {
+        MG_ERROR(("broken frame from iot-rpcd socket, closing"));
+        u->stats.errors++;
+        c->recv.len = 0;
+        c->is_closing = 1;
+        return -1;
+    }
+    mg_iobuf_del(&c->recv, 0, ofs);
+    if (c->recv.size - c->recv.len < LOCAL_RECORD_MAX && !mg_iobuf_resize(&c->recv, c->recv.len + LOCAL_RECORD_MAX))
+        c->is_closing = 1;
+    return 0;
+}
+
+int local_unix_send(struct local_unix *u, struct mg_connection *c, struct mg_str topic, struct mg_str data) {
+    size_t len = LOCAL_FRAME_HEADER + topic.len + data.len;
+    int rc;
+
+    if (len > LOCAL_RECORD_MAX || topic.len > UINT16_MAX) {
+        MG_ERROR(("frame of %lu bytes too large for iot-rpcd socket", (unsigned long) len));
+        u->stats.dropped++;
+        return -1;
+    }
+
+    //keep the order, nothing overtakes pending frames
+    rc = u->pending.count ? 1 : local_sendmsg(c, topic, data);
+    if (rc == 0) {
+        u->stats.frames_out++;
+        u->stats.bytes_out += len;
+        return 0;
+    }
+    if (rc < 0) {
+        MG_ERROR(("iot-rpcd socket send failed: %d", errno));
+        c->is_closing = 1;
+        return -1;
+    }
+
+    struct outq_pub pub = { .topic = topic, .cdata = mg_str_n(NULL, 0), .data = data };
+    if (outq_push(&u->pending, OUTQ_HIGH, &pub, LOCAL_PENDING_BYTES, OUTQ_DROP_NEWEST, mg_millis(), &u->pending_stats)) {
+        u->stats.dropped++;
+        return -1;
+    }
+    u->stats.deferred++;
+    return 0;
+}
+
+size_t local_unix_flush(struct local_unix *u, struct mg_connection *c) {
+    struct outq_msg *m;
+
+    while ((m = outq_peek(&u->pending)) != NULL) {
+        struct outq_pub pub = outq_msg_pub(m);
+        int rc = local_sendmsg(c, pub.topic, pub.data);
+        if (rc > 0)
+            break;
+        if (rc < 0) {
+            MG_ERROR(("iot-rpcd socket send failed: %d", errno));
+            c->is_closing = 1;
+            break;
+        }
+        u->stats.frames_out++;
+        u->stats.bytes_out += LOCAL_FRAME_HEADER + pub.topic.len + pub.data.len;
+        outq_pop(&u->pending, mg_millis(), &u->pending_stats);
+    }
+    return u->pending.count;
+}
+
+void local_unix_reset(struct local_unix *u) {
+    u->stats.dropped += u->pending.count;
+    outq_free(&u->pending);
+}
+
+void local_stats_dump(struct local_unix *u) {
+    MG_INFO(("iot-rpcd socket frames in: %llu, out: %llu, bytes in: %llu, out: %llu, deferred: %llu, dropped: %llu, errors: %llu",
+        (unsigned long long) u->stats.frames_in, (unsigned long long) u->stats.frames_out,
+        (unsigned long long) u->stats.bytes_in, (unsigned long long) u->stats.bytes_out,
+        (unsigned long long) u->stats.deferred, (unsigned long long) u->stats.dropped,
+        (unsigned long long) u->stats.errors));
+}
@@ -0,0 +1,54 @@
+#ifndef __IOT_LOCAL_H__
+#define __IOT_LOCAL_H__
+
+#include <iot/mongoose.h>
+#include "outq.h"
+
+#define LOCAL_UNIX_PREFIX   "unix://"
+#define LOCAL_RECORD_MAX    (128 * 1024)    //largest seqpacket record, recv always keeps this much room
+#define LOCAL_PENDING_BYTES (1024 * 1024)   //frames the socket did not take yet
+#define LOCAL_FLUSH_MS      10              //retry period of pending frames
+
+#define LOCAL_FRAME_HEADER  7               //u32 length, u8 type, u16 topic length, all big endian
+#define LOCAL_FRAME_PUBLISH 1               //topic then payload, same meaning as the mqtt publish it replaces
+
+struct local_stats {
+    uint64_t frames_in;
+    uint64_t frames_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t deferred;          //socket full, frame sent from pending later
+    uint64_t dropped;           //too large, or pending full
+    uint64_t errors;            //broken framing, the connection is closed
+};
+
+/*
+ * iot-rpcd channel over a unix SOCK_SEQPACKET socket instead of the local broker.
+ * each record holds one frame, a frame is the topic and payload of what would have been
+ * an mqtt publish, so replies take the same local_mqtt_msg_callback path.
+ */
+struct local_unix {
+    struct outq pending;
+    struct outq_stats pending_stats;
+    struct local_stats stats;
+};
+
+typedef void (*local_frame_fn)(struct mg_connection *c, struct mg_str topic, struct mg_str data);
+
+int local_is_unix(const char *url);
+//connect unix://path, NULL: failed
+struct mg_connection *local_unix_connect(struct mg_mgr *mgr, const char *url, mg_event_handler_t fn, void *fn_data);
+//hand a connected seqpacket fd to mongoose
+struct mg_connection *local_unix_wrap(struct mg_mgr *mgr, int fd, mg_event_handler_t fn, void *fn_data);
+
+//frames in c->recv to fn, on MG_EV_READ, -1: broken framing
+int local_unix_read(struct local_unix *u, struct mg_connection *c, local_frame_fn fn);
+//one frame in one record, kept in pending when the socket is full, -1: dropped or socket error
+int local_unix_send(struct local_unix *u, struct mg_connection *c, struct mg_str topic, struct mg_str data);
+//send pending frames, return how many are left
+size_t local_unix_flush(struct local_unix *u, struct mg_connection *c);
+void local_unix_reset(struct local_unix *u);
+
+void local_stats_dump(struct local_unix *u);
+
+#endif
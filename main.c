@@ -14,14 +14,49 @@ static void usage(const char *prog, struct client_option *default_opts) {
         "  -C CA    - ca content or file path for cloud mqtts communication, default: NULL\n"
         "  -c CERT  - cert content or file path for cloud mqtts communication, default: NULL\n"
         "  -k KEY   - key content or file path for cloud mqtts communication, default: NULL\n"
+        "  -r PATH  - file keeping the cloud tls session for resumption after restart, default: NULL\n"
         "  -d ADDR  - dns server address, default: '%s'\n"
         "  -t n     - dns server timeout, default: %d\n"
         "  -x PATH  - client connected/disconnected callback script, default: '%s'\n"
         "  -m PATH  - iot-rpcd lua callback script path, default: '%s'\n"
         "  -f NAME  - iot-rpcd lua callback script entrypoint, default: '%s'\n"
+        "  -F MODE  - cloud -> iot-rpcd forward mode, raw or parse, default: '%s'\n"
+        "  -q PATH  - store-and-forward queue file for cloud uplink, default: disabled\n"
+        "  -Q n     - queue file size in bytes, default: %lu\n"
+        "  -N n     - queue max records, 0 means no limit, default: %lu\n"
+        "  -D DROP  - queue full policy, oldest or newest, default: '%s'\n"
+        "  -R n     - queue drain rate, records per second, default: %d\n"
+        "  -S n     - queue file sync interval in ms, default: %d\n"
+        "  -T n     - iot-rpcd reply timeout of cloud requests in ms, default: %d\n"
+        "  -I n     - max in-flight cloud requests, default: %d\n"
+        "  -A       - run lua callbacks on a worker thread, default: event loop\n"
+        "  -L n     - lua callback timeout in ms, 0 means no limit, default: %d\n"
+        "  -B n     - batch window of report replies in ms, 0 means no batching, default: %d\n"
+        "  -b n     - batch size in bytes, default: %lu\n"
+        "  -z n     - deflate batches from n bytes, 0 means never, default: %lu\n"
+        "  -H n     - cloud send buffer high water in bytes, default: %lu\n"
+        "  -O n     - cloud outbound queue size in bytes per session, default: %lu\n"
+        "  -P DROP  - outbound queue full policy, oldest or newest, default: '%s'\n"
+        "  -M n     - cloud mqtt version, 4 (3.1.1) or 5 (falls back to 3.1.1), default: %d\n"
+        "  -W n     - unacked qos 1/2 publishes per cloud session, default: %d\n"
+        "  -e n     - max cloud reconnect backoff in ms, default: %d\n"
+        "  -i n     - metrics snapshot on mg/iot-client/metrics every n s, 0 means off, default: %d\n"
+        "  -X DIR   - spool directory of chunked cloud transfers, on flash, unset sends replies in one publish, default: NULL\n"
+        "  -K PATH  - file keeping adaptive keepalive intervals per network across restarts, default: NULL\n"
         "  -v LEVEL - debug level, from 0 to 4, default: %d\n",
         MG_VERSION, prog, opts->mqtt_serve_address, opts->mqtt_keepalive, \
-        opts->dns4_url, opts->dns4_timeout, opts->callback_lua, opts->module, opts->func, opts->debug_level);
+        opts->dns4_url, opts->dns4_timeout, opts->callback_lua, opts->module, opts->func,\
+        opts->forward_mode == FORWARD_MODE_PARSE ? "parse" : "raw",
+        (unsigned long) opts->queue_size, (unsigned long) opts->queue_max_records,
+        opts->queue_drop_policy == QUEUE_DROP_NEWEST ? "newest" : "oldest",
+        opts->queue_drain_rate, opts->queue_sync_interval,
+        opts->request_timeout, opts->max_inflight, opts->lua_timeout,
+        opts->batch_window, (unsigned long) opts->batch_bytes, (unsigned long) opts->deflate_threshold,
+        (unsigned long) opts->send_high_water, (unsigned long) opts->outq_bytes,
+        opts->outq_drop_policy == OUTQ_DROP_NEWEST ? "newest" : "oldest",
+        opts->cloud_mqtt_version, opts->inflight_window, opts->reconnect_max,
+        opts->metrics_interval,
+        opts->debug_level);
 
     exit(EXIT_FAILURE);
 }
@@ -37,6 +72,8 @@ static void parse_args(int argc, char *argv[], struct client_option *opts) {
                 opts->mqtt_keepalive = 6;
         } else if (strcmp(argv[i], "-C") == 0) {
             opts->cloud_mqtts_ca = argv[++i];
+        } else if (strcmp(argv[i], "-r") == 0) {
+            opts->cloud_tls_session = argv[++i];
         } else if (strcmp(argv[i], "-c") == 0) {
             opts->cloud_mqtts_cert = argv[++i];
         } else if (strcmp(argv[i], "-k") == 0) {
@@ -55,6 +92,96 @@ static void parse_args(int argc, char *argv[], struct client_option *opts) {
             opts->module = argv[++i];
         } else if( strcmp(argv[i], "-f") == 0) {
             opts->func = argv[++i];
+        } else if( strcmp(argv[i], "-F") == 0) {
+            const char *mode = argv[++i];
+            if (mode && strcmp(mode, "parse") == 0)
+                opts->forward_mode = FORWARD_MODE_PARSE;
+            else if (mode && strcmp(mode, "raw") == 0)
+                opts->forward_mode = FORWARD_MODE_RAW;
+            else
+                usage(argv[0], opts);
+        } else if( strcmp(argv[i], "-q") == 0) {
+            opts->queue_path = argv[++i];
+        } else if( strcmp(argv[i], "-Q") == 0) {
+            opts->queue_size = strtoul(argv[++i], NULL, 10);
+        } else if( strcmp(argv[i], "-N") == 0) {
+            opts->queue_max_records = strtoul(argv[++i], NULL, 10);
+        } else if( strcmp(argv[i], "-D") == 0) {
+            const char *drop = argv[++i];
+            if (drop && strcmp(drop, "oldest") == 0)
+                opts->queue_drop_policy = QUEUE_DROP_OLDEST;
+            else if (drop && strcmp(drop, "newest") == 0)
+                opts->queue_drop_policy = QUEUE_DROP_NEWEST;
+            else
+                usage(argv[0], opts);
+        } else if( strcmp(argv[i], "-R") == 0) {
+            opts->queue_drain_rate = atoi(argv[++i]);
+            if (opts->queue_drain_rate < 1)
+                opts->queue_drain_rate = 1;
+        } else if( strcmp(argv[i], "-T") == 0) {
+            opts->request_timeout = atoi(argv[++i]);
+            if (opts->request_timeout < CORR_TICK_MS)
+                opts->request_timeout = CORR_TICK_MS;
+        } else if( strcmp(argv[i], "-I") == 0) {
+            opts->max_inflight = atoi(argv[++i]);
+            if (opts->max_inflight < 1)
+                opts->max_inflight = 1;
+        } else if( strcmp(argv[i], "-A") == 0) {
+            opts->lua_async = 1;
+        } else if( strcmp(argv[i], "-L") == 0) {
+            opts->lua_timeout = atoi(argv[++i]);
+            if (opts->lua_timeout < 0)
+                opts->lua_timeout = 0;
+        } else if( strcmp(argv[i], "-B") == 0) {
+            opts->batch_window = atoi(argv[++i]);
+            if (opts->batch_window < 0)
+                opts->batch_window = 0;
+        } else if( strcmp(argv[i], "-b") == 0) {
+            opts->batch_bytes = strtoul(argv[++i], NULL, 10);
+            if (opts->batch_bytes < 256)
+                opts->batch_bytes = 256;
+        } else if( strcmp(argv[i], "-z") == 0) {
+            opts->deflate_threshold = strtoul(argv[++i], NULL, 10);
+        } else if( strcmp(argv[i], "-H") == 0) {
+            opts->send_high_water = strtoul(argv[++i], NULL, 10);
+            if (opts->send_high_water < 1024)
+                opts->send_high_water = 1024;
+        } else if( strcmp(argv[i], "-O") == 0) {
+            opts->outq_bytes = strtoul(argv[++i], NULL, 10);
+        } else if( strcmp(argv[i], "-P") == 0) {
+            const char *drop = argv[++i];
+            if (drop && strcmp(drop, "oldest") == 0)
+                opts->outq_drop_policy = OUTQ_DROP_OLDEST;
+            else if (drop && strcmp(drop, "newest") == 0)
+                opts->outq_drop_policy = OUTQ_DROP_NEWEST;
+            else
+                usage(argv[0], opts);
+        } else if( strcmp(argv[i], "-M") == 0) {
+            opts->cloud_mqtt_version = atoi(argv[++i]);
+            if (opts->cloud_mqtt_version != 4 && opts->cloud_mqtt_version != 5)
+                usage(argv[0], opts);
+        } else if( strcmp(argv[i], "-W") == 0) {
+            opts->inflight_window = atoi(argv[++i]);
+            if (opts->inflight_window < 1)
+                opts->inflight_window = 1;
+            if (opts->inflight_window > 65535)
+                opts->inflight_window = 65535;
+        } else if( strcmp(argv[i], "-e") == 0) {
+            opts->reconnect_max = atoi(argv[++i]);
+            if (opts->reconnect_max < 1000)
+                opts->reconnect_max = 1000;
+        } else if( strcmp(argv[i], "-i") == 0) {
+            opts->metrics_interval = atoi(argv[++i]);
+            if (opts->metrics_interval < 0)
+                opts->metrics_interval = 0;
+        } else if( strcmp(argv[i], "-K") == 0) {
+            opts->keepalive_state = argv[++i];
+        } else if( strcmp(argv[i], "-X") == 0) {
+            opts->xfer_dir = argv[++i];
+        } else if( strcmp(argv[i], "-S") == 0) {
+            opts->queue_sync_interval = atoi(argv[++i]);
+            if (opts->queue_sync_interval < 100)
+                opts->queue_sync_interval = 100;
         } else {
             usage(argv[0], opts);
         }
@@ -67,13 +194,10 @@ int main(int argc, char *argv[]) {
         .mqtt_serve_address = MQTT_LISTEN_ADDR,
         .mqtt_keepalive = 6,
 
-        .cloud_mqtt_client_id = NULL,
-        .cloud_mqtt_serve_address = NULL,
-        .cloud_mqtt_keepalive = 60,
-
         .cloud_mqtts_ca = NULL,
         .cloud_mqtts_cert = NULL,
         .cloud_mqtts_certkey = NULL,
+        .cloud_tls_session = NULL,
 
         .dns4_url = "udp://119.29.29.29:53", //if you want to use your own dns server, please change this, in a router, perfer to use udp://127.0.0.1:53
         .dns4_timeout = 6,
@@ -82,12 +206,35 @@ int main(int argc, char *argv[]) {
         .callback_lua = LUA_CALLBACK_SCRIPT,
         .module = "plugin/unicom/callback",
         .func = "handler",
+        .forward_mode = FORWARD_MODE_RAW,
+
+        .queue_path = NULL,
+        .queue_size = 256 * 1024,
+        .queue_max_records = 0,
+        .queue_drop_policy = QUEUE_DROP_OLDEST,
+        .queue_drain_rate = 20,
+        .queue_sync_interval = 5000,
+
+        .request_timeout = 10000,
+        .max_inflight = 256,
+
+        .batch_bytes = 8192,
+
+        .send_high_water = 16 * 1024,
+        .outq_bytes = 256 * 1024,
+        .outq_drop_policy = OUTQ_DROP_OLDEST,
+
+        .cloud_mqtt_version = 5,
+        .inflight_window = 16,
+
+        .reconnect_max = 60000,
+
+        .metrics_interval = 10,
     };
 
     parse_args(argc, argv, &opts);
 
     MG_INFO(("IoT-SDK version  : v%s", MG_VERSION));
-    MG_INFO(("Username         : %s", opts.cloud_mqtt_username));
     MG_INFO(("DNSv4 Server     : %s", opts.dns4_url));
     MG_INFO(("Lua handler path : %s", opts.callback_lua));
 
@@ -0,0 +1,120 @@
+#include <iot/mongoose.h>
+#include "metrics.h"
+
+static const char *counter_names[METRIC_COUNTERS] = {
+    "cloud_msgs_down", "cloud_bytes_down", "cloud_msgs_up", "cloud_bytes_up",
+    "local_msgs_in", "local_bytes_in", "local_msgs_out", "local_bytes_out",
+    "cloud_connects", "cloud_opens", "cloud_closes", "local_connects", "local_closes",
+    "lua_calls", "lua_errors", "cache_hits", "cache_coalesced", "cache_misses",
+};
+
+static const char *hist_names[METRIC_HISTS] = { "lua_us", "rpcd_ms", "connect_ms" };
+
+// values below METRICS_SUB are exact, above each power of 2 is split in METRICS_SUB buckets
+static int metrics_bucket(uint64_t v) {
+    if (v < METRICS_SUB)
+        return (int) v;
+    int msb = 63 - __builtin_clzll(v);
+    int idx = (msb - METRICS_SUB_BITS + 1) * METRICS_SUB + (int) ((v >> (msb - METRICS_SUB_BITS)) & (METRICS_SUB - 1));
+    return idx < METRICS_BUCKETS ? idx : METRICS_BUCKETS - 1;
+}
+
+// highest value of bucket idx
+static uint64_t metrics_bucket_max(int idx) {
+    if (idx < METRICS_SUB)
+        return (uint64_t) idx;
+    int msb = idx / METRICS_SUB + METRICS_SUB_BITS - 1;
+    uint64_t low = (uint64_t) (METRICS_SUB + idx % METRICS_SUB) << (msb - METRICS_SUB_BITS);
+    return low + ((uint64_t) 1 << (msb - METRICS_SUB_BITS)) - 1;
+}
+
+void metrics_observe(struct metrics *m, int id, uint64_t v) {
+    struct metrics_hist *h = &m->hists[id];
+    int b = metrics_bucket(v);
+
+    __atomic_store_n(&h->buckets[b], h->buckets[b] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+    if (v > h->max)
+        __atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+}
+
+static void metrics_merge(struct metrics **sets, int n, struct metrics *out) {
+    memset(out, 0, sizeof(*out));
+    for (int k = 0; k < n; k++) {
+        struct metrics *m = sets[k];
+        if (!m)
+            continue;
+        for (int i = 0; i < METRIC_COUNTERS; i++)
+            out->counters[i] += __atomic_load_n(&m->counters[i], __ATOMIC_RELAXED);
+        for (int i = 0; i < METRIC_HISTS; i++) {
+            struct metrics_hist *h = &m->hists[i], *o = &out->hists[i];
+            uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+            o->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            o->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+            if (max > o->max)
+                o->max = max;
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                o->buckets[b] += __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// upper bound of the bucket holding quantile q, capped by the exact max
+static uint64_t metrics_quantile(struct metrics_hist *h, double q) {
+    uint64_t total = 0, seen = 0, rank;
+
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+        total += h->buckets[b];
+    if (total == 0)
+        return 0;
+    rank = (uint64_t) (q * (total - 1)) + 1;
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t v = metrics_bucket_max(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+size_t metrics_json(struct metrics **sets, int n, uint64_t uptime_ms, const char *extra, char *buf, size_t len) {
+    struct metrics all;
+    size_t ofs = 0;
+
+    metrics_merge(sets, n, &all);
+
+#define OUT(...) do { if (ofs < len) ofs += mg_snprintf(buf + ofs, len - ofs, __VA_ARGS__); } while (0)
+    OUT("{\"uptime\":%llu,\"counters\":{", (unsigned long long) uptime_ms);
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+        OUT("%s\"%s\":%llu", i ? "," : "", counter_names[i], (unsigned long long) all.counters[i]);
+    OUT("},\"hists\":{");
+    for (int i = 0; i < METRIC_HISTS; i++) {
+        struct metrics_hist *h = &all.hists[i];
+        OUT("%s\"%s\":{\"count\":%llu,\"avg\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+            i ? "," : "", hist_names[i], (unsigned long long) h->count,
+            (unsigned long long) (h->count ? h->sum / h->count : 0),
+            (unsigned long long) metrics_quantile(h, 0.50), (unsigned long long) metrics_quantile(h, 0.90),
+            (unsigned long long) metrics_quantile(h, 0.99), (unsigned long long) h->max);
+    }
+    OUT("}%s%s}", extra ? "," : "", extra ? extra : "");
+#undef OUT
+
+    return ofs < len ? ofs : 0; //0: buf too small
+}
+
+void metrics_dump(struct metrics **sets, int n) {
+    struct metrics all;
+
+    metrics_merge(sets, n, &all);
+    for (int i = 0; i < METRIC_COUNTERS; i++)
+        MG_INFO(("metric %s: %llu", counter_names[i], (unsigned long long) all.counters[i]));
+    for (int i = 0; i < METRIC_HISTS; i++) {
+        struct metrics_hist *h = &all.hists[i];
+        MG_INFO(("metric %s: count %llu, avg %llu, p50 %llu, p90 %llu, p99 %llu, max %llu", hist_names[i],
+            (unsigned long long) h->count, (unsigned long long) (h->count ? h->sum / h->count : 0),
+            (unsigned long long) metrics_quantile(h, 0.50), (unsigned long long) metrics_quantile(h, 0.90),
+            (unsigned long long) metrics_quantile(h, 0.99), (unsigned long long) h->max));
+    }
+}
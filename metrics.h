@@ -0,0 +1,73 @@
+#ifndef __IOT_METRICS_H__
+#define __IOT_METRICS_H__
+
+#include <iot/mongoose.h>
+
+#define METRICS_SUB_BITS    2                       //4 linear sub-buckets per power of 2, 25% precision
+#define METRICS_SUB         (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS     128                     //values up to 2^32 - 1, larger land in the last one
+
+enum {
+    METRIC_CLOUD_MSGS_DOWN,     //cloud requests received
+    METRIC_CLOUD_BYTES_DOWN,
+    METRIC_CLOUD_MSGS_UP,       //publishes written to cloud connections
+    METRIC_CLOUD_BYTES_UP,
+    METRIC_LOCAL_MSGS_IN,       //iot-rpcd replies
+    METRIC_LOCAL_BYTES_IN,
+    METRIC_LOCAL_MSGS_OUT,      //requests sent to iot-rpcd
+    METRIC_LOCAL_BYTES_OUT,
+    METRIC_CLOUD_CONNECTS,      //connect attempts
+    METRIC_CLOUD_OPENS,         //MG_EV_MQTT_OPEN
+    METRIC_CLOUD_CLOSES,
+    METRIC_LOCAL_CONNECTS,
+    METRIC_LOCAL_CLOSES,
+    METRIC_LUA_CALLS,
+    METRIC_LUA_ERRORS,
+    METRIC_CACHE_HITS,          //cloud queries answered from the cache
+    METRIC_CACHE_COALESCED,     //cloud queries which waited on an identical one
+    METRIC_CACHE_MISSES,
+    METRIC_COUNTERS
+};
+
+enum {
+    METRIC_LUA_US,              //lua callback run time
+    METRIC_RPCD_MS,             //cloud request forwarded to iot-rpcd reply
+    METRIC_CONNECT_MS,          //cloud connect attempt to MG_EV_MQTT_OPEN
+    METRIC_HISTS
+};
+
+struct metrics_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+/*
+ * counters and log-linear histograms of one thread. only the owner thread writes, with
+ * relaxed atomic stores so the event loop can read a worker's set while it runs. nothing
+ * allocates, an update is a few adds.
+ */
+struct metrics {
+    uint64_t counters[METRIC_COUNTERS];
+    struct metrics_hist hists[METRIC_HISTS];
+};
+
+static inline void metrics_add(struct metrics *m, int id, uint64_t n) {
+    __atomic_store_n(&m->counters[id], m->counters[id] + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_observe(struct metrics *m, int id, uint64_t v);
+
+//merge n sets into json {"uptime":..,"counters":{..},"hists":{name:{count,avg,p50,p90,p99,max}}},
+//extra: more members appended to the object, NULL: none
+size_t metrics_json(struct metrics **sets, int n, uint64_t uptime_ms, const char *extra, char *buf, size_t len);
+void metrics_dump(struct metrics **sets, int n);
+
+#endif
@@ -5,15 +5,6 @@
 #include "client.h"
 #include "callback.h"
 
-#define CHECK_JSON_NODE(root, node, typ)    \
-    do {    \
-        if (!cJSON_Is##typ(node)) {    \
-            MG_ERROR(("invalid json node: %s", #node));    \
-            cJSON_Delete(root);    \
-            return -1;    \
-        }  \
-    } while(0)
-
 static void mqtt_ev_open_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
     MG_INFO(("mqtt client connection created"));
 }
@@ -47,7 +38,9 @@ static void mqtt_ev_close_cb(struct mg_connection *c, int ev, void *ev_data, voi
 
     struct client_private *priv = (struct client_private*)c->mgr->userdata;
     MG_INFO(("mqtt client connection closed"));
+    metrics_add(&priv->metrics, METRIC_LOCAL_CLOSES, 1);
     priv->mqtt_conn = NULL; // Mark that we're closed
+    sched_kick(&priv->sched, TASK_MQTT, priv->mqtt_connect_at + MQTT_RECONNECT_MS);
 
 }
 
@@ -128,11 +121,73 @@ static void mqtt_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_dat
     }
 }
 
-// Timer function - recreate client connection if it is closed
-void timer_mqtt_fn(void *arg) {
+// iot-rpcd over a unix seqpacket socket, frames carry the topic and payload of the publish they replace
+static void local_unix_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+
+    struct client_private *priv = (struct client_private*)c->mgr->userdata;
+
+    switch (ev) {
+        case MG_EV_OPEN:
+            MG_INFO(("connect to iot-rpcd: %s", priv->cfg.opts->mqtt_serve_address));
+            break;
+
+        case MG_EV_ERROR:
+            mqtt_ev_error_cb(c, ev, ev_data, fn_data);
+            break;
+
+        case MG_EV_READ:
+            local_unix_read(&priv->local, c, local_mqtt_msg_callback);
+            break;
+
+        case MG_EV_CLOSE:
+            MG_INFO(("iot-rpcd socket closed"));
+            metrics_add(&priv->metrics, METRIC_LOCAL_CLOSES, 1);
+            local_unix_reset(&priv->local);
+            priv->mqtt_conn = NULL;
+            sched_kick(&priv->sched, TASK_MQTT, priv->mqtt_connect_at + MQTT_RECONNECT_MS);
+            break;
+    }
+}
+
+// publish to iot-rpcd on the local channel, mqtt broker or unix socket
+void local_channel_pub(struct client_private *priv, struct mg_str topic, struct mg_str data) {
+
+    if (!priv->mqtt_conn)
+        return;
+    metrics_add(&priv->metrics, METRIC_LOCAL_MSGS_OUT, 1);
+    metrics_add(&priv->metrics, METRIC_LOCAL_BYTES_OUT, data.len);
+
+    if (local_is_unix(priv->cfg.opts->mqtt_serve_address)) {
+        if (local_unix_send(&priv->local, priv->mqtt_conn, topic, data) == 0 && priv->local.pending.count)
+            sched_kick(&priv->sched, TASK_MQTT, mg_millis() + LOCAL_FLUSH_MS);
+        return;
+    }
+
+    struct mg_mqtt_opts pub_opts;
+    memset(&pub_opts, 0, sizeof(pub_opts));
+    pub_opts.topic = topic;
+    pub_opts.message = data;
+    pub_opts.qos = MQTT_QOS, pub_opts.retain = false;
+    mg_mqtt_pub(priv->mqtt_conn, &pub_opts);
+}
+
+// Task function - recreate client connection if it is closed, return when the next ping is due
+uint64_t timer_mqtt_fn(void *arg, uint64_t now) {
     struct mg_mgr *mgr = (struct mg_mgr *)arg;
     struct client_private *priv = (struct client_private*)mgr->userdata;
-    uint64_t now = mg_millis();
+    uint64_t keepalive = (uint64_t) priv->cfg.opts->mqtt_keepalive * 1000;
+
+    //unix socket: no broker, no ping, a dead peer closes the socket
+    if (local_is_unix(priv->cfg.opts->mqtt_serve_address)) {
+        if (priv->mqtt_conn == NULL) {
+            priv->mqtt_conn = local_unix_connect(mgr, priv->cfg.opts->mqtt_serve_address, local_unix_cb, NULL);
+            priv->mqtt_connect_at = now;
+            metrics_add(&priv->metrics, METRIC_LOCAL_CONNECTS, 1);
+            if (priv->mqtt_conn == NULL)
+                return now + MQTT_RECONNECT_MS;
+        }
+        return local_unix_flush(&priv->local, priv->mqtt_conn) ? now + LOCAL_FLUSH_MS : SCHED_NEVER;
+    }
 
     if (priv->mqtt_conn == NULL) {
         struct mg_mqtt_opts opts = { 0 };
@@ -143,9 +198,14 @@ void timer_mqtt_fn(void *arg) {
         opts.keepalive = priv->cfg.opts->mqtt_keepalive;
 
         priv->mqtt_conn = mg_mqtt_connect(mgr, priv->cfg.opts->mqtt_serve_address, &opts, mqtt_cb, NULL);
+        priv->mqtt_connect_at = now;
+        metrics_add(&priv->metrics, METRIC_LOCAL_CONNECTS, 1);
         priv->ping_active = now;
         priv->pong_active = now;
 
+        if (priv->mqtt_conn == NULL) //close kicks a retry, nothing to close here
+            return now + MQTT_RECONNECT_MS;
+
     } else if (priv->cfg.opts->mqtt_keepalive) { //need keep alive
 
         if (now < priv->ping_active) {
@@ -153,31 +213,37 @@ void timer_mqtt_fn(void *arg) {
             priv->ping_active = now;
             priv->pong_active = now;
         }
-        if (now - priv->ping_active >= priv->cfg.opts->mqtt_keepalive * 1000) {
+        if (now - priv->ping_active >= keepalive) {
             mg_mqtt_ping(priv->mqtt_conn);
             priv->ping_active = now;
         }
     }
+
+    if (!keepalive)
+        return SCHED_NEVER;
+
+    //wake for the next ping, and for the pong timeout checked in MG_EV_POLL
+    uint64_t next = priv->ping_active + keepalive;
+    uint64_t pong_deadline = priv->pong_active + keepalive + 3000 + 1;
+    return pong_deadline < next ? pong_deadline : next;
 }
 
 static void cloud_mqtt_ev_open_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
-    MG_INFO(("cloud mqtt client connection created"));
+    struct cloud_session *s = (struct cloud_session *)fn_data;
+    MG_INFO(("cloud mqtt client %d connection created", s->index));
 }
 
 static void cloud_mqtt_ev_connect_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 
     struct client_private *priv = (struct client_private*)c->mgr->userdata;
+    struct cloud_session *s = (struct cloud_session *)fn_data;
 
-    MG_INFO(("cloud mqtt client connection connected"));
-
-    if (mg_url_is_ssl(priv->cfg.opts->cloud_mqtt_serve_address)) {
-        struct mg_tls_opts opts = { 0 };
-        opts.ca = priv->cfg.opts->cloud_mqtts_ca;
-        opts.cert = priv->cfg.opts->cloud_mqtts_cert;
-        opts.certkey = priv->cfg.opts->cloud_mqtts_certkey;
-
-        mg_tls_init(c, &opts);
+    MG_INFO(("cloud mqtt client %d connection connected", s->index));
+    s->stage = CLOUD_STAGE_CONNECTED;
 
+    if (mg_url_is_ssl(s->address)) {
+        s->tls_started = mg_millis();
+        tls_creds_start(&priv->tls, c, s->address, &s->tls_session);
     }
 
 }
@@ -189,58 +255,322 @@ static void cloud_mqtt_ev_error_cb(struct mg_connection *c, int ev, void *ev_dat
 
 static void cloud_mqtt_ev_poll_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 
-    struct client_private *priv = (struct client_private*)c->mgr->userdata;
-    if (!priv->cfg.opts->cloud_mqtt_keepalive) //no keepalive
-        return;
-
+    struct cloud_session *s = (struct cloud_session *)fn_data;
     uint64_t now = mg_millis();
 
-    if (priv->cloud_pong_active && now > priv->cloud_pong_active &&
-        now - priv->cloud_pong_active > (priv->cfg.opts->cloud_mqtt_keepalive + 6)*1000) {
-        MG_INFO(("cloud mqtt client connction timeout"));
+    //no packet at all since the ping, the link is gone even if tcp does not know yet
+    if (s->ping_wait && now > s->ping_wait && now - s->ping_wait > KA_PONG_MS && !c->is_closing) {
+        MG_INFO(("cloud mqtt client %d connction timeout", s->index));
         c->is_closing = 1;
     }
 
 }
 
+// equal jitter: half of the doubled delay is kept, half is random, sessions dropped together spread out
+static uint64_t cloud_backoff(int attempts, int cap_ms) {
+    uint64_t delay = MQTT_RECONNECT_MS;
+    uint32_t r;
+
+    while (attempts-- > 1 && delay < (uint64_t) cap_ms)
+        delay <<= 1;
+    if (delay > (uint64_t) cap_ms)
+        delay = cap_ms;
+    mg_random(&r, sizeof(r));
+    return delay / 2 + r % (delay / 2 + 1);
+}
+
 static void cloud_mqtt_ev_close_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 
     struct client_private *priv = (struct client_private*)c->mgr->userdata;
-    MG_INFO(("cloud mqtt client connection closed"));
-    if ( priv->registered ) {
-        priv->registered = 0;
-        priv->disconnected_check_times = 0;
+    struct cloud_session *s = (struct cloud_session *)fn_data;
+    uint64_t now = mg_millis();
+    MG_INFO(("cloud mqtt client %d connection closed", s->index));
+    metrics_add(&priv->metrics, METRIC_CLOUD_CLOSES, 1);
+    if ( s->registered ) {
+        s->registered = 0;
+        s->disconnected_check_times = 0;
+    }
+    s->conn = NULL; // Mark that we're closed
+
+    //timed out or reset, a ping after a longer idle than the path keeps was lost, the search steps down
+    if ( s->ping_wait && s->ping_interval )
+        ka_probe_fail(&s->probe, &priv->ka, s->ping_interval);
+    s->ping_wait = 0;
+
+    //the broker does not take the version: it refused it (3.1.1 or mqtt 5 code), or dropped our CONNECT
+    //without a CONNACK. tls failures, bad credentials and resets before the CONNECT keep the version
+    int refused = s->connack == 0x01 || s->connack == 0x84 || (s->connack < 0 && s->connect_sent);
+    //try 3.1.1 next time, and the other way round until one is accepted
+    if ( refused && !s->version_ok && priv->cfg.opts->cloud_mqtt_version == 5 ) {
+        s->version = s->version == 5 ? 4 : 5;
+        if ( s->version == 4 ) {
+            priv->cloud_stats.fallbacks++;
+            MG_INFO(("cloud mqtt client %d mqtt 5 refused, fall back to 3.1.1", s->index));
+        }
+    }
+    //a rejected session ticket must not be offered again
+    if ( s->tls_started ) {
+        s->tls_started = 0;
+        priv->tls.stats.failed++;
+        tls_session_free(&s->tls_session);
     }
-    priv->cloud_mqtt_conn = NULL; // Mark that we're closed
 
-}
+    //cached address did not answer, the next connect resolves the name again
+    if ( s->stage == CLOUD_STAGE_CONNECTING && s->by_cache )
+        dns_forget(&priv->dns, mg_url_host(s->address));
+    s->stage = CLOUD_STAGE_CONNECTING;
 
-static void cloud_mqtt_ev_mqtt_open_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+    //a connection which held starts the backoff over
+    if ( s->opened_at && now - s->opened_at >= CLOUD_STABLE_MS )
+        s->retry_attempts = 0;
+    s->opened_at = 0;
+    s->retry_due = now + cloud_backoff(s->retry_attempts, priv->cfg.opts->reconnect_max);
 
-    struct client_private *priv = (struct client_private*)c->mgr->userdata;
+    cloud_outq_abort(s);
+    cloud_batch_abort(s);
+    xfer_rewind(&priv->xfer, s->index); //the next connection resumes from the last ack
 
-    // MQTT connect is successful
-    MG_INFO(("connect to mqtt server: %s", priv->cfg.opts->cloud_mqtt_serve_address));
+    sched_kick(&priv->sched, TASK_CLOUD, priv->cloud_check_due);
+
+}
+
+static void cloud_mqtt_sub(struct mg_connection *c, struct cloud_session *s, const char *topic) {
     struct mg_mqtt_opts sub_opts;
     memset(&sub_opts, 0, sizeof(sub_opts));
-    struct mg_str subt = mg_str(priv->cfg.opts->topic_sub);
+    struct mg_str subt = mg_str(topic);
     sub_opts.topic = subt;
-    sub_opts.qos = priv->cfg.opts->cloud_mqtt_qos;
+    sub_opts.qos = s->qos;
     mg_mqtt_sub(c, &sub_opts);
     MG_INFO(("subscribed to %.*s", (int) subt.len, subt.ptr));
+}
+
+// mongoose 7.9 has no unsubscribe, the packet is built here
+static void cloud_mqtt_unsub(struct mg_connection *c, const char *topic) {
+    size_t len = strlen(topic);
+    uint16_t id = ++c->mgr->mqtt_id;
+    uint8_t b[2];
+
+    if (id == 0)
+        id = ++c->mgr->mqtt_id;
+    mg_mqtt_send_header(c, MQTT_CMD_UNSUBSCRIBE, 2, (uint32_t) (2 + (c->is_mqtt5 ? 1 : 0) + 2 + len));
+    b[0] = (uint8_t) (id >> 8);
+    b[1] = (uint8_t) id;
+    mg_send(c, b, sizeof(b));
+    if (c->is_mqtt5) //no properties
+        mg_send(c, "", 1);
+    b[0] = (uint8_t) (len >> 8);
+    b[1] = (uint8_t) len;
+    mg_send(c, b, sizeof(b));
+    mg_send(c, topic, len);
+    MG_INFO(("unsubscribed from %s", topic));
+}
+
+static void cloud_mqtt_ev_mqtt_open_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+
+    struct client_private *priv = (struct client_private*)c->mgr->userdata;
+    struct cloud_session *s = (struct cloud_session *)fn_data;
+
+    // MQTT connect is successful
+    MG_INFO(("connect to mqtt server: %s, client %d", s->address, s->index));
+    cJSON *item, *sub = cJSON_GetObjectItem((cJSON *) s->cfg, "topic_sub");
+    if (cJSON_IsArray(sub)) {
+        cJSON_ArrayForEach(item, sub)
+            cloud_mqtt_sub(c, s, item->valuestring);
+    } else {
+        cloud_mqtt_sub(c, s, s->topic_sub);
+    }
+
+    s->registered = 1;
+    s->stage = CLOUD_STAGE_OPEN;
+    s->opened_at = mg_millis();
+    metrics_add(&priv->metrics, METRIC_CLOUD_OPENS, 1);
+    metrics_observe(&priv->metrics, METRIC_CONNECT_MS, s->opened_at - s->connect_at);
+    s->version_ok = 1;
+    if (c->is_mqtt5) {
+        priv->cloud_stats.mqtt5++;
+        if (!s->receive_max) //CONNACK without receive maximum
+            s->receive_max = CLOUD_RECEIVE_MAX;
+    }
+    delta_reset(&priv->delta, s->index); //cloud may have lost state, next reports are full snapshots
+    cloud_mqtt_event_callback(c->mgr, s, "connected");
+
+    if (s->window.count > 0) { //unacked publishes of the last connection, in order, before anything new
+        MG_INFO(("cloud mqtt client %d resend %d publishes", s->index, s->window.count));
+        inflight_resend(&s->window, c, &priv->inflight_stats);
+    }
+    cloud_outq_release(s); //posted while the session was opening
+
+    if (s->index == 0) { //schedule may depend on the cloud config, reload it
+        priv->report_stale = 1;
+        sched_kick(&priv->sched, TASK_REPORT, mg_millis());
+    }
+
+    MG_DEBUG(("session %d memory, state: %lu, config: %lu, io buffers: %lu", s->index,
+        (unsigned long) sizeof(struct cloud_session), (unsigned long) cloud_session_cfg_bytes(s),
+        (unsigned long) (c->recv.size + c->send.size)));
+
+    if (priv->xfer.active > 0)
+        sched_kick(&priv->sched, TASK_XFER, mg_millis());
+
+    if (priv->queue && s->queue_pending && queue_count(priv->queue) > 0) {
+        MG_INFO(("cloud mqtt client %d drain queued records, %lu in queue", s->index,
+            (unsigned long) queue_count(priv->queue)));
+        priv->queue_drain_budget = 0;
+        sched_kick(&priv->sched, TASK_QUEUE, mg_millis());
+    }
+
+}
+
+static int mqtt5_prop_bytes(const uint8_t **pp, const uint8_t *end, struct mg_str *val) {
+    const uint8_t *p = *pp;
+    if (end - p < 2)
+        return -1;
+    size_t len = ((size_t) p[0] << 8) | p[1];
+    if ((size_t) (end - p - 2) < len)
+        return -1;
+    *val = mg_str_n((const char *) p + 2, len);
+    *pp = p + 2 + len;
+    return 0;
+}
+
+// walk mqtt5 properties in [*pp, end), 1: prop filled, 0: end or malformed
+static int mqtt5_prop_next(const uint8_t **pp, const uint8_t *end, struct mg_mqtt_prop *prop) {
+    const uint8_t *p = *pp;
+
+    if (p >= end)
+        return 0;
+    memset(prop, 0, sizeof(*prop));
+    prop->id = *p++;
+
+    switch (prop->id) {
+        case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A: //byte
+            if (end - p < 1)
+                return 0;
+            prop->iv = *p++;
+            break;
+        case 0x13: case 0x21: case 0x22: case 0x23: //two byte integer
+            if (end - p < 2)
+                return 0;
+            prop->iv = ((uint32_t) p[0] << 8) | p[1];
+            p += 2;
+            break;
+        case 0x02: case 0x11: case 0x18: case 0x27: //four byte integer
+            if (end - p < 4)
+                return 0;
+            prop->iv = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
+            p += 4;
+            break;
+        case 0x0B: { //variable byte integer
+            int shift = 0;
+            do {
+                if (p >= end || shift > 21)
+                    return 0;
+                prop->iv |= (uint32_t) (*p & 0x7f) << shift;
+                shift += 7;
+            } while (*p++ & 0x80);
+            break;
+        }
+        case 0x26: //string pair
+            if (mqtt5_prop_bytes(&p, end, &prop->key) || mqtt5_prop_bytes(&p, end, &prop->val))
+                return 0;
+            break;
+        case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F: //string, binary
+            if (mqtt5_prop_bytes(&p, end, &prop->val))
+                return 0;
+            break;
+        default:
+            return 0;
+    }
+
+    *pp = p;
+    return 1;
+}
+
+// CONNACK properties, mongoose parses properties of PUBLISH only
+static void cloud_mqtt_connack_props(struct cloud_session *s, struct mg_mqtt_message *mm) {
+    const uint8_t *p = (const uint8_t *) mm->dgram.ptr + 1, *end = (const uint8_t *) mm->dgram.ptr + mm->dgram.len;
+    struct mg_mqtt_prop prop;
+    uint32_t len = 0;
+    int shift = 0;
+
+    while (p < end && (*p++ & 0x80)) //remaining length
+        ;
+    p += 2; //acknowledge flags, reason code
+    do {
+        if (p >= end || shift > 21)
+            return;
+        len |= (uint32_t) (*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    if (len < (uint32_t) (end - p))
+        end = p + len;
+
+    while (mqtt5_prop_next(&p, end, &prop)) {
+        if (prop.id == MQTT_PROP_RECEIVE_MAXIMUM)
+            s->receive_max = (uint16_t) prop.iv;
+        else if (prop.id == MQTT_PROP_TOPIC_ALIAS_MAXIMUM)
+            s->alias_max = (uint16_t) prop.iv;
+        else if (prop.id == MQTT_PROP_MAXIMUM_QOS)
+            s->max_qos = (uint8_t) prop.iv;
+    }
+
+    MG_INFO(("cloud mqtt client %d mqtt 5, receive maximum: %u, topic alias maximum: %u, maximum qos: %u",
+        s->index, s->receive_max, s->alias_max, s->max_qos));
+}
+
+// variable header of a packet, after the fixed header
+static const uint8_t *mqtt_packet_body(struct mg_str dgram, const uint8_t **end) {
+    const uint8_t *p = (const uint8_t *) dgram.ptr + 1;
+    *end = (const uint8_t *) dgram.ptr + dgram.len;
+    while (p < *end && (*p++ & 0x80))
+        ;
+    return p;
+}
+
+// PUBACK, PUBREC or PUBCOMP of a qos publish
+static void cloud_mqtt_ack(struct cloud_session *s, struct mg_mqtt_message *mm) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    const uint8_t *end, *p = mqtt_packet_body(mm->dgram, &end);
+
+    if (end - p < 2)
+        return;
 
-    priv->registered = 1;
-    cloud_mqtt_event_callback(c->mgr, "connected");
+    uint16_t id = (uint16_t) ((p[0] << 8) | p[1]);
+    struct inflight_entry *e = inflight_find(&s->window, id);
+    if (!e) {
+        priv->inflight_stats.unknown++;
+        return;
+    }
+    if (end - p > 2 && p[2] >= 0x80) //mqtt5 reason code, nothing to retry
+        MG_ERROR(("cloud mqtt client %d publish %u rejected, reason: 0x%02x", s->index, id, p[2]));
 
+    if (mm->cmd == MQTT_CMD_PUBREC && e->qos == 2 && (end - p == 2 || p[2] < 0x80)) {
+        e->state = INFLIGHT_WAIT_COMP; //stays in the window until PUBCOMP, mongoose sent PUBREL
+        return;
+    }
+
+    inflight_release(&s->window, e, mg_millis(), &priv->inflight_stats);
+    cloud_outq_release(s);
 }
 
 static void cloud_mqtt_ev_mqtt_cmd_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 
     struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
     struct client_private *priv = (struct client_private*)c->mgr->userdata;
-
-    if (mm->cmd == MQTT_CMD_PINGRESP) {
-        priv->cloud_pong_active = mg_millis();
+    struct cloud_session *s = (struct cloud_session *)fn_data;
+
+    if (mm->cmd == MQTT_CMD_CONNACK) {
+        const uint8_t *end, *p = mqtt_packet_body(mm->dgram, &end);
+        if (p + 1 < end)
+            s->connack = p[1];
+        if (p < end && (*p & 1)) {
+            priv->cloud_stats.sessions_resumed++;
+            MG_INFO(("cloud mqtt client %d session resumed, %d publishes in flight", s->index, s->window.count));
+        }
+        if (c->is_mqtt5)
+            cloud_mqtt_connack_props(s, mm);
+    } else if (mm->cmd == MQTT_CMD_PUBACK || mm->cmd == MQTT_CMD_PUBREC || mm->cmd == MQTT_CMD_PUBCOMP) {
+        cloud_mqtt_ack(s, mm);
     }
 
 }
@@ -248,17 +578,52 @@ static void cloud_mqtt_ev_mqtt_cmd_cb(struct mg_connection *c, int ev, void *ev_
 static void cloud_mqtt_ev_mqtt_msg_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 
     struct mg_mqtt_message *mm = (struct mg_mqtt_message *) ev_data;
+    struct mg_str resp_topic = MG_NULL_STR, cdata = MG_NULL_STR;
     MG_DEBUG(("received %.*s <- %.*s", (int) mm->data.len, mm->data.ptr,
         (int) mm->topic.len, mm->topic.ptr));
 
+    // mqtt5 request, the reply goes to its response topic with its correlation data
+    if (c->is_mqtt5 && mm->props_size > 0 && mm->props_start + mm->props_size <= mm->dgram.len) {
+        const uint8_t *p = (const uint8_t *) mm->dgram.ptr + mm->props_start, *end = p + mm->props_size;
+        struct mg_mqtt_prop prop;
+        while (mqtt5_prop_next(&p, end, &prop)) {
+            if (prop.id == MQTT_PROP_RESPONSE_TOPIC)
+                resp_topic = prop.val;
+            else if (prop.id == MQTT_PROP_CORRELATION_DATA)
+                cdata = prop.val;
+        }
+    }
+
     // handle msg from cloud mqtt server
-    cloud_mqtt_msg_callback(c, mm->topic, mm->data);
+    cloud_mqtt_msg_callback((struct cloud_session *)fn_data, mm->topic, resp_topic, cdata, mm->data);
 
 }
 
 
+// any inbound packet is liveness, PINGRESP or not, and answers a pending ping
+static void cloud_mqtt_ev_read_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+
+    struct client_private *priv = (struct client_private*)c->mgr->userdata;
+    struct cloud_session *s = (struct cloud_session *)fn_data;
+
+    s->rx_active = mg_millis();
+    if (s->ping_wait) {
+        if (s->ping_interval)
+            ka_probe_ok(&s->probe, &priv->ka, s->ping_interval);
+        s->ping_wait = 0;
+    }
+
+}
+
 static void cloud_mqtt_cb(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
 
+    struct cloud_session *s = (struct cloud_session *)fn_data;
+    if (s->tls_started && !c->is_tls_hs && ev != MG_EV_CLOSE) { //first event after the handshake
+        struct client_private *priv = (struct client_private*)c->mgr->userdata;
+        tls_creds_done(&priv->tls, c, mg_millis() - s->tls_started);
+        s->tls_started = 0;
+    }
+
     switch (ev) {
         case MG_EV_OPEN:
             cloud_mqtt_ev_open_cb(c, ev, ev_data, fn_data);
@@ -288,12 +653,392 @@ static void cloud_mqtt_cb(struct mg_connection *c, int ev, void *ev_data, void *
             cloud_mqtt_ev_poll_cb(c, ev, ev_data, fn_data);
             break;
 
+        case MG_EV_READ:
+            cloud_mqtt_ev_read_cb(c, ev, ev_data, fn_data);
+            break;
+
+        case MG_EV_WRITE:
+            s->tx_active = mg_millis();
+            if (s->stage == CLOUD_STAGE_CONNECTED && c->send.len == 0)
+                s->connect_sent = 1;
+            cloud_outq_release(s);
+            break;
+
         case MG_EV_CLOSE:
             cloud_mqtt_ev_close_cb(c, ev, ev_data, fn_data);
             break;
     }
 }
 
+static int cloud_mqtt_config_check(cJSON *data) {
+    static const char *strs[] = {"address", "client_id", "user", "password", "topic_pub"};
+    static const char *nums[] = {"qos", "keepalive"};
+    cJSON *item, *sub = cJSON_GetObjectItem(data, "topic_sub");
+
+    //one topic, or a list of them
+    if (cJSON_IsArray(sub) && cJSON_GetArraySize(sub) > 0) {
+        cJSON_ArrayForEach(item, sub) {
+            if (!cJSON_IsString(item) || !route_filter_valid(item->valuestring)) {
+                MG_ERROR(("invalid json node: topic_sub"));
+                return -1;
+            }
+        }
+    } else if (!cJSON_IsString(sub)) {
+        MG_ERROR(("invalid json node: topic_sub"));
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+        if (!cJSON_IsString(cJSON_GetObjectItem(data, strs[i]))) {
+            MG_ERROR(("invalid json node: %s", strs[i]));
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+        if (!cJSON_IsNumber(cJSON_GetObjectItem(data, nums[i]))) {
+            MG_ERROR(("invalid json node: %s", nums[i]));
+            return -1;
+        }
+    }
+
+    //optional, "json" or "cbor"
+    const char *encoding = cJSON_GetStringValue(cJSON_GetObjectItem(data, "encoding"));
+    if (cJSON_GetObjectItem(data, "encoding") && (!encoding || (strcmp(encoding, "json") && strcmp(encoding, "cbor")))) {
+        MG_ERROR(("invalid json node: encoding"));
+        return -1;
+    }
+
+    //optional, numbers of the table may be left out
+    cJSON *xfer = cJSON_GetObjectItem(data, "transfer");
+    if (xfer && !cJSON_IsObject(xfer)) {
+        MG_ERROR(("invalid json node: transfer"));
+        return -1;
+    }
+    cJSON_ArrayForEach(item, xfer) {
+        if (!cJSON_IsNumber(item)) {
+            MG_ERROR(("invalid json node: transfer.%s", item->string));
+            return -1;
+        }
+    }
+
+    //optional, { min = 30, network = "46001" }
+    cJSON *ka = cJSON_GetObjectItem(data, "keepalive_adaptive");
+    if (ka && (!cJSON_IsObject(ka) ||
+        (cJSON_GetObjectItem(ka, "min") && !cJSON_IsNumber(cJSON_GetObjectItem(ka, "min"))) ||
+        (cJSON_GetObjectItem(ka, "network") && !cJSON_IsString(cJSON_GetObjectItem(ka, "network"))))) {
+        MG_ERROR(("invalid json node: keepalive_adaptive"));
+        return -1;
+    }
+    return 0;
+}
+
+// bytes held by the session config: cJSON nodes plus key and value strings
+size_t cloud_session_cfg_bytes(struct cloud_session *s) {
+    cJSON *item, *cfg = (cJSON *)s->cfg;
+    size_t n = 0;
+
+    if (!cfg)
+        return 0;
+
+    n = sizeof(cJSON);
+    cJSON_ArrayForEach(item, cfg) {
+        n += sizeof(cJSON) + (item->string ? strlen(item->string) + 1 : 0) +
+            (item->valuestring ? strlen(item->valuestring) + 1 : 0);
+    }
+    return n;
+}
+
+/*
+routes = {
+    { topic = "cmd/+/set", module = "plugin/unicom/cmd", func = "set" },
+    { topic = "ota/#", module = "plugin/ota", func = "handler" },
+    { topic = "ping", action = "ack" },
+    { topic = "debug/#", action = "drop" },
+}
+a bad route is skipped, the others still apply
+*/
+static void cloud_session_routes(struct cloud_session *s, cJSON *routes) {
+    cJSON *item;
+
+    route_free(&s->routes);
+    if (!cJSON_IsArray(routes))
+        return;
+    cJSON_ArrayForEach(item, routes) {
+        const char *topic = cJSON_GetStringValue(cJSON_GetObjectItem(item, "topic"));
+        const char *action = cJSON_GetStringValue(cJSON_GetObjectItem(item, "action"));
+        int a = ROUTE_FORWARD;
+
+        if (action && strcmp(action, "drop") == 0)
+            a = ROUTE_DROP;
+        else if (action && strcmp(action, "ack") == 0)
+            a = ROUTE_ACK;
+        else if (action && strcmp(action, "forward") != 0)
+            a = -1;
+        if (a < 0 || route_add(&s->routes, topic, cJSON_GetStringValue(cJSON_GetObjectItem(item, "module")),
+            cJSON_GetStringValue(cJSON_GetObjectItem(item, "func")), a))
+            MG_ERROR(("cloud mqtt client %d invalid route %s", s->index, topic ? topic : "(null)"));
+    }
+    if (s->routes.num_targets)
+        MG_INFO(("cloud mqtt client %d routes: %d", s->index, s->routes.num_targets));
+}
+
+/*
+cache = { ["call:system.board"] = 30, get_status = 5 }
+method, or method:object.method of a ubus style param, to seconds its reply is kept
+*/
+static void cloud_cache_rules(struct client_private *priv, cJSON *rules) {
+    cJSON *item;
+
+    cache_rules_clear(&priv->cache);
+    if (!cJSON_IsObject(rules))
+        return;
+    cJSON_ArrayForEach(item, rules) {
+        if (!cJSON_IsNumber(item) || cache_rule_add(&priv->cache, item->string, (int) (cJSON_GetNumberValue(item) * 1000)))
+            MG_ERROR(("invalid cache rule %s", item->string));
+    }
+    if (priv->cache.num_rules)
+        MG_INFO(("cache rules: %d", priv->cache.num_rules));
+}
+
+// number of the transfer table, clamped to lo..hi, def when left out
+static uint32_t cloud_xfer_num(cJSON *xfer, const char *key, uint32_t def, uint32_t lo, uint32_t hi) {
+    cJSON *item = cJSON_GetObjectItem(xfer, key);
+    double v = cJSON_IsNumber(item) ? cJSON_GetNumberValue(item) : def;
+    return v < lo ? lo : v > hi ? hi : (uint32_t) v;
+}
+
+/*
+transfer = { threshold = 65536, chunk = 16384, window = 8 }
+replies from threshold bytes go in chunks, the cloud acks them, see xfer.h
+*/
+static void cloud_session_xfer(struct cloud_session *s, cJSON *xfer) {
+    memset(&s->xfer, 0, sizeof(s->xfer));
+    if (!cJSON_IsObject(xfer))
+        return;
+    s->xfer.chunk = cloud_xfer_num(xfer, "chunk", XFER_CHUNK, XFER_CHUNK_MIN, XFER_CHUNK_MAX);
+    s->xfer.window = cloud_xfer_num(xfer, "window", XFER_WINDOW, 1, XFER_WINDOW_MAX);
+    s->xfer.threshold = cloud_xfer_num(xfer, "threshold", XFER_THRESHOLD, s->xfer.chunk, UINT32_MAX);
+    MG_INFO(("cloud mqtt client %d transfers from %lu bytes, chunk: %u, window: %u", s->index,
+        (unsigned long) s->xfer.threshold, s->xfer.chunk, s->xfer.window));
+}
+
+/*
+keepalive_adaptive = { min = 30, network = "46001" }
+idle pings at the longest interval between min and keepalive the network keeps a connection,
+found by binary search and kept per network name in -K, "default" when there is none
+*/
+static void cloud_session_keepalive(struct cloud_session *s, cJSON *ka) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    cJSON *min = cJSON_GetObjectItem(ka, "min");
+    const char *network = cJSON_GetStringValue(cJSON_GetObjectItem(ka, "network"));
+
+    s->probe.network[0] = '\0';
+    if (!cJSON_IsObject(ka) || s->keepalive <= 0)
+        return;
+    ka_probe_init(&s->probe, &priv->ka, network && network[0] ? network : "default",
+        cJSON_IsNumber(min) && cJSON_GetNumberValue(min) >= 1 ? (uint32_t) cJSON_GetNumberValue(min) : KA_MIN,
+        (uint32_t) s->keepalive);
+    MG_INFO(("cloud mqtt client %d adaptive keepalive on %s, %u..%u s, interval %u s", s->index, s->probe.network,
+        s->probe.min, s->probe.max, ka_probe_interval(&s->probe)));
+}
+
+// session takes another identity, what it kept for the old one must not reach the cloud under the new one
+static void cloud_session_forget(struct cloud_session *s) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+
+    delta_reset(&priv->delta, s->index);
+    corr_forget(&priv->corr, s->index);
+    cache_forget(&priv->cache, s->index);
+    for (int i = 0; i < XFER_MAX; i++) {
+        if (priv->xfer.slots[i].id && priv->xfer.slots[i].session == s->index)
+            xfer_end(&priv->xfer, &priv->xfer.slots[i], 0);
+    }
+    inflight_free(&s->window);
+    inflight_init(&s->window, priv->cfg.opts->inflight_window);
+    outq_free(&s->outq);
+    batch_reset(&s->batch);
+    memset(&s->queue_cur, 0, sizeof(s->queue_cur));
+    s->queue_pending = 1;
+}
+
+// apply identity config, called while session is disconnected, or by cloud_session_update
+static void cloud_session_apply(struct cloud_session *s, cJSON *data) {
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    const char *client_id = cJSON_GetStringValue(cJSON_GetObjectItem(data, "client_id"));
+    cJSON *cfg = cJSON_Duplicate(data, 1);
+    if (!cfg)
+        return;
+
+    if (s->client_id && client_id && strcmp(s->client_id, client_id) != 0) {
+        MG_INFO(("cloud mqtt client %d identity %s replaced by %s", s->index, s->client_id, client_id));
+        cloud_session_forget(s);
+    }
+
+    //a new broker gets the configured version again
+    const char *address = cJSON_GetStringValue(cJSON_GetObjectItem(cfg, "address"));
+    if (!s->version || !s->address || !address || strcmp(s->address, address) != 0) {
+        s->version = priv->cfg.opts->cloud_mqtt_version == 5 ? 5 : 4;
+        s->version_ok = 0;
+        tls_session_free(&s->tls_session);
+    }
+
+    if (s->cfg)
+        cJSON_Delete(s->cfg);
+    s->cfg = cfg;
+
+    s->address = cJSON_GetStringValue(cJSON_GetObjectItem(cfg, "address"));
+    s->client_id = cJSON_GetStringValue(cJSON_GetObjectItem(cfg, "client_id"));
+    s->user = cJSON_GetStringValue(cJSON_GetObjectItem(cfg, "user"));
+    s->password = cJSON_GetStringValue(cJSON_GetObjectItem(cfg, "password"));
+    cJSON *sub = cJSON_GetObjectItem(cfg, "topic_sub");
+    s->topic_sub = cJSON_GetStringValue(cJSON_IsArray(sub) ? cJSON_GetArrayItem(sub, 0) : sub);
+    s->topic_pub = cJSON_GetStringValue(cJSON_GetObjectItem(cfg, "topic_pub"));
+    s->qos = cJSON_GetNumberValue(cJSON_GetObjectItem(cfg, "qos"));
+    s->keepalive = cJSON_GetNumberValue(cJSON_GetObjectItem(cfg, "keepalive"));
+    const char *encoding = cJSON_GetStringValue(cJSON_GetObjectItem(cfg, "encoding"));
+    s->encoding = encoding && strcmp(encoding, "cbor") == 0 ? CLOUD_ENCODING_CBOR : CLOUD_ENCODING_JSON;
+    if (s->encoding == CLOUD_ENCODING_CBOR)
+        MG_INFO(("cloud mqtt client %d payload encoding: cbor", s->index));
+
+    cloud_session_xfer(s, cJSON_GetObjectItem(cfg, "transfer"));
+    cloud_session_keepalive(s, cJSON_GetObjectItem(cfg, "keepalive_adaptive"));
+    cloud_session_routes(s, cJSON_GetObjectItem(cfg, "routes"));
+    if (s->index == 0)
+        cloud_cache_rules(priv, cJSON_GetObjectItem(cfg, "cache"));
+}
+
+// topic i of topic_sub, a string or a list of them, NULL: no more
+static const char *cloud_sub_at(cJSON *sub, int i) {
+    if (cJSON_IsArray(sub))
+        return cJSON_GetStringValue(cJSON_GetArrayItem(sub, i));
+    return i == 0 ? cJSON_GetStringValue(sub) : NULL;
+}
+
+static int cloud_sub_has(cJSON *sub, const char *topic) {
+    const char *t;
+    for (int i = 0; (t = cloud_sub_at(sub, i)) != NULL; i++) {
+        if (strcmp(t, topic) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// subscriptions of an open connection from old to the config of s, new topics, or all of them for a new qos
+static void cloud_session_resub(struct cloud_session *s, cJSON *old, int old_qos) {
+    cJSON *olds = cJSON_GetObjectItem(old, "topic_sub"), *news = cJSON_GetObjectItem((cJSON *) s->cfg, "topic_sub");
+    const char *t;
+
+    for (int i = 0; (t = cloud_sub_at(news, i)) != NULL; i++) {
+        if (s->qos != old_qos || !cloud_sub_has(olds, t))
+            cloud_mqtt_sub(s->conn, s, t);
+    }
+    for (int i = 0; (t = cloud_sub_at(olds, i)) != NULL; i++) {
+        if (!cloud_sub_has(news, t))
+            cloud_mqtt_unsub(s->conn, t);
+    }
+}
+
+// new config of a connected session: a new broker or identity reconnects, anything else is applied in place
+static void cloud_session_update(struct cloud_session *s, cJSON *data) {
+    static const char *conn_keys[] = {"address", "client_id", "user", "password"};
+    cJSON *old = (cJSON *) s->cfg, *cfg;
+    struct ka_probe probe = s->probe;
+    int old_qos = s->qos;
+
+    if (cJSON_Compare(old, data, 1))
+        return;
+
+    for (size_t i = 0; i < sizeof(conn_keys) / sizeof(conn_keys[0]); i++) {
+        if (!cJSON_Compare(cJSON_GetObjectItem(old, conn_keys[i]), cJSON_GetObjectItem(data, conn_keys[i]), 1)) {
+            MG_INFO(("cloud mqtt client %d %s changed, reconnect", s->index, conn_keys[i]));
+            s->conn->is_draining = 1; //the close event connects again, with the new config
+            return;
+        }
+    }
+
+    //CONNECT carried the keepalive, a new one waits for the next connection
+    if ((cfg = cJSON_Duplicate(data, 1)) == NULL)
+        return;
+    if (cJSON_GetObjectItem(cfg, "keepalive")) {
+        cJSON *ka = cJSON_CreateNumber(s->keepalive);
+        if (!ka || !cJSON_ReplaceItemInObject(cfg, "keepalive", ka))
+            cJSON_Delete(ka);
+    } else {
+        cJSON_AddNumberToObject(cfg, "keepalive", s->keepalive);
+    }
+
+    s->cfg = NULL; //old is kept for the diff
+    cloud_session_apply(s, cfg);
+    cJSON_Delete(cfg);
+    if (!s->cfg) { //out of memory, nothing changed
+        s->cfg = old;
+        return;
+    }
+
+    //same search, its counters and the interval of the ping in flight go on
+    if (strcmp(probe.network, s->probe.network) == 0 && probe.min == s->probe.min && probe.max == s->probe.max)
+        s->probe = probe;
+    if (s->stage == CLOUD_STAGE_OPEN)
+        cloud_session_resub(s, old, old_qos);
+    //the broker has the alias bound to the old topic, the next publish binds it again
+    if (strcmp(cJSON_GetStringValue(cJSON_GetObjectItem(old, "topic_pub")), s->topic_pub) != 0)
+        s->alias_set = 0;
+    cJSON_Delete(old);
+    MG_INFO(("cloud mqtt client %d config updated in place", s->index));
+}
+
+static int cloud_sessions_grow(struct client_private *priv, int n) {
+    struct cloud_session **sessions;
+
+    if (n <= priv->num_sessions)
+        return 0;
+
+    sessions = realloc(priv->sessions, n * sizeof(struct cloud_session *));
+    if (!sessions)
+        return -1;
+    priv->sessions = sessions;
+
+    while (priv->num_sessions < n) {
+        struct cloud_session *s = calloc(1, sizeof(struct cloud_session));
+        if (!s)
+            return -1;
+        s->mgr = &priv->mgr;
+        s->index = priv->num_sessions;
+        inflight_init(&s->window, priv->cfg.opts->inflight_window);
+        s->queue_pending = 1; //records of the identity may be left from the last run
+        if (s->index == 0)
+            mg_snprintf(s->reply_topic, sizeof(s->reply_topic), "%s", IOT_CLIENT_RPCD_TOPIC_PREFIX);
+        else
+            mg_snprintf(s->reply_topic, sizeof(s->reply_topic), "%s-%d", IOT_CLIENT_RPCD_TOPIC_PREFIX, s->index);
+        priv->sessions[priv->num_sessions++] = s;
+    }
+
+    return 0;
+}
+
+// session of identity client_id besides the primary one: its own, one never used, a new one,
+// or at the limit one of a removed identity. -1: none left
+static int cloud_session_slot(struct client_private *priv, cJSON **items, const char *client_id) {
+    int fresh = -1, idle = -1;
+
+    for (int i = 1; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        if (items[i])
+            continue;
+        if (s->client_id && strcmp(s->client_id, client_id) == 0)
+            return i;
+        if (!s->client_id && fresh < 0)
+            fresh = i;
+        if (!s->enabled && !s->conn && idle < 0)
+            idle = i;
+    }
+    if (fresh >= 0)
+        return fresh;
+    if (priv->num_sessions < CLOUD_SESSION_MAX)
+        return cloud_sessions_grow(priv, priv->num_sessions + 1) ? -1 : priv->num_sessions - 1;
+    return idle;
+}
+
 /*
 0     : success
 other : failed
@@ -308,18 +1053,27 @@ config = {
         topic_sub = "topic1",
         topic_pub = "topic2",
         qos = 0,
-        keepalive = 60
+        keepalive = 60,
+        encoding = "json",  //optional, "cbor": json payloads are published as cbor, cbor requests reach iot-rpcd as json
+        transfer = { threshold = 65536, chunk = 16384, window = 8 },  //optional, the cloud takes large replies in chunks
+        keepalive_adaptive = { min = 30, network = "46001" }  //optional, idle pings searched between min and keepalive
+    }
+}
+
+gateway mode, data is an array of identities, data[1] is the primary one, the others are matched to
+their sessions by client_id:
+config = {
+    code = 0,
+    data = {
+        { address = "mqtt://10.5.2.37:11883", client_id = 'gw', ... },
+        { address = "mqtt://10.5.2.37:11883", client_id = 'sub-device-1', ... },
     }
 }
 */
-static int cloud_mqtt_config_load(void *arg) {
-    struct mg_mgr *mgr = (struct mg_mgr *)arg;
+static int cloud_mqtt_config_load(struct mg_mgr *mgr, struct mg_str ret) {
     struct client_private *priv = (struct client_private*)mgr->userdata;
     cJSON *root = NULL;
 
-    struct mg_str ret = MG_NULL_STR;
-    lua_callback(arg, "get_config", "", &ret);
-
     if (!ret.ptr) {
         MG_ERROR(("no cloud mqtt config"));
         return -1;
@@ -328,7 +1082,6 @@ static int cloud_mqtt_config_load(void *arg) {
     MG_DEBUG(("cloud mqtt config: %.*s", (int) ret.len, ret.ptr));
 
     root = cJSON_ParseWithLength(ret.ptr, ret.len);
-    free((void*)ret.ptr);
 
     if (!root) {
         MG_ERROR(("parse cloud mqtt config failed"));
@@ -343,24 +1096,57 @@ static int cloud_mqtt_config_load(void *arg) {
     }
 
     cJSON *data = cJSON_GetObjectItem(root, FIELD_DATA);
+    int n = cJSON_IsArray(data) ? cJSON_GetArraySize(data) : 1;
+
+    if (n < 1 || n > CLOUD_SESSION_MAX) {
+        MG_ERROR(("invalid cloud mqtt identities: %d", n));
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (cloud_mqtt_config_check(cJSON_IsArray(data) ? cJSON_GetArrayItem(data, i) : data)) {
+            cJSON_Delete(root);
+            return -1;
+        }
+    }
+
+    //the first identity is the primary session 0, the others keep their session by client_id,
+    //so state kept per session (delta documents, requests, transfers) stays with its identity
+    cJSON **items = calloc(priv->num_sessions + n, sizeof(cJSON *));
+    if (!items || cloud_sessions_grow(priv, 1)) {
+        MG_ERROR(("alloc cloud sessions failed"));
+        free(items);
+        cJSON_Delete(root);
+        return -1;
+    }
+    items[0] = cJSON_IsArray(data) ? cJSON_GetArrayItem(data, 0) : data;
+    for (int i = 1; i < n; i++) {
+        cJSON *item = cJSON_GetArrayItem(data, i);
+        int slot = cloud_session_slot(priv, items, cJSON_GetStringValue(cJSON_GetObjectItem(item, "client_id")));
+        if (slot < 0) {
+            MG_ERROR(("alloc cloud sessions failed"));
+            free(items);
+            cJSON_Delete(root);
+            return -1;
+        }
+        items[slot] = item;
+    }
 
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "address"), String);
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "client_id"), String);
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "user"), String);
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "password"), String);
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "topic_sub"), String);
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "topic_pub"), String);
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "qos"), Number);
-    CHECK_JSON_NODE(root, cJSON_GetObjectItem(data, "keepalive"), Number);
-
-    priv->cfg.opts->cloud_mqtt_serve_address = cJSON_GetStringValue(cJSON_GetObjectItem(data, "address"));
-    priv->cfg.opts->cloud_mqtt_client_id = cJSON_GetStringValue(cJSON_GetObjectItem(data, "client_id"));
-    priv->cfg.opts->cloud_mqtt_username = cJSON_GetStringValue(cJSON_GetObjectItem(data, "user"));
-    priv->cfg.opts->cloud_mqtt_password = cJSON_GetStringValue(cJSON_GetObjectItem(data, "password"));
-    priv->cfg.opts->topic_sub = cJSON_GetStringValue(cJSON_GetObjectItem(data, "topic_sub"));
-    priv->cfg.opts->topic_pub = cJSON_GetStringValue(cJSON_GetObjectItem(data, "topic_pub"));
-    priv->cfg.opts->cloud_mqtt_qos = cJSON_GetNumberValue(cJSON_GetObjectItem(data, "qos"));
-    priv->cfg.opts->cloud_mqtt_keepalive = cJSON_GetNumberValue(cJSON_GetObjectItem(data, "keepalive"));
+    for (int i = 0; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        s->enabled = items[i] != NULL;
+        if (!s->enabled) { //removed from config
+            if (s->conn)
+                s->conn->is_draining = 1;
+            continue;
+        }
+        if (!s->conn)
+            cloud_session_apply(s, items[i]);
+        else
+            cloud_session_update(s, items[i]);
+    }
+    free(items);
 
     //free prev config
     if ( priv->cfg.cloud_mqtt_cfg ) {
@@ -371,46 +1157,198 @@ static int cloud_mqtt_config_load(void *arg) {
 
 }
 
-// Timer function - recreate client connection if it is closed
-void timer_cloud_mqtt_fn(void *arg) {
-    struct mg_mgr *mgr = (struct mg_mgr *)arg;
+static void cloud_session_connect(struct cloud_session *s, uint64_t now) {
+
+    struct client_private *priv = (struct client_private*)s->mgr->userdata;
+    struct mg_mqtt_opts opts = { 0 };
+    struct mg_str host = mg_url_host(s->address);
+    const char *address = s->address;
+    char url[160];
+    uint32_t ip;
+
+    //a cached answer skips the resolver, the url keeps scheme and port
+    s->by_cache = 0;
+    if (!dns_is_ipv4(host)) {
+        if (dns_lookup(&priv->dns, host, now, &ip) == 0 &&
+            mg_snprintf(url, sizeof(url), "%.*s%d.%d.%d.%d%s", (int) (host.ptr - s->address), s->address,
+                ((uint8_t *) &ip)[0], ((uint8_t *) &ip)[1], ((uint8_t *) &ip)[2], ((uint8_t *) &ip)[3],
+                host.ptr + host.len) < sizeof(url)) {
+            address = url;
+            s->by_cache = 1;
+            priv->dns.stats.hits++;
+        } else {
+            priv->dns.stats.misses++;
+        }
+    }
+
+    if (s->client_id) {
+        opts.client_id = mg_str(s->client_id);
+    }
+
+    opts.clean = true;
+    opts.qos = s->qos;
+    opts.message = mg_str("goodbye");
+    opts.keepalive = s->keepalive;
+    opts.version = (uint8_t) s->version;
+    opts.user = mg_str(s->user);
+    opts.pass = mg_str(s->password);
+
+    //qos publishes survive a reconnect in a persistent session
+    struct mg_mqtt_prop expiry = { .id = MQTT_PROP_SESSION_EXPIRY_INTERVAL, .iv = CLOUD_SESSION_EXPIRY };
+    if (s->qos > 0) {
+        opts.clean = false;
+        if (s->version == 5) { //mqtt5 ends the session at disconnect without an expiry
+            opts.props = &expiry;
+            opts.num_props = 1;
+        }
+    }
+
+    //limits of the broker arrive with CONNACK, 3.1.1 has none
+    s->stage = CLOUD_STAGE_CONNECTING;
+    s->connect_sent = 0;
+    s->connack = -1;
+    s->alias_max = 0;
+    s->alias_set = 0;
+    s->receive_max = 0;
+    s->max_qos = 2;
+
+    s->retry_attempts++;
+    s->connect_at = now;
+    metrics_add(&priv->metrics, METRIC_CLOUD_CONNECTS, 1);
+    s->conn = mg_mqtt_connect(s->mgr, address, &opts, cloud_mqtt_cb, s);
+    if (!s->conn) //no close event follows
+        s->retry_due = now + cloud_backoff(s->retry_attempts, priv->cfg.opts->reconnect_max);
+    s->tx_active = now;
+    s->rx_active = now;
+    s->ping_wait = 0;
+
+}
+
+// get_config result, connect the sessions whose backoff ran out
+static void cloud_mqtt_config_done(struct mg_mgr *mgr, struct mg_str ret, const char *param) {
     struct client_private *priv = (struct client_private*)mgr->userdata;
     uint64_t now = mg_millis();
 
-    if ( priv->cloud_mqtt_conn == NULL && !cloud_mqtt_config_load(arg) ) {
+    priv->config_pending = 0;
+    if ( priv->config_reload ) //changed again while this one ran
+        sched_kick(&priv->sched, TASK_CLOUD, now);
+    if ( cloud_mqtt_config_load(mgr, ret) ) {
+        priv->config_due = now + cloud_backoff(++priv->config_attempts, priv->cfg.opts->reconnect_max);
+        return;
+    }
+    priv->config_attempts = 0;
+    priv->config_due = 0;
 
-        struct mg_mqtt_opts opts = { 0 };
+    for (int i = 0; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        if (s->enabled && !s->conn && s->retry_due <= now)
+            cloud_session_connect(s, now);
+    }
+}
+
+// Task function - reload config and reconnect sessions which are down, ping the connected ones
+uint64_t timer_cloud_mqtt_fn(void *arg, uint64_t now) {
+    struct mg_mgr *mgr = (struct mg_mgr *)arg;
+    struct client_private *priv = (struct client_private*)mgr->userdata;
+    uint64_t next = SCHED_NEVER;
+    uint64_t reconnect_due = priv->num_sessions == 0 ? now : SCHED_NEVER;
+    int down = priv->num_sessions == 0;
+
+    for (int i = 0; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        if (s->enabled && !s->conn && s->retry_due < reconnect_due)
+            reconnect_due = s->retry_due;
+        if (s->enabled && !s->registered)
+            down = 1;
+    }
+
+    //config reload first, each session then waits for its own backoff
+    if (reconnect_due < priv->config_due)
+        reconnect_due = priv->config_due;
+    if ((now >= reconnect_due || priv->config_reload) && !priv->config_pending) {
+        priv->config_pending = 1;
+        if (lua_callback_post(mgr, "get_config", "", cloud_mqtt_config_done))
+            priv->config_pending = 0; //worker full, next check tries again
+        else
+            priv->config_reload = 0;
+    } else if (reconnect_due > now && reconnect_due < next) {
+        next = reconnect_due;
+    }
+    if (priv->config_reload && !priv->config_pending && now + MQTT_RECONNECT_MS < next)
+        next = now + MQTT_RECONNECT_MS;
 
-        if (priv->cfg.opts->cloud_mqtt_client_id) {
-            opts.client_id = mg_str(priv->cfg.opts->cloud_mqtt_client_id);
+    //disconnected events keep a MQTT_RECONNECT_MS period while anything is down
+    if (down && now >= priv->cloud_check_due) {
+        priv->cloud_check_due = now + MQTT_RECONNECT_MS;
+
+        if (priv->num_sessions == 0 && ++priv->disconnected_check_times % 6 == 0) {
+            cloud_mqtt_event_callback(mgr, NULL, "disconnected");
         }
 
-        opts.clean = true;
-        opts.qos = priv->cfg.opts->cloud_mqtt_qos;
-        opts.message = mg_str("goodbye");
-        opts.keepalive = priv->cfg.opts->cloud_mqtt_keepalive;
-        opts.version = 4;
-        opts.user = mg_str(priv->cfg.opts->cloud_mqtt_username);
-        opts.pass = mg_str(priv->cfg.opts->cloud_mqtt_password);
-
-        priv->cloud_mqtt_conn = mg_mqtt_connect(mgr, priv->cfg.opts->cloud_mqtt_serve_address, &opts, cloud_mqtt_cb, NULL);
-        priv->cloud_ping_active = now;
-        priv->cloud_pong_active = now;
-
-    } else if (priv->cloud_mqtt_conn && priv->cfg.opts->cloud_mqtt_keepalive) { //need keep alive
-        
-        if (now < priv->cloud_ping_active) {
+        for (int i = 0; i < priv->num_sessions; i++) {
+            struct cloud_session *s = priv->sessions[i];
+            if (s->enabled && s->registered == 0 && ++s->disconnected_check_times % 6 == 0) {
+                cloud_mqtt_event_callback(mgr, s, "disconnected");
+            }
+        }
+    }
+
+    //resolve broker names ahead of the backoff expiry, the connect then starts on an address
+    for (int i = 0; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        struct mg_str host;
+
+        if (!s->enabled || s->conn || !s->address || dns_is_ipv4(host = mg_url_host(s->address)))
+            continue;
+        if (s->retry_due <= now + CLOUD_DNS_AHEAD_MS)
+            dns_resolve(&priv->dns, host, s->retry_due > now ? s->retry_due : now, now);
+        else if (s->retry_due - CLOUD_DNS_AHEAD_MS < next)
+            next = s->retry_due - CLOUD_DNS_AHEAD_MS;
+    }
+
+    for (int i = 0; i < priv->num_sessions; i++) {
+        struct cloud_session *s = priv->sessions[i];
+        uint64_t keepalive = (uint64_t) s->keepalive * 1000;
+
+        if (!s->conn || s->stage != CLOUD_STAGE_OPEN || !keepalive) //need keep alive
+            continue;
+
+        if (now < s->tx_active || now < s->rx_active) {
             MG_INFO(("system time loopback"));
-            priv->cloud_ping_active = now;
-            priv->cloud_pong_active = now;
+            s->tx_active = now;
+            s->rx_active = now;
         }
-        if (now - priv->cloud_ping_active >= priv->cfg.opts->cloud_mqtt_keepalive * 1000) {
-            mg_mqtt_ping(priv->cloud_mqtt_conn);
-            priv->cloud_ping_active = now;
+
+        //the pong timeout is checked in MG_EV_POLL
+        if (s->ping_wait) {
+            if (s->ping_wait + KA_PONG_MS + 1 < next)
+                next = s->ping_wait + KA_PONG_MS + 1;
+            continue;
         }
-    }
 
-    if (priv->registered == 0 && ++priv->disconnected_check_times % 6 == 0) {
-        cloud_mqtt_event_callback(mgr, "disconnected");
+        //traffic both ways within keepalive needs no ping, an idle link is probed at the searched interval
+        uint64_t last = s->tx_active > s->rx_active ? s->tx_active : s->rx_active;
+        uint64_t idle = s->probe.network[0] ? (uint64_t) ka_probe_interval(&s->probe) * 1000 : keepalive;
+        uint64_t due = last + idle;
+        if (s->tx_active + keepalive < due)
+            due = s->tx_active + keepalive;
+        if (s->rx_active + keepalive < due)
+            due = s->rx_active + keepalive;
+
+        if (now >= due) {
+            s->ping_interval = s->probe.network[0] && now - last >= idle ? (uint32_t) (idle / 1000) : 0;
+            s->ping_wait = now;
+            s->tx_active = now;
+            s->probe.pings++;
+            mg_mqtt_ping(s->conn);
+            due = now + KA_PONG_MS + 1;
+        }
+        if (due < next)
+            next = due;
     }
+
+    if (down && priv->cloud_check_due < next)
+        next = priv->cloud_check_due;
+
+    return next;
 }
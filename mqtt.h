@@ -4,8 +4,30 @@
 #define IOT_CLIENT_TOPIC  "mg/iot-client/+"
 #define IOT_CLIENT_RPCD_TOPIC "mg/iot-client/channel/iot-rpcd"
 #define IOT_CLIENT_RPCD_TOPIC_PREFIX "mg/iot-client/channel"
+#define IOT_CLIENT_METRICS_TOPIC "mg/iot-client/metrics"
 
-void timer_mqtt_fn(void *arg);
-void timer_cloud_mqtt_fn(void *arg);
+#define IOT_CLIENT_TIMEOUT_CODE -10408 //synthetic reply to cloud, iot-rpcd did not answer in time
+
+
+#define CLOUD_SESSION_MAX 1024 //gateway mode, max cloud identities in one process
+
+#define REPORT_INTERVAL_MS 1000 //gen_request period
+#define QUEUE_DRAIN_TICK_MS 100 //drain period while queued records can be sent
+
+#define CLOUD_TOPIC_ALIAS 1 //mqtt5 topic alias of topic_pub
+#define CLOUD_RECEIVE_MAX 65535 //mqtt5 receive maximum when the broker does not send one
+#define CLOUD_SESSION_EXPIRY 3600 //s, mqtt5 persistent session of qos > 0 sessions
+
+#define MQTT_RECONNECT_MS 1000 //min interval between connect attempts, base of the cloud backoff, also the disconnected check period
+#define CLOUD_STABLE_MS 30000 //a cloud connection open this long resets the backoff
+#define CLOUD_DNS_AHEAD_MS 2000 //broker name is resolved this long before the backoff expires
+
+struct cloud_session;
+struct client_private;
+
+uint64_t timer_mqtt_fn(void *arg, uint64_t now);
+uint64_t timer_cloud_mqtt_fn(void *arg, uint64_t now);
+size_t cloud_session_cfg_bytes(struct cloud_session *s);
+void local_channel_pub(struct client_private *priv, struct mg_str topic, struct mg_str data);
 
 #endif
\ No newline at end of file
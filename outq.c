@@ -0,0 +1,126 @@
+#include <iot/mongoose.h>
+#include "outq.h"
+
+static struct outq_msg *outq_unlink(struct outq *q, int prio) {
+    struct outq_class *c = &q->cls[prio];
+    struct outq_msg *m = c->head;
+
+    if (!m)
+        return NULL;
+    c->head = m->next;
+    if (!c->head)
+        c->tail = NULL;
+    c->count--;
+    q->count--;
+    q->bytes -= m->len + m->topic_len + m->cdata_len;
+    return m;
+}
+
+int outq_push(struct outq *q, int prio, const struct outq_pub *pub, size_t max_bytes, int policy,
+    uint64_t now, struct outq_stats *st) {
+    size_t len = pub->data.len + pub->topic.len + pub->cdata.len;
+
+    if (len > max_bytes || pub->topic.len > UINT16_MAX || pub->cdata.len > UINT16_MAX) {
+        st->dropped[prio]++;
+        return -1;
+    }
+
+    //low class is dropped first, a high message never gives way to a low one
+    while (q->bytes + len > max_bytes) {
+        int victim = q->cls[OUTQ_LOW].count ? OUTQ_LOW : (prio == OUTQ_HIGH ? OUTQ_HIGH : -1);
+        if (victim < 0 || (policy == OUTQ_DROP_NEWEST && victim == prio)) {
+            st->dropped[prio]++;
+            return -1;
+        }
+        free(outq_unlink(q, victim));
+        st->dropped[victim]++;
+    }
+
+    struct outq_msg *m = malloc(sizeof(struct outq_msg) + len);
+    if (!m) {
+        st->dropped[prio]++;
+        return -1;
+    }
+    m->next = NULL;
+    m->queued = now;
+    m->len = pub->data.len;
+    m->topic_len = (uint16_t) pub->topic.len;
+    m->cdata_len = (uint16_t) pub->cdata.len;
+    memcpy(m->buf, pub->data.ptr, pub->data.len);
+    if (pub->topic.len)
+        memcpy(m->buf + m->len, pub->topic.ptr, pub->topic.len);
+    if (pub->cdata.len)
+        memcpy(m->buf + m->len + m->topic_len, pub->cdata.ptr, pub->cdata.len);
+
+    struct outq_class *c = &q->cls[prio];
+    if (c->tail)
+        c->tail->next = m;
+    else
+        c->head = m;
+    c->tail = m;
+    c->count++;
+    q->count++;
+    q->bytes += len;
+
+    st->queued++;
+    if (q->count > st->max_count)
+        st->max_count = q->count;
+    if (q->bytes > st->max_bytes)
+        st->max_bytes = q->bytes;
+    return 0;
+}
+
+struct outq_msg *outq_peek(struct outq *q) {
+    for (int i = 0; i < OUTQ_CLASSES; i++) {
+        if (q->cls[i].head)
+            return q->cls[i].head;
+    }
+    return NULL;
+}
+
+struct outq_pub outq_msg_pub(struct outq_msg *m) {
+    struct outq_pub pub;
+    pub.data = mg_str_n(m->buf, m->len);
+    pub.topic = mg_str_n(m->buf + m->len, m->topic_len);
+    pub.cdata = mg_str_n(m->buf + m->len + m->topic_len, m->cdata_len);
+    return pub;
+}
+
+void outq_pop(struct outq *q, uint64_t now, struct outq_stats *st) {
+    for (int i = 0; i < OUTQ_CLASSES; i++) {
+        struct outq_msg *m = outq_unlink(q, i);
+        if (!m)
+            continue;
+        uint64_t wait = now > m->queued ? now - m->queued : 0;
+        st->sent[i]++;
+        st->wait_ms[i] += wait;
+        if (wait > st->max_wait_ms[i])
+            st->max_wait_ms[i] = wait;
+        free(m);
+        return;
+    }
+}
+
+void outq_free(struct outq *q) {
+    for (int i = 0; i < OUTQ_CLASSES; i++) {
+        struct outq_msg *m;
+        while ((m = outq_unlink(q, i)) != NULL)
+            free(m);
+    }
+}
+
+void outq_stats_dump(struct outq_stats *st) {
+    static const char *names[OUTQ_CLASSES] = {"high", "low"};
+
+    if (st->queued == 0)
+        return;
+    MG_INFO(("outbound direct: %llu, queued: %llu, max depth: %lu, max bytes: %lu",
+        (unsigned long long) st->direct, (unsigned long long) st->queued,
+        (unsigned long) st->max_count, (unsigned long) st->max_bytes));
+    for (int i = 0; i < OUTQ_CLASSES; i++) {
+        MG_INFO(("outbound %s sent: %llu, dropped: %llu, avg wait: %llu ms, max wait: %llu ms", names[i],
+            (unsigned long long) st->sent[i], (unsigned long long) st->dropped[i],
+            (unsigned long long) (st->sent[i] ? st->wait_ms[i] / st->sent[i] : 0),
+            (unsigned long long) st->max_wait_ms[i]));
+    }
+}
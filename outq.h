@@ -0,0 +1,68 @@
+#ifndef __IOT_OUTQ_H__
+#define __IOT_OUTQ_H__
+
+#include <iot/mongoose.h>
+
+#define OUTQ_HIGH       0   //control replies and request timeouts
+#define OUTQ_LOW        1   //reports, batches, queue drain, bulk replies
+#define OUTQ_CLASSES    2
+
+#define OUTQ_DROP_OLDEST 0  //queue full, drop the oldest message of the lowest class
+#define OUTQ_DROP_NEWEST 1  //queue full, reject the new message unless it outranks a queued one
+
+#define OUTQ_BULK_BYTES 4096 //control replies from this size go to the low class
+
+// one cloud publish
+struct outq_pub {
+    struct mg_str topic;    //empty: topic_pub of the session
+    struct mg_str cdata;    //mqtt5 correlation data, empty: none
+    struct mg_str data;
+};
+
+struct outq_msg {
+    struct outq_msg *next;
+    uint64_t queued;        //ms
+    size_t len;             //data, then topic and cdata in buf
+    uint16_t topic_len;
+    uint16_t cdata_len;
+    char buf[];
+};
+
+struct outq_class {
+    struct outq_msg *head;
+    struct outq_msg *tail;
+    size_t count;
+};
+
+struct outq_stats {
+    uint64_t direct;                    //published at once, send buffer below high water
+    uint64_t queued;                    //waited for the send buffer to drain
+    uint64_t sent[OUTQ_CLASSES];        //released from the queue
+    uint64_t dropped[OUTQ_CLASSES];     //by byte cap
+    uint64_t wait_ms[OUTQ_CLASSES];     //sum of time in queue of released messages
+    uint64_t max_wait_ms[OUTQ_CLASSES];
+    size_t max_count;                   //peak depth of one session
+    size_t max_bytes;
+};
+
+// outbound messages of one cloud connection, held while its send buffer is above high water
+struct outq {
+    struct outq_class cls[OUTQ_CLASSES];
+    size_t count;
+    size_t bytes;
+};
+
+//copy pub into the queue, make room by drop policy, 0: queued, -1: pub dropped
+int outq_push(struct outq *q, int prio, const struct outq_pub *pub, size_t max_bytes, int policy,
+    uint64_t now, struct outq_stats *st);
+//next message to send, high class first, NULL: empty
+struct outq_msg *outq_peek(struct outq *q);
+//publish of a queued message, valid until it is popped
+struct outq_pub outq_msg_pub(struct outq_msg *m);
+//remove the message outq_peek returned
+void outq_pop(struct outq *q, uint64_t now, struct outq_stats *st);
+void outq_free(struct outq *q);
+
+void outq_stats_dump(struct outq_stats *st);
+
+#endif
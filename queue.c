@@ -0,0 +1,369 @@
+#include <sys/mman.h>
+#include <stddef.h>
+#include <iot/mongoose.h>
+#include "queue.h"
+
+#define QUEUE_MAGIC         0x514f4949 //IIOQ
+#define QUEUE_VERSION       3
+#define QUEUE_RECORD_MAGIC  0x5152     //RQ
+#define QUEUE_WRAP_MAGIC    0x5157     //WQ
+
+struct queue_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;  //size of data region
+    uint32_t head;      //offset of the oldest record
+    uint32_t tail;      //offset of next write
+    uint32_t count;     //records in queue
+    uint32_t head_seq;  //sequence number of the oldest record, records are consecutive from head
+    uint32_t crc;       //crc32 of fields above
+};
+
+struct queue_record {
+    uint16_t magic;
+    uint16_t key_len;   //writer of the record
+    uint16_t topic_len; //publish topic, 0: topic_pub
+    uint16_t cdata_len; //mqtt5 correlation data
+    uint32_t len;       //data len
+    uint32_t seq;
+    uint32_t crc;       //crc32 of fields above, key, topic, cdata and data
+    uint32_t done;      //sent through a cursor, ahead of the head, not covered by crc
+};
+
+#define REC_HDR_SIZE sizeof(struct queue_record)
+#define REC_SIZE(n) ((REC_HDR_SIZE + (n) + 3) & ~((size_t) 3))
+#define REC_BODY(r) ((size_t) (r)->key_len + (r)->topic_len + (r)->cdata_len + (r)->len)
+
+static void header_update(struct queue *q) {
+    q->hdr->crc = mg_crc32(0, (const char *) q->hdr, offsetof(struct queue_header, crc));
+    q->dirty = 1;
+}
+
+static int header_valid(struct queue *q) {
+    struct queue_header *h = q->hdr;
+    return h->magic == QUEUE_MAGIC && h->version == QUEUE_VERSION &&
+        h->capacity == q->capacity && h->head <= q->capacity && h->tail <= q->capacity &&
+        h->crc == mg_crc32(0, (const char *) h, offsetof(struct queue_header, crc));
+}
+
+static uint32_t record_crc(const struct queue_record *rec) {
+    uint32_t crc = mg_crc32(0, (const char *) rec, offsetof(struct queue_record, crc));
+    return mg_crc32(crc, (const char *) (rec + 1), REC_BODY(rec));
+}
+
+//skip end of data region and wrap marker, return offset of record at pos
+static uint32_t record_pos(struct queue *q, uint32_t pos, uint32_t seq) {
+    if (q->capacity - pos < REC_HDR_SIZE)
+        return 0;
+    struct queue_record *rec = (struct queue_record *) (q->data + pos);
+    if (rec->magic == QUEUE_WRAP_MAGIC && rec->seq == seq)
+        return 0;
+    return pos;
+}
+
+static struct queue_record *record_at(struct queue *q, uint32_t pos) {
+    return (struct queue_record *) (q->data + pos);
+}
+
+static void queue_reset(struct queue *q) {
+    q->hdr->head = q->hdr->tail = 0;
+    q->hdr->count = 0;
+    header_update(q);
+}
+
+static void queue_drop_head(struct queue *q) {
+    struct queue_header *h = q->hdr;
+    uint32_t pos = record_pos(q, h->head, h->head_seq);
+    struct queue_record *rec = record_at(q, pos);
+
+    if (rec->done)
+        q->done--;
+    h->head = pos + REC_SIZE(REC_BODY(rec));
+    h->head_seq++;
+    if (--h->count == 0)
+        h->head = h->tail = 0;
+    header_update(q);
+}
+
+// records sent through cursors are freed once nothing older is left
+static void queue_reclaim(struct queue *q) {
+    while (q->hdr->count > 0 && record_at(q, record_pos(q, q->hdr->head, q->hdr->head_seq))->done)
+        queue_drop_head(q);
+}
+
+// walk records from head, stop at the first invalid one
+static void queue_recover(struct queue *q) {
+    struct queue_header *h = q->hdr;
+    uint32_t pos = h->head, seq = h->head_seq, n = 0;
+    size_t steps = q->capacity / REC_HDR_SIZE + 1;
+
+    while (steps--) {
+        uint32_t p = record_pos(q, pos, seq);
+        struct queue_record *rec = record_at(q, p);
+
+        if (rec->magic != QUEUE_RECORD_MAGIC || rec->seq != seq ||
+            REC_SIZE(REC_BODY(rec)) > q->capacity - p ||
+            rec->crc != record_crc(rec))
+            break;
+
+        pos = p + REC_SIZE(REC_BODY(rec));
+        seq++;
+        n++;
+        if (rec->done)
+            q->done++;
+    }
+
+    if (h->count > n)
+        q->stats.corrupted += h->count - n;
+
+    if (n == 0) {
+        queue_reset(q);
+        return;
+    }
+
+    h->tail = pos;
+    h->count = n;
+    header_update(q);
+    queue_reclaim(q);
+}
+
+struct queue *queue_open(const char *path, size_t size, size_t max_records, int drop_policy) {
+    struct queue *q = calloc(1, sizeof(struct queue));
+    struct stat st;
+
+    if (!q)
+        return NULL;
+
+    if (size < sizeof(struct queue_header) + 4096)
+        size = sizeof(struct queue_header) + 4096;
+    size &= ~((size_t) 3);
+
+    q->fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (q->fd < 0) {
+        MG_ERROR(("open queue %s failed: %d", path, errno));
+        free(q);
+        return NULL;
+    }
+
+    if (fstat(q->fd, &st) || ((size_t) st.st_size != size && ftruncate(q->fd, size))) {
+        MG_ERROR(("resize queue %s failed: %d", path, errno));
+        goto err;
+    }
+
+    q->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
+    if (q->map == MAP_FAILED) {
+        MG_ERROR(("mmap queue %s failed: %d", path, errno));
+        q->map = NULL;
+        goto err;
+    }
+
+    q->map_size = size;
+    q->hdr = (struct queue_header *) q->map;
+    q->data = q->map + sizeof(struct queue_header);
+    q->capacity = size - sizeof(struct queue_header);
+    q->max_records = max_records;
+    q->drop_policy = drop_policy;
+
+    if (header_valid(q)) {
+        queue_recover(q);
+    } else {
+        if (q->hdr->magic == QUEUE_MAGIC)
+            MG_ERROR(("queue %s header corrupted, reset", path));
+        memset(q->hdr, 0, sizeof(struct queue_header));
+        q->hdr->magic = QUEUE_MAGIC;
+        q->hdr->version = QUEUE_VERSION;
+        q->hdr->capacity = q->capacity;
+        queue_reset(q);
+    }
+
+    queue_sync(q);
+
+    MG_INFO(("queue %s opened, capacity: %lu, records: %lu, corrupted: %llu", path,
+        (unsigned long) q->capacity, (unsigned long) q->hdr->count, (unsigned long long) q->stats.corrupted));
+
+    return q;
+
+err:
+    close(q->fd);
+    free(q);
+    return NULL;
+}
+
+void queue_close(struct queue *q) {
+    if (!q)
+        return;
+    queue_sync(q);
+    munmap(q->map, q->map_size);
+    close(q->fd);
+    free(q);
+}
+
+//return offset to write a record of need bytes, -1: no room
+static long queue_fit(struct queue *q, size_t need) {
+    struct queue_header *h = q->hdr;
+
+    if (h->count == 0)
+        return 0;
+    if (h->tail > h->head) {
+        if (q->capacity - h->tail >= need)
+            return h->tail;
+        return h->head >= need ? 0 : -1; //wrap around
+    }
+    if (h->tail < h->head)
+        return h->head - h->tail >= need ? (long) h->tail : -1;
+    return -1; //tail == head, full
+}
+
+static char *record_put(char *p, struct mg_str s) {
+    if (s.len)
+        memcpy(p, s.ptr, s.len);
+    return p + s.len;
+}
+
+int queue_push(struct queue *q, struct mg_str key, const struct outq_pub *pub) {
+    struct queue_header *h = q->hdr;
+    size_t need = REC_SIZE(key.len + pub->topic.len + pub->cdata.len + pub->data.len);
+    long off;
+
+    if (key.len > 0xffff || pub->topic.len > 0xffff || pub->cdata.len > 0xffff || need > q->capacity) {
+        q->stats.dropped++;
+        return -1;
+    }
+
+    while ((off = queue_fit(q, need)) < 0 || (q->max_records && h->count >= q->max_records)) {
+        if (q->drop_policy == QUEUE_DROP_NEWEST || h->count == 0) {
+            q->stats.dropped++;
+            return -1;
+        }
+        queue_drop_head(q);
+        queue_reclaim(q);
+        q->stats.dropped++;
+    }
+
+    uint32_t seq = h->head_seq + h->count;
+    if (off == 0 && h->count > 0 && q->capacity - h->tail >= REC_HDR_SIZE) {
+        struct queue_record *wrap = record_at(q, h->tail);
+        memset(wrap, 0, REC_HDR_SIZE);
+        wrap->magic = QUEUE_WRAP_MAGIC;
+        wrap->seq = seq;
+    }
+
+    struct queue_record *rec = record_at(q, (uint32_t) off);
+    rec->magic = QUEUE_RECORD_MAGIC;
+    rec->key_len = (uint16_t) key.len;
+    rec->topic_len = (uint16_t) pub->topic.len;
+    rec->cdata_len = (uint16_t) pub->cdata.len;
+    rec->len = (uint32_t) pub->data.len;
+    rec->seq = seq;
+    rec->done = 0;
+    char *p = record_put((char *) (rec + 1), key);
+    p = record_put(p, pub->topic);
+    p = record_put(p, pub->cdata);
+    record_put(p, pub->data);
+    rec->crc = record_crc(rec);
+
+    if (h->count == 0)
+        h->head = (uint32_t) off;
+    h->tail = (uint32_t) (off + need);
+    h->count++;
+    header_update(q);
+
+    q->stats.pushed++;
+    return 0;
+}
+
+// publish stored in rec
+static struct outq_pub record_pub(struct queue_record *rec) {
+    const char *p = (const char *) (rec + 1) + rec->key_len;
+    struct outq_pub pub;
+    pub.topic = mg_str_n(p, rec->topic_len);
+    pub.cdata = mg_str_n(p + rec->topic_len, rec->cdata_len);
+    pub.data = mg_str_n(p + rec->topic_len + rec->cdata_len, rec->len);
+    return pub;
+}
+
+int queue_peek(struct queue *q, struct mg_str *key, struct outq_pub *pub) {
+    struct queue_header *h = q->hdr;
+
+    if (h->count == 0)
+        return -1;
+
+    struct queue_record *rec = record_at(q, record_pos(q, h->head, h->head_seq));
+    *key = mg_str_n((const char *) (rec + 1), rec->key_len);
+    *pub = record_pub(rec);
+    return 0;
+}
+
+void queue_pop(struct queue *q) {
+    if (q->hdr->count == 0)
+        return;
+    queue_drop_head(q);
+    q->stats.popped++;
+    queue_reclaim(q);
+}
+
+int queue_next(struct queue *q, struct queue_cursor *cur, struct mg_str key, struct outq_pub *pub) {
+    struct queue_header *h = q->hdr;
+
+    //records before the cursor were dropped, or the queue ran empty and starts over at 0
+    if ((uint32_t) (cur->seq - h->head_seq) > h->count || cur->seq == h->head_seq) {
+        cur->pos = h->head;
+        cur->seq = h->head_seq;
+    }
+
+    while ((uint32_t) (cur->seq - h->head_seq) < h->count) {
+        uint32_t p = record_pos(q, cur->pos, cur->seq);
+        struct queue_record *rec = record_at(q, p);
+
+        cur->pos = p;
+        if (!rec->done && rec->key_len == key.len && memcmp(rec + 1, key.ptr, key.len) == 0) {
+            *pub = record_pub(rec);
+            return 0;
+        }
+        cur->pos = p + REC_SIZE(REC_BODY(rec));
+        cur->seq++;
+    }
+    return -1;
+}
+
+void queue_done(struct queue *q, struct queue_cursor *cur) {
+    struct queue_record *rec;
+
+    if ((uint32_t) (cur->seq - q->hdr->head_seq) >= q->hdr->count)
+        return;
+    rec = record_at(q, record_pos(q, cur->pos, cur->seq));
+    if (rec->done)
+        return;
+    rec->done = 1;
+    q->done++;
+    q->dirty = 1;
+    q->stats.popped++;
+    cur->pos += REC_SIZE(REC_BODY(rec));
+    cur->seq++;
+    queue_reclaim(q);
+}
+
+size_t queue_count(struct queue *q) {
+    return q->hdr->count - q->done;
+}
+
+size_t queue_bytes(struct queue *q) {
+    struct queue_header *h = q->hdr;
+    if (h->count == 0)
+        return 0;
+    if (h->tail > h->head)
+        return h->tail - h->head;
+    return q->capacity - h->head + h->tail;
+}
+
+int queue_sync(struct queue *q) {
+    if (!q->dirty)
+        return 0;
+    if (msync(q->map, q->map_size, MS_SYNC)) {
+        MG_ERROR(("msync queue failed: %d", errno));
+        return -1;
+    }
+    q->dirty = 0;
+    q->stats.syncs++;
+    return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef __IOT_QUEUE_H__
+#define __IOT_QUEUE_H__
+
+#include <iot/mongoose.h>
+#include "outq.h"
+
+#define QUEUE_DROP_OLDEST 0 //queue full, drop the oldest records to make room
+#define QUEUE_DROP_NEWEST 1 //queue full, reject the new record
+
+struct queue_header;
+
+struct queue_stats {
+    uint64_t pushed;
+    uint64_t popped;
+    uint64_t dropped;   //dropped by byte cap or record limit
+    uint64_t corrupted; //records discarded by crc check when opening
+    uint64_t syncs;     //msync calls
+};
+
+// read position of the records of one key, the others are skipped
+struct queue_cursor {
+    uint32_t pos;
+    uint32_t seq;
+};
+
+/*
+ * fixed-size ring file, memory mapped, append-only records:
+ *  | header | record | record | ... | wrap | ... |
+ * each record is crc checked, writes are flushed by queue_sync, called from a timer.
+ * records are read from the head, or per key through cursors: a record sent through a
+ * cursor is marked done and its space is freed when the records before it are gone.
+ */
+struct queue {
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    struct queue_header *hdr;
+    uint8_t *data;
+    size_t capacity;        //byte cap of data region
+
+    size_t max_records;     //0: no limit
+    int drop_policy;
+    int dirty;
+    uint32_t done;          //records sent through a cursor, still behind an unsent head
+
+    struct queue_stats stats;
+};
+
+struct queue *queue_open(const char *path, size_t size, size_t max_records, int drop_policy);
+void queue_close(struct queue *q);
+
+//pub of writer key, its topic and correlation data are kept. 0: stored, -1: rejected
+int queue_push(struct queue *q, struct mg_str key, const struct outq_pub *pub);
+//0: oldest record returned, pointers are valid until next push/pop. -1: empty
+int queue_peek(struct queue *q, struct mg_str *key, struct outq_pub *pub);
+void queue_pop(struct queue *q);
+
+//next record of key at or after cur, cur points at it. 0: found, -1: none up to the tail
+int queue_next(struct queue *q, struct queue_cursor *cur, struct mg_str key, struct outq_pub *pub);
+//record at cur was sent, cur moves past it
+void queue_done(struct queue *q, struct queue_cursor *cur);
+
+//records not sent yet
+size_t queue_count(struct queue *q);
+size_t queue_bytes(struct queue *q);
+
+//flush dirty pages to flash
+int queue_sync(struct queue *q);
+
+#endif
@@ -0,0 +1,147 @@
+#include <iot/mongoose.h>
+#include <iot/cJSON.h>
+#include "report.h"
+
+static uint32_t report_rand(uint32_t n) {
+    uint32_t r;
+    if (n == 0)
+        return 0;
+    mg_random(&r, sizeof(r));
+    return r % (n + 1);
+}
+
+//a runs before b
+static int job_before(struct report_sched *r, int a, int b) {
+    struct report_job *ja = &r->jobs[a], *jb = &r->jobs[b];
+    if (ja->due != jb->due)
+        return ja->due < jb->due;
+    return ja->priority > jb->priority;
+}
+
+static void heap_up(struct report_sched *r, int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!job_before(r, r->heap[i], r->heap[parent]))
+            break;
+        int t = r->heap[i]; r->heap[i] = r->heap[parent]; r->heap[parent] = t;
+        i = parent;
+    }
+}
+
+static void heap_down(struct report_sched *r, int i) {
+    for (;;) {
+        int l = 2 * i + 1, m = i;
+        if (l < r->heap_len && job_before(r, r->heap[l], r->heap[m]))
+            m = l;
+        if (l + 1 < r->heap_len && job_before(r, r->heap[l + 1], r->heap[m]))
+            m = l + 1;
+        if (m == i)
+            break;
+        int t = r->heap[i]; r->heap[i] = r->heap[m]; r->heap[m] = t;
+        i = m;
+    }
+}
+
+static void heap_add(struct report_sched *r, int idx) {
+    r->heap[r->heap_len] = idx;
+    heap_up(r, r->heap_len++);
+}
+
+int report_sched_load(struct report_sched *r, void *jobs, uint64_t now) {
+    struct report_job old[REPORT_JOBS_MAX];
+    int num_old = r->num_jobs;
+    cJSON *item;
+
+    if (!cJSON_IsArray((cJSON *)jobs))
+        return -1;
+
+    memcpy(old, r->jobs, sizeof(struct report_job) * num_old);
+    memset(r->jobs, 0, sizeof(r->jobs));
+    r->num_jobs = r->heap_len = 0;
+    r->legacy = 0;
+
+    cJSON_ArrayForEach(item, (cJSON *)jobs) {
+        cJSON *name = cJSON_GetObjectItem(item, "name");
+        cJSON *interval = cJSON_GetObjectItem(item, "interval");
+        cJSON *jitter = cJSON_GetObjectItem(item, "jitter");
+        cJSON *priority = cJSON_GetObjectItem(item, "priority");
+        cJSON *delta = cJSON_GetObjectItem(item, "delta");
+        cJSON *full_every = cJSON_GetObjectItem(item, "full_every");
+
+        if (r->num_jobs >= REPORT_JOBS_MAX) {
+            MG_ERROR(("too many report jobs, max %d", REPORT_JOBS_MAX));
+            break;
+        }
+        if (!cJSON_IsString(name) || strlen(name->valuestring) >= REPORT_NAME_LEN ||
+            !cJSON_IsNumber(interval) || interval->valuedouble <= 0) {
+            MG_ERROR(("invalid report job, need name and interval"));
+            continue;
+        }
+
+        struct report_job *job = &r->jobs[r->num_jobs];
+        mg_snprintf(job->name, sizeof(job->name), "%s", name->valuestring);
+        double ms = interval->valuedouble * 1000;
+        job->interval = ms < REPORT_INTERVAL_MIN ? REPORT_INTERVAL_MIN : ms > UINT32_MAX ? UINT32_MAX : (uint32_t) ms;
+        ms = cJSON_IsNumber(jitter) && jitter->valuedouble > 0 ? jitter->valuedouble * 1000 : 0;
+        job->jitter = ms > job->interval ? job->interval : (uint32_t) ms;
+        job->priority = cJSON_IsNumber(priority) ? priority->valueint : 0;
+        job->delta = cJSON_IsTrue(delta);
+        job->full_every = cJSON_IsNumber(full_every) ? full_every->valueint : REPORT_FULL_EVERY;
+
+        job->slot = now;
+        job->due = now + report_rand(job->jitter); //first run spread over jitter too
+        for (int i = 0; i < num_old; i++) { //unchanged job keeps its phase
+            if (strcmp(old[i].name, job->name) == 0 && old[i].interval == job->interval) {
+                job->slot = old[i].slot;
+                job->due = old[i].due;
+                job->runs = old[i].runs;
+                job->skipped = old[i].skipped;
+                break;
+            }
+        }
+
+        heap_add(r, r->num_jobs++);
+    }
+
+    return r->num_jobs;
+}
+
+void report_sched_legacy(struct report_sched *r, uint64_t interval, uint64_t now) {
+    memset(r, 0, sizeof(*r));
+    r->legacy = 1;
+    r->num_jobs = 1;
+    mg_snprintf(r->jobs[0].name, sizeof(r->jobs[0].name), "%s", REPORT_LEGACY_NAME);
+    r->jobs[0].interval = (uint32_t) interval;
+    r->jobs[0].slot = r->jobs[0].due = now;
+    heap_add(r, 0);
+}
+
+struct report_job *report_sched_pop(struct report_sched *r, uint64_t now) {
+    if (r->heap_len == 0 || r->jobs[r->heap[0]].due > now)
+        return NULL;
+
+    struct report_job *job = &r->jobs[r->heap[0]];
+    r->heap[0] = r->heap[--r->heap_len];
+    heap_down(r, 0);
+    return job;
+}
+
+void report_sched_push(struct report_sched *r, struct report_job *job, uint64_t now) {
+    job->slot += job->interval;
+    if (job->slot < now) //fell behind, e.g. clock jumped or loop stalled, skip missed slots
+        job->slot = now;
+    job->due = job->slot + report_rand(job->jitter);
+    heap_add(r, (int) (job - r->jobs));
+}
+
+struct report_job *report_sched_find(struct report_sched *r, const char *name) {
+    for (int i = 0; i < r->num_jobs; i++) {
+        if (strcmp(r->jobs[i].name, name) == 0)
+            return &r->jobs[i];
+    }
+    return NULL;
+}
+
+uint64_t report_sched_next(struct report_sched *r) {
+    return r->heap_len > 0 ? r->jobs[r->heap[0]].due : UINT64_MAX;
+}
@@ -0,0 +1,51 @@
+#ifndef __IOT_REPORT_H__
+#define __IOT_REPORT_H__
+
+#include <iot/mongoose.h>
+
+#define REPORT_JOBS_MAX     64
+#define REPORT_NAME_LEN     32
+#define REPORT_INTERVAL_MIN 1000    //ms
+#define REPORT_FULL_EVERY   10      //delta job default, full snapshot every n reports
+#define REPORT_LEGACY_NAME  "gen_request"
+
+struct report_job {
+    char name[REPORT_NAME_LEN];
+    uint32_t interval;      //ms
+    uint32_t jitter;        //ms, each run fires at a random point of [slot, slot + jitter]
+    int priority;           //jobs due at the same wakeup run higher first
+    int delta;              //publish merge patches of the reply instead of the whole reply
+    int full_every;         //delta job, full snapshot every n reports
+    uint64_t slot;          //nominal run time, advances by interval so jitter does not drift
+    uint64_t due;           //slot + random jitter
+    uint64_t runs;
+    uint64_t skipped;       //due while cloud was not reachable
+};
+
+/*
+ * report jobs declared by get_schedule, kept in a min-heap on due time so lua is only
+ * called when a job is due.
+ */
+struct report_sched {
+    struct report_job jobs[REPORT_JOBS_MAX];
+    int num_jobs;
+    int heap[REPORT_JOBS_MAX];  //job indexes, heap[0] is due first
+    int heap_len;               //jobs in heap, a popped job is out until pushed back
+    int legacy;                 //no get_schedule, a single gen_request job with empty param
+};
+
+//replace jobs by a cJSON array of {name, interval, jitter, priority, delta, full_every}, times in seconds,
+//jobs with the same name and interval keep their phase. return jobs loaded, -1: invalid
+int report_sched_load(struct report_sched *r, void *jobs, uint64_t now);
+//the gen_request every REPORT_INTERVAL_MS of old scripts
+void report_sched_legacy(struct report_sched *r, uint64_t interval, uint64_t now);
+
+//pop the earliest job if it is due, NULL: none
+struct report_job *report_sched_pop(struct report_sched *r, uint64_t now);
+//schedule job popped by report_sched_pop to its next slot
+void report_sched_push(struct report_sched *r, struct report_job *job, uint64_t now);
+struct report_job *report_sched_find(struct report_sched *r, const char *name);
+//due time of the earliest job, UINT64_MAX: no job
+uint64_t report_sched_next(struct report_sched *r);
+
+#endif
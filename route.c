@@ -0,0 +1,280 @@
+#include <iot/mongoose.h>
+#include "forward.h"
+#include "route.h"
+
+static uint32_t route_hash(int parent, const char *p, size_t len) {
+    uint32_t h = 2166136261u ^ (uint32_t) parent;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t) p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// split topic at '/', -1: more than max levels
+static int route_levels(struct mg_str topic, struct mg_str *lv, int max) {
+    const char *p = topic.ptr, *end = topic.ptr + topic.len;
+    int n = 0;
+
+    for (;;) {
+        const char *q = memchr(p, '/', (size_t) (end - p));
+        if (n == max)
+            return -1;
+        lv[n++] = mg_str_n(p, (size_t) ((q ? q : end) - p));
+        if (!q)
+            return n;
+        p = q + 1;
+    }
+}
+
+static int route_node_new(struct route_table *t) {
+    if (t->num_nodes == t->cap_nodes) {
+        int cap = t->cap_nodes ? t->cap_nodes * 2 : 16;
+        struct route_node *nodes = realloc(t->nodes, cap * sizeof(*nodes));
+        if (!nodes)
+            return -1;
+        t->nodes = nodes;
+        int *frontier = realloc(t->frontier, 2 * cap * sizeof(*frontier));
+        if (!frontier)
+            return -1;
+        t->frontier = frontier;
+        t->cap_nodes = cap;
+    }
+    t->nodes[t->num_nodes].target = -1;
+    t->nodes[t->num_nodes].hash = -1;
+    t->nodes[t->num_nodes].plus = -1;
+    return t->num_nodes++;
+}
+
+static struct route_edge *route_edge_slot(struct route_edge *edges, uint32_t mask, int parent, struct mg_str level, uint32_t h) {
+    for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+        struct route_edge *e = &edges[i];
+        if (e->parent < 0)
+            return e;
+        if (e->hash == h && e->parent == parent && e->len == level.len && memcmp(e->level, level.ptr, level.len) == 0)
+            return e;
+    }
+}
+
+// keep the table at most half full
+static int route_edges_grow(struct route_table *t) {
+    uint32_t size = t->edges ? (t->mask + 1) * 2 : 64;
+    struct route_edge *edges = malloc(size * sizeof(*edges));
+
+    if (!edges)
+        return -1;
+    for (uint32_t i = 0; i < size; i++)
+        edges[i].parent = -1;
+    for (uint32_t i = 0; t->edges && i <= t->mask; i++) {
+        struct route_edge *e = &t->edges[i];
+        if (e->parent >= 0)
+            *route_edge_slot(edges, size - 1, e->parent, mg_str_n(e->level, e->len), e->hash) = *e;
+    }
+    free(t->edges);
+    t->edges = edges;
+    t->mask = size - 1;
+    return 0;
+}
+
+static int route_child(struct route_table *t, int parent, struct mg_str level) {
+    if (!t->edges)
+        return -1;
+    struct route_edge *e = route_edge_slot(t->edges, t->mask, parent, level, route_hash(parent, level.ptr, level.len));
+    return e->parent < 0 ? -1 : e->child;
+}
+
+static int route_child_add(struct route_table *t, int parent, struct mg_str level) {
+    int child = route_child(t, parent, level);
+    uint32_t h = route_hash(parent, level.ptr, level.len);
+
+    if (child >= 0)
+        return child;
+    if ((uint32_t) (t->num_edges + 1) * 2 > (t->edges ? t->mask + 1 : 0) && route_edges_grow(t))
+        return -1;
+    char *copy = malloc(level.len + 1);
+    if (!copy || (child = route_node_new(t)) < 0) {
+        free(copy);
+        return -1;
+    }
+    memcpy(copy, level.ptr, level.len);
+    copy[level.len] = '\0';
+    struct route_edge *e = route_edge_slot(t->edges, t->mask, parent, level, h);
+    e->parent = parent;
+    e->child = child;
+    e->hash = h;
+    e->level = copy;
+    e->len = level.len;
+    t->num_edges++;
+    return child;
+}
+
+int route_filter_valid(const char *filter) {
+    struct mg_str lv[ROUTE_LEVELS_MAX];
+    int n;
+
+    if (!filter || !filter[0] || (n = route_levels(mg_str(filter), lv, ROUTE_LEVELS_MAX)) < 0)
+        return 0;
+    for (int i = 0; i < n; i++) {
+        int wild = memchr(lv[i].ptr, '+', lv[i].len) || memchr(lv[i].ptr, '#', lv[i].len);
+        if (wild && lv[i].len != 1) //a wildcard is a whole level
+            return 0;
+        if (lv[i].len == 1 && lv[i].ptr[0] == '#' && i != n - 1)
+            return 0;
+    }
+    return 1;
+}
+
+void route_init(struct route_table *t) {
+    memset(t, 0, sizeof(*t));
+}
+
+void route_free(struct route_table *t) {
+    for (int i = 0; i < t->num_targets; i++) {
+        free(t->targets[i].filter);
+        free(t->targets[i].module);
+        free(t->targets[i].func);
+        free(t->targets[i].prefix);
+    }
+    for (uint32_t i = 0; t->edges && i <= t->mask; i++) {
+        if (t->edges[i].parent >= 0)
+            free(t->edges[i].level);
+    }
+    free(t->targets);
+    free(t->nodes);
+    free(t->frontier);
+    free(t->edges);
+    memset(t, 0, sizeof(*t));
+}
+
+int route_add(struct route_table *t, const char *filter, const char *module, const char *func, int action) {
+    struct mg_str lv[ROUTE_LEVELS_MAX];
+    struct route_target *rt;
+    int n, node, *slot;
+
+    if (!route_filter_valid(filter) || t->num_targets >= ROUTE_MAX)
+        return -1;
+    if (action == ROUTE_FORWARD && (!module || !func))
+        return -1;
+
+    if (t->num_nodes == 0 && route_node_new(t) < 0) //root
+        return -1;
+    if ((rt = realloc(t->targets, (t->num_targets + 1) * sizeof(*rt))) == NULL)
+        return -1;
+    t->targets = rt;
+    rt = &t->targets[t->num_targets];
+    memset(rt, 0, sizeof(*rt));
+    rt->action = action;
+    rt->filter = strdup(filter);
+    if (action == ROUTE_FORWARD) {
+        rt->module = strdup(module);
+        rt->func = strdup(func);
+        rt->prefix = forward_prefix(module, func);
+    }
+    if (!rt->filter || (action == ROUTE_FORWARD && (!rt->module || !rt->func || !rt->prefix)))
+        goto fail;
+    rt->prefix_len = rt->prefix ? strlen(rt->prefix) : 0;
+
+    n = route_levels(mg_str(rt->filter), lv, ROUTE_LEVELS_MAX);
+    node = 0;
+    for (int i = 0; i < n; i++) {
+        if (lv[i].len == 1 && lv[i].ptr[0] == '#')
+            break;
+        if (lv[i].len == 1 && lv[i].ptr[0] == '+') {
+            if (t->nodes[node].plus < 0) {
+                int child = route_node_new(t);
+                if (child < 0)
+                    goto fail;
+                t->nodes[node].plus = child;
+            }
+            node = t->nodes[node].plus;
+        } else if ((node = route_child_add(t, node, lv[i])) < 0) {
+            goto fail;
+        }
+    }
+
+    slot = lv[n - 1].len == 1 && lv[n - 1].ptr[0] == '#' ? &t->nodes[node].hash : &t->nodes[node].target;
+    if (*slot >= 0) {
+        MG_ERROR(("route %s repeats %s, ignored", filter, t->targets[*slot].filter));
+        goto fail;
+    }
+    *slot = t->num_targets++;
+    return 0;
+
+fail:
+    //nodes and edges already added stay, they lead to nothing
+    free(rt->filter);
+    free(rt->module);
+    free(rt->func);
+    free(rt->prefix);
+    return -1;
+}
+
+// one pass per level over the nodes the topic can be at, kept in precedence order: children of
+// a node go out exact first, then "+", and each node is reached by one path only, so the
+// frontier holds no duplicates and never exceeds the nodes of the table. the "#" of a node
+// loses to everything matched through its children but wins over every node after it
+static int route_walk(struct route_table *t, const struct mg_str *lv, int n) {
+    int *cur = t->frontier, *next = t->frontier + t->cap_nodes;
+    int num = 1, best = -1;
+
+    cur[0] = 0;
+    for (int i = 0; i < n && num > 0; i++) {
+        //wildcards at the first level do not match $SYS style topics
+        int wild = !(i == 0 && lv[0].len > 0 && lv[0].ptr[0] == '$');
+        int num_next = 0;
+
+        for (int k = 0; k < num; k++) {
+            struct route_node *nd = &t->nodes[cur[k]];
+            int child = route_child(t, cur[k], lv[i]);
+            if (child >= 0)
+                next[num_next++] = child;
+            if (wild && nd->plus >= 0)
+                next[num_next++] = nd->plus;
+            if (wild && nd->hash >= 0) {
+                best = nd->hash;
+                break;
+            }
+        }
+        int *tmp = cur;
+        cur = next;
+        next = tmp;
+        num = num_next;
+    }
+
+    for (int k = 0; k < num; k++) { //"a/#" also matches "a"
+        struct route_node *nd = &t->nodes[cur[k]];
+        if (nd->target >= 0)
+            return nd->target;
+        if (nd->hash >= 0)
+            return nd->hash;
+    }
+    return best;
+}
+
+struct route_target *route_match(struct route_table *t, struct mg_str topic) {
+    struct mg_str lv[ROUTE_LEVELS_MAX];
+    int n, r;
+
+    if (t->num_targets == 0)
+        return NULL;
+    if ((n = route_levels(topic, lv, ROUTE_LEVELS_MAX)) < 0 || (r = route_walk(t, lv, n)) < 0) {
+        t->misses++;
+        return NULL;
+    }
+    t->targets[r].hits++;
+    return &t->targets[r];
+}
+
+void route_stats_dump(struct route_table *t, int index) {
+    static const char *actions[] = { "forward", "drop", "ack" };
+
+    if (t->num_targets == 0)
+        return;
+    MG_INFO(("cloud mqtt client %d routes: %d, nodes: %d, misses: %llu", index, t->num_targets, t->num_nodes,
+        (unsigned long long) t->misses));
+    for (int i = 0; i < t->num_targets; i++) {
+        struct route_target *rt = &t->targets[i];
+        MG_INFO(("route %s -> %s %s %s, hits: %llu", rt->filter, actions[rt->action],
+            rt->module ? rt->module : "", rt->func ? rt->func : "", (unsigned long long) rt->hits));
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef __IOT_ROUTE_H__
+#define __IOT_ROUTE_H__
+
+#include <iot/mongoose.h>
+
+#define ROUTE_LEVELS_MAX    32      //topic levels looked at, deeper topics do not match
+#define ROUTE_MAX           1024    //routes per cloud identity
+
+enum {
+    ROUTE_FORWARD,              //envelope to module/func of iot-rpcd
+    ROUTE_DROP,                 //ignored
+    ROUTE_ACK,                  //answered {"code":0} by iot-client, iot-rpcd never sees it
+};
+
+struct route_target {
+    char *filter;               //topic filter as configured
+    char *module;
+    char *func;
+    char *prefix;               //forward_prefix of module/func
+    size_t prefix_len;
+    int action;                 //ROUTE_*
+    uint64_t hits;
+};
+
+struct route_node {
+    int target;                 //route ending exactly here, -1: none
+    int hash;                   //route of "#" below this node, -1: none
+    int plus;                   //child node of "+", -1: none
+};
+
+struct route_edge {
+    int parent;                 //-1: empty slot
+    int child;
+    uint32_t hash;
+    char *level;                //own copy, a failed route_add leaves its edges behind
+    size_t len;
+};
+
+/*
+ * cloud topic filters of one identity compiled into a trie, one node per topic level.
+ * literal levels are edges in one open addressing table keyed by (parent, level), so a
+ * step is one probe whatever the number of routes; "+" and "#" children hang off the node.
+ * a lookup walks all matching nodes level by level, each node at most once. exact levels
+ * win over "+", "+" over "#".
+ */
+struct route_table {
+    struct route_node *nodes;
+    int num_nodes;
+    int cap_nodes;
+    int *frontier;              //2 * cap_nodes, scratch of route_match
+
+    struct route_edge *edges;
+    int num_edges;
+    uint32_t mask;              //edges has mask + 1 slots
+
+    struct route_target *targets;
+    int num_targets;
+
+    uint64_t misses;            //no route, default module/func
+};
+
+void route_init(struct route_table *t);
+void route_free(struct route_table *t);
+//-1: invalid filter, or out of memory, duplicate filters keep the first route
+int route_add(struct route_table *t, const char *filter, const char *module, const char *func, int action);
+//route of topic, NULL: none
+struct route_target *route_match(struct route_table *t, struct mg_str topic);
+//1: filter is a valid mqtt topic filter
+int route_filter_valid(const char *filter);
+
+void route_stats_dump(struct route_table *t, int index);
+
+#endif
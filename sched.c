@@ -0,0 +1,63 @@
+#include <iot/mongoose.h>
+#include "sched.h"
+
+void sched_init(struct sched *s, uint64_t now) {
+    memset(s, 0, sizeof(*s));
+    s->started = now;
+}
+
+void sched_set(struct sched *s, int id, const char *name, sched_fn fn, void *arg, uint64_t due) {
+    if (id < 0 || id >= SCHED_TASKS_MAX)
+        return;
+    s->tasks[id].name = name;
+    s->tasks[id].fn = fn;
+    s->tasks[id].arg = arg;
+    s->tasks[id].due = due;
+    if (id >= s->num_tasks)
+        s->num_tasks = id + 1;
+}
+
+void sched_kick(struct sched *s, int id, uint64_t due) {
+    if (id >= 0 && id < s->num_tasks && due < s->tasks[id].due)
+        s->tasks[id].due = due;
+}
+
+int sched_run(struct sched *s, uint64_t now, int max_ms) {
+    uint64_t next = SCHED_NEVER;
+
+    s->wakeups++;
+
+    for (int i = 0; i < s->num_tasks; i++) {
+        struct sched_task *t = &s->tasks[i];
+        if (!t->fn || t->due > now)
+            continue;
+        t->due = SCHED_NEVER; //a kick from inside fn still counts
+        uint64_t due = t->fn(t->arg, now);
+        if (due < t->due)
+            t->due = due;
+        t->runs++;
+    }
+
+    //a task may kick an earlier one, scan after all of them ran
+    for (int i = 0; i < s->num_tasks; i++) {
+        if (s->tasks[i].fn && s->tasks[i].due < next)
+            next = s->tasks[i].due;
+    }
+
+    if (next <= now)
+        return 0;
+    if (next - now < (uint64_t) max_ms)
+        return (int) (next - now);
+    return max_ms;
+}
+
+void sched_dump(struct sched *s, uint64_t now) {
+    uint64_t secs = now > s->started ? (now - s->started) / 1000 : 0;
+
+    MG_INFO(("scheduler wakeups: %llu in %llu s", (unsigned long long) s->wakeups, (unsigned long long) secs));
+    for (int i = 0; i < s->num_tasks; i++) {
+        struct sched_task *t = &s->tasks[i];
+        if (t->fn)
+            MG_INFO(("task %s runs: %llu", t->name, (unsigned long long) t->runs));
+    }
+}
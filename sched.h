@@ -0,0 +1,40 @@
+#ifndef __IOT_SCHED_H__
+#define __IOT_SCHED_H__
+
+#include <iot/mongoose.h>
+
+#define SCHED_NEVER         UINT64_MAX
+#define SCHED_TASKS_MAX     12
+#define SCHED_POLL_MAX_MS   30000   //longest sleep in mg_mgr_poll, bounds mongoose internal timeouts (dns, connect)
+
+//run a due task, return its next due time in ms, SCHED_NEVER: until kicked
+typedef uint64_t (*sched_fn)(void *arg, uint64_t now);
+
+struct sched_task {
+    const char *name;
+    sched_fn fn;
+    void *arg;
+    uint64_t due;
+    uint64_t runs;
+};
+
+/*
+ * deadline scheduler in front of mg_mgr_poll, the poll timeout is the time to the
+ * earliest due task, events bring a task forward with sched_kick.
+ */
+struct sched {
+    struct sched_task tasks[SCHED_TASKS_MAX];
+    int num_tasks;
+    uint64_t wakeups;       //sched_run calls
+    uint64_t started;       //ms
+};
+
+void sched_init(struct sched *s, uint64_t now);
+void sched_set(struct sched *s, int id, const char *name, sched_fn fn, void *arg, uint64_t due);
+//make task id due no later than due
+void sched_kick(struct sched *s, int id, uint64_t due);
+//run due tasks, return ms until the earliest due task, capped by max_ms
+int sched_run(struct sched *s, uint64_t now, int max_ms);
+void sched_dump(struct sched *s, uint64_t now);
+
+#endif
@@ -0,0 +1,272 @@
+#include <iot/mongoose.h>
+#include "tls.h"
+
+static void tls_stat(const char *path, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    if (path && path[0] && path[0] != '-') //'-': pem content, nothing to watch
+        stat(path, st);
+}
+
+static int tls_changed(struct tls_creds *t) {
+    const char *paths[3] = { t->ca, t->cert, t->certkey };
+
+    for (int i = 0; i < 3; i++) {
+        struct stat st;
+        tls_stat(paths[i], &st);
+        if (st.st_mtime != t->files[i].st_mtime || st.st_size != t->files[i].st_size ||
+            st.st_ino != t->files[i].st_ino)
+            return 1;
+    }
+    return 0;
+}
+
+#if MG_ENABLE_OPENSSL
+
+static int s_address_idx = -1; //ex data of an SSL, broker address it connects to
+
+static void tls_address_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp) {
+    free(ptr);
+}
+
+static void tls_save(struct tls_creds *t, SSL_SESSION *sess, const char *address) {
+    char tmp[256];
+    FILE *fp;
+    int fd;
+    uint64_t now = mg_millis();
+
+    if (t->saved)
+        SSL_SESSION_free((SSL_SESSION *) t->saved);
+    SSL_SESSION_up_ref(sess);
+    t->saved = sess;
+    mg_snprintf(t->saved_address, sizeof(t->saved_address), "%s", address ? address : "");
+
+    if (!t->session_path || (t->saved_at && now - t->saved_at < TLS_SAVE_INTERVAL_MS))
+        return;
+    t->saved_at = now;
+
+    //write aside and rename, a crash never leaves half a session. owner only, it holds the master secret
+    mg_snprintf(tmp, sizeof(tmp), "%s.tmp", t->session_path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        MG_ERROR(("open %s failed: %d", tmp, errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    //address line first, pem readers skip what precedes the BEGIN line
+    int ok = fprintf(fp, "%s\n", t->saved_address) > 0 && PEM_write_SSL_SESSION(fp, sess);
+    if (fclose(fp) != 0 || !ok || rename(tmp, t->session_path) != 0) {
+        MG_ERROR(("save tls session %s failed", t->session_path));
+        unlink(tmp);
+        return;
+    }
+    t->stats.saved++;
+}
+
+// new ticket or session id from the broker, kept by the cloud session the handshake is for
+static int tls_new_session(SSL *ssl, SSL_SESSION *sess) {
+    struct tls_creds *t = (struct tls_creds *) SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+    void **session = (void **) SSL_get_app_data(ssl);
+
+    if (!SSL_SESSION_is_resumable(sess))
+        return 0;
+    if (session) {
+        if (*session)
+            SSL_SESSION_free((SSL_SESSION *) *session);
+        *session = sess; //the reference openssl hands over
+    }
+    tls_save(t, sess, (const char *) SSL_get_ex_data(ssl, s_address_idx));
+    return session ? 1 : 0;
+}
+
+static int tls_load_pem(SSL_CTX *ctx, const char *ca, const char *cert, const char *certkey) {
+    if (ca && ca[0]) {
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+        if (ca[0] == '-') {
+            BIO *bio = BIO_new_mem_buf(ca, -1);
+            X509_STORE *store = SSL_CTX_get_cert_store(ctx);
+            X509 *x;
+            int n = 0;
+            while (bio && (x = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL) {
+                X509_STORE_add_cert(store, x);
+                X509_free(x);
+                n++;
+            }
+            BIO_free(bio);
+            ERR_clear_error(); //end of the bundle
+            if (n == 0)
+                return -1;
+        } else if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1) {
+            return -1;
+        }
+    }
+
+    if (cert && cert[0]) {
+        const char *key = certkey && certkey[0] ? certkey : cert;
+        if (cert[0] == '-') {
+            BIO *bio = BIO_new_mem_buf(cert, -1);
+            X509 *x = bio ? PEM_read_bio_X509(bio, NULL, NULL, NULL) : NULL;
+            int rc = x ? SSL_CTX_use_certificate(ctx, x) : 0;
+            X509_free(x);
+            BIO_free(bio);
+            if (rc != 1)
+                return -1;
+        } else if (SSL_CTX_use_certificate_file(ctx, cert, SSL_FILETYPE_PEM) != 1) {
+            return -1;
+        }
+        if (key[0] == '-') {
+            BIO *bio = BIO_new_mem_buf(key, -1);
+            EVP_PKEY *pk = bio ? PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL) : NULL;
+            int rc = pk ? SSL_CTX_use_PrivateKey(ctx, pk) : 0;
+            EVP_PKEY_free(pk);
+            BIO_free(bio);
+            if (rc != 1)
+                return -1;
+        } else if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1) {
+            return -1;
+        }
+        if (SSL_CTX_check_private_key(ctx) != 1)
+            return -1;
+    }
+    return 0;
+}
+
+static int tls_load(struct tls_creds *t) {
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+
+    if (!ctx || tls_load_pem(ctx, t->ca, t->cert, t->certkey)) {
+        MG_ERROR(("load cloud tls credentials failed: %s", ERR_error_string(ERR_get_error(), NULL)));
+        SSL_CTX_free(ctx);
+        return -1;
+    }
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    //mg_tls_init is bypassed, so are its protocol options: TLS 1.2 and later only
+    SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1 | SSL_OP_NO_TLSv1_1);
+    //sessions live in the cloud sessions, not in the ctx cache
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+    SSL_CTX_set_app_data(ctx, t);
+    if (s_address_idx < 0)
+        s_address_idx = SSL_get_ex_new_index(0, NULL, NULL, NULL, tls_address_free);
+
+    if (t->ctx) //connections still in use hold their own reference
+        SSL_CTX_free((SSL_CTX *) t->ctx);
+    t->ctx = ctx;
+    t->stats.loads++;
+    MG_INFO(("cloud tls credentials loaded"));
+    return 0;
+}
+
+#endif
+
+void tls_creds_init(struct tls_creds *t, const char *ca, const char *cert, const char *certkey,
+    const char *session_path) {
+    memset(t, 0, sizeof(*t));
+    t->ca = ca;
+    t->cert = cert;
+    t->certkey = certkey;
+    t->session_path = session_path;
+
+#if MG_ENABLE_OPENSSL
+    FILE *fp;
+    if (session_path && (fp = fopen(session_path, "r")) != NULL) {
+        //a file without the address line has no broker to resume with
+        if (fgets(t->saved_address, sizeof(t->saved_address), fp) && strncmp(t->saved_address, "-----", 5) != 0) {
+            t->saved_address[strcspn(t->saved_address, "\r\n")] = '\0';
+            t->saved = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+        }
+        fclose(fp);
+        MG_INFO(("tls session %s %s", session_path, t->saved ? "loaded" : "invalid"));
+        ERR_clear_error();
+    }
+#endif
+}
+
+void tls_creds_free(struct tls_creds *t) {
+#if MG_ENABLE_OPENSSL
+    if (t->ctx)
+        SSL_CTX_free((SSL_CTX *) t->ctx);
+    tls_session_free(&t->saved);
+#endif
+    t->ctx = NULL;
+}
+
+void tls_creds_start(struct tls_creds *t, struct mg_connection *c, const char *address, void **session) {
+    const char *paths[3] = { t->ca, t->cert, t->certkey };
+
+#if MG_ENABLE_OPENSSL
+    if (!t->ctx || tls_changed(t)) {
+        for (int i = 0; i < 3; i++) //stamp first, a bad file is not retried until it changes again
+            tls_stat(paths[i], &t->files[i]);
+        tls_load(t);
+    }
+
+    if (t->ctx) {
+        struct mg_tls *tls = (struct mg_tls *) calloc(1, sizeof(*tls));
+        if (tls && (tls->ssl = SSL_new((SSL_CTX *) t->ctx)) != NULL) {
+            SSL_CTX_up_ref((SSL_CTX *) t->ctx); //mg_tls_free frees ctx and ssl
+            tls->ctx = (SSL_CTX *) t->ctx;
+            SSL_set_app_data(tls->ssl, session);
+            SSL_set_ex_data(tls->ssl, s_address_idx, address ? strdup(address) : NULL);
+            //the saved session only resumes with the broker it came from
+            if (!*session && t->saved && address && strcmp(t->saved_address, address) == 0)
+                SSL_set_session(tls->ssl, (SSL_SESSION *) t->saved);
+            else if (*session)
+                SSL_set_session(tls->ssl, (SSL_SESSION *) *session);
+            SSL_set_fd(tls->ssl, (int) (size_t) c->fd);
+            c->tls = tls;
+            c->is_tls = 1;
+            c->is_tls_hs = 1;
+            if (c->is_client && c->is_resolving == 0 && c->is_connecting == 0)
+                mg_tls_handshake(c);
+            return;
+        }
+        free(tls);
+    }
+#else
+    if (!t->ctx || tls_changed(t)) {
+        for (int i = 0; i < 3; i++)
+            tls_stat(paths[i], &t->files[i]);
+        t->ctx = t; //mg_tls_init parses the credentials of every connection
+        t->stats.loads++;
+    }
+    (void) address;
+    (void) session;
+#endif
+
+    struct mg_tls_opts opts = { 0 };
+    opts.ca = t->ca;
+    opts.cert = t->cert;
+    opts.certkey = t->certkey;
+    mg_tls_init(c, &opts);
+}
+
+void tls_creds_done(struct tls_creds *t, struct mg_connection *c, uint64_t ms) {
+    t->stats.handshakes++;
+    t->stats.hs_ms += ms;
+    if (ms > t->stats.max_hs_ms)
+        t->stats.max_hs_ms = ms;
+#if MG_ENABLE_OPENSSL
+    struct mg_tls *tls = (struct mg_tls *) c->tls;
+    if (tls && tls->ssl && SSL_session_reused(tls->ssl))
+        t->stats.resumed++;
+#else
+    (void) c;
+#endif
+}
+
+void tls_session_free(void **session) {
+#if MG_ENABLE_OPENSSL
+    if (*session)
+        SSL_SESSION_free((SSL_SESSION *) *session);
+#endif
+    *session = NULL;
+}
+
+void tls_stats_dump(struct tls_stats *st) {
+    if (st->handshakes == 0 && st->failed == 0)
+        return;
+    MG_INFO(("tls handshakes: %llu, resumed: %llu, failed: %llu, avg: %llu ms, max: %llu ms, credential loads: %llu, sessions saved: %llu",
+        (unsigned long long) st->handshakes, (unsigned long long) st->resumed, (unsigned long long) st->failed,
+        (unsigned long long) (st->handshakes ? st->hs_ms / st->handshakes : 0),
+        (unsigned long long) st->max_hs_ms, (unsigned long long) st->loads, (unsigned long long) st->saved));
+}
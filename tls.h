@@ -0,0 +1,51 @@
+#ifndef __IOT_TLS_H__
+#define __IOT_TLS_H__
+
+#include <iot/mongoose.h>
+
+#define TLS_SAVE_INTERVAL_MS 60000  //min period of session file writes
+#define TLS_ADDRESS_LEN      256    //broker url the saved session belongs to
+
+struct tls_stats {
+    uint64_t handshakes;        //completed
+    uint64_t resumed;           //completed by session resumption
+    uint64_t failed;            //closed before the handshake completed
+    uint64_t hs_ms;             //sum of tls start to handshake done
+    uint64_t max_hs_ms;
+    uint64_t loads;             //credentials parsed
+    uint64_t saved;             //session file writes
+};
+
+/*
+ * cloud mqtts credentials, parsed once into a shared SSL_CTX and parsed again only when
+ * a ca/cert/key file changes. each cloud session keeps the last session ticket of its
+ * broker, the newest one is also written to session_path with its broker address to resume
+ * after a restart, and only seeds connections to that address.
+ * without openssl every connection falls back to mg_tls_init.
+ */
+struct tls_creds {
+    const char *ca;             //content or file path, as mg_tls_opts
+    const char *cert;
+    const char *certkey;
+    const char *session_path;   //NULL: sessions kept in memory only
+    void *ctx;                  //SSL_CTX, NULL: not loaded
+    struct stat files[3];       //ca, cert and certkey when loaded
+    void *saved;                //SSL_SESSION of session_path, seeds sessions without one
+    char saved_address[TLS_ADDRESS_LEN]; //broker of saved
+    uint64_t saved_at;
+    struct tls_stats stats;
+};
+
+void tls_creds_init(struct tls_creds *t, const char *ca, const char *cert, const char *certkey,
+    const char *session_path);
+void tls_creds_free(struct tls_creds *t);
+
+//start the client handshake with broker address on c, resuming *session, which new tickets replace
+void tls_creds_start(struct tls_creds *t, struct mg_connection *c, const char *address, void **session);
+//handshake of c done after ms
+void tls_creds_done(struct tls_creds *t, struct mg_connection *c, uint64_t ms);
+void tls_session_free(void **session);
+
+void tls_stats_dump(struct tls_stats *st);
+
+#endif
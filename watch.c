@@ -0,0 +1,88 @@
+#include <sys/inotify.h>
+#include <iot/mongoose.h>
+#include "watch.h"
+
+// mongoose would recv() on the readable fd, which fails on a non-socket and closes it, the
+// events are read here first and the readable flag taken back
+static void watch_conn_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+    struct watch *w = (struct watch *) fn_data;
+    (void) ev_data;
+
+    if (ev == MG_EV_POLL && c->is_readable) {
+        c->is_readable = 0;
+        if (watch_changed(w) && w->fn)
+            w->fn(c->mgr);
+    } else if (ev == MG_EV_CLOSE) {
+        w->c = NULL;
+        w->fd = -1; //closed with the connection
+    }
+}
+
+int watch_init(struct watch *w, struct mg_mgr *mgr, const char *path, watch_fn fn) {
+    const char *slash = path ? strrchr(path, '/') : NULL;
+    char dir[256];
+
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+    if (!path || !path[0])
+        return -1;
+
+    if (!slash)
+        mg_snprintf(dir, sizeof(dir), ".");
+    else
+        mg_snprintf(dir, sizeof(dir), "%.*s", slash == path ? 1 : (int) (slash - path), path);
+    mg_snprintf(w->name, sizeof(w->name), "%s", slash ? slash + 1 : path);
+
+    if ((w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        MG_ERROR(("inotify init failed: %d", errno));
+        return -1;
+    }
+    if ((w->wd = inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO)) < 0) {
+        MG_ERROR(("watch %s failed: %d", dir, errno));
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    if ((w->c = mg_wrapfd(mgr, w->fd, watch_conn_fn, w)) == NULL) {
+        MG_ERROR(("watch %s failed, no connection", dir));
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    w->fn = fn;
+    MG_INFO(("watching %s for changes", path));
+    return 0;
+}
+
+int watch_changed(struct watch *w) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+
+    if (w->fd < 0)
+        return 0;
+
+    //an editor saving once may raise several events, all of them make one change
+    while ((n = read(w->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->len && strcmp(ev->name, w->name) == 0)
+                changed = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+    if (changed)
+        w->changes++;
+    return changed;
+}
+
+// the fd goes with the connection
+void watch_free(struct watch *w) {
+    if (w->c) {
+        w->c->is_closing = 1;
+        w->c->fn_data = NULL;
+        w->c->fn = NULL;
+    }
+    w->c = NULL;
+    w->fd = -1;
+}
@@ -0,0 +1,28 @@
+#ifndef __IOT_WATCH_H__
+#define __IOT_WATCH_H__
+
+#include <iot/mongoose.h>
+
+typedef void (*watch_fn)(struct mg_mgr *mgr);
+
+/*
+ * inotify on the directory of one file, editors and package managers replace files by
+ * rename, which a watch on the file itself would miss. the fd is a mongoose connection,
+ * events wake the event loop like any socket and fn runs once per batch of them.
+ */
+struct watch {
+    int fd;                 //-1: not watching
+    int wd;
+    struct mg_connection *c;
+    watch_fn fn;            //the file was written or replaced
+    char name[128];         //file name in the watched directory
+    uint64_t changes;       //writes or replacements seen
+};
+
+//0: watching
+int watch_init(struct watch *w, struct mg_mgr *mgr, const char *path, watch_fn fn);
+//read pending events, 1: the file was written or replaced
+int watch_changed(struct watch *w);
+void watch_free(struct watch *w);
+
+#endif
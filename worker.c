@@ -0,0 +1,342 @@
+#include <iot/mongoose.h>
+#include "worker.h"
+#include "arena.h"
+
+static int s_stuck; //replaced worker threads still blocked in a job, all workers
+
+static int ring_push(struct worker_ring *r, struct worker_job *job) {
+    uint32_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == WORKER_RING_SIZE)
+        return -1;
+    r->slots[tail & (WORKER_RING_SIZE - 1)] = job;
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static struct worker_job *ring_pop(struct worker_ring *r) {
+    uint32_t head = r->head;
+    if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    struct worker_job *job = r->slots[head & (WORKER_RING_SIZE - 1)];
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+    return job;
+}
+
+static void job_free(struct worker_job *job) {
+    free(job->method);
+    free(job->data);
+    free(job->script);
+    arena_release((void *)job->out.ptr); //the worker thread never opens a scope, it is heap memory
+    free(job);
+}
+
+static void *worker_thread(void *arg) {
+    struct worker_thread *t = (struct worker_thread *)arg;
+    struct worker_job *job;
+    struct worker *w;
+
+    for (;;) {
+        while (sem_wait(&t->sem) && errno == EINTR)
+            ;
+        if (__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE))
+            break;
+        if ((job = ring_pop(&t->req)) == NULL)
+            continue;
+
+        uint64_t start = metrics_now_us();
+        int ran = 0;
+        if (__atomic_load_n(&job->abandoned, __ATOMIC_ACQUIRE)) //event loop gave up while it was queued
+            job->status = -1;
+        else {
+            __atomic_store_n(&t->running, job, __ATOMIC_RELEASE);
+            job->status = lua_vm_call(&t->lua, job->script, job->method, job->data, job->timeout_ms, &job->out);
+            __atomic_store_n(&t->running, NULL, __ATOMIC_RELEASE);
+            ran = 1;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        if ((w = t->w) == NULL) { //replaced while blocked, nobody waits for the job
+            pthread_mutex_unlock(&t->lock);
+            job_free(job);
+            continue;
+        }
+        if (ran) {
+            metrics_observe(&w->metrics, METRIC_LUA_US, metrics_now_us() - start);
+            metrics_add(&w->metrics, METRIC_LUA_CALLS, 1);
+            if (job->status)
+                metrics_add(&w->metrics, METRIC_LUA_ERRORS, 1);
+        }
+        ring_push(&t->res, job); //never full, at most WORKER_RING_SIZE jobs pending
+        send(w->wake_fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        pthread_mutex_unlock(&t->lock);
+    }
+
+    lua_vm_close(&t->lua);
+    if (t->w == NULL) { //detached, what is left is ours
+        while ((job = ring_pop(&t->req)) != NULL)
+            job_free(job);
+        pthread_mutex_destroy(&t->lock);
+        sem_destroy(&t->sem);
+        free(t);
+        __atomic_sub_fetch(&s_stuck, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static struct worker_thread *worker_thread_start(struct worker *w) {
+    struct worker_thread *t = calloc(1, sizeof(struct worker_thread));
+    sigset_t all, old;
+    int ret;
+
+    if (!t)
+        return NULL;
+    t->w = w;
+    if (sem_init(&t->sem, 0, 0)) {
+        MG_ERROR(("worker sem init failed: %d", errno));
+        free(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+
+    //signals stay with the event loop thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    ret = pthread_create(&t->thread, NULL, worker_thread, t);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (ret) {
+        MG_ERROR(("worker thread create failed: %d", ret));
+        pthread_mutex_destroy(&t->lock);
+        sem_destroy(&t->sem);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static void worker_pending_del(struct worker *w, struct worker_job *job) {
+    for (int i = 0; i < w->num_pending; i++) {
+        if (w->pending[i] == job) {
+            w->pending[i] = w->pending[--w->num_pending];
+            return;
+        }
+    }
+}
+
+static void worker_job_done(struct worker *w, struct worker_job *job, uint64_t now) {
+    worker_pending_del(w, job);
+    w->stats.done++;
+    if (now - job->posted > w->stats.max_wait_ms)
+        w->stats.max_wait_ms = now - job->posted;
+
+    if (job->abandoned) {
+        MG_INFO(("lua %s returned %llu ms after it was abandoned", job->method,
+            (unsigned long long) (now - job->deadline)));
+    } else if (job->done) {
+        job->done(w->mgr, job->status == 0 ? job->out : mg_str_n(NULL, 0), job->data);
+    }
+    job_free(job);
+}
+
+// results back on the event loop
+static void worker_drain(struct worker *w) {
+    struct worker_job *job;
+    uint64_t now = mg_millis();
+
+    while ((job = ring_pop(&w->t->res)) != NULL)
+        worker_job_done(w, job, now);
+}
+
+static void worker_pipe_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data) {
+    if (ev == MG_EV_READ) {
+        c->recv.len = 0; //wakeup bytes carry nothing
+        worker_drain((struct worker *)fn_data);
+    }
+}
+
+static struct worker_job *worker_job_new(struct worker *w, const char *method, const char *data, lua_done_fn done,
+    uint64_t posted) {
+    struct worker_job *job = calloc(1, sizeof(struct worker_job));
+    if (!job)
+        return NULL;
+    job->method = strdup(method);
+    job->data = strdup(data);
+    job->script = strdup(w->script);
+    if (!job->method || !job->data || !job->script) {
+        job_free(job);
+        return NULL;
+    }
+    job->timeout_ms = w->timeout_ms;
+    job->done = done;
+    job->posted = posted;
+    job->deadline = w->timeout_ms > 0 ? posted + w->timeout_ms : 0;
+    return job;
+}
+
+static void worker_enqueue(struct worker *w, struct worker_job *job) {
+    ring_push(&w->t->req, job); //never full, same bound as pending
+    w->pending[w->num_pending++] = job;
+    sem_post(&w->t->sem);
+}
+
+// the running job is blocked in a C call the count hook cannot interrupt, it would hold the
+// thread and the pending slots for good: a new thread takes the jobs, the old one is left to it
+static void worker_restart(struct worker *w, struct worker_job *stuck) {
+    struct worker_thread *old = w->t, *t;
+    struct worker_job *jobs[WORKER_RING_SIZE];
+    uint64_t now = mg_millis();
+    int n = 0;
+
+    if (__atomic_load_n(&s_stuck, __ATOMIC_ACQUIRE) >= WORKER_STUCK_MAX)
+        return;
+    if ((t = worker_thread_start(w)) == NULL)
+        return;
+
+    w->stats.restarts++;
+    __atomic_add_fetch(&s_stuck, 1, __ATOMIC_RELEASE);
+    MG_ERROR(("lua %s blocked %llu ms past its deadline, worker thread replaced", stuck->method,
+        (unsigned long long) (now - stuck->deadline)));
+
+    //stop first, queued jobs must not start on the old thread
+    __atomic_store_n(&old->stop, 1, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&old->lock);
+    old->w = NULL;
+    pthread_mutex_unlock(&old->lock);
+    worker_drain(w); //results pushed before the detach are still ours
+    w->vm_builds += old->lua.builds;
+    w->vm_cache_hits += old->lua.cache_hits;
+    sem_post(&old->sem);
+    pthread_detach(old->thread);
+    w->t = t;
+
+    //the rest belongs to the old thread now, jobs not given up yet start over on the new one
+    for (int i = 0; i < w->num_pending; i++)
+        jobs[n++] = w->pending[i];
+    w->num_pending = 0;
+    for (int i = 0; i < n; i++) {
+        struct worker_job *job = jobs[i], *copy;
+        if (job->abandoned)
+            continue;
+        __atomic_store_n(&job->abandoned, 1, __ATOMIC_RELEASE);
+        if ((copy = worker_job_new(w, job->method, job->data, job->done, job->posted)) != NULL)
+            worker_enqueue(w, copy);
+        else if (job->done)
+            job->done(w->mgr, mg_str_n(NULL, 0), job->data);
+    }
+}
+
+// give up on jobs past their deadline, pick up results of a missed wakeup
+uint64_t worker_poll(struct worker *w, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+    struct worker_job *running;
+
+    worker_drain(w);
+
+    for (int i = 0; i < w->num_pending; i++) { //done may post, pending only grows here
+        struct worker_job *job = w->pending[i];
+        if (job->abandoned || !job->deadline)
+            continue;
+        if (now <= job->deadline) {
+            if (job->deadline < next)
+                next = job->deadline;
+            continue;
+        }
+        __atomic_store_n(&job->abandoned, 1, __ATOMIC_RELEASE);
+        w->stats.timeouts++;
+        MG_ERROR(("lua %s timeout, abandoned after %llu ms", job->method,
+            (unsigned long long) (now - job->posted)));
+        if (job->done)
+            job->done(w->mgr, mg_str_n(NULL, 0), job->data);
+    }
+
+    //pending jobs stay alive until they come back, so running can be looked at
+    running = __atomic_load_n(&w->t->running, __ATOMIC_ACQUIRE);
+    if (running && running->deadline) {
+        if (now >= running->deadline + WORKER_STUCK_MS)
+            worker_restart(w, running);
+        else if (running->deadline + WORKER_STUCK_MS < next)
+            next = running->deadline + WORKER_STUCK_MS;
+    }
+
+    return next;
+}
+
+struct worker *worker_init(struct mg_mgr *mgr, const char *script, int timeout_ms) {
+    struct worker *w = calloc(1, sizeof(struct worker));
+
+    if (!w)
+        return NULL;
+
+    w->mgr = mgr;
+    w->script = script;
+    w->timeout_ms = timeout_ms;
+
+    w->wake_fd = mg_mkpipe(mgr, worker_pipe_fn, w, false);
+    if (w->wake_fd < 0) {
+        MG_ERROR(("worker pipe failed"));
+        free(w);
+        return NULL;
+    }
+
+    if ((w->t = worker_thread_start(w)) == NULL) {
+        close(w->wake_fd);
+        free(w);
+        return NULL;
+    }
+
+    MG_INFO(("lua worker started, timeout: %d ms", timeout_ms));
+    return w;
+}
+
+void worker_free(struct worker *w) {
+    struct worker_thread *t = w->t;
+    struct worker_job *job;
+
+    __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+    sem_post(&t->sem);
+    pthread_join(t->thread, NULL);
+
+    while ((job = ring_pop(&t->res)) != NULL)
+        worker_pending_del(w, job), job_free(job);
+    while (w->num_pending > 0) //still queued for the worker
+        job_free(w->pending[--w->num_pending]);
+
+    MG_INFO(("lua worker posted: %llu, done: %llu, coalesced: %llu, rejected: %llu, timeouts: %llu, restarts: %llu, max wait: %llu ms",
+        (unsigned long long) w->stats.posted, (unsigned long long) w->stats.done,
+        (unsigned long long) w->stats.coalesced, (unsigned long long) w->stats.rejected,
+        (unsigned long long) w->stats.timeouts, (unsigned long long) w->stats.restarts,
+        (unsigned long long) w->stats.max_wait_ms));
+    MG_INFO(("lua worker vm builds: %llu, cache hits: %llu",
+        (unsigned long long) (w->vm_builds + t->lua.builds), (unsigned long long) (w->vm_cache_hits + t->lua.cache_hits)));
+
+    pthread_mutex_destroy(&t->lock);
+    sem_destroy(&t->sem);
+    free(t);
+    close(w->wake_fd);
+    free(w);
+}
+
+int worker_post(struct worker *w, const char *method, const char *data, lua_done_fn done) {
+    struct worker_job *job;
+
+    for (int i = 0; i < w->num_pending; i++) { //same call still waiting, one result serves both
+        job = w->pending[i];
+        if (!job->abandoned && job->done == done && strcmp(job->method, method) == 0 &&
+            strcmp(job->data, data) == 0) {
+            w->stats.coalesced++;
+            return 0;
+        }
+    }
+
+    if (w->num_pending >= WORKER_RING_SIZE) {
+        w->stats.rejected++;
+        MG_ERROR(("lua worker busy, drop %s", method));
+        return -1;
+    }
+
+    if ((job = worker_job_new(w, method, data, done, mg_millis())) == NULL)
+        return -1;
+    worker_enqueue(w, job);
+    w->stats.posted++;
+    return 0;
+}
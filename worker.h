@@ -0,0 +1,95 @@
+#ifndef __IOT_WORKER_H__
+#define __IOT_WORKER_H__
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <iot/mongoose.h>
+#include "callback.h"
+#include "metrics.h"
+
+#define WORKER_RING_SIZE    64      //power of 2, max jobs posted and not yet done
+#define WORKER_STUCK_MS     2000    //a job still running this long past its deadline is blocked in C, the thread is replaced
+#define WORKER_STUCK_MAX    4       //replaced threads still blocked, no more replacements beyond it
+
+struct worker_job {
+    char *method;
+    char *data;
+    char *script;               //copied for the thread, which may outlive struct worker
+    int timeout_ms;
+    lua_done_fn done;           //NULL: result ignored
+    uint64_t posted;            //ms
+    uint64_t deadline;          //ms, event loop gives up on the job after it, 0: never
+    int abandoned;              //done already called with no result, worker skips the call if not started
+    int status;                 //0: ok, written by worker
+    struct mg_str out;          //result, written by worker
+};
+
+// single producer single consumer ring, one side each thread
+struct worker_ring {
+    struct worker_job *slots[WORKER_RING_SIZE];
+    uint32_t head;              //next slot to pop, written by consumer
+    uint32_t tail;              //next slot to push, written by producer
+};
+
+struct worker_stats {
+    uint64_t posted;
+    uint64_t done;
+    uint64_t coalesced;         //identical call still pending, not posted
+    uint64_t rejected;          //too many pending jobs
+    uint64_t timeouts;          //abandoned by event loop
+    uint64_t restarts;          //threads replaced while blocked in a job
+    uint64_t max_wait_ms;       //longest post to done latency
+};
+
+struct worker;
+
+/*
+ * one worker thread and what it owns. a thread blocked in a job is detached and replaced:
+ * from then on it touches nothing of struct worker, frees its jobs and itself when the job returns.
+ */
+struct worker_thread {
+    struct worker *w;           //NULL once detached, read and cleared under lock
+    pthread_t thread;
+    pthread_mutex_t lock;       //results against detach
+    sem_t sem;                  //wakes worker, one post per job
+    int stop;
+
+    struct worker_ring req;     //event loop -> worker
+    struct worker_ring res;     //worker -> event loop
+    struct worker_job *running; //job in lua_vm_call, NULL: none
+
+    struct lua_vm lua;          //owned by the thread
+};
+
+/*
+ * lua callbacks on a dedicated thread with its own lua vm. jobs go to the worker through
+ * req, results come back through res and a socketpair wakes up mg_mgr_poll.
+ */
+struct worker {
+    struct mg_mgr *mgr;
+    const char *script;
+    int timeout_ms;
+    int wake_fd;                //write end of mg_mkpipe
+
+    struct worker_thread *t;    //current thread
+
+    struct worker_job *pending[WORKER_RING_SIZE]; //posted and not yet returned, event loop only
+    int num_pending;
+
+    struct worker_stats stats;
+    uint64_t vm_builds;         //of replaced threads
+    uint64_t vm_cache_hits;
+    struct metrics metrics;     //lua calls of the worker thread, written by it only
+};
+
+struct worker *worker_init(struct mg_mgr *mgr, const char *script, int timeout_ms);
+//join the thread, a script blocked in a C call delays it
+void worker_free(struct worker *w);
+
+//drain results, give up on jobs past their deadline, return the next deadline, UINT64_MAX: none
+uint64_t worker_poll(struct worker *w, uint64_t now);
+
+//0: posted or coalesced, -1: rejected
+int worker_post(struct worker *w, const char *method, const char *data, lua_done_fn done);
+
+#endif
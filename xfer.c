@@ -0,0 +1,224 @@
+#include <iot/mongoose.h>
+#include "xfer.h"
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) (v >> 24);
+    p[1] = (uint8_t) (v >> 16);
+    p[2] = (uint8_t) (v >> 8);
+    p[3] = (uint8_t) v;
+}
+
+void xfer_init(struct xfer_table *t, const char *dir) {
+    memset(t, 0, sizeof(*t));
+    t->dir = dir;
+    mg_random(&t->last_id, sizeof(t->last_id)); //ids of a restarted client do not collide with old ones
+    for (int i = 0; i < XFER_MAX; i++)
+        t->slots[i].fd = -1;
+}
+
+// write data to an unlinked file in dir, -1: failed
+static int xfer_spool(const char *dir, struct mg_str data) {
+    char path[256];
+    size_t off = 0;
+    int fd;
+
+    if (mg_snprintf(path, sizeof(path), "%s/iot-client-xfer-XXXXXX", dir) >= sizeof(path))
+        return -1;
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+    unlink(path);
+
+    while (off < data.len) {
+        ssize_t n = write(fd, data.ptr + off, data.len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(fd);
+            return -1;
+        }
+        off += (size_t) n;
+    }
+    return fd;
+}
+
+struct xfer *xfer_start(struct xfer_table *t, int session, const struct xfer_cfg *cfg, struct mg_str topic,
+    struct mg_str cdata, struct mg_str data, uint64_t now) {
+    struct xfer *x = NULL;
+
+    for (int i = 0; i < XFER_MAX && !x; i++) {
+        if (t->slots[i].id == 0)
+            x = &t->slots[i];
+    }
+    if (!t->dir || !x || topic.len > UINT16_MAX || cdata.len > UINT16_MAX)
+        goto fallback;
+
+    if ((x->dest = malloc(topic.len + cdata.len + 1)) == NULL)
+        goto fallback;
+    if ((x->fd = xfer_spool(t->dir, data)) < 0) {
+        MG_ERROR(("spool %lu bytes to %s failed: %d", (unsigned long) data.len, t->dir, errno));
+        free(x->dest);
+        x->dest = NULL;
+        goto fallback;
+    }
+
+    memcpy(x->dest, topic.ptr, topic.len);
+    memcpy(x->dest + topic.len, cdata.ptr, cdata.len);
+    x->topic_len = (uint16_t) topic.len;
+    x->cdata_len = (uint16_t) cdata.len;
+
+    if (++t->last_id == 0)
+        t->last_id = 1;
+    x->id = t->last_id;
+    x->session = session;
+    x->size = data.len;
+    x->chunk = cfg->chunk;
+    x->chunks = (uint32_t) ((data.len + cfg->chunk - 1) / cfg->chunk);
+    x->window = cfg->window;
+    x->crc = mg_crc32(0, data.ptr, data.len);
+    x->acked = x->next = x->sent = 0;
+    x->announced = 0;
+    x->retries = 0;
+    x->progress_at = now;
+    x->resend_at = now + XFER_RESEND_MS;
+
+    t->active++;
+    t->stats.started++;
+    MG_INFO(("transfer %u started, session %d, %llu bytes in %u chunks", x->id, session,
+        (unsigned long long) x->size, x->chunks));
+    return x;
+
+fallback:
+    t->stats.fallbacks++;
+    return NULL;
+}
+
+struct xfer *xfer_find(struct xfer_table *t, int session, uint32_t id) {
+    for (int i = 0; i < XFER_MAX && id; i++) {
+        if (t->slots[i].id == id && t->slots[i].session == session)
+            return &t->slots[i];
+    }
+    return NULL;
+}
+
+struct mg_str xfer_topic(const struct xfer *x) {
+    return mg_str_n(x->dest, x->topic_len);
+}
+
+struct mg_str xfer_cdata(const struct xfer *x) {
+    return mg_str_n(x->dest + x->topic_len, x->cdata_len);
+}
+
+struct mg_str xfer_begin(struct xfer_table *t, struct xfer *x) {
+    char msg[160];
+    size_t n = mg_snprintf(msg, sizeof(msg),
+        "{\"transfer\":{\"id\":%lu,\"size\":%llu,\"chunk\":%lu,\"chunks\":%lu,\"crc32\":\"%08lx\",\"next\":%lu}}",
+        (unsigned long) x->id, (unsigned long long) x->size, (unsigned long) x->chunk,
+        (unsigned long) x->chunks, (unsigned long) x->crc, (unsigned long) x->acked);
+
+    t->buf.len = 0;
+    if (mg_iobuf_add(&t->buf, 0, msg, n) == 0)
+        return mg_str_n(NULL, 0);
+    return mg_str_n((const char *) t->buf.buf, t->buf.len);
+}
+
+struct mg_str xfer_chunk(struct xfer_table *t, struct xfer *x, uint32_t seq) {
+    uint64_t off = (uint64_t) seq * x->chunk;
+    size_t len, got = 0;
+
+    if (seq >= x->chunks)
+        return mg_str_n(NULL, 0);
+    len = x->size - off < x->chunk ? (size_t) (x->size - off) : x->chunk;
+    if (t->buf.size < XFER_HDR_SIZE + len) {
+        mg_iobuf_free(&t->buf);
+        if (mg_iobuf_add(&t->buf, 0, NULL, XFER_HDR_SIZE + len) == 0)
+            return mg_str_n(NULL, 0);
+    }
+
+    uint8_t *p = t->buf.buf;
+    memcpy(p, XFER_MAGIC, 4);
+    put_u32(p + 4, x->id);
+    put_u32(p + 8, seq);
+    put_u32(p + 12, x->chunks);
+    while (got < len) {
+        ssize_t n = pread(x->fd, p + XFER_HDR_SIZE + got, len - got, (off_t) (off + got));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return mg_str_n(NULL, 0);
+        got += (size_t) n;
+    }
+    t->buf.len = XFER_HDR_SIZE + len;
+
+    t->stats.chunks++;
+    t->stats.bytes += len;
+    if (seq < x->sent)
+        t->stats.resent++;
+    else
+        x->sent = seq + 1;
+    return mg_str_n((const char *) p, t->buf.len);
+}
+
+int xfer_ack(struct xfer_table *t, struct xfer *x, int64_t next, uint64_t now) {
+    t->stats.acks++;
+    if (next < 0 || next > x->chunks)
+        return -1;
+    if ((uint32_t) next > x->sent) { //chunks never sent, the ack is not about this transfer
+        MG_ERROR(("transfer %u ack of %lld chunks, %u sent", x->id, (long long) next, x->sent));
+        return -1;
+    }
+
+    if ((uint32_t) next != x->acked) {
+        //behind acked the cloud lost chunks it had, sent again from its offset
+        if ((uint32_t) next < x->acked || (uint32_t) next > x->next)
+            x->next = (uint32_t) next;
+        x->acked = (uint32_t) next;
+        x->retries = 0;
+        x->progress_at = now;
+        x->resend_at = now + XFER_RESEND_MS;
+    }
+    return x->acked == x->chunks;
+}
+
+void xfer_rewind(struct xfer_table *t, int session) {
+    for (int i = 0; i < XFER_MAX; i++) {
+        struct xfer *x = &t->slots[i];
+        if (x->id && x->session == session) {
+            x->next = x->acked;
+            x->announced = 0;
+        }
+    }
+}
+
+void xfer_end(struct xfer_table *t, struct xfer *x, int ok) {
+    if (ok) {
+        t->stats.completed++;
+        MG_INFO(("transfer %u completed, %llu bytes", x->id, (unsigned long long) x->size));
+    } else {
+        t->stats.failed++;
+        MG_ERROR(("transfer %u failed at chunk %u of %u", x->id, x->acked, x->chunks));
+    }
+    close(x->fd);
+    free(x->dest);
+    memset(x, 0, sizeof(*x));
+    x->fd = -1;
+    t->active--;
+}
+
+void xfer_free(struct xfer_table *t) {
+    for (int i = 0; i < XFER_MAX; i++) {
+        if (t->slots[i].id)
+            xfer_end(t, &t->slots[i], 0);
+    }
+    mg_iobuf_free(&t->buf);
+}
+
+void xfer_stats_dump(struct xfer_stats *st) {
+    if (st->started == 0 && st->fallbacks == 0)
+        return;
+    MG_INFO(("transfers started: %llu, completed: %llu, failed: %llu, fallbacks: %llu",
+        (unsigned long long) st->started, (unsigned long long) st->completed,
+        (unsigned long long) st->failed, (unsigned long long) st->fallbacks));
+    MG_INFO(("transfer chunks: %llu, resent: %llu, bytes: %llu, acks: %llu",
+        (unsigned long long) st->chunks, (unsigned long long) st->resent,
+        (unsigned long long) st->bytes, (unsigned long long) st->acks));
+}
@@ -0,0 +1,97 @@
+#ifndef __IOT_XFER_H__
+#define __IOT_XFER_H__
+
+#include <iot/mongoose.h>
+
+#define XFER_MAX            8           //transfers in progress, all sessions
+#define XFER_MAGIC          "IXF1"
+#define XFER_HDR_SIZE       16          //magic, id, seq, chunks, big endian
+#define XFER_CHUNK          16384       //default chunk bytes
+#define XFER_CHUNK_MIN      512
+#define XFER_CHUNK_MAX      262144
+#define XFER_WINDOW         8           //default chunks sent ahead of the last ack
+#define XFER_WINDOW_MAX     64
+#define XFER_THRESHOLD      65536       //default reply size sent as a transfer
+#define XFER_RESEND_MS      10000       //no ack for this long, send again from the last ack
+#define XFER_RETRIES        5           //resends without progress before giving up
+#define XFER_IDLE_MS        600000      //no progress for this long, offline included, give up
+
+// per identity settings, chunk 0: the cloud does not take transfers
+struct xfer_cfg {
+    size_t threshold;       //replies from this size are sent in chunks
+    uint32_t chunk;
+    uint32_t window;
+};
+
+// one large reply spooled to a file, sent chunk by chunk as the cloud acks
+struct xfer {
+    uint32_t id;            //0: slot free
+    int session;            //index of the cloud session
+    int fd;                 //spool file, unlinked when created, gone with the fd
+    uint64_t size;
+    uint32_t chunk;
+    uint32_t chunks;
+    uint32_t window;
+    uint32_t crc;           //crc32 of the whole payload
+    uint32_t acked;         //chunks the cloud has, in order
+    uint32_t next;          //next chunk to send
+    uint32_t sent;          //chunks sent at least once, below it a send is a resend
+    int announced;          //begin message sent on the current connection
+    int retries;            //resends without progress
+    uint64_t progress_at;   //ms, start or last ack which moved acked
+    uint64_t resend_at;     //ms, send again from acked unless an ack comes first
+    char *dest;             //topic then correlation data of the reply
+    uint16_t topic_len;
+    uint16_t cdata_len;
+};
+
+struct xfer_stats {
+    uint64_t started;
+    uint64_t completed;
+    uint64_t failed;        //cancelled by the cloud, stalled or spool read error
+    uint64_t fallbacks;     //sent in one publish, no -X, table full or spool write failed
+    uint64_t chunks;        //chunk publishes, resends included
+    uint64_t resent;
+    uint64_t bytes;         //payload bytes of chunk publishes
+    uint64_t acks;
+};
+
+/*
+ * chunked transfer of replies too large for one publish. the payload is spooled to an
+ * unlinked file in the -X directory, which has to be on flash, a tmpfs spool saves no
+ * memory. once spooled chunks are read one at a time and mqtt holds up to window of them:
+ *   begin: {"transfer":{"id":1,"size":n,"chunk":n,"chunks":n,"crc32":"hex","next":0}}
+ *   chunk: | "IXF1" | id | seq | chunks | bytes of chunk seq |
+ *   ack  : {"transfer_ack":1,"next":n} from the cloud, n chunks received in order, n < 0 cancels
+ * after a reconnect or an ack timeout the begin message is sent again, chunks follow from acked.
+ */
+struct xfer_table {
+    struct xfer slots[XFER_MAX];
+    int active;
+    uint32_t last_id;
+    const char *dir;        //spool directory, NULL: no transfers, replies go out in one publish
+    struct mg_iobuf buf;    //begin message or framed chunk, reused
+    struct xfer_stats stats;
+};
+
+void xfer_init(struct xfer_table *t, const char *dir);
+//spool data for session, topic and cdata are where the reply goes, NULL: table full or spool failed
+struct xfer *xfer_start(struct xfer_table *t, int session, const struct xfer_cfg *cfg, struct mg_str topic,
+    struct mg_str cdata, struct mg_str data, uint64_t now);
+struct xfer *xfer_find(struct xfer_table *t, int session, uint32_t id);
+struct mg_str xfer_topic(const struct xfer *x);
+struct mg_str xfer_cdata(const struct xfer *x);
+//begin message of x, valid until the next xfer_begin or xfer_chunk
+struct mg_str xfer_begin(struct xfer_table *t, struct xfer *x);
+//framed chunk seq read from the spool, same lifetime, NULL ptr: read failed
+struct mg_str xfer_chunk(struct xfer_table *t, struct xfer *x, uint32_t seq);
+//cumulative ack of the cloud, 1: complete, 0: in progress, -1: cancelled or invalid, acks beyond sent included
+int xfer_ack(struct xfer_table *t, struct xfer *x, int64_t next, uint64_t now);
+//connection of session closed, its transfers start over from acked on the next one
+void xfer_rewind(struct xfer_table *t, int session);
+void xfer_end(struct xfer_table *t, struct xfer *x, int ok);
+void xfer_free(struct xfer_table *t);
+
+void xfer_stats_dump(struct xfer_stats *st);
+
+#endif